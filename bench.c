@@ -0,0 +1,298 @@
+// Microbenchmarks of the filesystem core
+//
+// Linked against dm510fs.c built with -DDM510FS_NO_MAIN, see `make bench`. The operations go through
+// dm510fs_oper exactly as FUSE calls them, so the numbers are those of the filesystem itself without the
+// kernel round trip. Each run works on a fresh image in a temporary directory and every result is one line
+// of JSON on stdout, e.g.
+//   {"bench":"create","files":10000,"ops":10000,"seconds":0.0123,"ops_per_sec":813008,"p50_ns":950,...}
+//
+// Usage: dm510fs_bench [files ...]   (default 1000 10000 100000)
+
+#include "dm510fs.h"
+#include <sys/stat.h>
+
+#define BENCH_FANOUT 100 // Files per directory
+#define BENCH_SEQ_BYTES (32 << 20) // Size of the file for the read and write benchmarks
+#define BENCH_SEQ_CHUNK (128 << 10) // Request size of sequential I/O, the default max_write of FUSE
+#define BENCH_RANDOM_CHUNK 4096
+#define BENCH_RANDOM_OPS 8192
+#define BENCH_SMALL_BYTES 300 // Size of the small files written to every file of the tree
+#define BENCH_DEPTH 32 // Levels of the tree moved by the rename benchmark
+#define BENCH_DEPTH_FILES 8 // Files per level of that tree
+#define BENCH_RENAMES 1000
+
+static uint64_t *samples; // Latency of every operation of the running benchmark
+static size_t sample_count;
+
+static uint64_t bench_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// xorshift64, deterministic so runs are comparable
+static uint64_t random_state = 0x9e3779b97f4a7c15;
+static uint64_t bench_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void check(int result, const char *what, const char *path) {
+    if(result < 0) {
+        fprintf(stderr, "%s %s failed: %s\n", what, path, strerror(-result));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(double fraction) {
+    size_t rank = (size_t)(fraction * (sample_count - 1) + 0.5);
+    return samples[rank];
+}
+
+// Print the result of a benchmark that ran sample_count operations in total_ns, moving bytes if it is an I/O benchmark
+static void emit(const char *name, int files, uint64_t total_ns, uint64_t bytes) {
+    qsort(samples, sample_count, sizeof(uint64_t), compare_samples);
+    double seconds = total_ns / 1e9;
+    printf("{\"bench\":\"%s\",\"files\":%d,\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.0f",
+           name, files, sample_count, seconds, sample_count / seconds);
+    if(bytes)
+        printf(",\"bytes\":%llu,\"mb_per_sec\":%.1f", (unsigned long long)bytes, bytes / seconds / (1 << 20));
+    printf(",\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+           (unsigned long long)percentile(0.5), (unsigned long long)percentile(0.9),
+           (unsigned long long)percentile(0.99), (unsigned long long)percentile(0.999),
+           (unsigned long long)samples[sample_count - 1]);
+    fflush(stdout);
+    sample_count = 0;
+}
+
+#define TIME(call) do { \
+        uint64_t start_ = bench_clock(); \
+        int result_ = (call); \
+        samples[sample_count++] = bench_clock() - start_; \
+        check(result_, #call, ""); \
+    } while(0)
+
+static int count_entry(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+    (*(size_t *)buf)++;
+    return 0;
+}
+
+static void file_path(char *path, int i) {
+    sprintf(path, "/d%d/f%d", i / BENCH_FANOUT, i);
+}
+
+static void bench_namespace(int files) {
+    char path[MAX_PATH_LENGTH];
+    int directories = (files + BENCH_FANOUT - 1) / BENCH_FANOUT;
+
+    uint64_t start = bench_clock();
+    for(int d = 0; d < directories; d++) {
+        sprintf(path, "/d%d", d);
+        TIME(dm510fs_oper.mkdir(path, S_IFDIR | 0755));
+    }
+    emit("mkdir", files, bench_clock() - start, 0);
+
+    start = bench_clock();
+    for(int i = 0; i < files; i++) {
+        file_path(path, i);
+        TIME(dm510fs_oper.mknod(path, S_IFREG | 0644, 0));
+    }
+    emit("create", files, bench_clock() - start, 0);
+
+    struct stat stbuf;
+    start = bench_clock();
+    for(int i = 0; i < files; i++) {
+        file_path(path, bench_random() % files);
+        TIME(dm510fs_oper.getattr(path, &stbuf));
+    }
+    emit("getattr", files, bench_clock() - start, 0);
+
+    // Lookups of names that do not exist, as done by shells searching PATH and compilers searching include paths
+    start = bench_clock();
+    for(int i = 0; i < files; i++) {
+        sprintf(path, "/d%d/missing%d", (int)(bench_random() % directories), i % 64);
+        uint64_t op_start = bench_clock();
+        int result = dm510fs_oper.getattr(path, &stbuf);
+        samples[sample_count++] = bench_clock() - op_start;
+        if(result != -ENOENT) {
+            fprintf(stderr, "getattr %s found a file that was never created\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    emit("getattr_missing", files, bench_clock() - start, 0);
+
+    size_t entries = 0;
+    start = bench_clock();
+    for(int d = 0; d < directories; d++) {
+        sprintf(path, "/d%d", d);
+        TIME(dm510fs_oper.readdir(path, &entries, count_entry, 0, NULL));
+    }
+    uint64_t elapsed = bench_clock() - start;
+    if(entries != (size_t)files + 2 * directories) {
+        fprintf(stderr, "readdir listed %zu entries, expected %d\n", entries, files + 2 * directories);
+        exit(EXIT_FAILURE);
+    }
+    emit("readdir", files, elapsed, 0);
+}
+
+static void bench_io(int files) {
+    char *buffer = malloc(BENCH_SEQ_CHUNK);
+    memset(buffer, 'x', BENCH_SEQ_CHUNK);
+    // Through a handle, as the kernel sends I/O on an open file
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    check(dm510fs_oper.create("/seq", S_IFREG | 0644, &fi), "create", "/seq");
+
+    uint64_t start = bench_clock();
+    for(off_t offset = 0; offset < BENCH_SEQ_BYTES; offset += BENCH_SEQ_CHUNK)
+        TIME(dm510fs_oper.write("/seq", buffer, BENCH_SEQ_CHUNK, offset, &fi));
+    emit("write_seq", files, bench_clock() - start, BENCH_SEQ_BYTES);
+
+    start = bench_clock();
+    for(off_t offset = 0; offset < BENCH_SEQ_BYTES; offset += BENCH_SEQ_CHUNK)
+        TIME(dm510fs_oper.read("/seq", buffer, BENCH_SEQ_CHUNK, offset, &fi));
+    emit("read_seq", files, bench_clock() - start, BENCH_SEQ_BYTES);
+
+    int chunks = BENCH_SEQ_BYTES / BENCH_RANDOM_CHUNK;
+    start = bench_clock();
+    for(int i = 0; i < BENCH_RANDOM_OPS; i++)
+        TIME(dm510fs_oper.write("/seq", buffer, BENCH_RANDOM_CHUNK, (off_t)(bench_random() % chunks) * BENCH_RANDOM_CHUNK, &fi));
+    emit("write_random", files, bench_clock() - start, (uint64_t)BENCH_RANDOM_OPS * BENCH_RANDOM_CHUNK);
+
+    start = bench_clock();
+    for(int i = 0; i < BENCH_RANDOM_OPS; i++)
+        TIME(dm510fs_oper.read("/seq", buffer, BENCH_RANDOM_CHUNK, (off_t)(bench_random() % chunks) * BENCH_RANDOM_CHUNK, &fi));
+    emit("read_random", files, bench_clock() - start, (uint64_t)BENCH_RANDOM_OPS * BENCH_RANDOM_CHUNK);
+
+    check(dm510fs_oper.release("/seq", &fi), "release", "/seq");
+    free(buffer);
+}
+
+// Small files such as configs and lock files, one write each, then reads of random ones
+static void bench_small(int files) {
+    char path[MAX_PATH_LENGTH];
+    char buffer[BENCH_SMALL_BYTES];
+    memset(buffer, 's', sizeof(buffer));
+
+    uint64_t start = bench_clock();
+    for(int i = 0; i < files; i++) {
+        file_path(path, i);
+        TIME(dm510fs_oper.write(path, buffer, BENCH_SMALL_BYTES, 0, NULL));
+    }
+    emit("write_small", files, bench_clock() - start, (uint64_t)files * BENCH_SMALL_BYTES);
+
+    start = bench_clock();
+    for(int i = 0; i < files; i++) {
+        file_path(path, bench_random() % files);
+        TIME(dm510fs_oper.read(path, buffer, BENCH_SMALL_BYTES, 0, NULL));
+    }
+    emit("read_small", files, bench_clock() - start, (uint64_t)files * BENCH_SMALL_BYTES);
+}
+
+// Moves a tree BENCH_DEPTH levels deep back and forth, which should cost the same as moving a single file
+static void bench_rename(int files) {
+    char path[MAX_PATH_LENGTH] = "/deep";
+    size_t length = strlen(path);
+    check(dm510fs_oper.mkdir(path, S_IFDIR | 0755), "mkdir", path);
+    for(int level = 0; level < BENCH_DEPTH; level++) {
+        length += sprintf(path + length, "/l%d", level);
+        check(dm510fs_oper.mkdir(path, S_IFDIR | 0755), "mkdir", path);
+        for(int i = 0; i < BENCH_DEPTH_FILES; i++) {
+            char file[MAX_PATH_LENGTH];
+            snprintf(file, sizeof(file), "%s/f%d", path, i);
+            check(dm510fs_oper.mknod(file, S_IFREG | 0644, 0), "mknod", file);
+        }
+    }
+
+    uint64_t start = bench_clock();
+    for(int i = 0; i < BENCH_RENAMES; i++) {
+        if(i % 2 == 0)
+            TIME(dm510fs_oper.rename("/deep", "/d0/deep"));
+        else
+            TIME(dm510fs_oper.rename("/d0/deep", "/deep"));
+    }
+    emit("rename_tree", files, bench_clock() - start, 0);
+
+    struct stat stbuf;
+    check(dm510fs_oper.getattr(path, &stbuf), "getattr", path); // The tree is back where it started
+}
+
+// Unmount writes every dirty record to the image, mounting reads it back and rebuilds the indexes
+static void bench_persist(int files) {
+    uint64_t start = bench_clock();
+    dm510fs_destroy(NULL);
+    samples[sample_count++] = bench_clock() - start;
+    emit("save", files, samples[0], 0);
+
+    memset(&geometry, 0, sizeof(geometry));
+    start = bench_clock();
+    dm510fs_init(NULL);
+    samples[sample_count++] = bench_clock() - start;
+    emit("restore", files, samples[0], 0);
+}
+
+static void bench_run(int files) {
+    unlink(PERSISENT_FILENAME);
+    unlink(JOURNAL_FILENAME);
+    unlink(JOURNAL_ALTERNATE_FILENAME);
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.max_inodes = files + files / BENCH_FANOUT + BENCH_DEPTH * (BENCH_DEPTH_FILES + 1) + 16;
+    geometry.max_blocks = BENCH_SEQ_BYTES / DEFAULT_BLOCK_SIZE * 2 + files; // Room for the small files in blocks too
+    dm510fs_init(NULL);
+
+    bench_namespace(files);
+    bench_small(files);
+    bench_io(files);
+    bench_rename(files);
+    bench_persist(files);
+
+    dm510fs_destroy(NULL);
+}
+
+int main(int argc, char *argv[]) {
+    int default_sizes[] = { 1000, 10000, 100000 };
+    int size_count = argc > 1 ? argc - 1 : 3;
+    int sizes[size_count];
+    int largest = 0;
+    for(int i = 0; i < size_count; i++) {
+        sizes[i] = argc > 1 ? atoi(argv[i + 1]) : default_sizes[i];
+        if(sizes[i] <= 0) {
+            fprintf(stderr, "usage: %s [files ...]\n", argv[0]);
+            return 1;
+        }
+        if(sizes[i] > largest)
+            largest = sizes[i];
+    }
+
+    size_t capacity = largest;
+    if(capacity < BENCH_SEQ_BYTES / BENCH_RANDOM_CHUNK)
+        capacity = BENCH_SEQ_BYTES / BENCH_RANDOM_CHUNK;
+    samples = malloc(capacity * sizeof(uint64_t));
+
+    // Keep the images out of the working directory
+    char directory[] = "/tmp/dm510fs-bench.XXXXXX";
+    if(mkdtemp(directory) == NULL || chdir(directory) != 0) {
+        perror(directory);
+        return 1;
+    }
+    log_level = LEVEL_WARN;
+
+    for(int i = 0; i < size_count; i++)
+        bench_run(sizes[i]);
+
+    unlink(PERSISENT_FILENAME);
+    unlink(JOURNAL_FILENAME);
+    unlink(JOURNAL_ALTERNATE_FILENAME);
+    if(chdir("/") == 0)
+        rmdir(directory);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,556 @@
+// Buffer cache of the data blocks
+//
+// The pool keeps its address range for max_blocks blocks, but only the units the cache holds are backed by
+// memory. A unit is a page-aligned run of blocks, one block unless blocks are smaller than a page. Code that
+// touches block data pins it first with cache_pin(), which reads missing units from the data region of the
+// image, and unpins it with cache_unpin(). Blocks marked dirty inside a transaction stay pinned until
+// journal_end() copied them, see cache_hold() and cache_release().
+//
+// Units are spread over shards by number, each shard running a CLOCK over frames of its own. A dirty unit
+// is written back in place before its frame is reused, once the journal holds every transaction that
+// changed it, so the image never gets ahead of the journal. Checkpoints write the remaining dirty blocks,
+// see cache_flush(). A prefetch thread loads the runs sequential readers are about to need, see inode_read().
+
+uint32_t cache_size = DEFAULT_CACHE_SIZE;
+
+int cache_fd = -1;
+char *cache_base; // The pool
+uint64_t cache_data_offset; // Of the data region in the image
+uint64_t cache_region_bytes; // Of the data region, max_blocks blocks
+size_t cache_unit_bytes;
+uint32_t cache_unit_blocks;
+uint32_t cache_unit_count;
+uint32_t *cache_unit_frames; // Frame + 1 holding each unit, 0 if none, guarded by the shard of the unit
+CacheFrame *cache_frames;
+// Pins of transactions that have not reached the journal buffer yet, see cache_hold(), per block of the unit of each
+// frame, cache_unit_blocks of them per frame. Guarded by the shard of the unit
+uint32_t *cache_holds;
+uint32_t cache_shard_frames; // Frames of each shard
+uint32_t cache_shard_count;
+CacheShard cache_shards[CACHE_SHARDS];
+
+// Writebacks run without the shard lock, checkpoints wait for them before syncing the image
+pthread_mutex_t cache_writeback_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_writeback_done = PTHREAD_COND_INITIALIZER;
+uint32_t cache_writebacks_running;
+
+// Runs queued for the prefetch thread, a ring of CACHE_PREFETCH_QUEUE entries
+pthread_mutex_t cache_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_prefetch_wakeup = PTHREAD_COND_INITIALIZER;
+uint32_t cache_prefetch_blocks[CACHE_PREFETCH_QUEUE][2]; // First block and block count
+uint32_t cache_prefetch_head;
+uint32_t cache_prefetch_tail;
+bool cache_prefetch_running;
+pthread_t cache_prefetch_thread;
+
+// Outcomes of pinning a unit, the negative ones set apart from the frames cache_victim() returns
+enum { CACHE_HIT, CACHE_CLAIMED, CACHE_BUSY = -1, CACHE_RETRY = -2 };
+
+static inline CacheShard *cache_shard(uint32_t unit) {
+    return &cache_shards[unit & (cache_shard_count - 1)];
+}
+
+static inline CacheFrame *cache_frame(uint32_t unit) {
+    uint32_t slot = cache_unit_frames[unit];
+    return slot == 0 ? NULL : &cache_frames[slot - 1];
+}
+
+// Holds of block, whose unit is in frame
+static inline uint32_t *cache_block_holds(const CacheFrame *frame, uint32_t block) {
+    return &cache_holds[(size_t)(frame - cache_frames) * cache_unit_blocks + block % cache_unit_blocks];
+}
+
+// Bytes of the unit inside the data region, the last unit may end past it
+static size_t cache_unit_length(uint32_t unit) {
+    uint64_t offset = (uint64_t)unit * cache_unit_bytes;
+    return cache_region_bytes - offset < cache_unit_bytes ? cache_region_bytes - offset : cache_unit_bytes;
+}
+
+static bool cache_unit_dirty(uint32_t unit) {
+    uint32_t first = unit * cache_unit_blocks;
+    for(uint32_t b = first; b < first + cache_unit_blocks && b < geometry.max_blocks; b++) {
+        if(__atomic_load_n(&block_dirty[b / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (b % 64)))
+            return true;
+    }
+    return false;
+}
+
+// Write the dirty unit of frame to the image, called with the shard lock held, which is dropped meanwhile
+// Returns 0 on success, -EIO if the unit could not be written, it stays dirty then
+static int cache_writeback(CacheShard *shard, CacheFrame *frame) {
+    // Write-ahead rule: the transactions that changed the unit reach the journal first
+    if(frame->sequence > __atomic_load_n(&journal_durable_sequence, __ATOMIC_ACQUIRE) && !journal_io_error) {
+        pthread_mutex_unlock(&shard->mutex);
+        journal_commit();
+        pthread_mutex_lock(&shard->mutex);
+        return 0;
+    }
+
+    uint32_t unit = frame->unit;
+    frame->writing = true;
+    __atomic_add_fetch(&cache_writebacks_running, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&shard->mutex);
+
+    uint32_t first = unit * cache_unit_blocks;
+    uint32_t end = first + cache_unit_blocks < geometry.max_blocks ? first + cache_unit_blocks : geometry.max_blocks;
+    for(uint32_t b = first; b < end; b++)
+        __atomic_fetch_and(&block_dirty[b / 64], ~((uint64_t)1 << (b % 64)), __ATOMIC_RELAXED);
+    uint64_t offset = (uint64_t)unit * cache_unit_bytes;
+    int result = pwrite_full(cache_fd, cache_base + offset, cache_unit_length(unit), cache_data_offset + offset);
+    if(result < 0) {
+        log_error("Error writing back data blocks %u to %u: %m", first, end - 1);
+        for(uint32_t b = first; b < end; b++)
+            __atomic_fetch_or(&block_dirty[b / 64], (uint64_t)1 << (b % 64), __ATOMIC_RELAXED);
+        __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&cache_writeback_mutex);
+    if(__atomic_sub_fetch(&cache_writebacks_running, 1, __ATOMIC_ACQ_REL) == 0)
+        pthread_cond_broadcast(&cache_writeback_done);
+    pthread_mutex_unlock(&cache_writeback_mutex);
+
+    pthread_mutex_lock(&shard->mutex);
+    frame->writing = false;
+    if(result == 0)
+        shard->writebacks++;
+    pthread_cond_broadcast(&shard->ready);
+    return result < 0 ? -EIO : 0;
+}
+
+// Find a frame of the shard for a new unit with the CLOCK, called with the shard lock held
+// Returns the frame, CACHE_RETRY after the lock was dropped, CACHE_BUSY if every frame is pinned and
+// wait is false, or -EIO if a dirty unit could not be written back
+static int cache_victim(CacheShard *shard, bool wait) {
+    for(uint32_t step = 0; step < 2 * cache_shard_frames; step++) {
+        uint32_t i = shard->hand;
+        shard->hand = i + 1 < cache_shard_frames ? i + 1 : 0;
+        CacheFrame *frame = &shard->frames[i];
+        if(frame->unit == CACHE_FREE)
+            return frame - cache_frames;
+        if(frame->pins > 0 || frame->loading || frame->writing)
+            continue;
+        if(frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+        if(cache_unit_dirty(frame->unit))
+            return cache_writeback(shard, frame) < 0 ? -EIO : CACHE_RETRY;
+
+        // Dropping the pages gives the memory back, they read as zeros until the frame is loaded again
+        madvise(cache_base + (size_t)frame->unit * cache_unit_bytes, cache_unit_bytes, MADV_DONTNEED);
+        cache_unit_frames[frame->unit] = 0;
+        frame->unit = CACHE_FREE;
+        shard->evictions++;
+        return frame - cache_frames;
+    }
+
+    if(!wait)
+        return CACHE_BUSY;
+    shard->waiters++;
+    pthread_cond_wait(&shard->ready, &shard->mutex);
+    shard->waiters--;
+    return CACHE_RETRY;
+}
+
+// Pin unit, called with the lock of its shard held
+// Returns CACHE_HIT, CACHE_CLAIMED if the caller must load the unit into its new frame, CACHE_BUSY if
+// waiting is needed and wait is false, or -EIO
+static int cache_pin_unit(CacheShard *shard, uint32_t unit, bool wait) {
+    for(;;) {
+        CacheFrame *frame = cache_frame(unit);
+        if(frame != NULL) {
+            if(frame->loading || frame->writing) {
+                if(!wait)
+                    return CACHE_BUSY;
+                pthread_cond_wait(&shard->ready, &shard->mutex);
+                continue;
+            }
+            frame->pins++;
+            frame->referenced = true;
+            shard->hits++;
+            return CACHE_HIT;
+        }
+
+        int victim = cache_victim(shard, wait);
+        if(victim == CACHE_RETRY)
+            continue;
+        if(victim < 0)
+            return victim;
+        frame = &cache_frames[victim];
+        frame->unit = unit;
+        frame->pins = 1;
+        frame->sequence = 0;
+        frame->referenced = true;
+        frame->loading = true;
+        cache_unit_frames[unit] = victim + 1;
+        shard->misses++;
+        return CACHE_CLAIMED;
+    }
+}
+
+// Read units [first, end), claimed by this thread, with a single pread, or just hand them over if fresh
+// Units past the end of the image read as zeros. A failed read gives the frames back
+// Returns 0 on success, -EIO if error occurred
+static int cache_load(uint32_t first, uint32_t end, bool fresh) {
+    int result = 0;
+    if(!fresh) {
+        uint64_t offset = (uint64_t)first * cache_unit_bytes;
+        size_t length = (size_t)(end - first - 1) * cache_unit_bytes + cache_unit_length(end - 1);
+        char *position = cache_base + offset;
+        while(length > 0) {
+            ssize_t n = pread(cache_fd, position, length, cache_data_offset + offset);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0) {
+                log_error("Error reading data blocks %u to %u: %m", first * cache_unit_blocks, end * cache_unit_blocks - 1);
+                result = -EIO;
+            }
+            if(n <= 0)
+                break; // The rest was never written and is still zero in memory
+            position += n;
+            offset += n;
+            length -= n;
+        }
+    }
+
+    for(uint32_t unit = first; unit < end; unit++) {
+        CacheShard *shard = cache_shard(unit);
+        pthread_mutex_lock(&shard->mutex);
+        CacheFrame *frame = cache_frame(unit);
+        frame->loading = false;
+        if(result < 0) {
+            madvise(cache_base + (size_t)unit * cache_unit_bytes, cache_unit_bytes, MADV_DONTNEED);
+            cache_unit_frames[unit] = 0;
+            frame->unit = CACHE_FREE;
+            frame->pins = 0;
+        }
+        pthread_cond_broadcast(&shard->ready);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return result;
+}
+
+// Wait until unit is loaded or written back, or until its shard has a frame to give, called with the shard
+// lock held, which is dropped meanwhile
+static void cache_wait(CacheShard *shard, uint32_t unit) {
+    CacheFrame *frame = cache_frame(unit);
+    if(frame == NULL)
+        cache_victim(shard, true);
+    else if(frame->loading || frame->writing)
+        pthread_cond_wait(&shard->ready, &shard->mutex);
+}
+
+// Keep blocks [block, block + count) in memory until cache_unpin(), reading those that are not
+// Misses next to each other are read together. fresh skips reading blocks the caller overwrites whole,
+// which only applies when every unit is a single block
+// A thread never waits with units of the call pinned, since their owner could be waiting for them in turn:
+// it lets them go, waits, and pins the run again from its start
+// Returns 0 on success, -EIO if the blocks could not be read, none of them stay pinned then
+int cache_pin(uint32_t block, uint32_t count, bool fresh) {
+    if(count == 0)
+        return 0;
+    uint32_t first = block / cache_unit_blocks;
+    uint32_t last = (block + count - 1) / cache_unit_blocks;
+    fresh = fresh && cache_unit_blocks == 1;
+
+    // Units [batch, unit) are claimed by this thread and not loaded yet, they are loaded before it waits for anyone
+    // Units [first, batch) are pinned and loaded
+    uint32_t batch = first;
+    uint32_t unit = first;
+    int result = 0;
+    while(unit <= last) {
+        CacheShard *shard = cache_shard(unit);
+        pthread_mutex_lock(&shard->mutex);
+        int state = cache_pin_unit(shard, unit, unit == first);
+        pthread_mutex_unlock(&shard->mutex);
+        if(state == CACHE_CLAIMED) {
+            unit++;
+            continue;
+        }
+
+        if(batch < unit && (result = cache_load(batch, unit, fresh)) == 0)
+            batch = unit;
+        if(state == CACHE_BUSY && result == 0) {
+            if(batch > first)
+                cache_unpin(first * cache_unit_blocks, (batch - first) * cache_unit_blocks);
+            pthread_mutex_lock(&shard->mutex);
+            cache_wait(shard, unit);
+            pthread_mutex_unlock(&shard->mutex);
+            unit = batch = first;
+            continue;
+        }
+        if(state == CACHE_HIT && result < 0)
+            cache_unpin(unit * cache_unit_blocks, 1);
+        if(result == 0 && state < 0)
+            result = state;
+        if(result < 0)
+            break;
+        batch = ++unit;
+    }
+    if(result == 0 && batch <= last)
+        result = cache_load(batch, last + 1, fresh);
+    if(result < 0 && batch > first)
+        cache_unpin(first * cache_unit_blocks, (batch - first) * cache_unit_blocks);
+    return result;
+}
+
+void cache_unpin(uint32_t block, uint32_t count) {
+    if(count == 0)
+        return;
+    uint32_t last = (block + count - 1) / cache_unit_blocks;
+    for(uint32_t unit = block / cache_unit_blocks; unit <= last; unit++) {
+        CacheShard *shard = cache_shard(unit);
+        pthread_mutex_lock(&shard->mutex);
+        CacheFrame *frame = cache_frame(unit);
+        if(--frame->pins == 0 && shard->waiters > 0)
+            pthread_cond_broadcast(&shard->ready);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+// Keep a block the running transaction changed pinned until journal_end() copied it, see cache_release()
+// The caller has the block pinned
+void cache_hold(uint32_t block) {
+    uint32_t unit = block / cache_unit_blocks;
+    CacheShard *shard = cache_shard(unit);
+    pthread_mutex_lock(&shard->mutex);
+    CacheFrame *frame = cache_frame(unit);
+    frame->pins++;
+    (*cache_block_holds(frame, block))++;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// Drop the hold of cache_hold() once the block is in the journal buffer as part of transaction sequence,
+// which must be durable before the block is written back. 0 if the transaction was not appended
+void cache_release(uint32_t block, uint64_t sequence) {
+    uint32_t unit = block / cache_unit_blocks;
+    CacheShard *shard = cache_shard(unit);
+    pthread_mutex_lock(&shard->mutex);
+    CacheFrame *frame = cache_frame(unit);
+    if(sequence > frame->sequence)
+        frame->sequence = sequence;
+    (*cache_block_holds(frame, block))--;
+    if(--frame->pins == 0 && shard->waiters > 0)
+        pthread_cond_broadcast(&shard->ready);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// Most blocks worth pinning at once, see CACHE_RUN_BYTES, and no more than a quarter of the cache, so a run
+// or the holds of a write, see inode_write_buf(), leave most frames of every shard to other threads
+uint32_t cache_run_blocks(void) {
+    uint32_t run = CACHE_RUN_BYTES > geometry.block_size ? CACHE_RUN_BYTES / geometry.block_size : 1;
+    uint32_t quarter = cache_shard_count * cache_shard_frames / 4 * cache_unit_blocks;
+    return quarter > 0 && quarter < run ? quarter : run;
+}
+
+// Queue blocks [block, block + count) for the prefetch thread, dropped if the queue is full
+void cache_prefetch(uint32_t block, uint32_t count) {
+    pthread_mutex_lock(&cache_prefetch_mutex);
+    if(cache_prefetch_running && cache_prefetch_tail - cache_prefetch_head < CACHE_PREFETCH_QUEUE) {
+        uint32_t *entry = cache_prefetch_blocks[cache_prefetch_tail++ % CACHE_PREFETCH_QUEUE];
+        entry[0] = block;
+        entry[1] = count;
+        pthread_cond_signal(&cache_prefetch_wakeup);
+    }
+    pthread_mutex_unlock(&cache_prefetch_mutex);
+}
+
+// Load queued runs, in pieces of cache_run_blocks(), and leave them to the CLOCK
+void* cache_prefetch_loop() {
+    pthread_mutex_lock(&cache_prefetch_mutex);
+    while(cache_prefetch_running) {
+        if(cache_prefetch_head == cache_prefetch_tail) {
+            pthread_cond_wait(&cache_prefetch_wakeup, &cache_prefetch_mutex);
+            continue;
+        }
+        uint32_t *entry = cache_prefetch_blocks[cache_prefetch_head++ % CACHE_PREFETCH_QUEUE];
+        uint32_t block = entry[0];
+        uint32_t end = entry[0] + entry[1];
+        pthread_mutex_unlock(&cache_prefetch_mutex);
+
+        for(uint32_t run = cache_run_blocks(); block < end && block < geometry.max_blocks; block += run) {
+            uint32_t count = end - block < run ? end - block : run;
+            if(block + count > geometry.max_blocks)
+                count = geometry.max_blocks - block;
+            if(cache_pin(block, count, false) < 0)
+                break;
+            cache_unpin(block, count);
+        }
+        pthread_mutex_lock(&cache_prefetch_mutex);
+    }
+    pthread_mutex_unlock(&cache_prefetch_mutex);
+    return NULL;
+}
+
+// Clear the dirty bit of the pinned block for a checkpoint to write it, unless a running transaction holds it,
+// and make sure the transactions that changed it are durable first, see cache_writeback()
+// Holds are taken before the bit is set, see mark_block_dirty(), so a block changed while it is written is
+// either skipped here or dirty again afterwards. Holds count per block: a block skipped for the hold of another
+// in its unit would stay out of the image once the journal holding its last change is emptied
+// Returns 1 if the block is to be written, 0 if it is clean or held, -1 if the journal could not be committed
+static int cache_take_dirty(uint32_t block) {
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    if(!(__atomic_fetch_and(&block_dirty[block / 64], ~bit, __ATOMIC_RELAXED) & bit))
+        return 0;
+    uint32_t unit = block / cache_unit_blocks;
+    CacheShard *shard = cache_shard(unit);
+    pthread_mutex_lock(&shard->mutex);
+    CacheFrame *frame = cache_frame(unit);
+    bool held = *cache_block_holds(frame, block) > 0;
+    uint64_t sequence = frame->sequence;
+    pthread_mutex_unlock(&shard->mutex);
+    if(!held && (sequence <= __atomic_load_n(&journal_durable_sequence, __ATOMIC_ACQUIRE) || journal_commit() == 0))
+        return 1;
+    __atomic_fetch_or(&block_dirty[block / 64], bit, __ATOMIC_RELAXED);
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+    return held ? 0 : -1;
+}
+
+// Write every dirty block to the image, called by checkpoints while operations go on
+// Blocks held by running transactions are left dirty, see cache_take_dirty()
+// Returns the number of blocks written, -1 if error occurred
+int cache_flush(void) {
+    int written = 0;
+    int result = 0;
+    uint32_t count = geometry.block_count;
+    uint32_t run = cache_run_blocks();
+    uint32_t i = 0;
+    while(i < count && result == 0) {
+        uint64_t word = __atomic_load_n(&block_dirty[i / 64], __ATOMIC_RELAXED) >> (i % 64);
+        if(word == 0) {
+            i = (i / 64 + 1) * 64;
+            continue;
+        }
+        i += __builtin_ctzll(word);
+        if(i >= count)
+            break;
+
+        // Pin the run first, so no writeback can start on it, then take the bits that are still set
+        uint32_t end = i;
+        while(end < count && end - i < run && (__atomic_load_n(&block_dirty[end / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (end % 64))))
+            end++;
+        if(cache_pin(i, end - i, false) < 0) {
+            result = -1;
+            break;
+        }
+        for(uint32_t b = i; b < end && result == 0; ) {
+            uint32_t start = b;
+            int taken = 0;
+            while(b < end && (taken = cache_take_dirty(b)) > 0)
+                b++;
+            if(b < end && taken < 0)
+                result = -1;
+            if(b > start && pwrite_full(cache_fd, BLOCK_DATA(cache_base, start), (size_t)(b - start) * geometry.block_size,
+                    cache_data_offset + (uint64_t)start * geometry.block_size) < 0) {
+                log_error("Error writing data blocks %u to %u: %m", start, b - 1);
+                mark_range_dirty(block_dirty, start, b);
+                result = -1;
+                break;
+            }
+            written += b - start;
+            if(b == start)
+                b++;
+        }
+        cache_unpin(i, end - i);
+        i = end;
+    }
+
+    // Writebacks that took dirty blocks from under the loop above must land before the image is synced
+    pthread_mutex_lock(&cache_writeback_mutex);
+    while(cache_writebacks_running > 0)
+        pthread_cond_wait(&cache_writeback_done, &cache_writeback_mutex);
+    pthread_mutex_unlock(&cache_writeback_mutex);
+    return result < 0 ? -1 : written;
+}
+
+void cache_collect(CacheStats *total) {
+    memset(total, 0, sizeof(CacheStats));
+    total->frames = cache_shard_count * cache_shard_frames;
+    total->unit_bytes = cache_unit_bytes;
+    for(uint32_t s = 0; s < cache_shard_count; s++) {
+        CacheShard *shard = &cache_shards[s];
+        pthread_mutex_lock(&shard->mutex);
+        total->hits += shard->hits;
+        total->misses += shard->misses;
+        total->evictions += shard->evictions;
+        total->writebacks += shard->writebacks;
+        for(uint32_t i = 0; i < cache_shard_frames; i++)
+            total->resident += shard->frames[i].unit != CACHE_FREE;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+// Set up the cache over the pool at base, whose blocks are stored from data_offset in the image open on fd,
+// and start the prefetch thread. The caps must be final
+// Returns 0 on success, -1 if error occurred
+int cache_open(int fd, char *base, uint64_t data_offset) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    cache_fd = fd;
+    cache_base = base;
+    cache_data_offset = data_offset;
+    cache_region_bytes = (uint64_t)geometry.max_blocks * geometry.block_size;
+    cache_unit_bytes = geometry.block_size > page ? geometry.block_size : page;
+    cache_unit_blocks = cache_unit_bytes / geometry.block_size;
+    cache_unit_count = (geometry.max_blocks + cache_unit_blocks - 1) / cache_unit_blocks;
+
+    uint64_t frames = (uint64_t)cache_size * 1024 * 1024 / cache_unit_bytes;
+    if(frames < CACHE_SHARD_FRAMES)
+        frames = CACHE_SHARD_FRAMES;
+    if(frames > cache_unit_count)
+        frames = cache_unit_count; // Everything fits
+    cache_shard_count = 1;
+    while(cache_shard_count < CACHE_SHARDS && frames / (cache_shard_count * 2) >= CACHE_SHARD_FRAMES)
+        cache_shard_count *= 2;
+    cache_shard_frames = (frames + cache_shard_count - 1) / cache_shard_count;
+
+    cache_unit_frames = allocate_region((size_t)cache_unit_count * sizeof(uint32_t));
+    cache_frames = calloc((size_t)cache_shard_count * cache_shard_frames, sizeof(CacheFrame));
+    cache_holds = calloc((size_t)cache_shard_count * cache_shard_frames * cache_unit_blocks, sizeof(uint32_t));
+    if(cache_unit_frames == NULL || cache_frames == NULL || cache_holds == NULL) {
+        log_error("Error allocating the buffer cache: %m");
+        return -1;
+    }
+    for(uint32_t i = 0; i < cache_shard_count * cache_shard_frames; i++)
+        cache_frames[i].unit = CACHE_FREE;
+    for(uint32_t s = 0; s < cache_shard_count; s++) {
+        CacheShard *shard = &cache_shards[s];
+        memset(shard, 0, sizeof(CacheShard));
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->ready, NULL);
+        shard->frames = &cache_frames[s * cache_shard_frames];
+    }
+    log_info("Buffer cache of %u units of %zu bytes in %u shards", cache_shard_count * cache_shard_frames, cache_unit_bytes, cache_shard_count);
+
+    cache_prefetch_head = cache_prefetch_tail = 0;
+    cache_prefetch_running = true;
+    if(pthread_create(&cache_prefetch_thread, NULL, cache_prefetch_loop, NULL) != 0) {
+        log_error("Failed to create prefetch thread: %m");
+        cache_prefetch_running = false;
+        return -1;
+    }
+    return 0;
+}
+
+// Stop the prefetch thread and drop the cache, after the last checkpoint wrote every dirty block
+void cache_close(void) {
+    pthread_mutex_lock(&cache_prefetch_mutex);
+    bool started = cache_prefetch_running;
+    cache_prefetch_running = false;
+    pthread_cond_signal(&cache_prefetch_wakeup);
+    pthread_mutex_unlock(&cache_prefetch_mutex);
+    if(started)
+        pthread_join(cache_prefetch_thread, NULL);
+
+    for(uint32_t s = 0; s < cache_shard_count; s++) {
+        pthread_mutex_destroy(&cache_shards[s].mutex);
+        pthread_cond_destroy(&cache_shards[s].ready);
+    }
+    munmap(cache_unit_frames, (size_t)cache_unit_count * sizeof(uint32_t));
+    free(cache_frames);
+    free(cache_holds);
+    cache_unit_frames = NULL;
+    cache_frames = NULL;
+    cache_holds = NULL;
+    cache_shard_count = 0;
+    cache_fd = -1;
+}
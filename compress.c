@@ -0,0 +1,406 @@
+// Transparent compression of data blocks
+//
+// With -o compress, file data is compressed a cluster at a time: COMPRESS_CLUSTER_BYTES of the file at an
+// aligned offset, once all of its blocks are written. A cluster that saves at least one block moves to the
+// blocks holding its compressed form, mapped by a single compressed extent; one that does not stays raw.
+// Compressed clusters are never changed in place. Writing into one, or cutting it with a truncate or a punched
+// hole, expands it back to raw blocks first, and a write compresses the clusters it completed or expanded
+// again once it is done, see compress_prepare() and compress_written().
+// Reads decompress a whole cluster into a buffer of the reading thread, which serves the reads that follow
+// in the same cluster until a compressed cluster is freed anywhere, see compress_forget().
+//
+// The codec is a byte-oriented LZ77 in the manner of LZ4. A sequence is a token byte holding the number of
+// literals and the match length less COMPRESS_MIN_MATCH in a nibble each, 15 meaning more length bytes follow,
+// then the literals and a two byte little endian match offset. The last sequence has literals only.
+// A stored cluster is the length of its compressed stream followed by the stream.
+
+bool compress_enabled; // -o compress
+uint64_t compress_generation = 1; // Bumped whenever a compressed cluster is freed
+
+// Buffers of a thread: a decompressed cluster, and room for one compressed
+typedef struct CompressBuffers {
+    uint32_t start; // First block of the compressed cluster held decompressed
+    uint64_t generation; // compress_generation when it was decompressed, 0 if nothing is held
+    char cluster[COMPRESS_CLUSTER_BYTES];
+    char packed[COMPRESS_CLUSTER_BYTES];
+} CompressBuffers;
+
+__thread CompressBuffers *own_compress_buffers;
+pthread_key_t compress_key; // Frees the buffers of an exiting thread
+pthread_once_t compress_key_once = PTHREAD_ONCE_INIT;
+
+// Blocks per cluster, compression only pays off with at least two
+uint32_t compress_cluster_blocks(void) {
+    return COMPRESS_CLUSTER_BYTES / geometry.block_size;
+}
+
+// Forget every decompressed cluster, their blocks may be reused
+void compress_forget(void) {
+    __atomic_fetch_add(&compress_generation, 1, __ATOMIC_RELAXED);
+}
+
+void compress_key_create(void) {
+    pthread_key_create(&compress_key, free);
+}
+
+// Returns the buffers of the calling thread, NULL if no memory was left for them
+static CompressBuffers *compress_buffers(void) {
+    if(own_compress_buffers == NULL) {
+        pthread_once(&compress_key_once, compress_key_create);
+        own_compress_buffers = calloc(1, sizeof(CompressBuffers));
+        if(own_compress_buffers != NULL)
+            pthread_setspecific(compress_key, own_compress_buffers);
+    }
+    return own_compress_buffers;
+}
+
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MAX_OFFSET 65535
+#define COMPRESS_HASH_BITS 12
+
+static inline uint32_t compress_read32(const uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint32_t compress_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+// Append the part of a length that did not fit its nibble
+static uint8_t *compress_put_length(uint8_t *out, size_t length) {
+    for(; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+// Append a sequence of literals followed by a match, match 0 for the last sequence
+// Returns the end of the sequence, NULL if it does not fit before end
+static uint8_t *compress_sequence(uint8_t *out, const uint8_t *end, const uint8_t *literals, size_t literal_count,
+        size_t offset, size_t match) {
+    size_t extra = match > 0 ? match - COMPRESS_MIN_MATCH : 0;
+    if((size_t)(end - out) < 1 + literal_count / 255 + 1 + literal_count + 2 + extra / 255 + 1)
+        return NULL;
+    uint8_t *token = out++;
+    *token = (literal_count < 15 ? literal_count : 15) << 4 | (extra < 15 ? extra : 15);
+    if(literal_count >= 15)
+        out = compress_put_length(out, literal_count - 15);
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+    if(match == 0)
+        return out;
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if(extra >= 15)
+        out = compress_put_length(out, extra - 15);
+    return out;
+}
+
+// Compress length bytes of src into at most capacity bytes of dst
+// Returns the compressed length, 0 if it does not fit
+static size_t compress_encode(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << COMPRESS_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint8_t *out = dst;
+    const uint8_t *end = dst + capacity;
+    size_t anchor = 0; // Start of the literals not written yet
+    size_t position = 0;
+    while(length >= COMPRESS_MIN_MATCH && position <= length - COMPRESS_MIN_MATCH) {
+        uint32_t value = compress_read32(src + position);
+        uint32_t *slot = &table[compress_hash(value)];
+        size_t candidate = *slot;
+        *slot = position;
+        if(candidate >= position || position - candidate > COMPRESS_MAX_OFFSET || compress_read32(src + candidate) != value) {
+            position += 1 + ((position - anchor) >> 6); // Skip faster through data that does not match
+            continue;
+        }
+
+        size_t match = COMPRESS_MIN_MATCH;
+        while(position + match + 8 <= length && memcmp(src + candidate + match, src + position + match, 8) == 0)
+            match += 8;
+        while(position + match < length && src[candidate + match] == src[position + match])
+            match++;
+        out = compress_sequence(out, end, src + anchor, position - anchor, position - candidate, match);
+        if(out == NULL)
+            return 0;
+        position += match;
+        anchor = position;
+    }
+    out = compress_sequence(out, end, src + anchor, length - anchor, 0, 0);
+    return out == NULL ? 0 : out - dst;
+}
+
+// Read the part of a length that did not fit its nibble
+// Returns false if the stream ends first
+static bool compress_get_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if(*in >= end)
+            return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while(byte == 255);
+    return true;
+}
+
+// Decompress the stream of src_length bytes at src into exactly length bytes at dst
+// Returns 0, or -1 if the stream is corrupt
+static int compress_decode(const uint8_t *src, size_t src_length, uint8_t *dst, size_t length) {
+    const uint8_t *in = src;
+    const uint8_t *in_end = src + src_length;
+    uint8_t *out = dst;
+    uint8_t *out_end = dst + length;
+    while(in < in_end) {
+        uint8_t token = *in++;
+        size_t literal_count = token >> 4;
+        if(literal_count == 15 && !compress_get_length(&in, in_end, &literal_count))
+            return -1;
+        if(literal_count > (size_t)(in_end - in) || literal_count > (size_t)(out_end - out))
+            return -1;
+        memcpy(out, in, literal_count);
+        in += literal_count;
+        out += literal_count;
+        if(in == in_end)
+            break; // The last sequence
+
+        if(in_end - in < 2)
+            return -1;
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match = token & 15;
+        if(match == 15 && !compress_get_length(&in, in_end, &match))
+            return -1;
+        match += COMPRESS_MIN_MATCH;
+        if(offset == 0 || offset > (size_t)(out - dst) || match > (size_t)(out_end - out))
+            return -1;
+        const uint8_t *from = out - offset;
+        if(offset >= match) {
+            memcpy(out, from, match);
+        } else {
+            for(size_t i = 0; i < match; i++)
+                out[i] = from[i]; // Overlapping, repeats the last offset bytes
+        }
+        out += match;
+    }
+    return out == out_end ? 0 : -1;
+}
+
+// Decompress the cluster of a compressed extent of a file the caller holds locked
+// *data is set to the cluster, in a buffer of the calling thread valid until its next call into this file
+// Returns 0, -ENOMEM, or -EIO if the blocks could not be read or do not hold a valid cluster
+int compress_read(const Extent *extent, const char **data) {
+    CompressBuffers *buffers = compress_buffers();
+    if(buffers == NULL)
+        return -ENOMEM;
+    uint64_t generation = __atomic_load_n(&compress_generation, __ATOMIC_RELAXED);
+    if(buffers->generation == generation && buffers->start == extent->start) {
+        *data = buffers->cluster;
+        return 0;
+    }
+
+    size_t block_size = geometry.block_size;
+    uint32_t stored = EXTENT_STORED(*extent);
+    size_t length = (size_t)EXTENT_LENGTH(*extent) * block_size;
+    if(length > COMPRESS_CLUSTER_BYTES || cache_pin(extent->start, stored, false) < 0)
+        return -EIO;
+    const char *packed = BLOCK_DATA(data_blocks, extent->start);
+    uint32_t packed_length;
+    memcpy(&packed_length, packed, sizeof(packed_length));
+    uint64_t start = stats_clock();
+    buffers->generation = 0;
+    int result = -1;
+    if(packed_length <= (size_t)stored * block_size - sizeof(packed_length))
+        result = compress_decode((const uint8_t *)packed + sizeof(packed_length), packed_length, (uint8_t *)buffers->cluster, length);
+    cache_unpin(extent->start, stored);
+    if(result < 0) {
+        log_error("Corrupt compressed cluster in blocks %u to %u", extent->start, extent->start + stored - 1);
+        return -EIO;
+    }
+    stats_decompress(start, length);
+
+    buffers->start = extent->start;
+    buffers->generation = generation;
+    *data = buffers->cluster;
+    return 0;
+}
+
+// Move the compressed cluster holding logical block of the file at index, if there is one, back to raw blocks,
+// called inside a transaction
+// Returns 0, -ENOSPC if no blocks or no room in the map were left for it, the file is unchanged then, or -errno
+int compress_expand(int index, uint32_t logical) {
+    InodeCold *cold = &inode_cold[index];
+    size_t block_size = geometry.block_size;
+    uint32_t run;
+    Extent extent;
+    int64_t block = extent_map(cold, data_blocks, logical, &run, NULL, &extent);
+    if(block < -1)
+        return block;
+    if(block < 0 || !EXTENT_IS_COMPRESSED(extent))
+        return 0;
+    const char *cluster;
+    int result = compress_read(&extent, &cluster);
+    if(result < 0)
+        return result;
+
+    // The raw blocks need not be contiguous, the map gets room for every piece before the cluster goes
+    uint32_t blocks = EXTENT_LENGTH(extent);
+    Extent pieces[COMPRESS_CLUSTER_BYTES / MIN_BLOCK_SIZE];
+    uint32_t count = 0;
+    for(uint32_t placed = 0; placed < blocks; ) {
+        uint32_t hint = count > 0 ? pieces[count - 1].start + pieces[count - 1].length : extent.start;
+        uint32_t got;
+        int start = allocate_blocks(block_bitmap, data_blocks, hint, blocks - placed, 1, &got);
+        if(start < 0) {
+            result = -ENOSPC;
+            break;
+        }
+        pieces[count++] = (Extent){ extent.logical + placed, start, got };
+        placed += got;
+    }
+    if(result == 0)
+        result = extent_reserve(index, block_bitmap, data_blocks, extent.logical, count);
+    for(uint32_t i = 0; result == 0 && i < count; i++){
+        if(cache_pin(pieces[i].start, pieces[i].length, true) < 0) {
+            result = -EIO;
+            break;
+        }
+        memcpy(BLOCK_DATA(data_blocks, pieces[i].start), cluster + (size_t)(pieces[i].logical - extent.logical) * block_size,
+                (size_t)pieces[i].length * block_size);
+        for(uint32_t b = 0; b < pieces[i].length; b++)
+            mark_block_dirty(pieces[i].start + b);
+        cache_unpin(pieces[i].start, pieces[i].length);
+    }
+    if(result < 0) {
+        for(uint32_t i = 0; i < count; i++)
+            deallocate_blocks(block_bitmap, pieces[i].start, pieces[i].length);
+        return result;
+    }
+
+    result = extent_remove(index, block_bitmap, data_blocks, extent.logical, extent.logical + blocks);
+    for(uint32_t i = 0; result == 0 && i < count; i++)
+        result = extent_insert(index, block_bitmap, data_blocks, pieces[i]);
+    return result;
+}
+
+// Expand the compressed cluster of the file at index that straddles boundary, the first logical block of
+// a range about to be cut, if there is one. Called inside a transaction
+// Returns 0 or -errno, see compress_expand()
+int compress_split(int index, uint32_t boundary) {
+    uint32_t run;
+    Extent extent;
+    int64_t block = extent_map(&inode_cold[index], data_blocks, boundary, &run, NULL, &extent);
+    if(block < -1)
+        return block;
+    if(block < 0 || !EXTENT_IS_COMPRESSED(extent) || extent.logical == boundary)
+        return 0;
+    return compress_expand(index, boundary);
+}
+
+// Expand every compressed cluster in blocks [first, last] of the file at index before a write to them,
+// called inside the transaction of the write. *expanded is set if the cluster holding last was compressed
+// Returns 0 or -errno, see compress_expand()
+int compress_prepare(int index, uint32_t first, uint32_t last, uint32_t *cursor, bool *expanded) {
+    *expanded = false;
+    for(uint32_t logical = first; logical <= last; ) {
+        uint32_t run;
+        Extent extent;
+        int64_t block = extent_map(&inode_cold[index], data_blocks, logical, &run, cursor, &extent);
+        if(block < -1)
+            return block;
+        if(block >= 0 && EXTENT_IS_COMPRESSED(extent)) {
+            int result = compress_expand(index, logical);
+            if(result < 0)
+                return result;
+            if(last - logical < run)
+                *expanded = true;
+        }
+        if(last - logical < run)
+            break;
+        logical += run;
+    }
+    return 0;
+}
+
+// Compress the cluster of the file at index starting at logical block cluster, called inside a transaction
+// Clusters that are not wholly written, or do not compress, or find no blocks, stay raw
+static void compress_cluster(int index, uint32_t cluster) {
+    Inode *inode = &filesystem[index];
+    InodeCold *cold = &inode_cold[index];
+    size_t block_size = geometry.block_size;
+    uint32_t blocks = compress_cluster_blocks();
+    if(((off_t)cluster + blocks) * block_size > inode->size)
+        return; // The file ends inside the cluster, it may still grow there
+    CompressBuffers *buffers = compress_buffers();
+    if(buffers == NULL)
+        return;
+
+    buffers->generation = 0; // The cluster buffer gathers the raw cluster
+    for(uint32_t logical = cluster; logical < cluster + blocks; ) {
+        uint32_t run;
+        Extent extent;
+        int64_t block = extent_map(cold, data_blocks, logical, &run, NULL, &extent);
+        if(block < 0 || EXTENT_IS_COMPRESSED(extent))
+            return; // A hole, which stays one, or already compressed
+        if(run > cluster + blocks - logical)
+            run = cluster + blocks - logical;
+        if(dedup_shared(block, run))
+            return; // Blocks deduplication found elsewhere cost nothing already
+        if(cache_pin(block, run, false) < 0)
+            return;
+        memcpy(buffers->cluster + (size_t)(logical - cluster) * block_size, BLOCK_DATA(data_blocks, block), (size_t)run * block_size);
+        cache_unpin(block, run);
+        logical += run;
+    }
+
+    // Worth it only if at least a block is saved
+    uint32_t packed_length;
+    uint64_t start = stats_clock();
+    size_t length = (size_t)blocks * block_size;
+    size_t packed = compress_encode((const uint8_t *)buffers->cluster, length, (uint8_t *)buffers->packed + sizeof(packed_length),
+            length - block_size - sizeof(packed_length));
+    stats_compress(start, length, packed);
+    if(packed == 0)
+        return;
+    packed_length = packed;
+    memcpy(buffers->packed, &packed_length, sizeof(packed_length));
+    packed += sizeof(packed_length);
+
+    uint32_t stored = (packed + block_size - 1) / block_size;
+    uint32_t got;
+    int first = allocate_blocks(block_bitmap, data_blocks, BLOCK_NO_HINT, stored, stored, &got);
+    if(first < 0)
+        return;
+    if(cache_pin(first, stored, true) < 0) {
+        deallocate_blocks(block_bitmap, first, stored);
+        return;
+    }
+    char *target = BLOCK_DATA(data_blocks, first);
+    memcpy(target, buffers->packed, packed);
+    memset(target + packed, 0, (size_t)stored * block_size - packed);
+    for(uint32_t b = 0; b < stored; b++)
+        mark_block_dirty(first + b);
+    cache_unpin(first, stored);
+
+    Extent extent = { cluster, first, EXTENT_COMPRESSED | stored << 16 | blocks };
+    if(extent_replace(index, block_bitmap, data_blocks, extent) < 0)
+        deallocate_blocks(block_bitmap, first, stored);
+}
+
+// Compress the clusters a write of [offset, end) to the file at index reached the end of, and the one it ended in
+// if compress_prepare() expanded that one, called inside the transaction of the write
+// Appends that stay inside the last block of a cluster leave it raw until one of them completes it
+void compress_written(int index, off_t offset, off_t end, bool expanded) {
+    uint32_t blocks = compress_cluster_blocks();
+    if(!compress_enabled || blocks < 2)
+        return;
+    uint32_t first = offset / geometry.block_size;
+    uint32_t last = (end - 1) / geometry.block_size;
+    for(uint32_t cluster = first - first % blocks; cluster <= last; cluster += blocks) {
+        if(((off_t)cluster + blocks) * geometry.block_size <= end || expanded)
+            compress_cluster(index, cluster);
+        if(cluster > UINT32_MAX - blocks)
+            break;
+    }
+}
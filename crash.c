@@ -0,0 +1,405 @@
+// Crash test of the journal and checkpoints
+//
+// Linked against dm510fs.c built with -DDM510FS_NO_MAIN like bench.c, see `make crash`. Each run mounts a fresh
+// image in a child process, which applies random steps to a few files (writes, zero writes, holes, truncation,
+// removal, clones and fsync) while another thread checkpoints back to back. The child is killed with SIGKILL
+// after a random delay, in the middle of a checkpoint. A second child mounts what was left, replaying the
+// journals, and checks that the files are those after some step, no earlier than the last fsync that returned.
+// Steps follow from the seed of the run, which a failure prints, and the image of the first failure is kept.
+//
+// Usage: dm510fs_crash [-r runs] [-s seed] [-b block size] [-d] [-c]   (-d dedup, -c compress)
+
+#include "dm510fs.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#define CRASH_FILES 4
+#define CRASH_FILE_BYTES (160 << 10) // Largest size of a file, hundreds of blocks to map at small block sizes
+#define CRASH_WRITE_BLOCKS 48 // Longest write, in blocks
+#define CRASH_POOL_BYTES (16 << 20)
+#define CRASH_CACHE_MIB 1 // Small, so blocks are evicted while they are written
+#define CRASH_DELAY_US 20000 // Steps run at least this long before the kill, and up to CRASH_DELAY_US more
+#define CRASH_CHECKPOINT_GAP_US 500
+
+enum { STEP_WRITE, STEP_ZERO, STEP_PUNCH, STEP_TRUNCATE, STEP_UNLINK, STEP_CLONE, STEP_CREATE, STEP_FSYNC };
+
+typedef struct Step {
+    int kind;
+    int file;
+    int target; // Of a clone
+    off_t offset;
+    size_t length;
+    uint64_t seed; // Of the data written
+} Step;
+
+typedef struct ModelFile {
+    char *data;
+    off_t size;
+    bool exists;
+} ModelFile;
+
+// Progress of the killed child, shared with the parent
+typedef struct Progress {
+    int ready; // The files were created and synced
+    int done; // Steps finished, -1 for none
+    int synced; // The last step that was an fsync, -1 for none
+    int checkpointing;
+} Progress;
+
+static uint32_t block_size = 512;
+static bool dedup;
+static bool compress;
+static ModelFile model[CRASH_FILES];
+static char buffer[CRASH_FILE_BYTES];
+static Progress *progress;
+
+// xorshift64, the steps of a run follow from its seed
+static uint64_t random_state;
+static uint64_t crash_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static Step next_step(void) {
+    Step step = { 0 };
+    int roll = crash_random() % 20;
+    step.kind = roll < 6 ? STEP_WRITE : roll < 10 ? STEP_ZERO : roll < 12 ? STEP_PUNCH : roll < 13 ? STEP_TRUNCATE :
+        roll < 14 ? STEP_UNLINK : roll < 16 ? STEP_CLONE : roll < 17 ? STEP_CREATE : STEP_FSYNC;
+    step.file = crash_random() % CRASH_FILES;
+    step.target = (step.file + 1 + crash_random() % (CRASH_FILES - 1)) % CRASH_FILES;
+    step.seed = crash_random();
+    // Mostly whole blocks, sometimes from the middle of one
+    step.offset = (off_t)(crash_random() % (CRASH_FILE_BYTES / block_size)) * block_size;
+    if(crash_random() % 3 == 0)
+        step.offset += crash_random() % block_size;
+    step.length = 1 + crash_random() % (CRASH_WRITE_BLOCKS * block_size);
+    if(step.offset + (off_t)step.length > CRASH_FILE_BYTES)
+        step.length = CRASH_FILE_BYTES - step.offset;
+    if(step.kind == STEP_TRUNCATE)
+        step.offset = crash_random() % CRASH_FILE_BYTES;
+    return step;
+}
+
+static void fill(char *data, size_t length, uint64_t seed) {
+    uint64_t state = seed | 1;
+    for(size_t i = 0; i < length; i++) {
+        state = state * 6364136223846793005 + 1442695040888963407;
+        data[i] = (char)(state >> 56);
+    }
+}
+
+static void file_path(char *path, int file) {
+    sprintf(path, "/f%d", file);
+}
+
+static void model_reset(void) {
+    for(int f = 0; f < CRASH_FILES; f++) {
+        memset(model[f].data, 0, CRASH_FILE_BYTES);
+        model[f].size = 0;
+        model[f].exists = true;
+    }
+}
+
+// Steps on files that do not exist, and clones onto files that do, are skipped by both sides
+static void model_apply(const Step *step) {
+    ModelFile *file = &model[step->file];
+    ModelFile *target = &model[step->target];
+    if(step->kind == STEP_CREATE) {
+        if(!file->exists)
+            *file = (ModelFile){ file->data, 0, true };
+        return;
+    }
+    if(!file->exists || step->kind == STEP_FSYNC)
+        return;
+    off_t end = step->offset + (off_t)step->length;
+    switch(step->kind) {
+        case STEP_WRITE:
+        case STEP_ZERO:
+            if(step->kind == STEP_WRITE)
+                fill(file->data + step->offset, step->length, step->seed);
+            else
+                memset(file->data + step->offset, 0, step->length);
+            if(end > file->size)
+                file->size = end;
+            break;
+        case STEP_PUNCH:
+            if(step->offset < file->size)
+                memset(file->data + step->offset, 0, (end < file->size ? end : file->size) - step->offset);
+            break;
+        case STEP_TRUNCATE:
+            if(step->offset < file->size)
+                memset(file->data + step->offset, 0, file->size - step->offset);
+            file->size = step->offset;
+            break;
+        case STEP_UNLINK:
+            memset(file->data, 0, CRASH_FILE_BYTES);
+            file->size = 0;
+            file->exists = false;
+            break;
+        case STEP_CLONE:
+            if(!target->exists) {
+                memcpy(target->data, file->data, CRASH_FILE_BYTES);
+                target->size = file->size;
+                target->exists = true;
+            }
+            break;
+    }
+}
+
+static void check(int result, const char *what, const char *path) {
+    if(result < 0) {
+        fprintf(stderr, "%s %s failed: %s\n", what, path, strerror(-result));
+        _exit(EXIT_FAILURE);
+    }
+}
+
+static void apply(const Step *step) {
+    char path[32], target[32], command[80];
+    file_path(path, step->file);
+    file_path(target, step->target);
+    if(step->kind == STEP_FSYNC) {
+        check(dm510fs_fsync("/", 0, NULL), "fsync", "/");
+        return;
+    }
+    if(step->kind == STEP_CREATE) {
+        if(!model[step->file].exists)
+            check(dm510fs_mknod(path, S_IFREG | 0644, 0), "mknod", path);
+        return;
+    }
+    if(!model[step->file].exists)
+        return;
+    switch(step->kind) {
+        case STEP_WRITE:
+        case STEP_ZERO:
+            if(step->kind == STEP_WRITE)
+                fill(buffer, step->length, step->seed);
+            else
+                memset(buffer, 0, step->length);
+            if(dm510fs_write(path, buffer, step->length, step->offset, NULL) != (int)step->length)
+                check(-EIO, "write", path);
+            break;
+        case STEP_PUNCH:
+            check(dm510fs_fallocate(path, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, step->offset, step->length, NULL),
+                  "fallocate", path);
+            break;
+        case STEP_TRUNCATE:
+            check(dm510fs_truncate(path, step->offset), "truncate", path);
+            break;
+        case STEP_UNLINK:
+            check(dm510fs_unlink(path), "unlink", path);
+            break;
+        case STEP_CLONE:
+            if(!model[step->target].exists) {
+                int length = sprintf(command, "clone %s %s\n", path, target);
+                check(dm510fs_write("/" CONTROL_FILENAME, command, length, 0, NULL), "clone", path);
+            }
+            break;
+    }
+}
+
+// Returns true if the mounted files are those of the model
+static bool matches(void) {
+    static char read_back[CRASH_FILE_BYTES];
+    for(int f = 0; f < CRASH_FILES; f++) {
+        char path[32];
+        file_path(path, f);
+        struct stat stbuf;
+        int result = dm510fs_getattr(path, &stbuf);
+        if(!model[f].exists) {
+            if(result != -ENOENT)
+                return false;
+            continue;
+        }
+        if(result < 0 || stbuf.st_size != model[f].size)
+            return false;
+        if(dm510fs_read(path, read_back, model[f].size, 0, NULL) != model[f].size)
+            return false;
+        if(memcmp(read_back, model[f].data, model[f].size) != 0)
+            return false;
+    }
+    return true;
+}
+
+static void mount_fresh(void) {
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.max_inodes = 64;
+    geometry.max_blocks = CRASH_POOL_BYTES / block_size;
+    geometry.block_size = block_size;
+    cache_size = CRASH_CACHE_MIB;
+    inline_size = 0;
+    dedup_enabled = dedup;
+    compress_enabled = compress;
+    dm510fs_init(NULL);
+}
+
+static void *checkpoint_loop(void *arg) {
+    for(;;) {
+        __atomic_store_n(&progress->checkpointing, 1, __ATOMIC_SEQ_CST);
+        dm510fs_checkpoint();
+        __atomic_store_n(&progress->checkpointing, 0, __ATOMIC_SEQ_CST);
+        usleep(CRASH_CHECKPOINT_GAP_US);
+    }
+    return NULL;
+}
+
+// Apply steps until killed
+static void crash_child(uint64_t seed) {
+    mount_fresh();
+    for(int f = 0; f < CRASH_FILES; f++) {
+        char path[32];
+        file_path(path, f);
+        check(dm510fs_mknod(path, S_IFREG | 0644, 0), "mknod", path);
+    }
+    check(dm510fs_fsync("/", 0, NULL), "fsync", "/");
+    pthread_t thread;
+    pthread_create(&thread, NULL, checkpoint_loop, NULL);
+    __atomic_store_n(&progress->ready, 1, __ATOMIC_SEQ_CST);
+
+    random_state = seed;
+    model_reset();
+    for(int i = 0;; i++) {
+        Step step = next_step();
+        apply(&step);
+        model_apply(&step);
+        __atomic_store_n(&progress->done, i, __ATOMIC_SEQ_CST);
+        if(step.kind == STEP_FSYNC)
+            __atomic_store_n(&progress->synced, i, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Mount what the killed child left and find the step it matches
+static void recover_child(uint64_t seed, int done, int synced) {
+    mount_fresh();
+    random_state = seed;
+    model_reset();
+    bool found = synced < 0 && matches();
+    // The step after the last one counted may have finished before the kill
+    for(int i = 0; i <= done + 1 && !found; i++) {
+        Step step = next_step();
+        model_apply(&step);
+        found = i >= synced && matches();
+    }
+    if(!found) {
+        fprintf(stderr, "seed %llu: no step matches the files, %d steps done, step %d synced\n",
+                (unsigned long long)seed, done, synced);
+        _exit(EXIT_FAILURE);
+    }
+    dm510fs_destroy(NULL);
+    _exit(EXIT_SUCCESS);
+}
+
+// Returns true if the filesystem recovered from the crash
+static bool crash_run(uint64_t seed) {
+    unlink(PERSISENT_FILENAME);
+    unlink(JOURNAL_FILENAME);
+    unlink(JOURNAL_ALTERNATE_FILENAME);
+    *progress = (Progress){ 0, -1, -1, 0 };
+    fflush(NULL);
+    pid_t pid = fork();
+    if(pid == 0)
+        crash_child(seed);
+
+    int status;
+    while(!__atomic_load_n(&progress->ready, __ATOMIC_SEQ_CST)) {
+        if(waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "seed %llu: mounting a fresh image failed\n", (unsigned long long)seed);
+            return false;
+        }
+        usleep(1000);
+    }
+    random_state = seed * 0x9e3779b97f4a7c15 | 1;
+    usleep(CRASH_DELAY_US + crash_random() % CRASH_DELAY_US);
+    for(int wait = 0; wait < 1000 && !__atomic_load_n(&progress->checkpointing, __ATOMIC_SEQ_CST); wait++)
+        usleep(10);
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    if(!WIFSIGNALED(status)) {
+        fprintf(stderr, "seed %llu: the steps failed before the kill\n", (unsigned long long)seed);
+        return false;
+    }
+
+    int done = progress->done;
+    int synced = progress->synced;
+    fflush(NULL);
+    pid = fork();
+    if(pid == 0)
+        recover_child(seed, done, synced);
+    waitpid(pid, &status, 0);
+    if(WIFSIGNALED(status)) {
+        fprintf(stderr, "seed %llu: mounting after the crash died of signal %d\n", (unsigned long long)seed,
+                WTERMSIG(status));
+        return false;
+    }
+    return WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 100;
+    uint64_t seed = 1;
+    int option;
+    while((option = getopt(argc, argv, "r:s:b:dc")) != -1) {
+        switch(option) {
+            case 'r': runs = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'b': block_size = atoi(optarg); break;
+            case 'd': dedup = true; break;
+            case 'c': compress = true; break;
+            default: goto usage;
+        }
+    }
+    if(optind != argc || runs <= 0 || block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+       (block_size & (block_size - 1)) != 0)
+        goto usage;
+
+    for(int f = 0; f < CRASH_FILES; f++)
+        model[f].data = malloc(CRASH_FILE_BYTES);
+    progress = mmap(NULL, sizeof(Progress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(progress == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    // Keep the images out of the working directory
+    char directory[] = "/tmp/dm510fs-crash.XXXXXX";
+    if(mkdtemp(directory) == NULL || chdir(directory) != 0) {
+        perror(directory);
+        return EXIT_FAILURE;
+    }
+    log_level = LEVEL_WARN;
+
+    int failures = 0;
+    for(int run = 0; run < runs; run++) {
+        uint64_t run_seed = seed * 100003 + run;
+        if(crash_run(run_seed))
+            continue;
+        if(failures++ == 0) {
+            char kept[sizeof(directory) + 8];
+            snprintf(kept, sizeof(kept), "%s/failed", directory);
+            if(mkdir(kept, 0755) == 0) {
+                const char *files[] = { PERSISENT_FILENAME, JOURNAL_FILENAME, JOURNAL_ALTERNATE_FILENAME };
+                for(int i = 0; i < 3; i++) {
+                    char to[sizeof(kept) + 32];
+                    snprintf(to, sizeof(to), "failed/%s", files[i]);
+                    rename(files[i], to);
+                }
+            }
+        }
+    }
+    printf("{\"crash\":\"%s\",\"block_size\":%u,\"dedup\":%s,\"compress\":%s,\"runs\":%d,\"failures\":%d}\n",
+           directory, block_size, dedup ? "true" : "false", compress ? "true" : "false", runs, failures);
+
+    unlink(PERSISENT_FILENAME);
+    unlink(JOURNAL_FILENAME);
+    unlink(JOURNAL_ALTERNATE_FILENAME);
+    if(failures == 0 && chdir("/") == 0)
+        rmdir(directory);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "usage: %s [-r runs] [-s seed] [-b block size] [-d] [-c]\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,506 @@
+// Block deduplication
+//
+// With -o dedup, every block a write completes is fingerprinted with a 64-bit hash. A block equal to one
+// already indexed is not kept: the file maps the indexed block instead and the new one is freed. Equality is
+// checked byte for byte, so a colliding hash only costs a comparison, see dedup_written().
+// Blocks mapped by more than one extent, here or by the clones of snapshot.c, carry a reference count in
+// dedup_blocks, absent meaning one.
+// deallocate_blocks() only frees a block once its last reference goes, and a file about to change a block
+// it shares gets a copy of its own in its place, see dedup_claim().
+//
+// Neither table is saved. Reference counts are rebuilt from the block maps at mount, see dedup_rebuild(),
+// and the fingerprint index starts empty, so blocks only match those written since the mount.
+// A block stays indexed until it is freed or its owner writes to it, which drops its fingerprint first.
+
+bool dedup_enabled; // -o dedup
+
+// A block that is shared or indexed. refs is 0 in free slots
+typedef struct DedupBlock {
+    uint32_t block;
+    uint32_t refs; // Extents mapping the block
+    uint64_t print; // Fingerprint of the block, 0 if it is not indexed
+} DedupBlock;
+
+// The indexed block of a fingerprint. print is 0 in free slots
+typedef struct DedupPrint {
+    uint64_t print;
+    uint32_t block;
+} DedupPrint;
+
+// Both tables are open addressed with linear probing and a power of two of slots, at most three quarters used
+pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+DedupBlock *dedup_blocks;
+uint32_t dedup_block_slots;
+uint32_t dedup_block_count; // Read without the lock to skip the tables while they are empty
+DedupPrint *dedup_prints;
+uint32_t dedup_print_slots;
+uint32_t dedup_print_count;
+uint32_t dedup_shared_count; // Blocks with more than one reference
+uint64_t dedup_saved; // References beyond the first, the blocks deduplication saved
+uint64_t dedup_lookups;
+uint64_t dedup_hits;
+
+#define DEDUP_MIN_SLOTS 1024
+
+static uint64_t dedup_hash(const char *data, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+    for(size_t i = 0; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word * 0xff51afd7ed558ccdull) * 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 29;
+    }
+    hash ^= hash >> 33;
+    return hash != 0 ? hash : 1; // 0 marks free slots
+}
+
+static inline uint32_t dedup_slot(uint64_t key, uint32_t slots) {
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & (slots - 1);
+}
+
+static DedupBlock *dedup_find_block(uint32_t block) {
+    if(dedup_block_count == 0)
+        return NULL;
+    for(uint32_t i = dedup_slot(block, dedup_block_slots); dedup_blocks[i].refs != 0; i = (i + 1) & (dedup_block_slots - 1))
+        if(dedup_blocks[i].block == block)
+            return &dedup_blocks[i];
+    return NULL;
+}
+
+static DedupPrint *dedup_find_print(uint64_t print) {
+    if(dedup_print_count == 0)
+        return NULL;
+    for(uint32_t i = dedup_slot(print, dedup_print_slots); dedup_prints[i].print != 0; i = (i + 1) & (dedup_print_slots - 1))
+        if(dedup_prints[i].print == print)
+            return &dedup_prints[i];
+    return NULL;
+}
+
+// Double the slots of a table once it is three quarters full, rehashing its entries
+// Returns -1 if no memory was left, the table is unchanged then
+static int dedup_grow_blocks(void) {
+    if((uint64_t)(dedup_block_count + 1) * 4 <= (uint64_t)dedup_block_slots * 3)
+        return 0;
+    uint32_t slots = dedup_block_slots ? dedup_block_slots * 2 : DEDUP_MIN_SLOTS;
+    DedupBlock *table = calloc(slots, sizeof(DedupBlock));
+    if(table == NULL)
+        return -1;
+    for(uint32_t i = 0; i < dedup_block_slots; i++) {
+        if(dedup_blocks[i].refs == 0)
+            continue;
+        uint32_t j = dedup_slot(dedup_blocks[i].block, slots);
+        while(table[j].refs != 0)
+            j = (j + 1) & (slots - 1);
+        table[j] = dedup_blocks[i];
+    }
+    free(dedup_blocks);
+    dedup_blocks = table;
+    dedup_block_slots = slots;
+    return 0;
+}
+
+static int dedup_grow_prints(void) {
+    if((uint64_t)(dedup_print_count + 1) * 4 <= (uint64_t)dedup_print_slots * 3)
+        return 0;
+    uint32_t slots = dedup_print_slots ? dedup_print_slots * 2 : DEDUP_MIN_SLOTS;
+    DedupPrint *table = calloc(slots, sizeof(DedupPrint));
+    if(table == NULL)
+        return -1;
+    for(uint32_t i = 0; i < dedup_print_slots; i++) {
+        if(dedup_prints[i].print == 0)
+            continue;
+        uint32_t j = dedup_slot(dedup_prints[i].print, slots);
+        while(table[j].print != 0)
+            j = (j + 1) & (slots - 1);
+        table[j] = dedup_prints[i];
+    }
+    free(dedup_prints);
+    dedup_prints = table;
+    dedup_print_slots = slots;
+    return 0;
+}
+
+// Returns the entry of block, adding one with a single reference if it has none, NULL if no memory was left
+static DedupBlock *dedup_add_block(uint32_t block) {
+    DedupBlock *entry = dedup_find_block(block);
+    if(entry != NULL)
+        return entry;
+    if(dedup_grow_blocks() < 0)
+        return NULL;
+    uint32_t i = dedup_slot(block, dedup_block_slots);
+    while(dedup_blocks[i].refs != 0)
+        i = (i + 1) & (dedup_block_slots - 1);
+    dedup_blocks[i] = (DedupBlock){ block, 1, 0 };
+    __atomic_store_n(&dedup_block_count, dedup_block_count + 1, __ATOMIC_RELEASE);
+    return &dedup_blocks[i];
+}
+
+// Linear probing deletes by moving later entries of the same probe sequence back into the hole
+static void dedup_delete_print(DedupPrint *entry) {
+    uint32_t mask = dedup_print_slots - 1;
+    uint32_t hole = entry - dedup_prints;
+    for(uint32_t i = (hole + 1) & mask; dedup_prints[i].print != 0; i = (i + 1) & mask) {
+        uint32_t home = dedup_slot(dedup_prints[i].print, dedup_print_slots);
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            dedup_prints[hole] = dedup_prints[i];
+            hole = i;
+        }
+    }
+    dedup_prints[hole].print = 0;
+    dedup_print_count--;
+}
+
+// Forget the fingerprint of entry and, if it is down to one reference, the entry itself
+static void dedup_forget(DedupBlock *entry) {
+    if(entry->print != 0) {
+        DedupPrint *print = dedup_find_print(entry->print);
+        if(print != NULL && print->block == entry->block)
+            dedup_delete_print(print);
+        entry->print = 0;
+    }
+    if(entry->refs > 1)
+        return;
+    uint32_t mask = dedup_block_slots - 1;
+    uint32_t hole = entry - dedup_blocks;
+    for(uint32_t i = (hole + 1) & mask; dedup_blocks[i].refs != 0; i = (i + 1) & mask) {
+        uint32_t home = dedup_slot(dedup_blocks[i].block, dedup_block_slots);
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            dedup_blocks[hole] = dedup_blocks[i];
+            hole = i;
+        }
+    }
+    dedup_blocks[hole].refs = 0;
+    __atomic_store_n(&dedup_block_count, dedup_block_count - 1, __ATOMIC_RELEASE);
+}
+
+// Index block under print, in place of the block a colliding fingerprint was indexed with
+static void dedup_index(uint32_t block, uint64_t print) {
+    DedupPrint *found = dedup_find_print(print);
+    if(found != NULL) {
+        uint32_t indexed = found->block;
+        dedup_delete_print(found);
+        DedupBlock *previous = dedup_find_block(indexed);
+        if(previous != NULL) {
+            previous->print = 0;
+            if(previous->refs == 1)
+                dedup_forget(previous);
+        }
+    }
+    DedupBlock *entry = dedup_add_block(block);
+    if(entry == NULL)
+        return;
+    if(dedup_grow_prints() < 0) {
+        if(entry->refs == 1)
+            dedup_forget(entry);
+        return;
+    }
+    uint32_t i = dedup_slot(print, dedup_print_slots);
+    while(dedup_prints[i].print != 0)
+        i = (i + 1) & (dedup_print_slots - 1);
+    dedup_prints[i] = (DedupPrint){ print, block };
+    dedup_print_count++;
+    entry->print = print;
+}
+
+// Whether the tables hold anything, if not no block is shared and deallocate_blocks() can skip them
+bool dedup_tracking(void) {
+    return __atomic_load_n(&dedup_block_count, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Drop a reference beyond the first to the block of entry
+static void dedup_unref(DedupBlock *entry) {
+    dedup_saved--;
+    if(--entry->refs == 1) {
+        dedup_shared_count--;
+        if(entry->print == 0)
+            dedup_forget(entry);
+    }
+}
+
+// Take another reference to each of count blocks from start, for one more extent mapping them
+// Returns 0, or -ENOMEM if the table could not grow, no reference is taken then
+int dedup_share(uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&dedup_mutex);
+    for(uint32_t block = start; block < start + count; block++) {
+        DedupBlock *entry = dedup_add_block(block);
+        if(entry == NULL) {
+            while(block-- > start)
+                dedup_unref(dedup_find_block(block));
+            pthread_mutex_unlock(&dedup_mutex);
+            return -ENOMEM;
+        }
+        if(entry->refs++ == 1)
+            dedup_shared_count++;
+        dedup_saved++;
+    }
+    pthread_mutex_unlock(&dedup_mutex);
+    return 0;
+}
+
+// Drop a reference to each of count blocks from start and free those that had no other, see deallocate_blocks()
+void dedup_deallocate(uint8_t bitmap[], uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&dedup_mutex);
+    uint32_t run = start;
+    for(uint32_t block = start; block < start + count; block++) {
+        DedupBlock *entry = dedup_find_block(block);
+        if(entry == NULL)
+            continue;
+        if(entry->refs == 1) {
+            dedup_forget(entry);
+            continue;
+        }
+        // Still mapped elsewhere, free the run before it
+        dedup_unref(entry);
+        release_blocks(bitmap, run, block - run);
+        run = block + 1;
+    }
+    release_blocks(bitmap, run, start + count - run);
+    pthread_mutex_unlock(&dedup_mutex);
+}
+
+// Whether any of count blocks from start is mapped more than once
+bool dedup_shared(uint32_t start, uint32_t count) {
+    if(!dedup_tracking())
+        return false;
+    bool shared = false;
+    pthread_mutex_lock(&dedup_mutex);
+    for(uint32_t block = start; block < start + count && !shared; block++) {
+        DedupBlock *entry = dedup_find_block(block);
+        shared = entry != NULL && entry->refs > 1;
+    }
+    pthread_mutex_unlock(&dedup_mutex);
+    return shared;
+}
+
+// Ready count blocks from start for a file about to change them, called inside the transaction of the change
+// Returns the length of the leading run of blocks that are either all shared, *shared set then, and must be
+// replaced by copies, or all the file's own, which lose their fingerprints as their data is about to change
+uint32_t dedup_claim(uint32_t start, uint32_t count, bool *shared) {
+    *shared = false;
+    if(!dedup_tracking())
+        return count;
+    pthread_mutex_lock(&dedup_mutex);
+    uint32_t length = 0;
+    for(; length < count; length++) {
+        DedupBlock *entry = dedup_find_block(start + length);
+        bool multiple = entry != NULL && entry->refs > 1;
+        if(length == 0)
+            *shared = multiple;
+        else if(multiple != *shared)
+            break;
+        if(entry != NULL && !multiple)
+            dedup_forget(entry);
+    }
+    pthread_mutex_unlock(&dedup_mutex);
+    return length;
+}
+
+// Count the references to every block from the block maps, after the tables were loaded or replayed
+// Files removed while open still hold theirs until reclaim_orphan_blocks()
+// Returns 0, -ENOMEM, or -EIO if a block map is damaged, which fails the mount rather than let writes free
+// blocks another file still uses
+int dedup_rebuild(const Inode fs[]) {
+    pthread_mutex_lock(&dedup_mutex);
+    free(dedup_blocks);
+    free(dedup_prints);
+    dedup_blocks = NULL;
+    dedup_prints = NULL;
+    dedup_block_slots = dedup_block_count = dedup_print_slots = dedup_print_count = 0;
+    dedup_shared_count = 0;
+    dedup_saved = dedup_lookups = dedup_hits = 0;
+
+    // A block met a second time is shared
+    int result = 0;
+    uint8_t *seen = calloc(BITMAP_WORDS(geometry.block_count), sizeof(uint64_t));
+    if(seen == NULL)
+        result = -ENOMEM;
+    for(uint32_t i = 0; result == 0 && i < geometry.inode_slots; i++) {
+        InodeCold *cold = &inode_cold[i];
+        if(fs[i].is_inline || cold->extent_count == 0)
+            continue;
+        ExtentWalk walk;
+        extent_walk(&walk, cold, data_blocks);
+        for(const Extent *extent; result == 0 && (extent = extent_next(&walk)) != NULL; ) {
+            uint32_t from = extent->start;
+            uint32_t stored = EXTENT_STORED(*extent);
+            if(from >= geometry.block_count || geometry.block_count - from < stored) {
+                log_error("Block map of inode %u points past the data blocks at block %u", i, from);
+                result = -EIO;
+                break;
+            }
+            uint32_t to = from + stored;
+            if(bitmap_scan(seen, from, to, true) == to) {
+                bitmap_fill(seen, from, to, true);
+                continue;
+            }
+            for(uint32_t block = from; block < to; block++) {
+                if(!block_in_use(seen, block)) {
+                    bitmap_fill(seen, block, block + 1, true);
+                    continue;
+                }
+                DedupBlock *entry = dedup_add_block(block);
+                if(entry == NULL) {
+                    result = -ENOMEM;
+                    break;
+                }
+                if(entry->refs++ == 1)
+                    dedup_shared_count++;
+                dedup_saved++;
+            }
+        }
+        if(result == 0 && walk.error < 0) {
+            log_error("Block map of inode %u could not be read", i);
+            result = walk.error;
+        }
+        extent_walk_end(&walk);
+    }
+    free(seen);
+    pthread_mutex_unlock(&dedup_mutex);
+    if(result == -ENOMEM)
+        log_error("No memory left to count shared blocks");
+    else if(result < 0)
+        log_error("Shared blocks could not be counted, check the image before mounting it again");
+    else if(dedup_shared_count > 0)
+        log_info("%u blocks are shared, saving %llu", dedup_shared_count, (unsigned long long)dedup_saved);
+    return result;
+}
+
+// Give the file at index a block of its own at logical block before it changes it in part, called inside a
+// transaction. A shared block is copied, a block of its own only loses its fingerprint
+// Returns 1 if the mapping changed, 0 if not, -ENOSPC if no block or no room in the map was left, or -EIO,
+// the file still maps the shared block then
+int dedup_unshare(int index, uint32_t logical) {
+    uint32_t run;
+    Extent extent;
+    int64_t block = extent_map(&inode_cold[index], data_blocks, logical, &run, NULL, &extent);
+    if(block < 0 || EXTENT_IS_COMPRESSED(extent))
+        return block < -1 ? block : 0;
+    bool shared;
+    dedup_claim(block, 1, &shared);
+    if(!shared)
+        return 0;
+
+    uint32_t got;
+    int copied = allocate_blocks(block_bitmap, data_blocks, BLOCK_NO_HINT, 1, 1, &got);
+    if(copied < 0)
+        return -ENOSPC;
+    if(cache_pin(copied, 1, true) < 0) {
+        deallocate_blocks(block_bitmap, copied, 1);
+        return -EIO;
+    }
+    if(cache_pin(block, 1, false) < 0) {
+        cache_unpin(copied, 1);
+        deallocate_blocks(block_bitmap, copied, 1);
+        return -EIO;
+    }
+    memcpy(BLOCK_DATA(data_blocks, copied), BLOCK_DATA(data_blocks, block), geometry.block_size);
+    mark_block_dirty(copied);
+    cache_unpin(block, 1);
+    cache_unpin(copied, 1);
+    Extent own = { logical, copied, 1 };
+    int result = extent_replace(index, block_bitmap, data_blocks, own);
+    if(result < 0) {
+        deallocate_blocks(block_bitmap, copied, 1);
+        return result;
+    }
+    return 1;
+}
+
+// True if the block at data holds only zeros
+static bool dedup_zeroed(const char *data, size_t size) {
+    return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+// Map the twins gathered in shared in place of the blocks written there, see dedup_written()
+static void dedup_map_twins(int index, Extent *shared) {
+    if(shared->length == 0)
+        return;
+    if(extent_replace(index, block_bitmap, data_blocks, *shared) < 0)
+        deallocate_blocks(block_bitmap, shared->start, shared->length);
+    shared->length = 0;
+}
+
+// Fingerprint the blocks a write of [offset, end) to the file at index completed, mapping an equal block
+// already indexed in place of each one that has its twin, called inside the transaction of the write
+// Blocks of zeros are punched out instead, a hole reads the same and a run of them stays one hole rather than
+// an extent per block mapping one twin. Twins that follow each other are mapped by one extent
+void dedup_written(int index, off_t offset, off_t end, uint32_t *cursor) {
+    if(!dedup_enabled)
+        return;
+    size_t block_size = geometry.block_size;
+    Extent shared = { 0, 0, 0 }; // Twins taken, not mapped yet
+    uint32_t zeros_from = 0, zeros_to = 0; // Blocks of zeros, not punched yet
+    for(uint32_t logical = offset / block_size; ((off_t)logical + 1) * block_size <= end; logical++) {
+        uint32_t run;
+        Extent extent;
+        int64_t block = extent_map(&inode_cold[index], data_blocks, logical, &run, cursor, &extent);
+        if(block < 0 || EXTENT_IS_COMPRESSED(extent) || cache_pin(block, 1, false) < 0)
+            continue;
+        const char *data = BLOCK_DATA(data_blocks, block);
+        if(dedup_zeroed(data, block_size)) {
+            cache_unpin(block, 1);
+            if(zeros_to != logical && zeros_to > zeros_from)
+                extent_remove(index, block_bitmap, data_blocks, zeros_from, zeros_to);
+            if(zeros_to != logical)
+                zeros_from = logical;
+            zeros_to = logical + 1;
+            continue;
+        }
+        uint64_t print = dedup_hash(data, block_size);
+
+        pthread_mutex_lock(&dedup_mutex);
+        dedup_lookups++;
+        DedupPrint *found = dedup_find_print(print);
+        int64_t candidate = found != NULL && found->block != block ? (int64_t)found->block : -1;
+        pthread_mutex_unlock(&dedup_mutex);
+
+        // Pinning may wait for the cache, so the candidate is read and compared without dedup_mutex and only
+        // taken if it is still indexed under print once the lock is back. A block changes only after its
+        // owner dropped its fingerprint, see dedup_claim()
+        bool pinned = candidate >= 0 && cache_pin(candidate, 1, false) == 0;
+        int64_t twin = pinned && memcmp(BLOCK_DATA(data_blocks, candidate), data, block_size) == 0 ? candidate : -1;
+
+        pthread_mutex_lock(&dedup_mutex);
+        if(twin >= 0) {
+            found = dedup_find_print(print);
+            DedupBlock *entry = dedup_find_block(twin);
+            if(found != NULL && found->block == twin && entry != NULL && entry->print == print) {
+                // The reference is taken before the lock goes, so the twin cannot be freed in between
+                if(entry->refs++ == 1)
+                    dedup_shared_count++;
+                dedup_saved++;
+                dedup_hits++;
+            } else {
+                twin = -1;
+            }
+        }
+        if(twin < 0)
+            dedup_index(block, print);
+        pthread_mutex_unlock(&dedup_mutex);
+        if(pinned)
+            cache_unpin(candidate, 1);
+        cache_unpin(block, 1);
+
+        if(twin < 0)
+            continue;
+        if(shared.length == 0 || logical != shared.logical + shared.length || twin != (int64_t)shared.start + shared.length) {
+            dedup_map_twins(index, &shared);
+            shared = (Extent){ logical, twin, 0 };
+        }
+        shared.length++;
+    }
+    dedup_map_twins(index, &shared);
+    if(zeros_to > zeros_from)
+        extent_remove(index, block_bitmap, data_blocks, zeros_from, zeros_to);
+}
+
+void dedup_collect(DedupStats *total) {
+    pthread_mutex_lock(&dedup_mutex);
+    total->indexed = dedup_print_count;
+    total->shared = dedup_shared_count;
+    total->saved = dedup_saved;
+    total->lookups = dedup_lookups;
+    total->hits = dedup_hits;
+    total->index_bytes = (size_t)dedup_block_slots * sizeof(DedupBlock) + (size_t)dedup_print_slots * sizeof(DedupPrint);
+    pthread_mutex_unlock(&dedup_mutex);
+}
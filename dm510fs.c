@@ -1,37 +1,1056 @@
 #include "dm510fs.h"
+#include "log.c"
 #include "helper.c"
-
-Inode filesystem[MAX_INODES];
+#include "names.c"
+#include "inline.c"
+#include "stats.c"
+#include "journal.c"
+#include "cache.c"
+#include "extent.c"
+#include "compress.c"
+#include "dedup.c"
+#include "snapshot.c"
+#include "lowlevel.c"
+
+Inode *filesystem; // Reserved for geometry.max_inodes slots, see reserve_tables()
+InodeCold *inode_cold; // Cold halves of the same slots
 int inode_count; // To track how many inodes are in the filesystem
 
+int image_fd = -1; // Open for the lifetime of the mount, flushed in place
+
 pthread_t save_thread;
 int save_interval = 5; //save the filesystems every 5 seconds
 int running = 1;
+pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t save_wakeup = PTHREAD_COND_INITIALIZER; // Signalled on unmount so the save thread stops without finishing its sleep
 
-DataBlock data_blocks[MAX_BLOCKS];
+char *data_blocks; // Reserved for geometry.max_blocks blocks of geometry.block_size bytes
+uint8_t *block_bitmap; // One bit per data block, set when in use
 
 /*
  * See descriptions in fuse source code usually located in /usr/include/fuse/fuse.h
  * Notice: The version on Github is a newer version than installed at IMADA
  */
-static struct fuse_operations dm510fs_oper = {
-	.getattr = dm510fs_getattr,
-	.readdir = dm510fs_readdir,
-	.mknod = dm510fs_mknod,
-	.mkdir = dm510fs_mkdir,
-	.unlink = dm510fs_unlink,
-	.rmdir = dm510fs_rmdir,
-	.truncate = dm510fs_truncate,
-	.open = dm510fs_open,
-	.read = dm510fs_read,
-	.release = dm510fs_release,
-	.write = dm510fs_write,
-	.rename = dm510fs_rename,
-	.utime = dm510fs_utime,
+/*
+ * Every handler runs through a wrapper that records its latency and result, see stats.c
+ */
+#define TIMED(name, op, params, args) \
+	static int timed_##name params { \
+		uint64_t start = stats_clock(); \
+		int result = dm510fs_##name args; \
+		stats_record(op, start, result); \
+		return result; \
+	}
+
+TIMED(getattr, OP_GETATTR, (const char *path, struct stat *stbuf), (path, stbuf))
+TIMED(readdir, OP_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+TIMED(open, OP_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(read, OP_READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TIMED(write, OP_WRITE, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TIMED(write_buf, OP_WRITE, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi))
+TIMED(mknod, OP_MKNOD, (const char *path, mode_t mode, dev_t devno), (path, mode, devno))
+TIMED(mkdir, OP_MKDIR, (const char *path, mode_t mode), (path, mode))
+TIMED(unlink, OP_UNLINK, (const char *path), (path))
+TIMED(rmdir, OP_RMDIR, (const char *path), (path))
+TIMED(rename, OP_RENAME, (const char *path, const char *new_path), (path, new_path))
+TIMED(truncate, OP_TRUNCATE, (const char *path, off_t size), (path, size))
+TIMED(ftruncate, OP_TRUNCATE, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi))
+TIMED(create, OP_MKNOD, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+TIMED(utime, OP_UTIME, (const char *path, struct utimbuf *ubuf), (path, ubuf))
+TIMED(release, OP_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(flush, OP_FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(fsync, OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+TIMED(fallocate, OP_FALLOCATE, (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi), (path, mode, offset, length, fi))
+
+struct fuse_operations dm510fs_oper = {
+	.getattr = timed_getattr,
+	.readdir = timed_readdir,
+	.mknod = timed_mknod,
+	.mkdir = timed_mkdir,
+	.unlink = timed_unlink,
+	.rmdir = timed_rmdir,
+	.truncate = timed_truncate,
+	.ftruncate = timed_ftruncate,
+	.open = timed_open,
+	.create = timed_create,
+	.read = timed_read,
+	.release = timed_release,
+	.write = timed_write,
+	.write_buf = timed_write_buf,
+	.rename = timed_rename,
+	.flush = timed_flush,
+	.fsync = timed_fsync,
+	.fallocate = timed_fallocate,
+	.utime = timed_utime,
 	.init = dm510fs_init,
 	.destroy = dm510fs_destroy
 };
 
+/*
+ * Operations on resolved inodes, shared by the path handlers below and the inode-number handlers in lowlevel.c.
+ * Callers of the *_locked ones hold the namespace lock exclusively, the others hold the namespace lock shared
+ * and the lock of the inode, exclusively for those that change it.
+ */
+void inode_stat(int index, struct stat *stbuf) {
+	Inode *inode = &filesystem[index];
+	stbuf->st_mode = inode->mode;
+	stbuf->st_nlink = inode->is_active ? inode->nlink : 0; // Removed but still open
+	stbuf->st_size = inode->size;
+	stbuf->st_dev = inode->devno;
+	stbuf->st_uid = inode->owner;
+	stbuf->st_gid = inode->group;
+	stbuf->st_atime = inode->access_time;
+	stbuf->st_mtime = inode->modif_time;
+}
+
+// Returns the readdir offset following child: 1 follows ".", 2 follows ".." and 3 + (position << 32 | slot) follows
+// a child, the slot only helping to find it again
+off_t dir_cookie(int child) {
+	return 3 + (off_t)((uint64_t)inode_cold[child].position << 32 | (uint32_t)child);
+}
+
+// Returns the first child of the directory at index to list after readdir offset, -1 if there is none
+int dir_first_after(int index, off_t offset) {
+	int child = inode_cold[index].first_child;
+	if(offset <= 2)
+		return child;
+	uint32_t position = (uint64_t)(offset - 3) >> 32;
+	uint32_t previous = (uint32_t)(offset - 3);
+	// Straight after the last returned child while it is still there, positions never being given twice
+	if(previous < geometry.inode_slots && filesystem[previous].is_active && filesystem[previous].parent == index
+			&& inode_cold[previous].position == position)
+		return inode_cold[previous].next_sibling;
+	// Otherwise after where it was: children linked later, renamed ones among them, are further down the list
+	while(child >= 0 && inode_cold[child].position <= position)
+		child = inode_cold[child].next_sibling;
+	return child;
+}
+
+// Give the children of every directory of an image before version 9 their positions, each directory in a
+// transaction of its own. Those child lists keep their order, newest first
+static void dir_upgrade(void) {
+	if(image_version >= 9)
+		return;
+	for(uint32_t i = 0; i < geometry.inode_slots; i++) {
+		if(!filesystem[i].is_active || !filesystem[i].is_dir)
+			continue;
+		journal_begin();
+		dir_renumber(i);
+		journal_end(filesystem, block_bitmap, data_blocks);
+	}
+}
+
+// Create an entry called name in the directory parent, a directory if mode says so
+// Returns the slot of the new inode, or -errno
+int create_entry_locked(int parent, const PathName *name, mode_t mode, dev_t devno) {
+	if(parent == ROOT_INDEX && is_stats_name(name->text)) return -EEXIST;
+	if(parent == ROOT_INDEX && strcmp(name->text, SNAPSHOT_DIRNAME) == 0) return -EACCES; // Made by snapshot.c only
+	if(in_snapshot(parent)) return -EROFS;
+	return add_entry_locked(parent, name, mode, devno);
+}
+
+// Like create_entry_locked() without the names and places kept from users, for snapshot.c
+int add_entry_locked(int parent, const PathName *name, mode_t mode, dev_t devno) {
+	size_t length = name->length;
+	if(!filesystem[parent].is_dir) return -ENOTDIR;
+	if(length + 1 > MAX_NAME_LENGTH) {
+		log_debug("Cannot create inode, the length of filename exceeded the limit: %zu > %d", length + 1, MAX_NAME_LENGTH);
+		return -ENAMETOOLONG;
+	}
+	if(find_child(filesystem, parent, name) >= 0) return -EEXIST;
+	if(inode_count >= (int)geometry.max_inodes) {
+		log_debug("Cannot create inode, the limit for number of files reached: %d == %u", inode_count, geometry.max_inodes);
+		return -ENOSPC;
+	}
+
+	// Take an unused Inode, growing the table inside the transaction so checkpoints see it whole
+	journal_begin();
+	uint32_t stored = name_store(name->text, length);
+	int index = stored == 0 ? -1 : find_inactive_index(filesystem);
+	if(index < 0) {
+		name_release(stored, length);
+		journal_end(filesystem, block_bitmap, data_blocks);
+		return -ENOSPC;
+	}
+	inode_refs[index].generation++; // Inode numbers of earlier files in the slot go stale
+
+	Inode *inode = &filesystem[index];
+	bool directory = S_ISDIR(mode);
+	inode->is_active = true;
+	inode->is_dir = directory;
+	inode->mode = mode;
+	inode->nlink = directory ? 2 : 1;
+	inode->devno = directory ? 0 : devno; // Device number by makedev
+	inode->size = directory ? 4096 : 0;
+	inode->group = getgid();
+	inode->owner = getuid();
+	inode->access_time = time(NULL);
+	inode->modif_time = time(NULL);
+	inode->name = stored;
+	inode->name_length = length;
+	inode->is_inline = false;
+	inode_cold[index].extent_count = 0;
+	inode_cold[index].extent_index = 0;
+	inode_cold[index].first_child = -1;
+	if(directory) {
+		inode_cold[index].last_child = -1;
+		inode_cold[index].next_position = 0;
+	}
+	mark_inode_dirty(index);
+
+	dir_link_child(filesystem, parent, index);
+	path_index_insert(filesystem, index);
+	inode_count++;
+	journal_end(filesystem, block_bitmap, data_blocks);
+
+	return index;
+}
+
+// Remove the entry called name from the directory parent, which must be a directory exactly if directory is set
+int remove_entry_locked(int parent, const PathName *name, bool directory) {
+	int index = find_child(filesystem, parent, name);
+	if(index < 0) return -ENOENT;
+	if(in_snapshot(index)) return -EROFS; // Snapshots are dropped through the control file
+	if(directory) {
+		if(!filesystem[index].is_dir) return -ENOTDIR;
+		if(inode_cold[index].first_child >= 0) return -ENOTEMPTY;
+	} else if(filesystem[index].is_dir) {
+		return -EISDIR;
+	}
+
+	journal_begin();
+	remove_inode(filesystem, block_bitmap, data_blocks, index);
+	inode_count--;
+	journal_end(filesystem, block_bitmap, data_blocks);
+	return 0;
+}
+
+// Move the entry called name in parent to new_name in new_parent, replacing what is there following rename(2)
+int rename_entry_locked(int parent, const PathName *name, int new_parent, const PathName *new_name) {
+    int index = find_child(filesystem, parent, name);
+    if (index < 0) return -ENOENT;
+    if (!filesystem[new_parent].is_dir) return -ENOTDIR;
+
+    size_t new_length = new_name->length;
+    if (new_length + 1 > MAX_NAME_LENGTH) return -ENAMETOOLONG;
+    if (new_parent == ROOT_INDEX && is_stats_name(new_name->text)) return -EACCES;
+    if (new_parent == ROOT_INDEX && strcmp(new_name->text, SNAPSHOT_DIRNAME) == 0) return -EACCES;
+    if (in_snapshot(index) || in_snapshot(new_parent)) return -EROFS;
+
+    // A directory cannot be moved inside itself
+    if (filesystem[index].is_dir && is_ancestor(filesystem, index, new_parent)) return -EINVAL;
+
+    int existing = find_child(filesystem, new_parent, new_name);
+    if (existing == index) return 0;
+    if (existing >= 0) {
+        // Replace the existing entry, following rename(2)
+        if (filesystem[existing].is_dir) {
+            if (!filesystem[index].is_dir) return -EISDIR;
+            if (inode_cold[existing].first_child >= 0) return -ENOTEMPTY;
+        } else if (filesystem[index].is_dir) {
+            return -ENOTDIR;
+        }
+    }
+
+    journal_begin();
+    uint32_t stored = name_store(new_name->text, new_length);
+    if (stored == 0) {
+        journal_end(filesystem, block_bitmap, data_blocks);
+        return -ENOSPC;
+    }
+    if (existing >= 0) {
+        remove_inode(filesystem, block_bitmap, data_blocks, existing);
+        inode_count--;
+    }
+
+    path_index_remove(filesystem, index);
+    dir_unlink_child(filesystem, index);
+    name_release(filesystem[index].name, filesystem[index].name_length);
+    filesystem[index].name = stored;
+    filesystem[index].name_length = new_length;
+    dir_link_child(filesystem, new_parent, index);
+    path_index_insert(filesystem, index);
+    filesystem[index].modif_time = time(NULL);
+    mark_inode_dirty(index);
+    journal_end(filesystem, block_bitmap, data_blocks);
+
+    return 0;
+}
+
+void inode_set_times(int index, time_t access_time, time_t modif_time) {
+	journal_begin();
+	filesystem[index].access_time = access_time;
+	filesystem[index].modif_time = modif_time;
+	mark_inode_dirty(index);
+	journal_end(filesystem, block_bitmap, data_blocks);
+}
+
+// Copy the next size bytes of source to memory at to, moving source past them
+// With splice_read the data of a write is still in a pipe, so this is the only copy it takes
+// Returns 0, or -EIO if source ran short
+static int source_copy(char *to, struct fuse_bufvec *source, size_t size) {
+    struct fuse_bufvec target = FUSE_BUFVEC_INIT(size);
+    target.buf[0].mem = to;
+    ssize_t copied = fuse_buf_copy(&target, source, 0);
+    return copied == (ssize_t)size ? 0 : -EIO;
+}
+
+// Copy block from to the pinned buffer to
+// Returns 0, or -EIO if it could not be read
+static int block_copy(char *to, uint32_t from) {
+    if (cache_pin(from, 1, false) < 0)
+        return -EIO;
+    memcpy(to, BLOCK_DATA(data_blocks, from), geometry.block_size);
+    cache_unpin(from, 1);
+    return 0;
+}
+
+// Write size bytes of source at offset to the blocks of the file at index, allocating those it lacks
+// Blocks shared with other files are written to copies, which take their place in the block map only once
+// written, so a write that stops early leaves the file mapping the shared blocks still
+// Returns the number of bytes written, fewer than size only if the block pool filled up, the blocks
+// could not be read or source ran short, with *error set then
+static size_t write_blocks(int index, struct fuse_bufvec *source, size_t size, off_t offset, uint32_t *cursor, int *error) {
+    size_t block_size = geometry.block_size;
+    InodeCold *cold = &inode_cold[index];
+    uint32_t last = (offset + size - 1) / block_size;
+
+    size_t total_written = 0;
+    while (total_written < size) {
+        off_t position = offset + total_written;
+        uint32_t logical = position / block_size;
+        size_t block_offset = position % block_size;
+
+        uint32_t run;
+        int64_t block = extent_map(cold, data_blocks, logical, &run, cursor, NULL);
+        if (block < -1) {
+            *error = block;
+            break;
+        }
+        if (run > last - logical + 1)
+            run = last - logical + 1;
+        if (run > cache_run_blocks())
+            run = cache_run_blocks();
+        bool fresh = block < 0;
+        // Blocks written whole need not be read first, so a partial last block gets a pass of its own
+        size_t left = size - total_written;
+        if (!fresh && block_offset == 0 && left >= block_size && left < (size_t)run * block_size)
+            run = left / block_size;
+        int64_t shared = -1; // The shared blocks the run is copied from
+        if (!fresh) {
+            bool multiple;
+            run = dedup_claim(block, run, &multiple);
+            if (multiple)
+                shared = block;
+        }
+        if (fresh || shared >= 0) {
+            // Place the new blocks right after those of the previous logical block so the extents merge
+            uint32_t hint = BLOCK_NO_HINT;
+            uint32_t previous_run;
+            if (logical > 0) {
+                int64_t previous = extent_map(cold, data_blocks, logical - 1, &previous_run, cursor, NULL);
+                if (previous >= 0)
+                    hint = previous + 1;
+            }
+            block = allocate_blocks(block_bitmap, data_blocks, hint, run, 1, &run);
+            if (block < 0) {
+                *error = -ENOSPC;
+                break;
+            }
+        }
+        if (fresh) {
+            Extent extent = { logical, block, run };
+            int inserted = extent_insert(index, block_bitmap, data_blocks, extent);
+            if (inserted < 0) {
+                deallocate_blocks(block_bitmap, block, run);
+                *error = inserted;
+                break;
+            }
+        }
+        bool whole = block_offset == 0 && left >= (size_t)run * block_size;
+        if (cache_pin(block, run, fresh || shared >= 0 || whole) < 0) {
+            if (shared >= 0)
+                deallocate_blocks(block_bitmap, block, run);
+            *error = -EIO;
+            break;
+        }
+
+        char *first = BLOCK_DATA(data_blocks, block);
+        size_t span = (size_t)run * block_size - block_offset;
+        size_t write_size = (size - total_written < span) ? size - total_written : span;
+        uint32_t touched = (block_offset + write_size + block_size - 1) / block_size;
+        int copied = 0;
+        if (fresh) {
+            // Fresh blocks may still hold data of freed files, so clear what this write does not cover
+            memset(first, 0, block_offset);
+            memset(first + block_offset + write_size, 0, span - write_size);
+        } else if (shared >= 0) {
+            // Copies of blocks written in part keep the rest of the shared data, only the first and last can be
+            if (block_offset != 0)
+                copied = block_copy(first, shared);
+            if (copied == 0 && (block_offset + write_size) % block_size != 0 && (touched > 1 || block_offset == 0))
+                copied = block_copy(first + (size_t)(touched - 1) * block_size, shared + touched - 1);
+        }
+        if (copied == 0)
+            copied = source_copy(first + block_offset, source, write_size);
+        for (uint32_t b = 0; b < touched; b++)
+            mark_block_dirty(block + b);
+        cache_unpin(block, run);
+        if (copied == 0 && shared >= 0) {
+            Extent extent = { logical, block, run };
+            copied = extent_replace(index, block_bitmap, data_blocks, extent);
+        }
+        if (copied < 0) {
+            if (shared >= 0)
+                deallocate_blocks(block_bitmap, block, run);
+            *error = copied;
+            break;
+        }
+
+        total_written += write_size;
+    }
+    return total_written;
+}
+
+// Read size bytes at offset, all within the file, from the blocks of the file at index
+// Returns 0, or -EIO if the blocks could not be read
+static int read_blocks(int index, char *buf, size_t size, off_t offset, uint32_t *cursor) {
+    size_t block_size = geometry.block_size;
+    size_t total_read = 0;
+    while (total_read < size) {
+        off_t position = offset + total_read;
+        uint32_t logical = position / block_size;
+        size_t block_offset = position % block_size;
+
+        uint32_t run;
+        Extent extent;
+        int64_t block = extent_map(&inode_cold[index], data_blocks, logical, &run, cursor, &extent);
+        if (block < -1)
+            return block;
+        bool compressed = block >= 0 && EXTENT_IS_COMPRESSED(extent);
+        if (block >= 0 && !compressed && run > cache_run_blocks())
+            run = cache_run_blocks();
+        size_t span = (size_t)run * block_size - block_offset;
+        size_t read_size = (size - total_read < span) ? size - total_read : span;
+        if (block < 0) {
+            memset(buf + total_read, 0, read_size); // Holes read as zeros
+        } else if (compressed) {
+            const char *cluster;
+            int error = compress_read(&extent, &cluster);
+            if (error < 0)
+                return error;
+            memcpy(buf + total_read, cluster + (size_t)(logical - extent.logical) * block_size + block_offset, read_size);
+        } else {
+            uint32_t pinned = (block_offset + read_size + block_size - 1) / block_size;
+            if (cache_pin(block, pinned, false) < 0)
+                return -EIO;
+            memcpy(buf + total_read, BLOCK_DATA(data_blocks, block) + block_offset, read_size);
+            cache_unpin(block, pinned);
+        }
+
+        total_read += read_size;
+    }
+    return 0;
+}
+
+// Move the data of the inline file at index to blocks, called inside a transaction
+// Returns 0, or -ENOSPC if the block pool is full, the file stays inline then
+static int inode_promote(int index, uint32_t *cursor) {
+    Inode *inode = &filesystem[index];
+    InodeCold *cold = &inode_cold[index];
+    uint32_t granule = cold->inline_data;
+    const char *data = INLINE_DATA(cold);
+    inode->is_inline = false; // The block map shares its space with the chunk reference
+    cold->extent_count = 0;
+    cold->extent_index = 0;
+
+    int error = 0;
+    struct fuse_bufvec source = FUSE_BUFVEC_INIT(inode->size);
+    source.buf[0].mem = (void *)data;
+    if (write_blocks(index, &source, inode->size, 0, cursor, &error) < (size_t)inode->size) {
+        extent_free_all(cold, block_bitmap, data_blocks);
+        cold->inline_data = granule;
+        inode->is_inline = true;
+        return error;
+    }
+    name_arena_free(granule, INLINE_GRANULES(inode->size));
+    mark_inode_dirty(index);
+    return 0;
+}
+
+// Move the first size bytes, size > 0, of the file at index from blocks to an inline chunk and free the blocks,
+// called inside a transaction. A full arena leaves the file in blocks
+static void inode_demote(int index, off_t size) {
+    Inode *inode = &filesystem[index];
+    InodeCold *cold = &inode_cold[index];
+    uint32_t granules = INLINE_GRANULES(size);
+    uint32_t granule = name_arena_allocate(granules);
+    if (granule == 0)
+        return;
+
+    char *chunk = name_arena + (size_t)granule * NAME_GRANULE;
+    size_t kept = size < inode->size ? (size_t)size : (size_t)inode->size;
+    if (read_blocks(index, chunk, kept, 0, NULL) < 0) {
+        name_arena_free(granule, granules);
+        return;
+    }
+    memset(chunk + kept, 0, (size_t)granules * NAME_GRANULE - kept);
+    mark_names_dirty(granule, granules);
+    extent_free_all(cold, block_bitmap, data_blocks);
+    cold->inline_data = granule;
+    inode->is_inline = true;
+}
+
+// Clear bytes [from, to) of the file at index where it has blocks, called inside a transaction
+// Bytes past the end of a file must read as zeros once it grows again, and holes already do
+// Returns 0, or -EIO if the map or the blocks could not be read
+static int inode_zero_range(int index, off_t from, off_t to) {
+    size_t block_size = geometry.block_size;
+    while (from < to) {
+        size_t block_offset = from % block_size;
+        size_t length = (size_t)(to - from) < block_size - block_offset ? (size_t)(to - from) : block_size - block_offset;
+        uint32_t run;
+        Extent extent;
+        int64_t block = extent_map(&inode_cold[index], data_blocks, from / block_size, &run, NULL, &extent);
+        if (block < -1)
+            return block;
+        if (block >= 0 && EXTENT_IS_COMPRESSED(extent)) {
+            // Compressed clusters are not changed in place
+            int error = compress_expand(index, from / block_size);
+            if (error < 0)
+                return error;
+            continue;
+        }
+        if (block >= 0) {
+            // Nor are blocks shared with other files
+            int unshared = dedup_unshare(index, from / block_size);
+            if (unshared < 0)
+                return unshared;
+            if (unshared > 0)
+                continue;
+            if (cache_pin(block, 1, false) < 0)
+                return -EIO;
+            memset(BLOCK_DATA(data_blocks, block) + block_offset, 0, length);
+            mark_block_dirty(block);
+            cache_unpin(block, 1);
+        }
+        from += length;
+    }
+    return 0;
+}
+
+// Returns 0, -EROFS in a snapshot, -ENOSPC if the file had to move to blocks and the pool is full, or -EIO
+int inode_truncate(int index, off_t size) {
+	if (in_snapshot(index)) return -EROFS;
+	Inode *inode = &filesystem[index];
+	InodeCold *cold = &inode_cold[index];
+	size_t block_size = geometry.block_size;
+	int result = 0;
+	journal_begin();
+	bool small = size <= inline_size && !inode->is_dir;
+	if (inode->is_inline) {
+		if (size == 0)
+			inline_free(index);
+		else if (!small || inline_resize(index, size) < 0)
+			result = inode_promote(index, NULL); // Too large, or no room to grow in the arena
+	} else if (size == 0) {
+		extent_free_all(cold, block_bitmap, data_blocks);
+	} else {
+		if (small && (cold->extent_count > 0 || cold->extent_index != 0))
+			inode_demote(index, size);
+		if (!inode->is_inline && size < inode->size) {
+			// Free the blocks past the new last one and clear its tail
+			uint32_t kept = (size + block_size - 1) / block_size;
+			result = compress_split(index, kept);
+			if (result == 0)
+				result = inode_zero_range(index, size, (off_t)kept * block_size);
+			if (result == 0)
+				result = extent_remove(index, block_bitmap, data_blocks, kept, UINT32_MAX);
+			extent_shrink(cold, block_bitmap, data_blocks);
+		}
+	}
+	if (result == 0) {
+		inode->modif_time = time(NULL);
+		inode->size = size;
+		mark_inode_dirty(index);
+	}
+	journal_end(filesystem, block_bitmap, data_blocks);
+	return result;
+}
+
+// Clear [from, to) of the file at index and free the blocks the range covers whole
+static int inode_punch(int index, off_t from, off_t to) {
+    Inode *inode = &filesystem[index];
+    InodeCold *cold = &inode_cold[index];
+    size_t block_size = geometry.block_size;
+    int result = 0;
+    journal_begin();
+    if (inode->is_inline) {
+        off_t end = to < inode->size ? to : inode->size;
+        if (from < end) {
+            memset(INLINE_DATA(cold) + from, 0, end - from);
+            uint32_t first = from / NAME_GRANULE;
+            mark_names_dirty(cold->inline_data + first, (end - 1) / NAME_GRANULE - first + 1);
+        }
+    } else {
+        uint32_t first = (from + block_size - 1) / block_size;
+        uint32_t last = to / block_size;
+        if (first > last) {
+            result = inode_zero_range(index, from, to); // Within one block
+        } else {
+            result = compress_split(index, first);
+            if (result == 0)
+                result = compress_split(index, last);
+            if (result == 0)
+                result = inode_zero_range(index, from, (off_t)first * block_size);
+            if (result == 0)
+                result = inode_zero_range(index, (off_t)last * block_size, to);
+            if (result == 0)
+                result = extent_remove(index, block_bitmap, data_blocks, first, last);
+            extent_shrink(cold, block_bitmap, data_blocks);
+        }
+    }
+    if (result == 0) {
+        inode->modif_time = time(NULL);
+        mark_inode_dirty(index);
+    }
+    journal_end(filesystem, block_bitmap, data_blocks);
+    return result;
+}
+
+// Give every hole of the file at index between offset and end zeroed blocks, and make the file end
+// at least at end if extend is set
+// Each run of blocks is a transaction of its own, so a large preallocation never holds much of the cache.
+// A crash in between leaves some of the blocks allocated, which is harmless as they read as zeros
+static int inode_preallocate(int index, off_t offset, off_t end, bool extend) {
+    Inode *inode = &filesystem[index];
+    InodeCold *cold = &inode_cold[index];
+    size_t block_size = geometry.block_size;
+    off_t grown = extend && end > inode->size ? end : inode->size;
+    int result = 0;
+
+    if (inode->is_inline) {
+        // The chunk of an inline file is its allocation, unless the range reaches past what stays inline
+        journal_begin();
+        if (end <= grown && inline_wanted(index, grown) && inline_resize(index, grown) == 0) {
+            if (grown > inode->size) {
+                inode->size = grown;
+                inode->modif_time = time(NULL);
+                mark_inode_dirty(index);
+            }
+            journal_end(filesystem, block_bitmap, data_blocks);
+            return 0;
+        }
+        result = inode_promote(index, NULL);
+        journal_end(filesystem, block_bitmap, data_blocks);
+    }
+
+    uint32_t logical = offset / block_size;
+    uint32_t last = (end - 1) / block_size;
+    while (result == 0 && logical <= last) {
+        uint32_t run;
+        int64_t block = extent_map(cold, data_blocks, logical, &run, NULL, NULL);
+        if (block < -1) {
+            result = block;
+            break;
+        }
+        if (run > last - logical + 1)
+            run = last - logical + 1;
+        if (block >= 0) {
+            logical += run;
+            continue;
+        }
+        if (run > cache_run_blocks())
+            run = cache_run_blocks();
+
+        journal_begin();
+        uint32_t hint = BLOCK_NO_HINT;
+        uint32_t previous_run;
+        int64_t previous = logical > 0 ? extent_map(cold, data_blocks, logical - 1, &previous_run, NULL, NULL) : -1;
+        if (previous >= 0)
+            hint = previous + 1;
+        block = allocate_blocks(block_bitmap, data_blocks, hint, run, 1, &run);
+        if (block < 0) {
+            result = -ENOSPC;
+        } else if (cache_pin(block, run, true) < 0) {
+            deallocate_blocks(block_bitmap, block, run);
+            result = -EIO;
+        } else {
+            // Freed blocks may still hold data of other files
+            memset(BLOCK_DATA(data_blocks, block), 0, (size_t)run * block_size);
+            for (uint32_t b = 0; b < run; b++)
+                mark_block_zeroed(block + b);
+            cache_unpin(block, run);
+            Extent extent = { logical, block, run };
+            result = extent_insert(index, block_bitmap, data_blocks, extent);
+            if (result < 0)
+                deallocate_blocks(block_bitmap, block, run);
+        }
+        journal_end(filesystem, block_bitmap, data_blocks);
+        logical += run;
+    }
+
+    if (result == 0 && grown > inode->size) {
+        journal_begin();
+        inode->size = grown;
+        inode->modif_time = time(NULL);
+        mark_inode_dirty(index);
+        journal_end(filesystem, block_bitmap, data_blocks);
+    }
+    return result;
+}
+
+// Allocate or punch out [offset, offset + length) of the file at index, see fallocate(2)
+// Mode 0 and FALLOC_FL_KEEP_SIZE give the holes in the range zeroed blocks, the first also growing the file to
+// cover the range. FALLOC_FL_PUNCH_HOLE, which needs FALLOC_FL_KEEP_SIZE, turns the range into a hole
+// Returns 0, -EOPNOTSUPP for other modes, -ENOSPC if the pool filled up, or -errno
+int inode_fallocate(int index, int mode, off_t offset, off_t length) {
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+    if (length > INT64_MAX - offset || (uint64_t)(offset + length - 1) / geometry.block_size >= UINT32_MAX)
+        return -EFBIG; // Logical block numbers are 32 bits
+    if (filesystem[index].is_dir)
+        return -EISDIR;
+    if (in_snapshot(index))
+        return -EROFS;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE)
+        return inode_punch(index, offset, offset + length);
+    return inode_preallocate(index, offset, offset + length, !(mode & FALLOC_FL_KEEP_SIZE));
+}
+
+// Returns the number of bytes written, fewer than size only if the block pool filled up, or -errno
+// handle is the file handle written through, whose block map cursor is used, see extent_map(), NULL without one
+int inode_write(int index, const char *buf, size_t size, off_t offset, FileHandle *handle) {
+    struct fuse_bufvec source = FUSE_BUFVEC_INIT(size);
+    source.buf[0].mem = (void *)buf;
+    return inode_write_buf(index, &source, offset, handle);
+}
+
+// Like inode_write() for the data in source, which write_buf hands over without copying it out of a pipe first
+int inode_write_buf(int index, struct fuse_bufvec *source, off_t offset, FileHandle *handle) {
+    uint32_t *cursor = handle != NULL ? &handle->cursor : NULL;
+    size_t block_size = geometry.block_size;
+    size_t size = fuse_buf_size(source);
+    if (size > 0 && (uint64_t)(offset + size - 1) / block_size >= UINT32_MAX)
+        return -EFBIG; // Logical block numbers are 32 bits
+    if (size == 0)
+        return 0;
+    if (in_snapshot(index))
+        return -EROFS;
+
+    Inode *inode = &filesystem[index];
+    off_t end = offset + size;
+    journal_begin();
+
+    // Small files take a single copy into the arena, a full arena sends them to blocks like the rest
+    char staged_data[MAX_INLINE_SIZE];
+    struct fuse_bufvec staged = FUSE_BUFVEC_INIT(size);
+    if (inline_wanted(index, end > inode->size ? end : inode->size)) {
+        const char *data = (const char *)source->buf[0].mem + source->off;
+        if (source->count > 1 || (source->buf[0].flags & FUSE_BUF_IS_FD)) {
+            // A spliced write this small is staged, so the blocks can still take it below if the arena cannot
+            int error = source_copy(staged_data, source, size);
+            if (error < 0) {
+                journal_end(filesystem, block_bitmap, data_blocks);
+                return error;
+            }
+            staged.buf[0].mem = staged_data;
+            source = &staged;
+            data = staged_data;
+        }
+        int written = inline_write(index, data, size, offset);
+        if (written >= 0) {
+            journal_end(filesystem, block_bitmap, data_blocks);
+            return written;
+        }
+    }
+    int error = inode->is_inline ? inode_promote(index, cursor) : 0;
+    journal_end(filesystem, block_bitmap, data_blocks);
+    if (error < 0)
+        return error;
+
+    // The blocks a transaction changes stay held in the cache until it ends, see cache_hold(), so a large
+    // write takes a transaction per piece of cache_run_blocks() blocks
+    size_t piece_bytes = (size_t)cache_run_blocks() * block_size;
+    size_t total_written = 0;
+    while (total_written < size) {
+        off_t position = offset + total_written;
+        size_t piece = piece_bytes - position % piece_bytes;
+        if (piece > size - total_written)
+            piece = size - total_written;
+        journal_begin();
+
+        // Compressed clusters in the way go back to raw blocks first
+        bool expanded;
+        error = compress_prepare(index, position / block_size, (position + piece - 1) / block_size, cursor, &expanded);
+        size_t written = error < 0 ? 0 : write_blocks(index, source, piece, position, cursor, &error);
+
+        // A write cut short by a full pool still reports the bytes that made it
+        if (written > 0) {
+            if (inode->size < position + (off_t)written)
+                inode->size = position + written;
+            inode->modif_time = time(NULL);
+            mark_inode_dirty(index);
+            dedup_written(index, position, position + written, cursor);
+            compress_written(index, position, position + written, expanded);
+        }
+        journal_end(filesystem, block_bitmap, data_blocks);
+        total_written += written;
+        if (written < piece)
+            break;
+    }
+
+    return total_written > 0 ? (int)total_written : error;
+}
+
+// Queue the blocks ahead of a read of [offset, end) through handle for the prefetch thread, if the handle reads
+// the file sequentially. The window doubles with every sequential read, and prefetches go out once half of it
+// was read, so the prefetch thread stays ahead without a request per read
+static void inode_readahead(int index, FileHandle *handle, off_t offset, off_t end) {
+    size_t block_size = geometry.block_size;
+    off_t expected = __atomic_exchange_n(&handle->next_offset, end, __ATOMIC_RELAXED);
+    if (offset != expected) {
+        __atomic_store_n(&handle->readahead, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&handle->prefetched, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    uint32_t window = __atomic_load_n(&handle->readahead, __ATOMIC_RELAXED);
+    window = window == 0 ? CACHE_READAHEAD_MIN : window < CACHE_READAHEAD_MAX ? window * 2 : CACHE_READAHEAD_MAX;
+    __atomic_store_n(&handle->readahead, window, __ATOMIC_RELAXED);
+
+    off_t from = __atomic_load_n(&handle->prefetched, __ATOMIC_RELAXED);
+    if (from < end)
+        from = end;
+    off_t to = end + window < filesystem[index].size ? end + window : filesystem[index].size;
+    if (from - end > window / 2 || from >= to)
+        return;
+    __atomic_store_n(&handle->prefetched, to, __ATOMIC_RELAXED);
+
+    uint32_t last = (to - 1) / block_size;
+    for (uint32_t logical = from / block_size; logical <= last; ) {
+        uint32_t run;
+        Extent extent;
+        int64_t block = extent_map(&inode_cold[index], data_blocks, logical, &run, NULL, &extent);
+        if (block < -1)
+            return;
+        if (block >= 0 && EXTENT_IS_COMPRESSED(extent))
+            cache_prefetch(block, EXTENT_STORED(extent)); // The whole cluster, whose blocks are all read
+        else if (block >= 0)
+            cache_prefetch(block, run > last - logical + 1 ? last - logical + 1 : run);
+        logical += run;
+    }
+}
+
+// Record a read of the file at index the way relatime does: the access time is only stored when it is not newer
+// than the last change or is ATIME_REFRESH_SECONDS old, so reading a file seldom dirties its inode
+// Concurrent readers may both store the time, so the store is atomic and goes through a transaction of its own
+static void inode_accessed(int index) {
+    Inode *inode = &filesystem[index];
+    time_t now = time(NULL);
+    time_t accessed = __atomic_load_n(&inode->access_time, __ATOMIC_RELAXED);
+    if (accessed > inode->modif_time && now - accessed < ATIME_REFRESH_SECONDS)
+        return;
+    journal_begin();
+    __atomic_store_n(&inode->access_time, now, __ATOMIC_RELAXED);
+    mark_inode_dirty(index);
+    journal_end(filesystem, block_bitmap, data_blocks);
+}
+
+// Returns the number of bytes read, 0 at or past the end of the file, or -EIO
+// handle is the file handle read through, NULL without one. Sequential reads through a handle prefetch ahead
+int inode_read(int index, char *buf, size_t size, off_t offset, FileHandle *handle) {
+    Inode *inode = &filesystem[index];
+    if (offset >= inode->size)
+        return 0;
+
+    size_t to_read = (size < (size_t)(inode->size - offset)) ? size : (size_t)(inode->size - offset);
+    if (inode->is_inline) {
+        memcpy(buf, INLINE_DATA(&inode_cold[index]) + offset, to_read);
+    } else {
+        if (read_blocks(index, buf, to_read, offset, handle != NULL ? &handle->cursor : NULL) < 0)
+            return -EIO;
+        if (handle != NULL)
+            inode_readahead(index, handle, offset, offset + to_read);
+    }
+
+    inode_accessed(index);
+    return to_read;
+}
+
+// Holes in read replies point here
+static const char zero_data[64 * 1024];
+
+// Like inode_read(), but fill vector with pieces of the block pool, the inline data and zeros for holes instead of
+// copying them, so the reply goes from the cache to the kernel in one copy. Callers keep the inode locked and the
+// vector alive until the reply is sent, then call read_vector_release()
+// Returns the number of bytes read, 0 at or past the end of the file, -EIO, or -EAGAIN with nothing held if the
+// range is compressed or in more pieces than the vector holds, to be read by inode_read() then
+int inode_read_vector(int index, size_t size, off_t offset, FileHandle *handle, ReadVector *vector) {
+    Inode *inode = &filesystem[index];
+    vector->count = 0;
+    if (offset >= inode->size)
+        return 0;
+
+    size_t to_read = (size < (size_t)(inode->size - offset)) ? size : (size_t)(inode->size - offset);
+    if (inode->is_inline) {
+        vector->segments[0].iov_base = INLINE_DATA(&inode_cold[index]) + offset;
+        vector->segments[0].iov_len = to_read;
+        vector->pinned[0] = 0;
+        vector->count = 1;
+    } else {
+        size_t block_size = geometry.block_size;
+        uint32_t *cursor = handle != NULL ? &handle->cursor : NULL;
+        for (size_t total_read = 0; total_read < to_read; ) {
+            off_t position = offset + total_read;
+            uint32_t logical = position / block_size;
+            size_t block_offset = position % block_size;
+
+            uint32_t run;
+            Extent extent;
+            int64_t block = extent_map(&inode_cold[index], data_blocks, logical, &run, cursor, &extent);
+            int error = block < -1 ? (int)block : vector->count == READ_VECTOR_SEGMENTS ? -EAGAIN
+                : block >= 0 && EXTENT_IS_COMPRESSED(extent) ? -EAGAIN : 0;
+            if (error == 0 && block >= 0 && run > cache_run_blocks())
+                run = cache_run_blocks();
+            size_t span = (size_t)run * block_size - block_offset;
+            size_t read_size = (to_read - total_read < span) ? to_read - total_read : span;
+
+            struct iovec *segment = &vector->segments[vector->count];
+            uint32_t pinned = 0;
+            if (error < 0) {
+                // Handled below
+            } else if (block < 0) {
+                if (read_size > sizeof(zero_data))
+                    read_size = sizeof(zero_data);
+                segment->iov_base = (void *)zero_data;
+            } else {
+                pinned = (block_offset + read_size + block_size - 1) / block_size;
+                if (cache_pin(block, pinned, false) < 0)
+                    error = -EIO;
+                segment->iov_base = BLOCK_DATA(data_blocks, block) + block_offset;
+            }
+            if (error < 0) {
+                read_vector_release(vector);
+                return error;
+            }
+            segment->iov_len = read_size;
+            vector->blocks[vector->count] = block;
+            vector->pinned[vector->count] = pinned;
+            vector->count++;
+            total_read += read_size;
+        }
+        if (handle != NULL)
+            inode_readahead(index, handle, offset, offset + to_read);
+    }
+
+    inode_accessed(index);
+    return to_read;
+}
+
+// Drop the cache pins of a vector filled by inode_read_vector()
+void read_vector_release(ReadVector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        if (vector->pinned[i] > 0)
+            cache_unpin(vector->blocks[i], vector->pinned[i]);
+    }
+    vector->count = 0;
+}
+
+// Drop a reference to the slot at index once its count reached zero
+// A file removed while referenced is reclaimed here: its data once no handle is open, its slot once the kernel forgot it too
+void inode_unref(int index) {
+	// Removals set orphan under the exclusive lock, so holding it shared is enough to see a removal that saw references
+	pthread_rwlock_rdlock(&namespace_lock);
+	bool orphan = inode_refs[index].orphan;
+	pthread_rwlock_unlock(&namespace_lock);
+	if(!orphan)
+		return;
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	InodeRef *ref = &inode_refs[index];
+	if(ref->orphan && __atomic_load_n(&ref->opens, __ATOMIC_ACQUIRE) == 0) {
+		InodeCold *cold = &inode_cold[index];
+		if(cold->extent_count > 0 || cold->extent_index != 0 || filesystem[index].is_inline) {
+			journal_begin();
+			inline_free(index);
+			extent_free_all(cold, block_bitmap, data_blocks);
+			mark_inode_dirty(index);
+			journal_end(filesystem, block_bitmap, data_blocks);
+		}
+		if(__atomic_load_n(&ref->lookups, __ATOMIC_ACQUIRE) == 0) {
+			ref->orphan = false;
+			free_inodes_push(filesystem, index, index + 1);
+		}
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+}
+
+// Released handles are kept for the next open, handles are allocated HANDLE_CHUNK at a time
+#define HANDLE_CHUNK 64
+typedef struct HandleChunk {
+	struct HandleChunk *next;
+	FileHandle handles[HANDLE_CHUNK];
+} HandleChunk;
+HandleChunk *handle_chunks;
+FileHandle *free_handles;
+pthread_mutex_t handle_pool_mutex = PTHREAD_MUTEX_INITIALIZER; // Taken last, after any other lock
+
+// Returns a handle on the file at index, NULL if out of memory
+// Callers hold the namespace lock, which keeps the slot from being removed before the handle counts
+FileHandle *handle_open(int index) {
+	pthread_mutex_lock(&handle_pool_mutex);
+	if(free_handles == NULL) {
+		HandleChunk *chunk = malloc(sizeof(HandleChunk));
+		if(chunk != NULL) {
+			chunk->next = handle_chunks;
+			handle_chunks = chunk;
+			for(int i = 0; i < HANDLE_CHUNK; i++) {
+				chunk->handles[i].next_free = free_handles;
+				free_handles = &chunk->handles[i];
+			}
+		}
+	}
+	FileHandle *handle = free_handles;
+	if(handle != NULL)
+		free_handles = handle->next_free;
+	pthread_mutex_unlock(&handle_pool_mutex);
+	if(handle == NULL)
+		return NULL;
+	handle->index = index;
+	handle->cursor = UINT32_MAX;
+	handle->readahead = 0;
+	handle->next_offset = 0;
+	handle->prefetched = 0;
+	__atomic_add_fetch(&inode_refs[index].opens, 1, __ATOMIC_ACQ_REL);
+	return handle;
+}
+
+void handle_release(FileHandle *handle) {
+	int index = handle->index;
+	pthread_mutex_lock(&handle_pool_mutex);
+	handle->next_free = free_handles;
+	free_handles = handle;
+	pthread_mutex_unlock(&handle_pool_mutex);
+	if(__atomic_sub_fetch(&inode_refs[index].opens, 1, __ATOMIC_ACQ_REL) == 0)
+		inode_unref(index);
+}
+
+// Like lock_path() for an open file, which always succeeds: the file may have been removed since, but its
+// data stays until the handle is released, as unlink(2) promises
+int handle_lock(const FileHandle *handle, bool exclusive) {
+	pthread_rwlock_rdlock(&namespace_lock);
+	if(exclusive)
+		pthread_rwlock_wrlock(&inode_locks[handle->index]);
+	else
+		pthread_rwlock_rdlock(&inode_locks[handle->index]);
+	return handle->index;
+}
+
 /*
  * Return file attributes.
  * The "stat" structure is described in detail in the stat(2) manual page.
@@ -40,21 +1059,19 @@ static struct fuse_operations dm510fs_oper = {
  * This call is pretty much required for a usable filesystem.
 */
 int dm510fs_getattr( const char *path, struct stat *stbuf ) {
-	printf("getattr: (path=%s)\n", path);
+	log_debug("getattr: (path=%s)", path);
 
 	memset(stbuf, 0, sizeof(struct stat));
-	int index = find_active_path_index(filesystem, MAX_INODES, path);
+	if(is_stats_path(path)) {
+		stats_getattr(path, stbuf);
+		return 0;
+	}
+	int index = lock_path(filesystem, path, false);
 	if(index < 0) return -ENOENT;
 
-	printf("Found inode for path %s, name %s at location %i \n", path, filesystem[index].name, index);
-	stbuf->st_mode = filesystem[index].mode;
-	stbuf->st_nlink = filesystem[index].nlink;
-	stbuf->st_size = filesystem[index].size;
-	stbuf->st_dev = filesystem[index].devno;
-	stbuf->st_uid = filesystem[index].owner;
-	stbuf->st_gid = filesystem[index].group;
-	stbuf->st_atime = filesystem[index].access_time;
-	stbuf->st_mtime = filesystem[index].modif_time;
+	log_trace("Found inode for path %s, name %s at location %i", path, INODE_NAME(&filesystem[index]), index);
+	inode_stat(index, stbuf);
+	unlock_path(index);
 
 	return 0;
 }
@@ -83,26 +1100,23 @@ int dm510fs_getattr( const char *path, struct stat *stbuf ) {
  * in particular it can return -EBADF if the file handle is invalid, or -ENOENT if you use the path argument and the path doesn't exist.
 */
 int dm510fs_readdir( const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi ) {
-	printf("readdir: (path=%s)\n", path);
-
-	// Check if the directory path exists
-	if(find_active_path_index(filesystem, MAX_INODES, path) < 0)
-		return -ENOENT;
-
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-
-	for(int i = 0; i < MAX_INODES; i++){
-		// Check that it is active and not the exact same path
-		if(filesystem[i].is_active && strcmp(filesystem[i].path, path) != 0){
-			// Check if the inode is in the same directory path
-			char *real_path = extract_path_from_abs(filesystem[i].path);
-			printf("real_path: %s\n", real_path);
-			if(strcmp(path, real_path) == 0)
-				filler(buf, filesystem[i].name, NULL, 0);
-		}
+	log_debug("readdir: (path=%s)", path);
+
+	// Child lists belong to the namespace, so the shared namespace lock is all a listing needs
+	pthread_rwlock_rdlock(&namespace_lock);
+	int index = find_active_path_index(filesystem, geometry.inode_slots, path);
+	int error = index < 0 ? -ENOENT : !filesystem[index].is_dir ? -ENOTDIR : 0;
+	if(error != 0 || (offset < 1 && filler(buf, ".", NULL, 1) != 0) || (offset < 2 && filler(buf, "..", NULL, 2) != 0)) {
+		pthread_rwlock_unlock(&namespace_lock);
+		return error;
 	}
 
+	for(int child = dir_first_after(index, offset); child >= 0; child = inode_cold[child].next_sibling){
+		if(filler(buf, INODE_NAME(&filesystem[child]), NULL, dir_cookie(child)) != 0)
+			break;
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+
 	return 0;
 }
 
@@ -114,326 +1128,293 @@ int dm510fs_readdir( const char *path, void *buf, fuse_fill_dir_t filler, off_t
  * Link: https://github.com/libfuse/libfuse/blob/0c12204145d43ad4683136379a130385ef16d166/include/fuse_common.h#L50
 */
 int dm510fs_open( const char *path, struct fuse_file_info *fi ) {
-    printf("open: (path=%s)\n", path);
+    log_debug("open: (path=%s)", path);
+	if(is_stats_path(path)) return stats_open(path, fi);
 
-	int index = find_active_path_index(filesystem, MAX_INODES, path);
+	pthread_rwlock_rdlock(&namespace_lock);
+	int index = find_active_path_index(filesystem, geometry.inode_slots, path);
+	FileHandle *handle = index < 0 ? NULL : handle_open(index);
+	pthread_rwlock_unlock(&namespace_lock);
 	if(index < 0) return -ENOENT;
+	if(handle == NULL) return -ENOMEM;
 	
+	fi->fh = (uintptr_t)handle;
 	return 0;
 }
 
+// Returns the handle opened on fi, NULL for callers that did not open the file (bench.c) or a statistics file
+static FileHandle *file_handle(const char *path, const struct fuse_file_info *fi) {
+	if(fi == NULL || fi->fh == 0 || is_stats_path(path)) return NULL;
+	return (FileHandle *)(uintptr_t)fi->fh;
+}
+
 /*
  * Create a new directory
 */
-int dm510fs_mkdir(const char *path, mode_t mode) {
-	printf("mkdir: (path=%s) (mode=%hu)\n", path, mode);
-
-	int error = handle_inode_creation(filesystem, MAX_INODES, path, inode_count);
-	if(error != 0) return error;
-
-	// Locate the first unused Inode in the filesystem
-	int free_index = find_inactive_index(filesystem, MAX_INODES, path);
-	if(free_index < 0) return -ENOSPC;
+static int mkdir_locked(const char *path, mode_t mode) {
+	log_debug("mkdir: (path=%s) (mode=%hu)", path, mode);
+	if(is_stats_path(path)) return -EEXIST;
+	if(strlen(path) + 1 > MAX_PATH_LENGTH) return -ENAMETOOLONG;
 
-	Inode *inode = &filesystem[free_index];
-	inode->is_active = true;
-	inode->is_dir = true;
-	inode->mode = S_IFDIR | mode;
-	inode->nlink = 2;
-	inode->size = 4096;
-	inode->group = getgid();
-	inode->owner = getuid();
-	inode->access_time = time(NULL);
-	inode->modif_time = time(NULL);
+	PathName name;
+	int parent = find_parent_index(filesystem, geometry.inode_slots, path, &name);
+	if(parent < 0) return -ENOENT;
 
-	char *name = extract_name_from_abs(path);
-	memcpy(inode->name, name, strlen(name) + 1);
-	memcpy(inode->path, path, strlen(path) + 1); 			
-	inode_count++;
-
-	return 0;
+	int index = create_entry_locked(parent, &name, S_IFDIR | mode, 0);
+	return index < 0 ? index : 0;
 }
 
-int dm510fs_mknod(const char *path, mode_t mode, dev_t devno){
-	printf("mknod: (path=%s) (mode=%hu)\n", path, mode);
+int dm510fs_mkdir(const char *path, mode_t mode) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = mkdir_locked(path, mode);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
 
-	int error = handle_inode_creation(filesystem, MAX_INODES, path, inode_count);
-	if(error != 0) return error;
+// Returns the slot of the new inode, or -errno
+static int mknod_locked(const char *path, mode_t mode, dev_t devno) {
+	log_debug("mknod: (path=%s) (mode=%hu)", path, mode);
+	if(is_stats_path(path)) return -EEXIST;
+	if(strlen(path) + 1 > MAX_PATH_LENGTH) return -ENAMETOOLONG;
 
-	// Locate the first unused Inode in the filesystem
-	int free_index = find_inactive_index(filesystem, MAX_INODES, path);
-	if(free_index < 0) return -ENOSPC;
+	PathName name;
+	int parent = find_parent_index(filesystem, geometry.inode_slots, path, &name);
+	if(parent < 0) return -ENOENT;
 
-	Inode *inode = &filesystem[free_index];
-	inode->is_active = true;
-	inode->is_dir = false;
-	inode->mode = mode;
-	inode->nlink = 1;
-	inode->devno = devno; // Device number by makedev
-	inode->size = 0;
-	inode->group = getgid();
-	inode->owner = getuid();
-	inode->access_time = time(NULL);
-	inode->modif_time = time(NULL);
-	for(int i =0;i<DIRECT_POINTERS;i++){
-		inode->direct_pointers[i] = -1;
-	}
+	return create_entry_locked(parent, &name, mode, devno);
+}
 
-	char *name = extract_name_from_abs(path);
-	memcpy(inode->name, name, strlen(name) + 1);
-	memcpy(inode->path, path, strlen(path) + 1);
-	inode_count++;
+int dm510fs_mknod(const char *path, mode_t mode, dev_t devno) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = mknod_locked(path, mode, devno);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result < 0 ? result : 0;
+}
 
+/*
+ * Create and open a file, so open(2) with O_CREAT costs one request instead of a mknod and an open
+*/
+int dm510fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int index = mknod_locked(path, mode, 0);
+	FileHandle *handle = index < 0 ? NULL : handle_open(index);
+	pthread_rwlock_unlock(&namespace_lock);
+	if(index < 0) return index;
+	if(handle == NULL) return -ENOMEM;
+
+	fi->fh = (uintptr_t)handle;
 	return 0;
 }
 
 int dm510fs_utime(const char * path, struct utimbuf *ubuf){
-	printf("utime: (path=%s)\n",path);
+	log_debug("utime: (path=%s)", path);
+	if(is_stats_path(path)) return -EACCES;
 	
-	int index = find_active_path_index(filesystem, MAX_INODES, path);
+	int index = lock_path(filesystem, path, true);
 	if(index < 0) return -ENOENT;
+	if(in_snapshot(index)) {
+		unlock_path(index);
+		return -EROFS;
+	}
 
-	printf("utime: path:%s at location %i\n", path, index);
-	filesystem[index].access_time = ubuf->actime;
-	filesystem[index].modif_time = ubuf->modtime;
+	log_trace("utime: path:%s at location %i", path, index);
+	inode_set_times(index, ubuf->actime, ubuf->modtime);
+	unlock_path(index);
 	return 0;
 }
 
-int dm510fs_rename(const char *path, const char *new_path) {
-    printf("rename : (path=%s)\n", path);
-
-    int count = 0;
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (filesystem[i].is_active && strncmp(filesystem[i].path, path, strlen(path)) == 0) {
-
-			bool is_subfolder = strlen(filesystem[i].path) > strlen(path);
-			char *new_name = extract_name_from_abs(new_path);
-			char *prev_name = extract_name_from_abs(path);
-			if (!is_subfolder) {
-				strcpy(filesystem[i].name, new_name);
-				strcpy(filesystem[i].path, new_path);
-			} else {
-				char result[strlen(filesystem[i].path) - strlen(prev_name) + strlen(new_name) + 1]; // Include space for '\0'
-				int insertIndex = 0;
-				const char delimiters[] = "/";
-				strcpy(result, "/"); // Start with a leading '/'
-				insertIndex++;
-				char *token = strtok(filesystem[i].path, delimiters); // Initialize strtok with filesystem[i].path
-				while (token != NULL) {
-					if (strcmp(token, prev_name) == 0) { // Compare token with prev_name
-						strcat(result, new_name); // Add new_name to result
-						insertIndex += strlen(new_name); 
-					} else {
-						strcat(result, token); // Add token to result
-						insertIndex += strlen(token); // Update insertIndex
-					}
-					token = strtok(NULL, delimiters);
-					if (token != NULL) {
-						strcat(result, "/"); // Add '/' if token is not NULL
-						insertIndex++;
-					}
-				}
-				strcpy(filesystem[i].path, result); // Update filesystem[i].path with the new path
-				free(token);
-			}
-			count++;
-			free(new_name);
-			free(prev_name);
+/*
+ * Rename a file or directory.
+ * Inodes only know their name and parent, so moving a directory relinks that single inode
+ * and its whole subtree follows without being touched.
+*/
+static int rename_locked(const char *path, const char *new_path) {
+    log_debug("rename : (path=%s)", path);
+    if (is_stats_path(path) || is_stats_path(new_path)) return -EACCES;
+    if (strcmp(path, "/") == 0) return -EBUSY;
+
+    PathName name, new_name;
+    int parent = find_parent_index(filesystem, geometry.inode_slots, path, &name);
+    if (parent < 0) return -ENOENT;
+    int new_parent = find_parent_index(filesystem, geometry.inode_slots, new_path, &new_name);
+    if (new_parent < 0) return -ENOENT;
+
+    return rename_entry_locked(parent, &name, new_parent, &new_name);
+}
 
-        }
-    }
-    if (count > 0) {
-        return 0;
-    }
-    return -ENOENT;
+int dm510fs_rename(const char *path, const char *new_path) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = rename_locked(path, new_path);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
 }
 
-int dm510fs_unlink(const char *path){
-	printf("unlink : (path=%s)\n",path);
+static int unlink_locked(const char *path) {
+	log_debug("unlink : (path=%s)", path);
+	if(is_stats_path(path)) return -EACCES;
 
-	int index = find_active_path_index(filesystem, MAX_INODES, path);
-	if(index < 0) return -ENOENT;
+	PathName name;
+	int parent = find_parent_index(filesystem, geometry.inode_slots, path, &name);
+	if(parent < 0) return -ENOENT;
+	return remove_entry_locked(parent, &name, false);
+}
 
-	filesystem[index].is_active = false;
-	for(int j =0; j < DIRECT_POINTERS; j++){
-		if(filesystem[index].direct_pointers[j] != -1) {
-			deallocate_block(data_blocks, j);
-			filesystem[index].direct_pointers[j] = -1;
-		}
-	}
-	inode_count--;
-	return 0;
+int dm510fs_unlink(const char *path) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = unlink_locked(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
 }
 
-int dm510fs_rmdir(const char *path) {
-    printf("rmdir: (path=%s)\n", path);
-	int count = 0;
-
-    for (int i = 0; i < MAX_INODES; i++) {
-		// Check for inodes inside of the directory using strncmp
-		bool path_in_directory = strncmp(filesystem[i].path, path, strlen(path)) == 0;
-        if (filesystem[i].is_active && path_in_directory) {
-            filesystem[i].is_active = false;
-			count++;
-			inode_count--;
-			
-        }
-    }
+static int rmdir_locked(const char *path) {
+    log_debug("rmdir: (path=%s)", path);
+	if(is_stats_path(path)) return -ENOTDIR;
+	if(strcmp(path, "/") == 0) return -EBUSY;
 
-	if(count != 0) return 0;
+	PathName name;
+	int parent = find_parent_index(filesystem, geometry.inode_slots, path, &name);
+	if(parent < 0) return -ENOENT;
+	return remove_entry_locked(parent, &name, true);
+}
 
-    return -ENOENT; 
+int dm510fs_rmdir(const char *path) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = rmdir_locked(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
 }
 
 int dm510fs_truncate(const char *path, off_t size){
-    printf("truncate: (path=%s, size=%lld)\n", path, (long long)size);
+    log_debug("truncate: (path=%s, size=%lld)", path, (long long)size);
+	if(is_control_path(path)) return 0; // Shells truncate what they redirect into
+	if(is_stats_path(path)) return -EACCES;
 
-	int index = find_active_path_index(filesystem, MAX_INODES, path);
+	int index = lock_path(filesystem, path, true);
 	if(index >= 0) {
-		filesystem[index].modif_time = time(NULL);
-		filesystem[index].size = size;
-		return 0;
+		int result = inode_truncate(index, size);
+		unlock_path(index);
+		return result;
 	}
 
 	return -ENOENT;
 }
 
-/* 
- * Write to a file in the filesystem if it is active and has space for the buffer and offset given
-*/
-/*
-int dm510fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info * filp){
-	printf("write: (path=%s), (size=%lu), (offset=%ld) \n", path, size, offset);
-	
-	// Check if the offset plus the size of the buffer does not surpass the max limit
-	if(offset + size >= MAX_DATA_IN_FILE){
-		printf("The size of data exceeded the limit: %ld > %d \n", size + offset, MAX_DATA_IN_FILE); 
-		return -EMSGSIZE;
-	}
+int dm510fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	FileHandle *handle = file_handle(path, fi);
+	if(handle == NULL) return dm510fs_truncate(path, size);
+	log_debug("ftruncate: (path=%s, size=%lld)", path, (long long)size);
 
-	int index = find_active_path_index(filesystem, MAX_INODES, path);
-	if(index < 0) return -ENOENT;
+	int index = handle_lock(handle, true);
+	int result = inode_truncate(index, size);
+	unlock_path(index);
+	return result;
+}
 
-	if(filesystem[index].size < offset + size) // Adjust the size if it increases
-		filesystem[index].size = offset + size;
+/*
+ * Preallocate zeroed blocks for a range of a file or punch a hole into it, see inode_fallocate()
+ */
+int dm510fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	log_debug("fallocate: (path=%s, mode=%d, offset=%lld, length=%lld)", path, mode, (long long)offset, (long long)length);
+	if(is_stats_path(path)) return -EACCES;
 
-	memcpy(filesystem[index].data + offset, buf, size);
-	filesystem[index].modif_time = time(NULL); // Update modification time
-	return size;
+	FileHandle *handle = file_handle(path, fi);
+	int index = handle != NULL ? handle_lock(handle, true) : lock_path(filesystem, path, true);
+	if(index < 0) return -ENOENT;
+	int result = inode_fallocate(index, mode, offset, length);
+	unlock_path(index);
+	return result;
 }
+
+/* 
+ * Write to a file in the filesystem if it is active and has space for the buffer and offset given
 */
 int dm510fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info * filp) {
-    printf("write: (path=%s), (size=%lu), (offset=%ld) \n", path, size, offset);
+    log_debug("write: (path=%s), (size=%lu), (offset=%ld)", path, size, offset);
+    if (is_control_path(path)) return control_write(buf, size);
+    if (is_stats_path(path)) return -EACCES;
 
-    int index = find_active_path_index(filesystem, MAX_INODES, path);
+    FileHandle *handle = file_handle(path, filp);
+    int index = handle != NULL ? handle_lock(handle, true) : lock_path(filesystem, path, true);
     if (index < 0) return -ENOENT;
+    int result = inode_write(index, buf, size, offset, handle);
+    unlock_path(index);
 
-    Inode *inode = &filesystem[index];
-
-    size_t total_written = 0;
-    size_t to_write = size;
-    size_t block_offset = offset % MAX_DATA_IN_BLOCK;
-
-    while (to_write > 0) {
-        int block_index = offset / MAX_DATA_IN_BLOCK;
-        if (block_index < DIRECT_POINTERS) {
-            if (inode->direct_pointers[block_index] == -1) {
-                inode->direct_pointers[block_index] = allocate_block(data_blocks);
-                if (inode->direct_pointers[block_index] == -1) return -ENOSPC;
-            }
+    return result;
+}
 
-            int block = inode->direct_pointers[block_index];
-            size_t write_size = (to_write < MAX_DATA_IN_BLOCK - block_offset) ? to_write : MAX_DATA_IN_BLOCK - block_offset;
-            memcpy(data_blocks[block].data + block_offset, buf + total_written, write_size);
 
-            to_write -= write_size;
-            total_written += write_size;
-            offset += write_size;
-            block_offset = 0;
-        } else {
-            return -EMSGSIZE;
-        }
+/*
+ * Write the data in buf, which stays in the pipe it was spliced into until it is copied to the blocks
+ */
+int dm510fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(buf);
+    log_debug("write_buf: (path=%s), (size=%zu), (offset=%lld)", path, size, (long long)offset);
+    if (is_control_path(path)) {
+        // Commands are parsed from memory
+        char *data = scratch_buffer(size);
+        struct fuse_bufvec copy = FUSE_BUFVEC_INIT(size);
+        copy.buf[0].mem = data;
+        return data == NULL ? -ENOMEM : fuse_buf_copy(&copy, buf, 0) != (ssize_t)size ? -EIO : control_write(data, size);
     }
+    if (is_stats_path(path)) return -EACCES;
 
-    inode->size = (inode->size < offset) ? offset : inode->size;
-    inode->modif_time = time(NULL);
+    FileHandle *handle = file_handle(path, fi);
+    int index = handle != NULL ? handle_lock(handle, true) : lock_path(filesystem, path, true);
+    if (index < 0) return -ENOENT;
+    int result = inode_write_buf(index, buf, offset, handle);
+    unlock_path(index);
 
-    return total_written;
+    return result;
 }
 
-
 /*
  * Read size bytes from the given file into the buffer buf, beginning offset bytes into the file. See read(2) for full details.
  * Returns the number of bytes transferred, or 0 if offset was at or beyond the end of the file. Required for any sensible filesystem.
 */
-/*
-int dm510fs_read( const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi ) {
-	printf("read: (path=%s), (size=%lu), (offset=%ld) \n", path, size, offset);
-
-	int index = find_active_path_index(filesystem, MAX_INODES, path);
-	if(index < 0) return -ENOENT;
-
-	if(offset >= filesystem[index].size) return 0;
-
-	printf("Read path: %s at location %i\n", path, index);
-	// Check if buffer has enough size to receive the data from the offset
-	off_t file_size = filesystem[index].size - offset;	
-	if(size < file_size) {
-		printf("Buffer does not have enough size for the data of the file\n");
-		return -ENOBUFS;
-	} 
-
-	memcpy(buf, filesystem[index].data + offset, file_size);
-	filesystem[index].access_time = time(NULL); // Update access time
-	return filesystem[index].size;
-}
-*/
 int dm510fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("read: (path=%s), (size=%lu), (offset=%ld) \n", path, size, offset);
+    log_debug("read: (path=%s), (size=%lu), (offset=%ld)", path, size, offset);
+    if (is_stats_path(path)) return stats_read(path, buf, size, offset, fi);
 
-    int index = find_active_path_index(filesystem, MAX_INODES, path);
+    FileHandle *handle = file_handle(path, fi);
+    int index = handle != NULL ? handle_lock(handle, false) : lock_path(filesystem, path, false);
     if (index < 0) return -ENOENT;
+    int result = inode_read(index, buf, size, offset, handle);
+    unlock_path(index);
 
-    Inode *inode = &filesystem[index];
-
-    if (offset >= inode->size) return 0;
-
-    size_t total_read = 0;
-    size_t to_read = size;
-    size_t block_offset = offset % MAX_DATA_IN_BLOCK;
-
-    while (to_read > 0 && offset < inode->size) {
-        int block_index = offset / MAX_DATA_IN_BLOCK;
-        if (block_index < DIRECT_POINTERS && inode->direct_pointers[block_index] != -1) {
-            int block = inode->direct_pointers[block_index];
-            size_t read_size = (to_read < MAX_DATA_IN_BLOCK - block_offset) ? to_read : MAX_DATA_IN_BLOCK - block_offset;
-            read_size = (read_size < inode->size - offset) ? read_size : inode->size - offset;
-            memcpy(buf + total_read, data_blocks[block].data + block_offset, read_size);
-
-            to_read -= read_size;
-            total_read += read_size;
-            offset += read_size;
-            block_offset = 0;
-        } else {
-            break;
-        }
-    }
-
-    inode->access_time = time(NULL);
-
-    return total_read;
+    return result;
 }
 
-
 /*
  * This is the only FUSE function that doesn't have a directly corresponding system call, although close(2) is related.
  * Release is called when FUSE is completely done with a file; at that point, you can free up any temporarily allocated data structures.
  */
 int dm510fs_release(const char *path, struct fuse_file_info *fi) {
-	printf("release: (path=%s)\n", path);
+	log_debug("release: (path=%s)", path);
+	FileHandle *handle = file_handle(path, fi);
+	if(is_stats_path(path)) stats_release(fi);
+	else if(handle != NULL) handle_release(handle);
 	return 0;
 }
 
+/*
+ * Called on each close(2) of a file descriptor.
+ * Closing does not imply durability, so nothing is forced to disk here; the journal commits on its own within JOURNAL_COMMIT_INTERVAL_MS.
+ */
+int dm510fs_flush(const char *path, struct fuse_file_info *fi) {
+	log_debug("flush: (path=%s)", path);
+	return 0;
+}
+
+/*
+ * Synchronize file contents.
+ * Every completed operation is already in the journal buffer, so this waits for the group commit that makes it durable.
+ * Concurrent callers share a single fdatasync of the journal.
+ */
+int dm510fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	log_debug("fsync: (path=%s)", path);
+	return journal_sync();
+}
+
 /**
  * Initialize filesystem
  *
@@ -442,16 +1423,62 @@ int dm510fs_release(const char *path, struct fuse_file_info *fi) {
  * parameter to the destroy() method. It overrides the initial
  * value provided to fuse_main() / fuse_new().
  */
-void* dm510fs_init() {
-    printf("init filesystem\n");
-	inode_count = restore_filesystem(PERSISENT_FILENAME, filesystem, MAX_INODES);
-	
-	for (int i = 0; i < MAX_BLOCKS; i++) {
-        data_blocks[i].is_active = false;
-    }
+void* dm510fs_init(struct fuse_conn_info *conn) {
+	// Started here rather than in main, fuse_main() forks into the background before calling init
+	if (log_start() != 0)
+		fprintf(stderr, "Failed to create log writer thread, logging synchronously\n");
+    log_info("init filesystem");
+	stats_started_ns = stats_clock();
+	namespace_lock_init();
+	image_fd = open_image(PERSISENT_FILENAME);
+	if (image_fd < 0) exit(EXIT_FAILURE);
+
+	inode_count = restore_filesystem(image_fd, &filesystem, &block_bitmap, &data_blocks);
+	if (inode_count < 0) {
+		log_error("Failed to restore the filesystem from %s", PERSISENT_FILENAME);
+		exit(EXIT_FAILURE);
+	}
+	Superblock layout;
+	image_layout(&layout);
+	if (cache_open(image_fd, data_blocks, layout.data_offset) < 0) exit(EXIT_FAILURE);
+	compress_forget(); // Clusters decompressed by an earlier mount in this process are stale
+	if (compress_enabled && compress_cluster_blocks() < 2) {
+		log_warn("Compression needs blocks of at most %d bytes, leaving data uncompressed", COMPRESS_CLUSTER_BYTES / 2);
+		compress_enabled = false;
+	}
+
+	// Redo every committed transaction that had not been checkpointed into the image yet
+	if (journal_open(JOURNAL_FILENAME, JOURNAL_ALTERNATE_FILENAME) < 0) exit(EXIT_FAILURE);
+	int replayed = journal_replay(filesystem, block_bitmap, data_blocks);
+	if (replayed < 0) exit(EXIT_FAILURE);
+	if (replayed > 0) {
+		log_info("Replayed %d journal transactions", replayed);
+		inode_count = count_active_inodes(filesystem);
+	}
+	allocator_rebuild(filesystem, block_bitmap);
+	if (extent_upgrade(filesystem, block_bitmap, data_blocks) < 0) exit(EXIT_FAILURE);
+	dir_upgrade();
+	if (dedup_rebuild(filesystem) < 0) exit(EXIT_FAILURE);
+	reclaim_orphan_blocks(filesystem, block_bitmap, data_blocks);
+	if (name_arena_rebuild(filesystem) < 0) exit(EXIT_FAILURE);
+	journal_checkpoint(image_fd, filesystem, block_bitmap, data_blocks);
+	path_index_rebuild(filesystem, geometry.inode_slots);
+	snapshot_recover();
+
+	if (journal_start() != 0) {
+		log_error("Failed to create journal commit thread: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	// Writes of up to max_write bytes per request, 128 KiB by default, instead of a page, and with splice_read
+	// their data stays in a pipe until write_buf copies it into the blocks
+	if (conn != NULL)
+		conn->want |= FUSE_CAP_BIG_WRITES | (conn->capable & FUSE_CAP_SPLICE_READ);
+
 	// Start the periodic save thread
+	running = 1; // Cleared by a previous destroy when the core is mounted again in the same process
     if (pthread_create(&save_thread, NULL, periodic_save, NULL) != 0) {
-        perror("Failed to create save thread");
+        log_error("Failed to create save thread: %m");
         exit(EXIT_FAILURE);
     }
     return NULL;
@@ -462,24 +1489,172 @@ void* dm510fs_init() {
  * Called on filesystem exit.
  */
 void dm510fs_destroy(void *private_data) {
-	printf("filesystem unmounted\n");
+	log_info("filesystem unmounted");
+	pthread_mutex_lock(&save_mutex);
 	running = 0;
+	pthread_cond_signal(&save_wakeup);
+	pthread_mutex_unlock(&save_mutex);
     pthread_join(save_thread, NULL);
-	save_filesystem(PERSISENT_FILENAME, filesystem, MAX_INODES);
+	journal_stop();
+	uint64_t start = stats_clock();
+	stats_record(OP_CHECKPOINT, start, journal_checkpoint(image_fd, filesystem, block_bitmap, data_blocks));
+	cache_close();
+	journal_close();
+	close(image_fd);
+	image_fd = -1;
+	release_tables(filesystem, block_bitmap, data_blocks);
+	log_stop();
 }
 
 void* periodic_save() {
-    while (running) {
-        sleep(save_interval);
-        save_filesystem(PERSISENT_FILENAME, filesystem, MAX_INODES);
-		printf("the filesystem periodic save completed.\n");
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += save_interval;
+        pthread_mutex_lock(&save_mutex);
+        while (running && pthread_cond_timedwait(&save_wakeup, &save_mutex, &deadline) != ETIMEDOUT)
+            ;
+        bool stop = !running;
+        pthread_mutex_unlock(&save_mutex);
+        if (stop)
+            break;
+
+        int written = dm510fs_checkpoint();
+		if (written > 0)
+			log_debug("the filesystem periodic save completed: %d records written.", written);
     }
     return NULL;
 }
 
+// Checkpoint now, as the periodic save does: only dirty records are written, and a clean filesystem skips the
+// cycle entirely. Returns the number of image records written, -1 if error occurred
+int dm510fs_checkpoint(void) {
+    uint64_t start = stats_clock();
+    int written = journal_checkpoint(image_fd, filesystem, block_bitmap, data_blocks);
+    if (written != 0)
+        stats_record(OP_CHECKPOINT, start, written); // Clean cycles are not counted
+    return written;
+}
 
-int main( int argc, char *argv[] ) {
-	fuse_main( argc, argv, &dm510fs_oper );
 
+// Built with -DDM510FS_NO_MAIN the core can be linked into other programs, see bench.c
+#ifndef DM510FS_NO_MAIN
+enum {
+	KEY_LOG_LEVEL,
+	KEY_TIMEOUT,
+	KEY_INLINE_SIZE,
+	KEY_CACHE_SIZE,
+	KEY_COMPRESS,
+	KEY_DEDUP,
+	KEY_HIGHLEVEL
+};
+
+bool use_path_api; // -o highlevel
+
+/*
+ * Geometry options, e.g. -o max_inodes=1000000,max_blocks=4000000
+ * inodes and blocks set the initial table sizes of a new image, the caps bound how far they grow.
+ * Caps of an existing image can be raised but not lowered.
+ * log_level=error|warn|info|debug|trace sets how much is logged, debug logs every operation.
+ * entry_timeout, attr_timeout and negative_timeout set how long the kernel caches names, attributes and misses.
+ * inline_size sets up to how many bytes files keep their data out of blocks, 0 stores every file in blocks.
+ * cache_size sets how many MiB of data blocks are kept in memory.
+ * compress compresses the data of files written from now on, see compress.c.
+ * dedup shares blocks written from now on with equal ones, see dedup.c.
+ * highlevel serves the path-based handlers through fuse_main() instead of the inode-number ones in lowlevel.c.
+ */
+static struct fuse_opt dm510fs_opts[] = {
+	{ "inodes=%u", offsetof(Geometry, inode_slots), 0 },
+	{ "max_inodes=%u", offsetof(Geometry, max_inodes), 0 },
+	{ "blocks=%u", offsetof(Geometry, block_count), 0 },
+	{ "max_blocks=%u", offsetof(Geometry, max_blocks), 0 },
+	{ "block_size=%u", offsetof(Geometry, block_size), 0 },
+	FUSE_OPT_KEY("log_level=%s", KEY_LOG_LEVEL),
+	FUSE_OPT_KEY("entry_timeout=%s", KEY_TIMEOUT),
+	FUSE_OPT_KEY("attr_timeout=%s", KEY_TIMEOUT),
+	FUSE_OPT_KEY("negative_timeout=%s", KEY_TIMEOUT),
+	FUSE_OPT_KEY("inline_size=%s", KEY_INLINE_SIZE),
+	FUSE_OPT_KEY("cache_size=%s", KEY_CACHE_SIZE),
+	FUSE_OPT_KEY("compress", KEY_COMPRESS),
+	FUSE_OPT_KEY("dedup", KEY_DEDUP),
+	FUSE_OPT_KEY("highlevel", KEY_HIGHLEVEL),
+	FUSE_OPT_END
+};
+
+static int dm510fs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+	if (key == KEY_HIGHLEVEL) {
+		use_path_api = true;
+		return 0;
+	}
+	if (key == KEY_COMPRESS) {
+		compress_enabled = true;
+		return 0;
+	}
+	if (key == KEY_DEDUP) {
+		dedup_enabled = true;
+		return 0;
+	}
+	if (key == KEY_TIMEOUT) {
+		char *end;
+		double seconds = strtod(strchr(arg, '=') + 1, &end);
+		if (*end != '\0' || seconds < 0) {
+			printf("Invalid timeout in %s\n", arg);
+			return -1;
+		}
+		*(strncmp(arg, "entry", 5) == 0 ? &entry_timeout : strncmp(arg, "attr", 4) == 0 ? &attr_timeout : &negative_timeout) = seconds;
+		return 0;
+	}
+	if (key == KEY_INLINE_SIZE) {
+		char *end;
+		unsigned long size = strtoul(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0' || size > MAX_INLINE_SIZE) {
+			printf("inline_size must be at most %d\n", MAX_INLINE_SIZE);
+			return -1;
+		}
+		inline_size = size;
+		return 0;
+	}
+	if (key == KEY_CACHE_SIZE) {
+		char *end;
+		unsigned long size = strtoul(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0' || size < MIN_CACHE_SIZE || size > UINT32_MAX) {
+			printf("cache_size must be at least %d MiB\n", MIN_CACHE_SIZE);
+			return -1;
+		}
+		cache_size = size;
+		return 0;
+	}
+	if (key != KEY_LOG_LEVEL)
+		return 1; // Keep everything else for fuse_main()
+
+	int level = log_parse_level(strchr(arg, '=') + 1);
+	if (level < 0) {
+		printf("Unknown log level in %s\n", arg);
+		return -1;
+	}
+	if (level > LOG_COMPILE_LEVEL)
+		printf("Records above level %d are compiled out, rebuild with -DLOG_COMPILE_LEVEL=%d\n", LOG_COMPILE_LEVEL, level);
+	log_level = level;
 	return 0;
 }
+
+int main( int argc, char *argv[] ) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, &geometry, dm510fs_opts, dm510fs_opt_proc) == -1)
+		return 1;
+	uint32_t block_size = geometry.block_size;
+	if (block_size != 0 && (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0)) {
+		printf("block_size must be a power of two between %d and %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+		return 1;
+	}
+
+	int status = 0;
+	if (use_path_api)
+		fuse_main( args.argc, args.argv, &dm510fs_oper, NULL );
+	else
+		status = lowlevel_main(&args);
+	fuse_opt_free_args(&args);
+
+	return status;
+}
+#endif
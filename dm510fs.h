@@ -1,28 +1,269 @@
 #include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <endian.h>
 
 
-#define MAX_DATA_IN_FILE 256
 #define MAX_PATH_LENGTH 256
 #define MAX_NAME_LENGTH 64
-#define MAX_INODES 16
+#define DEFAULT_MAX_INODES 16 // Default cap, raise with -o max_inodes=N
+#define ATIME_REFRESH_SECONDS (24 * 60 * 60) // Reads store the access time at most this often, see inode_accessed()
 #define PERSISENT_FILENAME "filesystem.dat"
+#define ROOT_INDEX 0
 
-#define MAX_DATA_IN_BLOCK 256
-#define MAX_BLOCKS 16
-#define DIRECT_POINTERS 12
+#define DEFAULT_BLOCK_SIZE 4096 // Block size of new images, set with -o block_size=N
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1024 * 1024)
+#define DEFAULT_MAX_BLOCKS 16 // Default cap, raise with -o max_blocks=N
+#define INLINE_EXTENTS 3 // Extents kept in the inode before the map spills to pool blocks
+#define DEFAULT_INLINE_SIZE 512 // Files up to this many bytes keep their data in the name arena, set with -o inline_size=N
+#define MAX_INLINE_SIZE 1024
 
-typedef struct DataBlock{
-    char data[MAX_DATA_IN_BLOCK];
-    bool is_active;
-} DataBlock;
+#define INODE_CHUNK 4096 // Inode slots committed at a time when the table grows
+#define NAME_GRANULE 8 // Names are stored in the name arena in units of this many bytes, see names.c
+#define NAME_CLASSES (MAX_INLINE_SIZE / NAME_GRANULE) // Chunk sizes, in granules, a name or inline file data can take
+#define NAME_PAGE 256 // Bytes of the name arena per dirty bit and journal record
+#define NAME_CHUNK (64 * 1024) // Bytes of the name arena committed at a time
+#define NAME_ARENA_SIZE(inodes) (((size_t)(inodes) * (MAX_NAME_LENGTH + MAX_INLINE_SIZE) / NAME_PAGE + 1) * NAME_PAGE) // Reserved for a cap of inodes
+#define BLOCK_CHUNK 4096 // Data blocks added at a time when the pool grows
+
+#define MIN_PATH_BUCKETS 64 // Power of two, doubled while smaller than the inode table
+#define NEG_CACHE_SIZE 32 // Power of two
+
+#define BITMAP_BYTES(bits) (((size_t)(bits) + 7) / 8)
+#define BITMAP_WORDS(bits) (((size_t)(bits) + 63) / 64) // In memory the bitmap is padded to whole words
+#define BLOCK_NO_HINT UINT32_MAX // Lets allocate_blocks() continue after the previous allocation
+
+// Logging, see log.c
+// Records above LOG_COMPILE_LEVEL are compiled out, records above log_level are skipped at run time
+enum LogLevel {
+    LEVEL_ERROR = 0,
+    LEVEL_WARN = 1,
+    LEVEL_INFO = 2,
+    LEVEL_DEBUG = 3, // One record per operation
+    LEVEL_TRACE = 4
+};
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LEVEL_DEBUG
+#endif
+#define LOG_DEFAULT_LEVEL LEVEL_INFO // Change with -o log_level=NAME
+#define LOG_RING_ENTRIES 256 // Records buffered per thread before new ones are dropped
+#define LOG_MESSAGE_SIZE 496
+#define LOG_FLUSH_INTERVAL_MS 50
+
+#define LOG_AT(level, ...) do { \
+        if((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) \
+            log_write((level), __VA_ARGS__); \
+    } while(0)
+#define log_error(...) LOG_AT(LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG_AT(LEVEL_TRACE, __VA_ARGS__)
+
+typedef struct LogRecord {
+    uint64_t time; // Nanoseconds since the epoch
+    uint32_t level;
+    uint32_t length;
+    char text[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+// Single producer, single consumer ring owned by one thread at a time
+typedef struct LogRing {
+    LogRecord records[LOG_RING_ENTRIES];
+    uint64_t head; // Records published, only advanced by the owning thread
+    uint64_t tail; // Records written out, only advanced by log_drain()
+    uint64_t dropped; // Records lost to a full ring since the last drain
+    bool in_use; // Cleared when the owning thread exits, so the next new thread takes the ring over
+    struct LogRing *next;
+} LogRing;
+
+extern int log_level;
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Operation statistics, see stats.c
+#define STATS_FILENAME ".dm510fs-stats" // Reserved read-only files in the root directory, not listed by readdir
+#define STATS_JSON_FILENAME ".dm510fs-stats.json"
+#define CONTROL_FILENAME ".dm510fs-control" // Reserved write-only file taking the commands of snapshot.c
+// Log-linear latency histograms: values below 2^(STATS_SUB_BITS + 1) nanoseconds are exact,
+// above that every power of two is split into 2^STATS_SUB_BITS buckets (about 6% wide)
+#define STATS_SUB_BITS 4
+#define STATS_MAX_BITS 36 // Longer durations, above about 68 s, land in the last bucket
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+enum StatsOperation {
+    OP_GETATTR,
+    OP_LOOKUP, // Inode-number front end only, see lowlevel.c
+    OP_SETATTR, // Likewise, the path front end times truncate and utime instead
+    OP_READDIR,
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_MKNOD,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_TRUNCATE,
+    OP_UTIME,
+    OP_RELEASE,
+    OP_FLUSH,
+    OP_FSYNC,
+    OP_FALLOCATE,
+    OP_CHECKPOINT, // Image saves by periodic_save() and at unmount
+    OP_JOURNAL_COMMIT, // Journal writes and fdatasync by the commit thread
+    OP_COUNT
+};
+
+// Counters of one thread, only ever written by that thread
+typedef struct ThreadStats {
+    uint64_t count[OP_COUNT];
+    uint64_t errors[OP_COUNT];
+    uint64_t total_ns[OP_COUNT];
+    uint64_t max_ns[OP_COUNT];
+    uint64_t buckets[OP_COUNT][STATS_BUCKETS];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t checkpoint_records;
+    uint64_t compress_clusters; // Clusters given to the codec
+    uint64_t compress_rejected; // Of those, clusters left raw as they did not compress
+    uint64_t compress_in; // Bytes of the clusters stored compressed
+    uint64_t compress_out; // Bytes they took compressed
+    uint64_t compress_ns;
+    uint64_t decompress_bytes;
+    uint64_t decompress_ns;
+    bool in_use; // Cleared when the owning thread exits, the next new thread continues the counters
+    struct ThreadStats *next;
+} ThreadStats;
+
+// Rendering of the statistics taken when a stats file is opened, kept in fi->fh until release
+typedef struct StatsSnapshot {
+    size_t length;
+    char *text;
+} StatsSnapshot;
+
+extern int inode_count;
+
+// On-disk image layout: superblock, data blocks, inode table, cold inode table, name arena and block bitmap,
+// each region starting at a multiple of IMAGE_ALIGNMENT. The data blocks come first so raising a cap never moves them
+#define IMAGE_MAGIC 0x444d3531 // "DM51"
+#define IMAGE_VERSION 9 // Inodes map blocks with extents since version 3, are split in hot and cold records since version 4,
+                        // the data blocks lead the image since version 5, extents may be compressed since version 6
+                        // and blocks may be mapped by several extents since version 7. Maps too large for the inode
+                        // are a tree of map blocks since version 8, see extent_upgrade(). Children are listed in the
+                        // order they were linked, with positions for readdir, since version 9, see dir_upgrade()
+#define IMAGE_MIN_VERSION 5 // Oldest version mounted, upgraded in place when next written
+#define IMAGE_ALIGNMENT 4096
+#define IMAGE_ALIGN(x) (((x) + IMAGE_ALIGNMENT - 1) & ~((uint64_t)IMAGE_ALIGNMENT - 1))
+
+// Write-ahead journal, see journal.c
+#define JOURNAL_FILENAME "filesystem.journal"
+#define JOURNAL_ALTERNATE_FILENAME "filesystem.journal.1" // The two files take turns, see journal_checkpoint()
+#define JOURNAL_MAGIC 0x4a4e4c32 // "JNL2"
+#define JOURNAL_MAGIC_V1 0x4a4e4c31 // "JNL1", checksummed byte by byte, still replayed
+#define JOURNAL_COMMIT_INTERVAL_MS 1000
+#define JOURNAL_BITMAP_CHUNK 8 // Bytes of block bitmap per journal record
+
+enum JournalRecordType {
+    JOURNAL_INODE = 1,
+    JOURNAL_BLOCK = 2,
+    JOURNAL_BITMAP = 3,
+    JOURNAL_NAMES = 4, // A NAME_PAGE of the name arena
+    JOURNAL_ZERO = 5 // A data block cleared to zeros, which needs no payload
+};
+
+// Precedes the records of one transaction, the checksum covers the records and the sequence number
+typedef struct JournalHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint32_t length; // Bytes of records following the header
+    uint32_t record_count;
+} JournalHeader;
+
+// Followed by the after-image of the record: an Inode and its InodeCold, a data block, a bitmap chunk or a name page
+typedef struct JournalRecord {
+    uint32_t type;
+    uint32_t index;
+} JournalRecord;
+
+bool journal_touch(uint32_t type, uint32_t index);
+
+// Data of block index in the pool
+#define BLOCK_DATA(data_blocks, index) ((data_blocks) + (size_t)(index) * geometry.block_size)
+
+// A run of length blocks of a file, starting at block logical of the file and at block start of the pool
+// A compressed extent maps a whole cluster of the file to the fewer blocks holding it compressed, see compress.c.
+// Its length packs both counts: EXTENT_COMPRESSED | stored blocks << 16 | logical blocks
+typedef struct Extent {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t length;
+} Extent;
+
+#define EXTENT_COMPRESSED 0x80000000u
+#define EXTENT_MAX_LENGTH 0x7fffffffu // Longest raw extent
+#define EXTENT_IS_COMPRESSED(extent) (((extent).length & EXTENT_COMPRESSED) != 0)
+#define EXTENT_LENGTH(extent) (EXTENT_IS_COMPRESSED(extent) ? (extent).length & 0xffff : (extent).length) // Logical blocks
+#define EXTENT_STORED(extent) (EXTENT_IS_COMPRESSED(extent) ? ((extent).length >> 16) & 0x7fff : (extent).length) // Pool blocks
+
+typedef struct Superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inode_size; // sizeof(Inode) when the image was written
+    uint32_t inode_slots;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint64_t inode_table_offset;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+    uint32_t max_inodes; // Caps the regions are reserved for, since version 2
+    uint32_t max_blocks;
+    uint64_t cold_table_offset; // Since version 4
+    uint64_t names_offset;
+    uint32_t cold_size; // sizeof(InodeCold) when the image was written
+    uint32_t name_granules; // Granules of the name arena in use
+} Superblock;
+
+// The records a checkpoint writes, taken from the dirty bits while operations are held off, see image_mark()
+typedef struct ImageMark {
+    Superblock layout; // As of the mark, the regions are written the way it describes them
+    uint64_t *inodes; // Dirty bits of the inode records
+    uint64_t *colds;
+    uint64_t *names; // Of the pages of the name arena
+    char *inode_records; // Copies of the records of the set bits as of the mark, in the order of the bits
+    char *cold_records;
+    char *name_records;
+    uint8_t *bitmap; // Copy of the block bitmap, which transactions after the mark may change, NULL if it was clean
+    bool dirty; // image_dirty as of the mark, nothing is written without it
+    bool superblock;
+} ImageMark;
+
+// Sizes of the inode table and block pool
+// Tables are reserved up to the caps and committed in chunks as they fill, so growing never moves existing entries
+typedef struct Geometry {
+    uint32_t inode_slots; // Committed inode slots
+    uint32_t max_inodes; // Creating past this gives -ENOSPC
+    uint32_t block_count; // Committed data blocks
+    uint32_t max_blocks;
+    uint32_t block_size; // Bytes per data block, a power of two fixed when the image is created
+} Geometry;
+
+extern Geometry geometry;
 
 //Thread variables
 extern pthread_t save_thread;
@@ -31,24 +272,259 @@ extern int running;
 
 void* periodic_save();
 
+// An inode is split over two tables indexed by the same slot, and its name lives in the name arena
+// The hot record holds what lookups, getattr and scans of the table read, one cache line per inode
 typedef struct Inode
 {
+    uint32_t mode;
+    uint32_t nlink;
+    int64_t size;
+    int64_t access_time;
+    int64_t modif_time;
+    uint32_t owner;
+    uint32_t group;
+    uint32_t devno; // As FUSE carries it to the kernel
+    uint32_t name_hash; // Hash of parent and name, kept in sync by the path index
+    int32_t hash_next; // Next inode in the same path index bucket, -1 if last
+    int32_t parent; // Slot of the containing directory, -1 for the root
+    uint32_t name; // First granule of the name in the name arena, see INODE_NAME()
+    uint8_t name_length;
     bool is_active;
     bool is_dir;
-    char data[MAX_DATA_IN_FILE];
-    char path[MAX_PATH_LENGTH];
-    char name[MAX_NAME_LENGTH];
-    mode_t mode;
-    nlink_t nlink;
-    off_t size;
-    dev_t devno;
-    time_t access_time;
-    time_t modif_time;
-    uid_t owner;
-    gid_t group;
-    int direct_pointers[DIRECT_POINTERS];
+    bool is_inline; // The data is in the name arena instead of blocks, see inline.c
 } Inode;
 
+_Static_assert(sizeof(Inode) == 64, "hot inode records are one cache line");
+
+// The cold record holds the block map and the child list, read by I/O and directory listings
+typedef struct InodeCold
+{
+    // Block map, sorted by logical block. Up to INLINE_EXTENTS extents live here;
+    // beyond that the map moves to a tree of map blocks, see extent.c
+    uint32_t extent_count; // Extents of the whole map
+    union {
+        Extent extents[INLINE_EXTENTS];
+        uint32_t inline_data; // First granule of the data of an inline file, whose block map is empty
+        struct { // Of a directory, whose block map is empty
+            int32_t last_child; // Tail of the child list, -1 if empty
+            uint32_t next_position; // Given to the next child linked, see dir_link_child()
+        };
+    };
+    uint32_t extent_index; // 1 + pool block of the root of the tree, 0 while the map lives here
+    uint32_t legacy_blocks; // Before version 8, the length of the run holding the map from block extent_index on
+    int32_t first_child; // Head of the child list of a directory, -1 if empty
+    int32_t next_sibling; // Neighbours in the child list of the parent
+    int32_t prev_sibling;
+    uint32_t position; // Rank of this entry among the children of the parent, rising along the child list
+} InodeCold;
+
+_Static_assert(sizeof(InodeCold) == 64, "cold inode records are one cache line");
+
+// Entry of an index block of a map, see extent.c: a block of the level below, whose range of logical blocks
+// starts at logical and ends where that of the next entry starts. count is the number of extents of a map block
+typedef struct ExtentEntry {
+    uint32_t logical;
+    uint32_t block;
+    uint32_t count;
+} ExtentEntry;
+
+typedef struct ExtentIndex {
+    uint32_t count; // Entries
+    uint32_t levels; // Index levels from this one down to the map blocks, 1 if it lists map blocks
+    uint32_t reserved;
+    ExtentEntry entries[];
+} ExtentIndex;
+
+#define EXTENT_MAX_LEVELS 8 // Index levels of a map, more than a file of 2^32 blocks needs
+
+// The blocks from the root of a map down to one of its map blocks, all pinned
+typedef struct ExtentPath {
+    uint32_t depth; // Index levels
+    uint32_t blocks[EXTENT_MAX_LEVELS + 1]; // Of each level, the map block last
+    ExtentIndex *nodes[EXTENT_MAX_LEVELS];
+    uint32_t slots[EXTENT_MAX_LEVELS]; // Entry followed in each index block
+    Extent *extents; // Of the map block
+    uint32_t limit; // End of the range of the map block
+} ExtentPath;
+
+// Walks the extents of a map in logical order, pinning the path to one map block at a time, see extent_walk()
+typedef struct ExtentWalk {
+    const InodeCold *cold;
+    char *data_blocks;
+    ExtentPath path;
+    bool pinned; // path holds the map block walked
+    bool done; // No map block left
+    const Extent *extents;
+    uint32_t position;
+    uint32_t count;
+    int error; // -EIO once a block of the map could not be read
+} ExtentWalk;
+
+void extent_free_all(InodeCold *cold, uint8_t bitmap[], char data_blocks[]);
+
+// Transparent compression, see compress.c
+#define COMPRESS_CLUSTER_BYTES (64 * 1024) // Unit of compression, in blocks of at most half its size
+extern bool compress_enabled;
+uint32_t compress_cluster_blocks(void);
+void compress_forget(void);
+
+// Block deduplication, see dedup.c
+typedef struct DedupStats {
+    uint32_t indexed; // Blocks in the fingerprint index
+    uint32_t shared; // Blocks mapped more than once
+    uint64_t saved; // References beyond the first
+    uint64_t lookups;
+    uint64_t hits; // Lookups that found an equal block
+    size_t index_bytes;
+} DedupStats;
+
+extern bool dedup_enabled;
+bool dedup_tracking(void);
+void dedup_deallocate(uint8_t bitmap[], uint32_t start, uint32_t count);
+bool dedup_shared(uint32_t start, uint32_t count);
+void dedup_collect(DedupStats *total);
+int dedup_share(uint32_t start, uint32_t count);
+
+// Snapshots and clones, see snapshot.c
+#define SNAPSHOT_DIRNAME ".snapshots" // Reserved directory in the root holding the snapshots, read-only
+#define SNAPSHOT_PARTIAL_PREFIX ".partial-" // Names a snapshot while it is built or dropped
+#define SNAPSHOT_BATCH_INODES 256 // Inodes a snapshot copies or drops per transaction
+bool in_snapshot(int index);
+int control_write(const char *buf, size_t size);
+void snapshot_recover(void);
+
+// Name arena, see names.c
+extern char *name_arena;
+extern uint32_t name_granules_used;
+extern uint64_t *name_dirty;
+#define INODE_NAME(inode) (name_arena + (size_t)(inode)->name * NAME_GRANULE)
+#define INLINE_DATA(cold) (name_arena + (size_t)(cold)->inline_data * NAME_GRANULE)
+#define INLINE_GRANULES(size) (((size_t)(size) + NAME_GRANULE - 1) / NAME_GRANULE) // Chunk of an inline file of size bytes
+#define NAME_PAGES(granules) (((size_t)(granules) * NAME_GRANULE + NAME_PAGE - 1) / NAME_PAGE)
+int name_arena_reserve(uint32_t granules);
+void name_arena_release(void);
+int name_arena_commit(uint32_t granules);
+uint32_t name_arena_allocate(uint32_t granules);
+void name_arena_free(uint32_t granule, uint32_t granules);
+uint32_t name_store(const char *name, size_t length);
+void name_release(uint32_t granule, size_t length);
+
+// Inline storage of small files, see inline.c
+extern uint32_t inline_size;
+bool inline_wanted(int index, off_t size);
+int inline_resize(int index, off_t size);
+int inline_write(int index, const char *buf, size_t size, off_t offset);
+void inline_free(int index);
+
+// Buffer cache of the data blocks, see cache.c
+#define DEFAULT_CACHE_SIZE 256 // MiB of data blocks kept in memory, set with -o cache_size=N
+#define MIN_CACHE_SIZE 16
+#define CACHE_SHARDS 64 // Most locks over the units, a power of two
+#define CACHE_SHARD_FRAMES 16 // Fewest frames per shard, small caches of large blocks get fewer shards
+#define CACHE_RUN_BYTES (1024 * 1024) // Most bytes reads and writes pin at once
+#define CACHE_READAHEAD_MIN (128 * 1024) // Window of the first sequential read, doubled with every further one
+#define CACHE_READAHEAD_MAX (4 * 1024 * 1024)
+#define CACHE_PREFETCH_QUEUE 256 // Runs waiting for the prefetch thread, further ones are dropped
+#define CACHE_FREE UINT32_MAX
+
+// A frame of the cache holds one unit, a page-aligned run of blocks the cache loads and evicts as a whole
+// Fields other than unit are guarded by the shard of the unit held
+typedef struct CacheFrame {
+    uint32_t unit; // Unit held, CACHE_FREE if none
+    uint32_t pins; // Users that rely on the unit staying in memory
+    uint64_t sequence; // Last journal transaction that changed the unit, durable before the unit is written back
+    bool referenced; // Second chance of the CLOCK, set by every use
+    bool loading; // Being read from the image, pinners wait for it
+    bool writing; // Being written back to the image, pinners wait for it
+} CacheFrame;
+
+// The units whose number is the shard number modulo the shard count, with frames of their own
+typedef struct CacheShard {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready; // Signalled when a unit of the shard finished loading or writing back, or a frame was unpinned
+    CacheFrame *frames;
+    uint32_t hand; // Next frame the CLOCK looks at
+    uint32_t waiters; // Threads waiting for a frame to be unpinned
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} CacheShard;
+
+// Totals of the shards, for the statistics files
+typedef struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint32_t frames;
+    uint32_t resident; // Frames holding a unit
+    size_t unit_bytes;
+} CacheStats;
+
+extern uint32_t cache_size;
+int cache_open(int fd, char *base, uint64_t data_offset);
+void cache_close(void);
+int cache_pin(uint32_t block, uint32_t count, bool fresh);
+void cache_unpin(uint32_t block, uint32_t count);
+void cache_hold(uint32_t block);
+void cache_release(uint32_t block, uint64_t sequence);
+void cache_prefetch(uint32_t block, uint32_t count);
+int cache_flush(void);
+uint32_t cache_run_blocks(void);
+void cache_collect(CacheStats *total);
+
+// References to an inode slot from the kernel (lowlevel.c) and from open file handles
+typedef struct InodeRef {
+    uint64_t lookups; // Lookups the kernel has not forgotten yet
+    uint32_t opens; // Open file handles, which keep the data of a removed file until the last release
+    uint32_t generation; // Bumped whenever the slot is reused, so inode numbers of removed files go stale
+    bool orphan; // Removed while still referenced, the last forget or release reclaims it, see inode_unref()
+} InodeRef;
+
+// State of an open file, stored in fi->fh from open or create until release
+// Holding a handle keeps the slot from reuse, so I/O through it needs no path or inode number lookup
+typedef struct FileHandle {
+    int index; // Slot of the file
+    uint32_t cursor; // Slot of the last extent used in its map block, where sequential I/O finds the next one
+    uint32_t readahead; // Bytes prefetched ahead of sequential reads, 0 while reads are not sequential
+    off_t next_offset; // Where the next read starts if the file is read sequentially
+    off_t prefetched; // Prefetches were issued up to here
+    struct FileHandle *next_free; // Next handle in the pool while released, see handle_open()
+} FileHandle;
+
+// A read reply made of pieces of the file data itself rather than a copy, see inode_read_vector()
+#define READ_VECTOR_SEGMENTS 64
+typedef struct ReadVector {
+    int count; // Segments filled in
+    struct iovec segments[READ_VECTOR_SEGMENTS];
+    uint32_t blocks[READ_VECTOR_SEGMENTS]; // First block under each segment
+    uint32_t pinned[READ_VECTOR_SEGMENTS]; // Cache pins taken for each segment, 0 for inline data and holes
+} ReadVector;
+
+extern InodeRef *inode_refs;
+extern Inode *filesystem;
+extern InodeCold *inode_cold;
+extern uint8_t *block_bitmap;
+extern char *data_blocks;
+
+// Remembers paths recently looked up and found missing
+// An entry is only valid while its generation matches the path index generation
+typedef struct NegativeEntry {
+    uint32_t hash;
+    uint32_t generation;
+    char path[MAX_PATH_LENGTH];
+} NegativeEntry;
+
+// A component of a path, pointing into the path rather than copied out of it, with its characters hashed
+// once by hash_text() so the lookup under each parent only mixes in the parent, see hash_child()
+// Views of the last component of a path and of whole names end their string, those from path_next() need not
+typedef struct PathName {
+    const char *text;
+    size_t length;
+    uint32_t hash;
+} PathName;
+
 int dm510fs_getattr( const char *, struct stat * );
 int dm510fs_readdir( const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info * );
 int dm510fs_open( const char *, struct fuse_file_info * );
@@ -61,6 +537,35 @@ int dm510fs_rename(const char *path, const char *new_path);
 int dm510fs_rmdir(const char *path);
 int dm510fs_unlink(const char *path);
 int dm510fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info * filp);
+int dm510fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
 int dm510fs_truncate(const char *path, off_t size);
-void* dm510fs_init();
+int dm510fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
+int dm510fs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+int dm510fs_flush(const char *path, struct fuse_file_info *fi);
+int dm510fs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int dm510fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+void* dm510fs_init(struct fuse_conn_info *conn);
 void dm510fs_destroy(void *private_data);
+int dm510fs_checkpoint(void);
+
+void inode_stat(int index, struct stat *stbuf);
+off_t dir_cookie(int child);
+int dir_first_after(int index, off_t offset);
+int create_entry_locked(int parent, const PathName *name, mode_t mode, dev_t devno);
+int add_entry_locked(int parent, const PathName *name, mode_t mode, dev_t devno);
+int remove_entry_locked(int parent, const PathName *name, bool directory);
+int rename_entry_locked(int parent, const PathName *name, int new_parent, const PathName *new_name);
+void inode_set_times(int index, time_t access_time, time_t modif_time);
+int inode_truncate(int index, off_t size);
+int inode_fallocate(int index, int mode, off_t offset, off_t length);
+int inode_write(int index, const char *buf, size_t size, off_t offset, FileHandle *handle);
+int inode_write_buf(int index, struct fuse_bufvec *source, off_t offset, FileHandle *handle);
+int inode_read(int index, char *buf, size_t size, off_t offset, FileHandle *handle);
+int inode_read_vector(int index, size_t size, off_t offset, FileHandle *handle, ReadVector *vector);
+void read_vector_release(ReadVector *vector);
+void inode_unref(int index);
+FileHandle *handle_open(int index);
+void handle_release(FileHandle *handle);
+int handle_lock(const FileHandle *handle, bool exclusive);
+
+extern struct fuse_operations dm510fs_oper; // The handlers behind their TIMED wrappers, as registered with FUSE
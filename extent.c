@@ -0,0 +1,862 @@
+// Extent block maps
+//
+// A file maps its logical blocks to pool blocks with extents sorted by logical block.
+// Small maps live in the cold inode record. Once they outgrow it the extents move to a tree of single pool blocks:
+// map blocks each hold a sorted array of extents, and index blocks list the blocks of the level below in logical
+// order, from the root, which never moves, down. Every index entry has a key, the first logical block of its
+// range, which ends at the key of the next entry: a lookup follows at each level the last entry keyed at or
+// before the block wanted, and finds the extents of a range nowhere else. The first key of an index block is
+// not looked at, the range of the entry listing the index block bounds it instead.
+// A change rewrites the map block it falls in and, when extents come or go, the index block above, so the map
+// never needs a run of free blocks and only the blocks of one path are pinned at a time. A full block splits
+// in two, a full root moves to a new block below itself, and emptied blocks are freed.
+// A run allocated right after the blocks of the previous extent merges into it, so a file written sequentially
+// needs very few extents.
+// Compressed extents, see compress.c, always cover a whole cluster: they never merge, and callers expand
+// them to raw blocks before cutting into them.
+// Before version 8 a map that outgrew the inode moved to one run of pool blocks, doubled whenever it filled.
+// extent_upgrade() moves those to map blocks at mount.
+
+// Extents per map block
+static uint32_t extent_leaf_capacity(void) {
+    return geometry.block_size / sizeof(Extent);
+}
+
+// Entries per index block
+static uint32_t extent_index_capacity(void) {
+    return (geometry.block_size - sizeof(ExtentIndex)) / sizeof(ExtentEntry);
+}
+
+// Entry listing the map block of the path
+static ExtentEntry *extent_listed(const ExtentPath *path) {
+    return &path->nodes[path->depth - 1]->entries[path->slots[path->depth - 1]];
+}
+
+// Returns the entry of the index block whose range holds logical: the last keyed at or before it, else the first
+static uint32_t extent_find_entry(const ExtentIndex *node, uint32_t logical) {
+    int low = 1;
+    int high = (int)node->count - 1;
+    uint32_t found = 0;
+    while(low <= high) {
+        int middle = low + (high - low) / 2;
+        if(node->entries[middle].logical <= logical) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+// Let go of the blocks of the path
+static void extent_release(ExtentPath *path) {
+    if(path->extents != NULL)
+        cache_unpin(path->blocks[path->depth], 1);
+    path->extents = NULL;
+    for(int level = (int)path->depth - 1; level >= 0; level--)
+        if(path->nodes[level] != NULL)
+            cache_unpin(path->blocks[level], 1);
+    path->depth = 0;
+}
+
+// Report a map block of cold that does not fit the tree, see extent_node_fits()
+// Returns -EIO
+static int extent_corrupt(const InodeCold *cold, uint32_t block) {
+    log_error("Block map of inode %u is damaged at map block %u", (uint32_t)(cold - inode_cold), block);
+    return -EIO;
+}
+
+// Whether an index block read from a map fits the tree, levels being one below those of the index block listing
+// it, or 0 for the root, which may have up to EXTENT_MAX_LEVELS
+static bool extent_node_fits(const ExtentIndex *node, uint32_t levels) {
+    return node->count > 0 && node->count <= extent_index_capacity() && node->levels > 0
+        && node->levels <= EXTENT_MAX_LEVELS && (levels == 0 || node->levels == levels);
+}
+
+// Whether an entry of an index block of levels lists a block of the pool, and a map block no fuller than it can be
+static bool extent_entry_fits(const ExtentEntry *entry, uint32_t levels) {
+    return entry->block < geometry.block_count && (levels > 1 || entry->count <= extent_leaf_capacity());
+}
+
+// Pin the path from the root of the map of cold, which is out of the inode, to the map block whose range holds logical
+// The blocks are checked against the pool and the capacities on the way, so a damaged map reads as an error
+// Returns 0, or -EIO if a block could not be read or the map is damaged, nothing stays pinned then
+static int extent_descend(const InodeCold *cold, char data_blocks[], uint32_t logical, ExtentPath *path) {
+    path->depth = 0;
+    path->extents = NULL;
+    path->limit = UINT32_MAX;
+    uint32_t block = cold->extent_index - 1;
+    if(block >= geometry.block_count)
+        return extent_corrupt(cold, block);
+    uint32_t levels = 0;
+    for(;;) {
+        if(cache_pin(block, 1, false) < 0) {
+            extent_release(path);
+            return -EIO;
+        }
+        ExtentIndex *node = (ExtentIndex *)BLOCK_DATA(data_blocks, block);
+        path->blocks[path->depth] = block;
+        path->nodes[path->depth] = node;
+        path->depth++;
+        if(!extent_node_fits(node, levels)) {
+            extent_release(path);
+            return extent_corrupt(cold, block);
+        }
+        uint32_t slot = extent_find_entry(node, logical);
+        path->slots[path->depth - 1] = slot;
+        if(slot + 1 < node->count && node->entries[slot + 1].logical < path->limit)
+            path->limit = node->entries[slot + 1].logical;
+        if(!extent_entry_fits(&node->entries[slot], node->levels)) {
+            extent_release(path);
+            return extent_corrupt(cold, block);
+        }
+        block = node->entries[slot].block;
+        levels = node->levels - 1;
+        if(levels == 0)
+            break;
+    }
+    if(cache_pin(block, 1, false) < 0) {
+        extent_release(path);
+        return -EIO;
+    }
+    path->blocks[path->depth] = block;
+    path->extents = (Extent *)BLOCK_DATA(data_blocks, block);
+    return 0;
+}
+
+// Returns the position of the last extent starting at or before logical, -1 if there is none
+int extent_search(const Extent extents[], uint32_t count, uint32_t logical) {
+    int low = 0;
+    int high = (int)count - 1;
+    int found = -1;
+    while(low <= high) {
+        int middle = low + (high - low) / 2;
+        if(extents[middle].logical <= logical) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+// Whether position is what extent_search() would return for logical
+static bool extent_is_last_before(const Extent extents[], uint32_t count, uint32_t position, uint32_t logical) {
+    return position < count && extents[position].logical <= logical
+        && (position + 1 == count || extents[position + 1].logical > logical);
+}
+
+// Returns the pool block holding logical block of the file, -1 if it is a hole, or -EIO if the map could not be read
+// run is set to the number of blocks from logical on that are mapped contiguously, or that are unmapped;
+// a hole spanning the ranges of several map blocks is reported a range at a time
+// cursor, if not NULL, is the slot found by the previous call: the search in the map block is skipped when
+// logical falls in that extent or the next one, as it does for sequential I/O. Readers sharing a handle race on
+// it harmlessly, a stale cursor only costs the search.
+// found, if not NULL, is set to the extent holding logical. A compressed extent has no block per logical block:
+// the first block of its cluster is returned then, and callers that may meet one must check found
+int64_t extent_map(InodeCold *cold, char data_blocks[], uint32_t logical, uint32_t *run, uint32_t *cursor, Extent *found) {
+    ExtentPath path = { 0 };
+    const Extent *extents = cold->extents;
+    uint32_t count = cold->extent_count;
+    uint32_t limit = UINT32_MAX;
+    if(cold->extent_index != 0) {
+        if(extent_descend(cold, data_blocks, logical, &path) < 0)
+            return -EIO;
+        extents = path.extents;
+        count = extent_listed(&path)->count;
+        limit = path.limit;
+    }
+
+    int position;
+    uint32_t hint = cursor != NULL ? __atomic_load_n(cursor, __ATOMIC_RELAXED) : UINT32_MAX;
+    if(extent_is_last_before(extents, count, hint, logical))
+        position = hint;
+    else if(hint != UINT32_MAX && extent_is_last_before(extents, count, hint + 1, logical))
+        position = hint + 1;
+    else
+        position = extent_search(extents, count, logical);
+    if(cursor != NULL && position >= 0)
+        __atomic_store_n(cursor, (uint32_t)position, __ATOMIC_RELAXED);
+    int64_t block = -1;
+    if(position >= 0 && logical - extents[position].logical < EXTENT_LENGTH(extents[position])) {
+        uint32_t skipped = logical - extents[position].logical;
+        *run = EXTENT_LENGTH(extents[position]) - skipped;
+        block = extents[position].start + (EXTENT_IS_COMPRESSED(extents[position]) ? 0 : (int64_t)skipped);
+        if(found != NULL)
+            *found = extents[position];
+    } else {
+        uint32_t next = position + 1;
+        *run = (next < count ? extents[next].logical : limit) - logical;
+    }
+    extent_release(&path);
+    return block;
+}
+
+// Start walking the extents of the map of cold, see extent_next()
+void extent_walk(ExtentWalk *walk, const InodeCold *cold, char data_blocks[]) {
+    *walk = (ExtentWalk){ .cold = cold, .data_blocks = data_blocks };
+    if(cold->extent_index == 0) {
+        walk->extents = cold->extents;
+        walk->count = cold->extent_count;
+        walk->done = true;
+    }
+}
+
+// Returns the next extent of the walk, NULL after the last one or once a block could not be read, see error
+const Extent *extent_next(ExtentWalk *walk) {
+    while(walk->position == walk->count) {
+        uint32_t from = 0;
+        if(walk->pinned) {
+            walk->pinned = false;
+            extent_release(&walk->path);
+            walk->done = walk->path.limit == UINT32_MAX;
+            from = walk->path.limit;
+        }
+        if(walk->done)
+            return NULL;
+        walk->error = extent_descend(walk->cold, walk->data_blocks, from, &walk->path);
+        if(walk->error < 0) {
+            walk->done = true;
+            return NULL;
+        }
+        walk->pinned = true;
+        walk->extents = walk->path.extents;
+        walk->position = 0;
+        walk->count = extent_listed(&walk->path)->count;
+    }
+    return &walk->extents[walk->position++];
+}
+
+// Let go of the blocks the walk pinned
+void extent_walk_end(ExtentWalk *walk) {
+    if(walk->pinned)
+        extent_release(&walk->path);
+    walk->pinned = false;
+}
+
+// Allocate a block for the map near hint, pinned and cleared
+// Returns the block, -ENOSPC if none was left or -EIO if it could not be pinned
+static int extent_new_block(uint8_t bitmap[], char data_blocks[], uint32_t hint) {
+    uint32_t got;
+    int block = allocate_blocks(bitmap, data_blocks, hint, 1, 1, &got);
+    if(block < 0)
+        return -ENOSPC;
+    if(cache_pin(block, 1, true) < 0) {
+        deallocate_blocks(bitmap, block, 1);
+        return -EIO;
+    }
+    memset(BLOCK_DATA(data_blocks, block), 0, geometry.block_size);
+    return block;
+}
+
+// Move the map out of the inode to a map block under a new root
+// Returns -ENOSPC if no blocks were left for them, -EIO if they could not be pinned
+static int extent_spill(InodeCold *cold, uint8_t bitmap[], char data_blocks[]) {
+    int root = extent_new_block(bitmap, data_blocks, BLOCK_NO_HINT);
+    if(root < 0)
+        return root;
+    int leaf = extent_new_block(bitmap, data_blocks, root + 1);
+    if(leaf < 0) {
+        cache_unpin(root, 1);
+        deallocate_blocks(bitmap, root, 1);
+        return leaf;
+    }
+    ExtentIndex *index = (ExtentIndex *)BLOCK_DATA(data_blocks, root);
+    index->count = 1;
+    index->levels = 1;
+    index->entries[0] = (ExtentEntry){ 0, leaf, cold->extent_count };
+    memcpy(BLOCK_DATA(data_blocks, leaf), cold->extents, cold->extent_count * sizeof(Extent));
+    mark_block_dirty(root);
+    mark_block_dirty(leaf);
+    cache_unpin(root, 1);
+    cache_unpin(leaf, 1);
+    memset(cold->extents, 0, sizeof(cold->extents));
+    cold->extent_index = root + 1;
+    return 0;
+}
+
+// Split the map block of the path, the extents from position at on, 0 <= at <= count, moving to a new map block
+// keyed key: the logical of the first extent moved, or if none is, at or past the end of the extents kept.
+// An index block full of entries cannot take the new one: the lowest full index block of the path splits
+// instead, and if they all are full the root moves to a new block below itself. Callers descend again and
+// retry until the map block splits. The path is stale afterwards in any case
+// Returns -ENOSPC if no block was left or the map has as many levels as it may, -EIO
+static int extent_split(ExtentPath *path, uint32_t at, uint32_t key, uint8_t bitmap[], char data_blocks[]) {
+    uint32_t capacity = extent_index_capacity();
+    int level = (int)path->depth - 1;
+    while(level >= 0 && path->nodes[level]->count == capacity)
+        level--;
+    if(level < 0) {
+        ExtentIndex *root = path->nodes[0];
+        if(root->levels == EXTENT_MAX_LEVELS)
+            return -ENOSPC;
+        int block = extent_new_block(bitmap, data_blocks, path->blocks[0] + 1);
+        if(block < 0)
+            return block;
+        memcpy(BLOCK_DATA(data_blocks, block), root, geometry.block_size);
+        root->count = 1;
+        root->levels++;
+        root->entries[0] = (ExtentEntry){ 0, block, 0 };
+        mark_block_dirty(block);
+        cache_unpin(block, 1);
+        mark_block_dirty(path->blocks[0]);
+        return 0;
+    }
+
+    ExtentIndex *parent = path->nodes[level];
+    uint32_t slot = path->slots[level];
+    uint32_t below = path->blocks[level + 1];
+    int block = extent_new_block(bitmap, data_blocks, below + 1);
+    if(block < 0)
+        return block;
+    ExtentEntry entry = { key, block, 0 };
+    if(level + 1 == (int)path->depth) {
+        ExtentEntry *listed = &parent->entries[slot];
+        entry.count = listed->count - at;
+        memcpy(BLOCK_DATA(data_blocks, block), &path->extents[at], entry.count * sizeof(Extent));
+        listed->count = at; // The extents kept stay where they are, the map block needs no rewrite
+    } else {
+        // An index block appended to at its end moves only its last entry, so appends fill index blocks in turn
+        ExtentIndex *node = path->nodes[level + 1];
+        ExtentIndex *sibling = (ExtentIndex *)BLOCK_DATA(data_blocks, block);
+        uint32_t half = path->slots[level + 1] + 1 == node->count ? node->count - 1 : node->count / 2;
+        sibling->count = node->count - half;
+        sibling->levels = node->levels;
+        memcpy(sibling->entries, &node->entries[half], sibling->count * sizeof(ExtentEntry));
+        node->count = half;
+        entry.logical = node->entries[half].logical;
+        mark_block_dirty(below);
+    }
+    memmove(&parent->entries[slot + 2], &parent->entries[slot + 1], (parent->count - slot - 1) * sizeof(ExtentEntry));
+    parent->entries[slot + 1] = entry;
+    parent->count++;
+    mark_block_dirty(block);
+    cache_unpin(block, 1);
+    mark_block_dirty(path->blocks[level]);
+    return 0;
+}
+
+// Free the map block of the path and take it out of its index block, and so on up for index blocks left empty
+// but the root. The path is stale afterwards
+// Blocks freed here are left as they were: one changed and not held could reach the image before the transaction
+// is durable, written back along with a dirty neighbour in the cache, see cache_writeback()
+static void extent_drop(ExtentPath *path, uint8_t bitmap[]) {
+    cache_unpin(path->blocks[path->depth], 1);
+    path->extents = NULL;
+    deallocate_blocks(bitmap, path->blocks[path->depth], 1);
+    for(int level = (int)path->depth - 1; level >= 0; level--) {
+        ExtentIndex *node = path->nodes[level];
+        uint32_t slot = path->slots[level];
+        if(node->count > 1 || level == 0) {
+            memmove(&node->entries[slot], &node->entries[slot + 1], (node->count - slot - 1) * sizeof(ExtentEntry));
+            node->count--;
+            mark_block_dirty(path->blocks[level]);
+            break;
+        }
+        cache_unpin(path->blocks[level], 1);
+        path->nodes[level] = NULL;
+        deallocate_blocks(bitmap, path->blocks[level], 1);
+    }
+}
+
+// Whether the raw extent next can be appended to the raw extent previous
+static bool extent_continues(const Extent *previous, const Extent *next) {
+    return !EXTENT_IS_COMPRESSED(*previous) && !EXTENT_IS_COMPRESSED(*next)
+        && previous->logical + previous->length == next->logical && previous->start + previous->length == next->start
+        && previous->length <= EXTENT_MAX_LENGTH - next->length;
+}
+
+// Insert extent into the sorted array of count extents, merging with its neighbours where possible
+// Returns the new count, or -1 if the extent needed a slot of its own and all capacity were used
+static int extent_array_insert(Extent extents[], uint32_t count, uint32_t capacity, Extent extent) {
+    uint32_t position = extent_search(extents, count, extent.logical) + 1;
+    if(position > 0 && extent_continues(&extents[position - 1], &extent)) {
+        Extent *previous = &extents[position - 1];
+        previous->length += extent.length;
+        if(position < count && extent_continues(previous, &extents[position])) {
+            // The extent filled the gap between its neighbours
+            previous->length += extents[position].length;
+            memmove(&extents[position], &extents[position + 1], (count - position - 1) * sizeof(Extent));
+            return count - 1;
+        }
+        return count;
+    }
+    if(position < count && extent_continues(&extent, &extents[position])) {
+        extents[position].logical = extent.logical;
+        extents[position].start = extent.start;
+        extents[position].length += extent.length;
+        return count;
+    }
+    if(count == capacity)
+        return -1;
+    memmove(&extents[position + 1], &extents[position], (count - position) * sizeof(Extent));
+    extents[position] = extent;
+    return count + 1;
+}
+
+// Keep the ranges after the map block of the path clear of [.., end), end that of an extent just put there:
+// those ranges hold no extent up to end, so their keys move up to it, and map blocks listed next to the path's
+// with nothing left in their range go
+static void extent_raise(ExtentPath *path, uint32_t end, uint8_t bitmap[]) {
+    for(int level = (int)path->depth - 1; level >= 0; level--) {
+        ExtentIndex *node = path->nodes[level];
+        uint32_t next = path->slots[level] + 1;
+        bool changed = false;
+        while(next < node->count && node->entries[next].logical < end) {
+            if(level + 1 == (int)path->depth && node->entries[next].count == 0) {
+                deallocate_blocks(bitmap, node->entries[next].block, 1);
+                memmove(&node->entries[next], &node->entries[next + 1], (node->count - next - 1) * sizeof(ExtentEntry));
+                node->count--;
+            } else {
+                node->entries[next++].logical = end;
+            }
+            changed = true;
+        }
+        if(changed)
+            mark_block_dirty(path->blocks[level]);
+        if(next < node->count)
+            break; // Ranges further on start past this one
+    }
+}
+
+// Map the blocks of extent, which must all be holes of the inode at index, merging with its neighbours where possible
+// Returns -ENOSPC if the map had to grow and no blocks were left for it, -EIO if the map could not be read
+int extent_insert(int index, uint8_t bitmap[], char data_blocks[], Extent extent) {
+    InodeCold *cold = &inode_cold[index];
+    if(cold->extent_index == 0) {
+        int count = extent_array_insert(cold->extents, cold->extent_count, INLINE_EXTENTS, extent);
+        if(count >= 0) {
+            cold->extent_count = count;
+            mark_inode_dirty(index);
+            return 0;
+        }
+        int result = extent_spill(cold, bitmap, data_blocks);
+        if(result < 0)
+            return result;
+        mark_inode_dirty(index);
+    }
+
+    uint32_t capacity = extent_leaf_capacity();
+    for(;;) {
+        ExtentPath path;
+        int result = extent_descend(cold, data_blocks, extent.logical, &path);
+        if(result < 0)
+            return result;
+        ExtentEntry *listed = extent_listed(&path);
+        int count = extent_array_insert(path.extents, listed->count, capacity, extent);
+        if(count >= 0) {
+            cold->extent_count += count - (int)listed->count;
+            mark_block_dirty(path.blocks[path.depth]);
+            if((uint32_t)count != listed->count) {
+                listed->count = count;
+                mark_block_dirty(path.blocks[path.depth - 1]);
+            }
+            extent_raise(&path, extent.logical + EXTENT_LENGTH(extent), bitmap);
+            extent_release(&path);
+            mark_inode_dirty(index);
+            return 0;
+        }
+
+        // A full map block splits in halves, or past its last extent for appends, which fill map blocks in turn
+        bool append = extent_search(path.extents, capacity, extent.logical) + 1 == (int)capacity;
+        uint32_t at = append ? capacity : capacity / 2;
+        uint32_t key = append ? extent.logical : path.extents[at].logical;
+        result = extent_split(&path, at, key, bitmap, data_blocks);
+        extent_release(&path);
+        if(result < 0)
+            return result;
+    }
+}
+
+// Make room for extra more extents in the range of the map block holding logical in the map of the inode at index,
+// so removing and inserting extents there cannot fail. extra is less than a map block holds
+// Returns -ENOSPC if the map had to grow and no blocks were left for it, -EIO if the map could not be read
+int extent_reserve(int index, uint8_t bitmap[], char data_blocks[], uint32_t logical, uint32_t extra) {
+    InodeCold *cold = &inode_cold[index];
+    if(cold->extent_index == 0) {
+        if(cold->extent_count + extra <= INLINE_EXTENTS)
+            return 0;
+        int result = extent_spill(cold, bitmap, data_blocks);
+        if(result < 0)
+            return result;
+        mark_inode_dirty(index);
+    }
+    uint32_t capacity = extent_leaf_capacity();
+    if(extra >= capacity)
+        return -ENOSPC;
+
+    for(;;) {
+        ExtentPath path;
+        int result = extent_descend(cold, data_blocks, logical, &path);
+        if(result < 0)
+            return result;
+        uint32_t count = extent_listed(&path)->count;
+        if(count + extra <= capacity) {
+            extent_release(&path);
+            return 0;
+        }
+        // Split off the extents after logical, then those before the one holding it, which leaves that one alone
+        uint32_t position = extent_search(path.extents, count, logical) + 1;
+        uint32_t at = position < count ? position : position - 1;
+        result = extent_split(&path, at, path.extents[at].logical, bitmap, data_blocks);
+        extent_release(&path);
+        if(result < 0)
+            return result;
+    }
+}
+
+// Unmap logical blocks [from, to) from the sorted array of count extents and free the data blocks they held
+// changed is set if any extent was cut
+// Returns the new count, or -1 if an extent had to be split and all capacity were used, the array is unchanged then
+static int extent_array_remove(Extent extents[], uint32_t count, uint32_t capacity, uint32_t from, uint32_t to,
+        uint8_t bitmap[], bool *changed) {
+    int position = extent_search(extents, count, from);
+    *changed = false;
+    if(position >= 0 && extents[position].logical < from && extents[position].logical + EXTENT_LENGTH(extents[position]) > to) {
+        // A hole in the middle of an extent leaves its two ends
+        if(count == capacity)
+            return -1;
+        Extent *head = &extents[position];
+        Extent tail = { to, head->start + (to - head->logical), head->logical + head->length - to };
+        deallocate_blocks(bitmap, head->start + (from - head->logical), to - from);
+        head->length = from - head->logical;
+        memmove(&extents[position + 2], &extents[position + 1], (count - position - 1) * sizeof(Extent));
+        extents[position + 1] = tail;
+        *changed = true;
+        return count + 1;
+    }
+
+    uint32_t next = position < 0 ? 0 : position;
+    if(position >= 0 && extents[position].logical < from) {
+        // Keep the head of the extent the range starts in
+        Extent *head = &extents[position];
+        uint32_t end = head->logical + EXTENT_LENGTH(*head);
+        if(end > from) {
+            deallocate_blocks(bitmap, head->start + (from - head->logical), end - from);
+            head->length = from - head->logical;
+            *changed = true;
+        }
+        next = position + 1;
+    }
+    uint32_t kept = next;
+    while(next < count && extents[next].logical < to) {
+        Extent *extent = &extents[next];
+        *changed = true;
+        if(extent->logical + EXTENT_LENGTH(*extent) <= to) {
+            deallocate_blocks(bitmap, extent->start, EXTENT_STORED(*extent));
+            if(EXTENT_IS_COMPRESSED(*extent))
+                compress_forget();
+            next++;
+        } else {
+            // Keep the tail of the extent the range ends in
+            uint32_t cut = to - extent->logical;
+            deallocate_blocks(bitmap, extent->start, cut);
+            extent->logical = to;
+            extent->start += cut;
+            extent->length -= cut;
+            break;
+        }
+    }
+    memmove(&extents[kept], &extents[next], (count - next) * sizeof(Extent));
+    return count - (next - kept);
+}
+
+// Unmap logical blocks [from, to) of the inode at index and free the data blocks they held
+// A compressed extent must lie wholly inside or outside the range, see compress_split()
+// Returns -ENOSPC if an extent had to be split and the map could not grow, -EIO if the map could not be read
+int extent_remove(int index, uint8_t bitmap[], char data_blocks[], uint32_t from, uint32_t to) {
+    InodeCold *cold = &inode_cold[index];
+    if(from >= to || cold->extent_count == 0)
+        return 0;
+    bool changed;
+    if(cold->extent_index == 0) {
+        int count = extent_array_remove(cold->extents, cold->extent_count, INLINE_EXTENTS, from, to, bitmap, &changed);
+        if(count >= 0) {
+            cold->extent_count = count;
+            if(changed)
+                mark_inode_dirty(index);
+            return 0;
+        }
+        int result = extent_spill(cold, bitmap, data_blocks);
+        if(result < 0)
+            return result;
+        mark_inode_dirty(index);
+    }
+
+    // The map blocks are visited a range at a time. Only the one holding from can have an extent starting
+    // before the range, the others only lose extents and go once empty. That one stays for extent_reserve()
+    uint32_t capacity = extent_leaf_capacity();
+    uint32_t first = UINT32_MAX;
+    for(uint32_t logical = from; ; ) {
+        ExtentPath path;
+        int result = extent_descend(cold, data_blocks, logical, &path);
+        if(result < 0)
+            return result;
+        ExtentEntry *listed = extent_listed(&path);
+        if(logical == from)
+            first = listed->block;
+        uint32_t listed_count = listed->count;
+        if(listed->block != first && (listed_count == 0 || (path.extents[0].logical >= from &&
+                path.extents[listed_count - 1].logical + EXTENT_LENGTH(path.extents[listed_count - 1]) <= to))) {
+            // Wholly inside the range, so freed without being written, and removing a long range holds few blocks
+            // in the transaction
+            for(uint32_t e = 0; e < listed_count; e++) {
+                deallocate_blocks(bitmap, path.extents[e].start, EXTENT_STORED(path.extents[e]));
+                if(EXTENT_IS_COMPRESSED(path.extents[e]))
+                    compress_forget();
+            }
+            cold->extent_count -= listed_count;
+            mark_inode_dirty(index);
+            logical = path.limit;
+            extent_drop(&path, bitmap);
+            extent_release(&path);
+            if(logical >= to)
+                return 0;
+            continue;
+        }
+        int count = extent_array_remove(path.extents, listed->count, capacity, from, to, bitmap, &changed);
+        if(count < 0) {
+            result = extent_split(&path, capacity / 2, path.extents[capacity / 2].logical, bitmap, data_blocks);
+            extent_release(&path);
+            if(result < 0)
+                return result;
+            continue;
+        }
+        if(changed)
+            mark_inode_dirty(index);
+        cold->extent_count += count - (int)listed->count;
+        bool recounted = (uint32_t)count != listed->count;
+        listed->count = count;
+        if(changed)
+            mark_block_dirty(path.blocks[path.depth]);
+        if(recounted)
+            mark_block_dirty(path.blocks[path.depth - 1]);
+        logical = path.limit;
+        extent_release(&path);
+        if(logical >= to)
+            return 0;
+    }
+}
+
+// Map extent in place of whatever mapped its logical blocks before, freeing those blocks
+// Returns -ENOSPC if the map had to grow and no blocks were left for it, the file is unchanged then,
+// or -EIO if the map could not be read
+int extent_replace(int index, uint8_t bitmap[], char data_blocks[], Extent extent) {
+    // Removing may split an extent and inserting adds one, room for both keeps either from failing halfway
+    int result = extent_reserve(index, bitmap, data_blocks, extent.logical, 2);
+    if(result == 0)
+        result = extent_remove(index, bitmap, data_blocks, extent.logical, extent.logical + EXTENT_LENGTH(extent));
+    if(result == 0)
+        result = extent_insert(index, bitmap, data_blocks, extent);
+    return result;
+}
+
+// Free the index block of the map of cold and every block of the map below it, levels as for extent_node_fits()
+// An index block that cannot be read or is damaged leaks the blocks below, they are found again by no file
+static void extent_free_node(const InodeCold *cold, uint32_t block, uint32_t levels, uint8_t bitmap[], char data_blocks[]) {
+    if(block >= geometry.block_count) {
+        extent_corrupt(cold, block);
+        return;
+    }
+    if(cache_pin(block, 1, false) == 0) {
+        const ExtentIndex *node = (const ExtentIndex *)BLOCK_DATA(data_blocks, block);
+        bool fits = extent_node_fits(node, levels);
+        if(!fits)
+            extent_corrupt(cold, block);
+        for(uint32_t i = 0; fits && i < node->count; i++) {
+            if(node->levels > 1)
+                extent_free_node(cold, node->entries[i].block, node->levels - 1, bitmap, data_blocks);
+            else if(node->entries[i].block < geometry.block_count)
+                deallocate_blocks(bitmap, node->entries[i].block, 1);
+        }
+        cache_unpin(block, 1);
+    }
+    deallocate_blocks(bitmap, block, 1);
+}
+
+// Move a map held in map blocks back into the inode once it fits there again
+void extent_shrink(InodeCold *cold, uint8_t bitmap[], char data_blocks[]) {
+    if(cold->extent_index == 0 || cold->extent_count > INLINE_EXTENTS)
+        return;
+    Extent inline_extents[INLINE_EXTENTS];
+    uint32_t count = 0;
+    ExtentWalk walk;
+    extent_walk(&walk, cold, data_blocks);
+    for(const Extent *extent; count < INLINE_EXTENTS && (extent = extent_next(&walk)) != NULL; )
+        inline_extents[count++] = *extent;
+    int error = walk.error;
+    extent_walk_end(&walk);
+    if(error < 0)
+        return;
+    extent_free_node(cold, cold->extent_index - 1, 0, bitmap, data_blocks);
+    cold->extent_index = 0;
+    memcpy(cold->extents, inline_extents, count * sizeof(Extent));
+}
+
+// Free every data block and map block of the inode
+// A map that cannot be read leaks its data blocks, they are found again by no file
+void extent_free_all(InodeCold *cold, uint8_t bitmap[], char data_blocks[]) {
+    ExtentWalk walk;
+    extent_walk(&walk, cold, data_blocks);
+    for(const Extent *extent; (extent = extent_next(&walk)) != NULL; ) {
+        deallocate_blocks(bitmap, extent->start, EXTENT_STORED(*extent));
+        if(EXTENT_IS_COMPRESSED(*extent))
+            compress_forget();
+    }
+    extent_walk_end(&walk);
+    if(cold->extent_index != 0)
+        extent_free_node(cold, cold->extent_index - 1, 0, bitmap, data_blocks);
+    cold->extent_index = 0;
+    cold->extent_count = 0;
+}
+
+// Copy the index block of the map of cold and every block of the map below it to new blocks, see extent_copy()
+// levels as for extent_node_fits()
+// Returns the copy of the index block, -ENOSPC or -EIO, nothing of the copy is left then
+static int extent_copy_node(const InodeCold *cold, uint32_t block, uint32_t levels, uint8_t bitmap[], char data_blocks[]) {
+    if(block >= geometry.block_count)
+        return extent_corrupt(cold, block);
+    if(cache_pin(block, 1, false) < 0)
+        return -EIO;
+    const ExtentIndex *node = (const ExtentIndex *)BLOCK_DATA(data_blocks, block);
+    if(!extent_node_fits(node, levels)) {
+        cache_unpin(block, 1);
+        return extent_corrupt(cold, block);
+    }
+    int copy = extent_new_block(bitmap, data_blocks, BLOCK_NO_HINT);
+    if(copy < 0) {
+        cache_unpin(block, 1);
+        return copy;
+    }
+    ExtentIndex *to = (ExtentIndex *)BLOCK_DATA(data_blocks, copy);
+    to->levels = node->levels;
+    int result = 0;
+    for(; result == 0 && to->count < node->count; to->count++) {
+        const ExtentEntry *entry = &node->entries[to->count];
+        int child;
+        if(node->levels > 1) {
+            child = extent_copy_node(cold, entry->block, node->levels - 1, bitmap, data_blocks);
+        } else if(!extent_entry_fits(entry, 1)) {
+            child = extent_corrupt(cold, block);
+        } else if(cache_pin(entry->block, 1, false) < 0) {
+            child = -EIO;
+        } else {
+            child = extent_new_block(bitmap, data_blocks, BLOCK_NO_HINT);
+            if(child >= 0) {
+                memcpy(BLOCK_DATA(data_blocks, child), BLOCK_DATA(data_blocks, entry->block), entry->count * sizeof(Extent));
+                mark_block_dirty(child);
+                cache_unpin(child, 1);
+            }
+            cache_unpin(entry->block, 1);
+        }
+        if(child < 0) {
+            result = child;
+            break;
+        }
+        to->entries[to->count] = (ExtentEntry){ entry->logical, child, entry->count };
+    }
+    if(result < 0) {
+        for(uint32_t i = 0; i < to->count; i++) {
+            if(to->levels > 1)
+                extent_free_node(cold, to->entries[i].block, to->levels - 1, bitmap, data_blocks);
+            else
+                deallocate_blocks(bitmap, to->entries[i].block, 1);
+        }
+    } else {
+        mark_block_dirty(copy);
+    }
+    cache_unpin(copy, 1);
+    cache_unpin(block, 1);
+    if(result < 0) {
+        deallocate_blocks(bitmap, copy, 1);
+        return result;
+    }
+    return copy;
+}
+
+// Give target, whose map is empty, a map of its own holding the extents of the map of cold
+// The data blocks are not shared here, see dedup_share()
+// Returns -ENOSPC if no blocks were left for the copy, -EIO if the map could not be read
+int extent_copy(const InodeCold *cold, InodeCold *target, uint8_t bitmap[], char data_blocks[]) {
+    if(cold->extent_index == 0) {
+        memcpy(target->extents, cold->extents, sizeof(target->extents));
+    } else {
+        int root = extent_copy_node(cold, cold->extent_index - 1, 0, bitmap, data_blocks);
+        if(root < 0)
+            return root;
+        target->extent_index = root + 1;
+    }
+    target->extent_count = cold->extent_count;
+    return 0;
+}
+
+// Move the maps that images before version 8 keep in a run of pool blocks to map blocks, at mount before
+// anything reads them. Each map moves in a transaction of its own, so a crash leaves it in either form
+// Returns -1 if a map could not be read or moved
+int extent_upgrade(Inode fs[], uint8_t bitmap[], char data_blocks[]) {
+    size_t block_size = geometry.block_size;
+    uint32_t capacity = extent_leaf_capacity();
+    uint32_t moved = 0;
+    for(uint32_t i = 0; i < geometry.inode_slots; i++) {
+        InodeCold *cold = &inode_cold[i];
+        if(cold->legacy_blocks == 0)
+            continue;
+        uint32_t start = cold->extent_index;
+        uint32_t blocks = cold->legacy_blocks;
+        uint32_t count = cold->extent_count;
+        if(start >= geometry.block_count || blocks > geometry.block_count - start
+                || (uint64_t)count * sizeof(Extent) > (uint64_t)blocks * block_size) {
+            log_error("Block map of inode %u lies outside the pool", i);
+            return -1;
+        }
+        // A failed move could not be undone: the blocks of the new map must fit in the pool once the run is free.
+        // Appends fill map blocks and index blocks but for one entry
+        uint32_t level = (count + capacity - 1) / capacity;
+        uint32_t needed = 1 + level; // The root and the map blocks
+        for(uint32_t fanout = extent_index_capacity() - 1; level > fanout + 1; needed += level)
+            level = (level + fanout - 1) / fanout;
+        if(needed > geometry.max_blocks - blocks_used + blocks) {
+            log_error("No room left to move the block map of inode %u to map blocks", i);
+            return -1;
+        }
+        Extent *extents = malloc((size_t)blocks * block_size);
+        if(extents == NULL) {
+            log_error("No memory left to move the block map of inode %u", i);
+            return -1;
+        }
+        int result = 0;
+        for(uint32_t b = 0; result == 0 && b < blocks; b++) {
+            if(cache_pin(start + b, 1, false) < 0) {
+                result = -EIO;
+                break;
+            }
+            memcpy((char *)extents + b * block_size, BLOCK_DATA(data_blocks, start + b), block_size);
+            cache_unpin(start + b, 1);
+        }
+
+        journal_begin();
+        if(result == 0) {
+            // The run goes first, the map blocks may take its place
+            deallocate_blocks(bitmap, start, blocks);
+            cold->extent_index = 0;
+            cold->legacy_blocks = 0;
+            cold->extent_count = 0;
+            memset(cold->extents, 0, sizeof(cold->extents));
+            mark_inode_dirty(i);
+        }
+        for(uint32_t e = 0; result == 0 && e < count; e++)
+            result = extent_insert(i, bitmap, data_blocks, extents[e]);
+        journal_end(fs, bitmap, data_blocks);
+        free(extents);
+        if(result < 0) {
+            log_error("Block map of inode %u could not be moved to map blocks: %s", i, strerror(-result));
+            return -1;
+        }
+        moved++;
+    }
+    if(moved > 0)
+        log_info("Moved the block maps of %u inodes to map blocks", moved);
+    return 0;
+}
@@ -1,189 +1,1191 @@
-char *extract_name_from_abs(const char *path){
-    const char *last_slash = strrchr(path, '/'); 
-    if (last_slash == NULL)
-        return NULL;
+// Current sizes of the inode table and block pool
+Geometry geometry;
+
+// Locking
+//
+// namespace_lock covers the tree: names, child lists, the path index and which slots are active.
+// Operations on existing paths hold it shared from lookup to return, so an inode cannot be removed
+// or reused under them; mkdir, mknod, unlink, rmdir and rename hold it exclusively.
+// inode_locks[i] covers the contents of inode i: attributes, block map and data blocks.
+// Order: namespace_lock, an inode lock, the journal lock (journal_begin), dedup_mutex, block_allocator_mutex.
+// The shard locks of the buffer cache come last and are never held across I/O of the journal, see cache.c.
+pthread_rwlock_t namespace_lock;
+pthread_rwlock_t *inode_locks; // Reserved for geometry.max_inodes, committed with the inode table
+InodeRef *inode_refs; // Likewise, never saved, the kernel holds no references across mounts
+pthread_mutex_t block_allocator_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void namespace_lock_init(void) {
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    // Creates and removals must not starve behind a steady stream of lookups
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&namespace_lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+}
+
+// Fill in whatever the mount options left unset
+void geometry_defaults(Geometry *g) {
+    if(g->max_inodes == 0)
+        g->max_inodes = DEFAULT_MAX_INODES;
+    if(g->max_blocks == 0)
+        g->max_blocks = DEFAULT_MAX_BLOCKS;
+    if(g->inode_slots == 0 || g->inode_slots > g->max_inodes)
+        g->inode_slots = g->max_inodes < INODE_CHUNK ? g->max_inodes : INODE_CHUNK;
+    if(g->block_size == 0)
+        g->block_size = DEFAULT_BLOCK_SIZE;
+    if(g->block_count == 0 || g->block_count > g->max_blocks)
+        g->block_count = g->max_blocks < BLOCK_CHUNK ? g->max_blocks : BLOCK_CHUNK;
+}
+
+// Reserve address space for bytes without backing it with memory
+// Returns NULL if error occurred
+void *reserve_region(size_t bytes) {
+    void *base = mmap(NULL, bytes > 0 ? bytes : 1, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+// Allocate zeroed memory that is only backed once its pages are touched
+// Returns NULL if error occurred
+void *allocate_region(size_t bytes) {
+    void *base = mmap(NULL, bytes > 0 ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+// Make bytes [from, to) of a reserved region usable, new pages read as zero
+int commit_region(void *base, size_t from, size_t to) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = from / page * page;
+    size_t end = (to + page - 1) / page * page;
+    if(end <= start)
+        return 0;
+    return mprotect((char *)base + start, end - start, PROT_READ | PROT_WRITE);
+}
+
+// Dirty tracking for incremental flushes, one bit per inode slot and per data block
+uint64_t *inode_dirty; // Sized for geometry.max_inodes, see reserve_tables()
+uint64_t *cold_dirty; // The cold records of the same slots, set and cleared along with inode_dirty
+uint64_t *block_dirty;
+bool bitmap_dirty;
+bool superblock_dirty;
+bool image_dirty; // Set whenever any of the above is set, so clean cycles cost nothing
+uint32_t image_version; // Of the image as restored, before the upgrades at mount
+uint64_t *mark_words; // Room for the bits of the mark of the running checkpoint, see image_mark()
+size_t mark_word_capacity;
+uint8_t *mark_bitmap;
+size_t mark_bitmap_capacity;
+char *mark_records; // Copies of the records of the mark, see image_mark()
+size_t mark_record_capacity;
+
+// Marking also records the change in the running journal transaction, if any
+// Operations on different inodes mark concurrently, so the bits are set atomically
+void mark_inode_dirty(int index) {
+    __atomic_fetch_or(&inode_dirty[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELAXED);
+    __atomic_fetch_or(&cold_dirty[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELAXED);
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+    journal_touch(JOURNAL_INODE, index);
+}
+
+// Blocks are held before their bit is set, which a checkpoint writing them concurrently relies on, see cache_take_dirty()
+void mark_block_dirty(int index) {
+    if(journal_touch(JOURNAL_BLOCK, index))
+        cache_hold(index);
+    __atomic_fetch_or(&block_dirty[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELAXED);
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+}
+
+// Like mark_block_dirty() for a block the caller cleared to zeros, which the journal records without a copy
+void mark_block_zeroed(int index) {
+    if(journal_touch(JOURNAL_ZERO, index))
+        cache_hold(index);
+    __atomic_fetch_or(&block_dirty[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELAXED);
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+}
+
+void mark_bitmap_dirty(int block) {
+    __atomic_store_n(&bitmap_dirty, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+    journal_touch(JOURNAL_BITMAP, block / 8 / JOURNAL_BITMAP_CHUNK);
+}
+
+// Mark the bitmap bits of blocks [from, to) dirty, one journal record per chunk
+void mark_bitmap_range_dirty(uint32_t from, uint32_t to) {
+    uint32_t chunk_blocks = 8 * JOURNAL_BITMAP_CHUNK;
+    for(uint32_t block = from - from % chunk_blocks; block < to; block += chunk_blocks)
+        mark_bitmap_dirty(block);
+}
+
+// Mark bits [from, to) of a dirty map
+void mark_range_dirty(uint64_t dirty[], uint32_t from, uint32_t to) {
+    for(uint32_t i = from; i < to; i++)
+        __atomic_fetch_or(&dirty[i / 64], (uint64_t)1 << (i % 64), __ATOMIC_RELAXED);
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+}
+
+// Mark every table dirty so the next flush writes the whole image, the data blocks stay where they are
+void mark_image_dirty(void) {
+    memset(inode_dirty, 0xff, (geometry.inode_slots + 63) / 64 * sizeof(uint64_t));
+    memset(cold_dirty, 0xff, (geometry.inode_slots + 63) / 64 * sizeof(uint64_t));
+    memset(name_dirty, 0xff, BITMAP_WORDS(NAME_PAGES(name_granules_used)) * sizeof(uint64_t));
+    bitmap_dirty = true;
+    superblock_dirty = true;
+    image_dirty = true;
+}
+
+// Hash index from (parent, name) to inode slot, chained through Inode.hash_next
+// The bucket count is a power of two that doubles as the inode table grows
+int *path_buckets;
+uint32_t path_bucket_count;
+// Bumped whenever a name is added to the index, invalidating every negative entry
+uint32_t path_index_generation = 1;
+__thread NegativeEntry negative_cache[NEG_CACHE_SIZE]; // Per thread, lookups only hold the namespace lock shared
 
-    return strdup(last_slash + 1);
+// FNV-1a hash of a path string
+uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for(const unsigned char *c = (const unsigned char *)path; *c != '\0'; c++){
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// FNV-1a hash of the first length characters of text
+uint32_t hash_text(const char *text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-char *extract_path_from_abs(const char *path) {
+// Hash of a name in the directory parent, from the hash_text() of the name, so a name hashed once
+// while a path is split can be looked up under any parent
+uint32_t hash_child(int parent, uint32_t text_hash) {
+    uint32_t hash = text_hash ^ (uint32_t)parent * 0x9e3779b1u;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+uint32_t hash_name(int parent, const char *name, size_t length) {
+    return hash_child(parent, hash_text(name, length));
+}
+
+// A view of the whole string name
+PathName path_name(const char *name) {
+    size_t length = strlen(name);
+    return (PathName){ name, length, hash_text(name, length) };
+}
+
+// A view of the length characters at name, which need not end the string
+PathName path_name_length(const char *name, size_t length) {
+    return (PathName){ name, length, hash_text(name, length) };
+}
+
+// Move *position in the first length characters of path past the next component and set *name to it,
+// hashing it in the same pass that finds its end
+// Returns false once no component is left
+bool path_next(const char *path, size_t length, size_t *position, PathName *name) {
+    size_t at = *position;
+    while(at < length && path[at] == '/')
+        at++;
+    if(at == length) {
+        *position = at;
+        return false;
+    }
+    uint32_t hash = 2166136261u;
+    size_t end = at;
+    for(; end < length && path[end] != '/'; end++){
+        hash ^= (unsigned char)path[end];
+        hash *= 16777619u;
+    }
+    *name = (PathName){ path + at, end - at, hash };
+    *position = end;
+    return true;
+}
+
+// Split path at its last slash: returns the view of the last component, which ends the string, and sets
+// *parent_length to the length of the directory part, or to SIZE_MAX if path has no slash
+PathName path_last(const char *path, size_t *parent_length) {
     const char *last_slash = strrchr(path, '/');
+    if(last_slash == NULL) {
+        *parent_length = SIZE_MAX;
+        return path_name(path);
+    }
+    *parent_length = last_slash - path;
+    return path_name(last_slash + 1);
+}
 
-    if (last_slash == NULL) {
-        return NULL;
-    } else if (*(last_slash + 1) == '\0') {
-        return strdup("/");
+// Add the inode at index to the index under its current parent and name
+void path_index_insert(Inode fs[], int index) {
+    Inode *inode = &fs[index];
+    inode->name_hash = hash_name(inode->parent, INODE_NAME(inode), inode->name_length);
+    int bucket = inode->name_hash & (path_bucket_count - 1);
+    inode->hash_next = path_buckets[bucket];
+    path_buckets[bucket] = index;
+    path_index_generation++;
+}
+
+// Remove the inode at index from the index, must be called before its parent or name changes
+void path_index_remove(Inode fs[], int index) {
+    int *link = &path_buckets[fs[index].name_hash & (path_bucket_count - 1)];
+    while(*link >= 0){
+        if(*link == index){
+            *link = fs[index].hash_next;
+            fs[index].hash_next = -1;
+            return;
+        }
+        link = &fs[*link].hash_next;
     }
+}
 
-    size_t dir_len = last_slash - path + 1;
+// Rebuild the index from every active inode in the filesystem except the root
+void path_index_rebuild(Inode fs[], const int fs_max_size) {
+    for(uint32_t i = 0; i < path_bucket_count; i++){
+        path_buckets[i] = -1;
+    }
+    for(int i = 0; i < fs_max_size; i++){
+        fs[i].hash_next = -1;
+        if(fs[i].is_active && i != ROOT_INDEX){
+            path_index_insert(fs, i);
+        }
+    }
+}
 
-    if(dir_len != 1){
-        dir_len--;
+// Make sure there are at least as many buckets as inode slots, rehashing if the table grew
+void path_index_resize(Inode fs[], uint32_t slots) {
+    if(path_buckets != NULL && path_bucket_count >= slots)
+        return;
+
+    uint32_t count = path_bucket_count > 0 ? path_bucket_count : MIN_PATH_BUCKETS;
+    while(count < slots)
+        count *= 2;
+    int *buckets = realloc(path_buckets, count * sizeof(int));
+    if(buckets == NULL) {
+        log_error("Error growing path index: %m"); // Keep the smaller table, chains just get longer
+        return;
     }
+    path_buckets = buckets;
+    path_bucket_count = count;
+    path_index_rebuild(fs, geometry.inode_slots);
+}
 
-    char *dir_path = (char *)malloc(dir_len + 1);
-    if (dir_path == NULL) {
-        return NULL;
+// Returns the index of the child called name of the directory parent
+// Returns -1 if there is no such child
+int find_child(const Inode fs[], int parent, const PathName *name) {
+    uint32_t hash = hash_child(parent, name->hash);
+    for(int i = path_buckets[hash & (path_bucket_count - 1)]; i >= 0; i = fs[i].hash_next){
+        if(fs[i].is_active && fs[i].name_hash == hash && fs[i].parent == parent
+                && fs[i].name_length == name->length && memcmp(INODE_NAME(&fs[i]), name->text, name->length) == 0){
+            return i;
+        }
     }
+    return -1;
+}
 
-    strncpy(dir_path, path, dir_len);
-    dir_path[dir_len + 1] = '\0'; // Null-terminate the string
+// Like find_child() for the first length characters of name
+int find_child_index(const Inode fs[], int parent, const char *name, size_t length) {
+    PathName view = path_name_length(name, length);
+    return find_child(fs, parent, &view);
+}
 
-    return dir_path;
+// Resolve the first length characters of path one component at a time, starting from the root
+// Returns -1 if a component is missing or an intermediate component is not a directory
+int resolve_path_prefix(const Inode fs[], const char *path, size_t length) {
+    int index = ROOT_INDEX;
+    size_t position = 0;
+    PathName name;
+    while(path_next(path, length, &position, &name)){
+        if(!fs[index].is_dir)
+            return -1;
+        index = find_child(fs, index, &name);
+        if(index < 0)
+            return -1;
+    }
+    return index;
 }
 
 // Returns the index of the found path in the filesystem provided if this is active
 // Returns -1 if the file was not found or if it is not active (deleted)
+// Misses are remembered in the negative cache until the next name is added
 // fs -> filesystem
 int find_active_path_index(const Inode fs[], const int fs_max_size, const char *path) {
-	for(int i = 0; i < fs_max_size; i++){
-		if(fs[i].is_active && strcmp(fs[i].path, path) == 0){
-            return i;
-        }
+    uint32_t hash = hash_path(path);
+    NegativeEntry *negative = &negative_cache[hash & (NEG_CACHE_SIZE - 1)];
+    if(negative->generation == path_index_generation && negative->hash == hash && strcmp(negative->path, path) == 0){
+        return -1;
     }
 
+    size_t path_length = strlen(path);
+    int index = resolve_path_prefix(fs, path, path_length);
+    if(index >= 0)
+        return index;
+
+    if(path_length < MAX_PATH_LENGTH){
+        negative->hash = hash;
+        negative->generation = path_index_generation;
+        memcpy(negative->path, path, path_length + 1);
+    }
     return -1;
 }
 
-// Handle error cases for the creation of an inode
-int handle_inode_creation(const Inode fs[], const int fs_max_size, const char *path, const int inode_count) {
-    // Check if the path already exists
-	if(find_active_path_index(fs, fs_max_size, path) >= 0) 
-		return -EEXIST;
-	
-	// Check if the number of inodes is not exceeded
-	if(inode_count >= fs_max_size){
-		printf("Cannot create inode\n");
-		printf("The limit for number of files reached : %d == %d\n", inode_count, fs_max_size);
-		return -ENOSPC;
-	}
-
-    // Takes into account the null terminating character
-	size_t path_length = strlen(path) + 1;
-	size_t name_length = strlen(extract_name_from_abs(path)) + 1;
-
-	if(name_length > MAX_NAME_LENGTH){
-		printf("Cannot create inode\n");
-		printf("The length of filename exceeded the limit: %ld > %d \n", name_length, MAX_NAME_LENGTH); 
-		return -ENAMETOOLONG;
-	}
-
-	if(path_length > MAX_PATH_LENGTH){
-		printf("Cannot create inode\n");
-		printf("The length of path exceeded the limit: %ld > %d \n", path_length, MAX_PATH_LENGTH); 
-		return -ENAMETOOLONG;
-	}
+// Returns the index of the directory containing path, -1 if it does not exist
+// Sets *name to the view of the last component of path
+// fs -> filesystem
+int find_parent_index(const Inode fs[], const int fs_max_size, const char *path, PathName *name) {
+    size_t parent_length;
+    *name = path_last(path, &parent_length);
+    if(parent_length == SIZE_MAX)
+        return -1;
 
-    return 0;
+    int index = resolve_path_prefix(fs, path, parent_length);
+    if(index < 0 || !fs[index].is_dir)
+        return -1;
+    return index;
 }
 
-// Returns the index of the first inactive node in the filesystem
-// Returns -1 if every node is active
-// fs -> filesystem
-int find_inactive_index(const Inode fs[], const int fs_max_size, const char *path) {
-	for(int i = 0; i < fs_max_size; i++){
-		if(!fs[i].is_active){
-            return i;
+// Look up path with the namespace lock held shared and lock the inode found, exclusively to modify it
+// Returns the slot with both locks held, or -1 with neither held if path does not exist
+int lock_path(const Inode fs[], const char *path, bool exclusive) {
+    pthread_rwlock_rdlock(&namespace_lock);
+    int index = find_active_path_index(fs, geometry.inode_slots, path);
+    if(index < 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return -1;
+    }
+    if(exclusive)
+        pthread_rwlock_wrlock(&inode_locks[index]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[index]);
+    return index;
+}
+
+void unlock_path(int index) {
+    pthread_rwlock_unlock(&inode_locks[index]);
+    pthread_rwlock_unlock(&namespace_lock);
+}
+
+// Scratch memory of a thread for the temporaries of one request, kept from request to request so that once
+// it has grown to the largest request seen, requests no longer allocate
+__thread char *scratch;
+__thread size_t scratch_capacity;
+pthread_key_t scratch_key; // Frees the scratch memory of an exiting thread
+pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+void scratch_key_create(void) {
+    pthread_key_create(&scratch_key, free);
+}
+
+// Returns size bytes of scratch memory, valid until the next call on this thread, NULL if no memory was left
+void *scratch_buffer(size_t size) {
+    if(size <= scratch_capacity)
+        return scratch;
+    pthread_once(&scratch_key_once, scratch_key_create);
+    size_t capacity = scratch_capacity > 0 ? scratch_capacity : 4096;
+    while(capacity < size)
+        capacity *= 2;
+    char *grown = realloc(scratch, capacity);
+    if(grown == NULL)
+        return NULL;
+    scratch = grown;
+    scratch_capacity = capacity;
+    pthread_setspecific(scratch_key, scratch);
+    return scratch;
+}
+
+// Number the children of the directory at index from 0 along its child list, and find the tail of the list
+static void dir_renumber(int index) {
+    InodeCold *dir = &inode_cold[index];
+    uint32_t position = 0;
+    dir->last_child = -1;
+    for(int child = dir->first_child; child >= 0; child = inode_cold[child].next_sibling) {
+        inode_cold[child].position = position++;
+        dir->last_child = child;
+        mark_inode_dirty(child);
+    }
+    dir->next_position = position;
+    mark_inode_dirty(index);
+}
+
+// Append child to the child list of parent, with a position above that of every child linked before it,
+// so a listing resumed at a position neither repeats nor misses entries that stayed
+void dir_link_child(Inode fs[], int parent, int child) {
+    InodeCold *cold = &inode_cold[child];
+    InodeCold *dir = &inode_cold[parent];
+    if(dir->next_position > INT32_MAX) // Keeps readdir offsets positive, see dir_cookie()
+        dir_renumber(parent);
+    fs[child].parent = parent;
+    cold->position = dir->next_position++;
+    cold->next_sibling = -1;
+    cold->prev_sibling = dir->last_child;
+    if(cold->prev_sibling >= 0) {
+        inode_cold[cold->prev_sibling].next_sibling = child;
+        mark_inode_dirty(cold->prev_sibling);
+    } else {
+        dir->first_child = child;
+    }
+    dir->last_child = child;
+    mark_inode_dirty(parent);
+    mark_inode_dirty(child);
+}
+
+// Remove child from the child list of its parent
+void dir_unlink_child(Inode fs[], int child) {
+    Inode *inode = &fs[child];
+    InodeCold *cold = &inode_cold[child];
+    if(inode->parent < 0)
+        return;
+
+    if(cold->prev_sibling >= 0) {
+        inode_cold[cold->prev_sibling].next_sibling = cold->next_sibling;
+        mark_inode_dirty(cold->prev_sibling);
+    } else {
+        inode_cold[inode->parent].first_child = cold->next_sibling;
+    }
+    if(cold->next_sibling >= 0) {
+        inode_cold[cold->next_sibling].prev_sibling = cold->prev_sibling;
+        mark_inode_dirty(cold->next_sibling);
+    } else {
+        inode_cold[inode->parent].last_child = cold->prev_sibling;
+    }
+    mark_inode_dirty(inode->parent);
+    mark_inode_dirty(child);
+
+    inode->parent = -1;
+    cold->next_sibling = -1;
+    cold->prev_sibling = -1;
+}
+
+// Returns true if the directory ancestor is index itself or one of its ancestors
+bool is_ancestor(const Inode fs[], int ancestor, int index) {
+    for(; index >= 0; index = fs[index].parent){
+        if(index == ancestor)
+            return true;
+    }
+    return false;
+}
+
+// Stack of inactive inode slots, so creating an inode takes one pop instead of a scan of the table
+// Slots are only taken and returned under the exclusive namespace lock, so the stack needs no lock of its own
+int *free_inodes;
+uint32_t free_inode_count;
+uint32_t free_inode_capacity;
+
+// Push the inactive slots among [from, to), highest first so the lowest slots are reused first
+void free_inodes_push(const Inode fs[], uint32_t from, uint32_t to) {
+    if(free_inode_capacity < geometry.inode_slots) {
+        int *grown = realloc(free_inodes, geometry.inode_slots * sizeof(int));
+        if(grown == NULL) {
+            log_error("Error growing free inode list: %m"); // Slots left off the list are found again at the next mount
+            return;
         }
+        free_inodes = grown;
+        free_inode_capacity = geometry.inode_slots;
+    }
+    for(uint32_t i = to; i-- > from; ) {
+        if(!fs[i].is_active && i != ROOT_INDEX && free_inode_count < free_inode_capacity)
+            free_inodes[free_inode_count++] = i;
     }
+}
 
-    return -1;
+// Reserve the inode tables, name arena and data blocks up to the caps and commit the current geometry,
+// with granules of the name arena in use. Data blocks are backed by memory as the cache loads them, see cache.c
+// Returns 0 on success, -1 if error occurred
+int reserve_tables(Inode **fs, uint8_t **bitmap, char **data_blocks, uint32_t granules) {
+    *fs = reserve_region((size_t)geometry.max_inodes * sizeof(Inode));
+    inode_cold = reserve_region((size_t)geometry.max_inodes * sizeof(InodeCold));
+    inode_locks = reserve_region((size_t)geometry.max_inodes * sizeof(pthread_rwlock_t));
+    inode_refs = reserve_region((size_t)geometry.max_inodes * sizeof(InodeRef));
+    *data_blocks = allocate_region((size_t)geometry.max_blocks * geometry.block_size);
+    // Bitmaps are a bit per entry, so they are allocated whole and only touched pages cost memory
+    *bitmap = allocate_region(BITMAP_WORDS(geometry.max_blocks) * sizeof(uint64_t));
+    inode_dirty = allocate_region((geometry.max_inodes + 63) / 64 * sizeof(uint64_t));
+    cold_dirty = allocate_region((geometry.max_inodes + 63) / 64 * sizeof(uint64_t));
+    block_dirty = allocate_region((geometry.max_blocks + 63) / 64 * sizeof(uint64_t));
+    if(*fs == NULL || inode_cold == NULL || inode_locks == NULL || inode_refs == NULL || *data_blocks == NULL || *bitmap == NULL
+            || inode_dirty == NULL || cold_dirty == NULL || block_dirty == NULL || name_arena_reserve(granules) < 0
+            || commit_region(*fs, 0, (size_t)geometry.inode_slots * sizeof(Inode)) < 0
+            || commit_region(inode_cold, 0, (size_t)geometry.inode_slots * sizeof(InodeCold)) < 0
+            || commit_region(inode_locks, 0, (size_t)geometry.inode_slots * sizeof(pthread_rwlock_t)) < 0
+            || commit_region(inode_refs, 0, (size_t)geometry.inode_slots * sizeof(InodeRef)) < 0) {
+        log_error("Error reserving filesystem tables: %m");
+        return -1;
+    }
+    for(uint32_t i = 0; i < geometry.inode_slots; i++)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    path_index_resize(*fs, geometry.inode_slots);
+    return 0;
+}
+
+void release_tables(Inode fs[], uint8_t bitmap[], char data_blocks[]) {
+    munmap(fs, (size_t)geometry.max_inodes * sizeof(Inode));
+    munmap(inode_cold, (size_t)geometry.max_inodes * sizeof(InodeCold));
+    munmap(inode_locks, (size_t)geometry.max_inodes * sizeof(pthread_rwlock_t));
+    munmap(inode_refs, (size_t)geometry.max_inodes * sizeof(InodeRef));
+    munmap(data_blocks, (size_t)geometry.max_blocks * geometry.block_size);
+    munmap(bitmap, BITMAP_WORDS(geometry.max_blocks) * sizeof(uint64_t));
+    munmap(inode_dirty, (geometry.max_inodes + 63) / 64 * sizeof(uint64_t));
+    munmap(cold_dirty, (geometry.max_inodes + 63) / 64 * sizeof(uint64_t));
+    name_arena_release();
+    munmap(block_dirty, (geometry.max_blocks + 63) / 64 * sizeof(uint64_t));
+    free(path_buckets);
+    path_buckets = NULL;
+    path_bucket_count = 0;
+    free(free_inodes);
+    free_inodes = NULL;
+    free_inode_count = 0;
+    free_inode_capacity = 0;
+    free(mark_words);
+    mark_words = NULL;
+    mark_word_capacity = 0;
+    free(mark_bitmap);
+    mark_bitmap = NULL;
+    mark_bitmap_capacity = 0;
+    free(mark_records);
+    mark_records = NULL;
+    mark_record_capacity = 0;
+}
+
+// Commit inode slots in chunks until there are at least slots of them
+// Callers hold the namespace lock exclusively, or run before the filesystem is mounted
+// Returns the new number of slots, -1 if that would pass the cap
+int grow_inode_table(Inode fs[], uint32_t slots) {
+    if(slots > geometry.max_inodes)
+        return -1;
+    if(slots <= geometry.inode_slots)
+        return geometry.inode_slots;
+
+    uint32_t chunks = (slots - geometry.inode_slots + INODE_CHUNK - 1) / INODE_CHUNK;
+    uint64_t grown = geometry.inode_slots + (uint64_t)chunks * INODE_CHUNK;
+    if(grown > geometry.max_inodes)
+        grown = geometry.max_inodes;
+    if(commit_region(fs, (size_t)geometry.inode_slots * sizeof(Inode), (size_t)grown * sizeof(Inode)) < 0
+            || commit_region(inode_cold, (size_t)geometry.inode_slots * sizeof(InodeCold), (size_t)grown * sizeof(InodeCold)) < 0
+            || commit_region(inode_locks, (size_t)geometry.inode_slots * sizeof(pthread_rwlock_t), (size_t)grown * sizeof(pthread_rwlock_t)) < 0
+            || commit_region(inode_refs, (size_t)geometry.inode_slots * sizeof(InodeRef), (size_t)grown * sizeof(InodeRef)) < 0) {
+        log_error("Error growing inode table: %m");
+        return -1;
+    }
+    for(uint32_t i = geometry.inode_slots; i < grown; i++)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    // New slots are written out as well, the image may hold stale bytes there after a relocation
+    mark_range_dirty(inode_dirty, geometry.inode_slots, grown);
+    mark_range_dirty(cold_dirty, geometry.inode_slots, grown);
+    uint32_t first_new = geometry.inode_slots;
+    geometry.inode_slots = grown;
+    path_index_resize(fs, geometry.inode_slots);
+    free_inodes_push(fs, first_new, grown);
+    superblock_dirty = true;
+    return geometry.inode_slots;
+}
+
+// Add data blocks in chunks until there are at least count of them
+// New blocks may hold stale bytes in the image, writes clear whatever part of a new block they do not cover
+// Callers hold block_allocator_mutex, or run before the filesystem is mounted
+// Returns the new number of blocks, -1 if that would pass the cap
+int grow_block_pool(uint32_t count) {
+    if(count > geometry.max_blocks)
+        return -1;
+    if(count <= geometry.block_count)
+        return geometry.block_count;
+
+    uint32_t chunks = (count - geometry.block_count + BLOCK_CHUNK - 1) / BLOCK_CHUNK;
+    uint64_t grown = geometry.block_count + (uint64_t)chunks * BLOCK_CHUNK;
+    if(grown > geometry.max_blocks)
+        grown = geometry.max_blocks;
+    geometry.block_count = grown;
+    superblock_dirty = true;
+    return geometry.block_count;
+}
+
+// Returns the index of an inactive node in the filesystem, growing the table when every slot is active
+// Returns -1 if every node is active and the table is at its cap
+// fs -> filesystem
+int find_inactive_index(Inode fs[]) {
+    if(free_inode_count == 0 && grow_inode_table(fs, geometry.inode_slots + 1) < 0)
+        return -1;
+    if(free_inode_count == 0)
+        return -1;
+    return free_inodes[--free_inode_count];
 }
 
 // Create the root inode for the filesystem
 void create_root_inode(Inode fs[]){
-	fs[0].is_active = true;
-	fs[0].is_dir = true;
-	fs[0].mode = S_IFDIR | 0755;
-	fs[0].nlink = 2;
-    fs[0].access_time = time(NULL);
-    fs[0].modif_time = time(NULL);
-    fs[0].size = 4096;
-	memcpy(fs[0].path, "/", 2);
+	fs[ROOT_INDEX].is_active = true;
+	fs[ROOT_INDEX].is_dir = true;
+	fs[ROOT_INDEX].mode = S_IFDIR | 0755;
+	fs[ROOT_INDEX].nlink = 2;
+    fs[ROOT_INDEX].access_time = time(NULL);
+    fs[ROOT_INDEX].modif_time = time(NULL);
+    fs[ROOT_INDEX].size = 4096;
+    fs[ROOT_INDEX].parent = -1;
+    inode_cold[ROOT_INDEX].first_child = -1;
+    inode_cold[ROOT_INDEX].next_sibling = -1;
+    inode_cold[ROOT_INDEX].prev_sibling = -1;
+    inode_cold[ROOT_INDEX].last_child = -1;
+    inode_cold[ROOT_INDEX].next_position = 0;
+}
+
+// Compute the region offsets of an image for the current geometry
+// Regions are laid out for the caps, so growing the tables never moves them
+// The data region comes first and keeps its offset when a cap is raised, only the tables after it move
+void image_layout(Superblock *sb) {
+    memset(sb, 0, sizeof(Superblock));
+    sb->magic = IMAGE_MAGIC;
+    sb->version = IMAGE_VERSION;
+    sb->inode_size = sizeof(Inode);
+    sb->inode_slots = geometry.inode_slots;
+    sb->block_size = geometry.block_size;
+    sb->block_count = geometry.block_count;
+    sb->max_inodes = geometry.max_inodes;
+    sb->max_blocks = geometry.max_blocks;
+    sb->data_offset = IMAGE_ALIGN(sizeof(Superblock));
+    sb->cold_size = sizeof(InodeCold);
+    sb->name_granules = name_granules_used;
+    sb->inode_table_offset = IMAGE_ALIGN(sb->data_offset + (uint64_t)geometry.max_blocks * geometry.block_size);
+    sb->cold_table_offset = IMAGE_ALIGN(sb->inode_table_offset + (uint64_t)geometry.max_inodes * sizeof(Inode));
+    sb->names_offset = IMAGE_ALIGN(sb->cold_table_offset + (uint64_t)geometry.max_inodes * sizeof(InodeCold));
+    sb->bitmap_offset = IMAGE_ALIGN(sb->names_offset + NAME_ARENA_SIZE(geometry.max_inodes));
+    sb->image_size = IMAGE_ALIGN(sb->bitmap_offset + BITMAP_BYTES(geometry.max_blocks));
+}
+
+// pread/pwrite until the whole region is transferred
+// Returns 0 on success, -1 on error or unexpected end of file
+int pread_full(int fd, void *buf, size_t size, off_t offset) {
+    char *position = buf;
+    while(size > 0){
+        ssize_t n = pread(fd, position, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        position += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int pwrite_full(int fd, const void *buf, size_t size, off_t offset) {
+    const char *position = buf;
+    while(size > 0){
+        ssize_t n = pwrite(fd, position, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        position += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Open the image file, creating it if it does not exist
+// Returns the file descriptor, -1 if error occurred
+int open_image(const char *filename) {
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if(fd < 0)
+        log_error("Error opening filesystem file: %m");
+    return fd;
+}
+
+int count_active_inodes(const Inode fs[]) {
+    int inode_count = 0;
+    for(uint32_t i = 0; i < geometry.inode_slots; i++) {
+        if(fs[i].is_active)
+            inode_count++;
+    }
+    return inode_count;
 }
 
-// Restore the filesystem from a .dat file created from outside
+// Restore the filesystem from an image file created from outside
+// The tables are reserved here, sized from the image, or from the mount options for a new image
+// An empty file gives a fresh filesystem with only the root directory, marked dirty so the next flush lays out the image
 // Returns the number of inodes in the filesystem, -1 if error occurred
 // fs -> filesystem
-int restore_filesystem(const char *filename, Inode fs[], const int fs_max_size) {
-    // Clear the existing filesystem
-    memset(fs, 0, fs_max_size * sizeof(Inode));
-
-    //Check if the file doesn't exist
-    if (access(filename, F_OK) != 0) {
-        create_root_inode(fs);
-        printf("Creating filesystem file...\n");
-        // Create filesystem file
-        FILE *file = fopen(filename, "w");
-        if(file == NULL) {
-            perror("Error creating filesystem file");
+int restore_filesystem(int fd, Inode **fs, uint8_t **bitmap, char **data_blocks) {
+    Superblock sb;
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    if(file_size == 0) {
+        log_info("Creating filesystem file...");
+        geometry_defaults(&geometry);
+        if(reserve_tables(fs, bitmap, data_blocks, 1) < 0)
             return -1;
-        }
-        fclose(file);
+        create_root_inode(*fs);
+        mark_image_dirty();
+        image_version = IMAGE_VERSION;
         return 1;
     }
 
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror("Error opening file for reading");
+    memset(&sb, 0, sizeof(Superblock));
+    if(pread_full(fd, &sb, sizeof(Superblock), 0) < 0 || sb.magic != IMAGE_MAGIC) {
+        log_error("Filesystem file is not a dm510fs image");
+        return -1;
+    }
+    if(sb.version < IMAGE_MIN_VERSION || sb.version > IMAGE_VERSION) {
+        log_error("Unsupported image version %u, expected %u", sb.version, IMAGE_VERSION);
+        return -1;
+    }
+    image_version = sb.version;
+    if(sb.inode_size != sizeof(Inode) || sb.cold_size != sizeof(InodeCold) || sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE
+            || (sb.block_size & (sb.block_size - 1)) != 0) {
+        log_error("Image geometry does not match: inodes of %u bytes, blocks of %u bytes", sb.inode_size, sb.block_size);
         return -1;
     }
 
-    // Read each inode from the file and populate the filesystem array
-    Inode temp;
-    int next_file_index = -1;
-    int inode_count = 0;
-    while(fread(&temp, sizeof(Inode), 1, file) == 1) {
-        next_file_index++;
-        if(next_file_index < fs_max_size) {
-            fs[next_file_index] = temp;
-            inode_count++;
-        } else {
-            printf("Max number of inodes reached.\n");
-            break;
-        }
+    // Caps can only be raised by the mount options, never lowered below the image
+    // The block size is part of the image and cannot be changed
+    geometry.inode_slots = sb.inode_slots;
+    geometry.block_count = sb.block_count;
+    geometry.block_size = sb.block_size;
+    if(geometry.max_inodes < sb.max_inodes)
+        geometry.max_inodes = sb.max_inodes;
+    if(geometry.max_blocks < sb.max_blocks)
+        geometry.max_blocks = sb.max_blocks;
+    if(sb.name_granules > NAME_ARENA_SIZE(geometry.max_inodes) / NAME_GRANULE) {
+        log_error("Image name arena does not fit: %u granules", sb.name_granules);
+        return -1;
+    }
+    if(reserve_tables(fs, bitmap, data_blocks, sb.name_granules) < 0)
+        return -1;
+
+    // Slots are stored in order, so parent and sibling links stay valid
+    if(pread_full(fd, *fs, (size_t)sb.inode_slots * sizeof(Inode), sb.inode_table_offset) < 0
+            || pread_full(fd, inode_cold, (size_t)sb.inode_slots * sizeof(InodeCold), sb.cold_table_offset) < 0
+            || pread_full(fd, name_arena, (size_t)name_granules_used * NAME_GRANULE, sb.names_offset) < 0
+            || pread_full(fd, *bitmap, BITMAP_BYTES(sb.block_count), sb.bitmap_offset) < 0) {
+        log_error("Error reading filesystem image: %m");
+        return -1;
+    }
+
+    // Raised caps move the tables, so they are rewritten whole at the next flush
+    // Data blocks are read by the cache as they are needed
+    Superblock layout;
+    image_layout(&layout);
+    if(layout.inode_table_offset != sb.inode_table_offset || layout.bitmap_offset != sb.bitmap_offset) {
+        log_info("Relocating image regions for %u inodes and %u blocks", geometry.max_inodes, geometry.max_blocks);
+        mark_image_dirty();
+    } else if(sb.version < IMAGE_VERSION) {
+        // Older images are valid as they are but for block maps in runs of pool blocks and child lists without
+        // positions, see extent_upgrade() and dir_upgrade()
+        superblock_dirty = true;
+        image_dirty = true;
     }
 
-    fclose(file);
+    int inode_count = count_active_inodes(*fs);
+    if(!(*fs)[ROOT_INDEX].is_active) {
+        create_root_inode(*fs);
+        mark_inode_dirty(ROOT_INDEX);
+        inode_count++;
+    }
     return inode_count;
 }
 
-void save_filesystem(const char *filename, Inode fs[], const int fs_max_size) {
-    //Check if the file doesn't exist
-    if (access(filename, F_OK) != 0) {
-        printf("Filesystem file does not exist.\n");
-        return;
+// Count the set bits among the first count of marked
+static size_t count_marked(const uint64_t marked[], int count) {
+    size_t set = 0;
+    for(int w = 0; w < (count + 63) / 64; w++)
+        set += __builtin_popcountll(count - w * 64 >= 64 ? marked[w] : marked[w] & (((uint64_t)1 << (count % 64)) - 1));
+    return set;
+}
+
+// Copy the records of base whose bits are set in marked to copies, one after another in the order of their bits
+// Returns the end of the copies
+static char *copy_marked(char *copies, const uint64_t marked[], int count, const void *base, size_t record_size) {
+    for(int w = 0; w < (count + 63) / 64; w++) {
+        uint64_t word = marked[w];
+        while(word != 0) {
+            int i = w * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            if(i >= count)
+                break;
+            memcpy(copies, (const char *)base + (size_t)i * record_size, record_size);
+            copies += record_size;
+        }
     }
+    return copies;
+}
 
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        perror("Error opening file for writing");
+// Write every run of consecutive set bits in marked as a single pwrite of records from copies, which holds the
+// records of the set bits one after another, see copy_marked()
+// Returns the number of records written, -1 if error occurred
+int flush_dirty_runs(int fd, const uint64_t marked[], int count, const char *copies, size_t record_size, off_t region_offset) {
+    int written = 0;
+    int i = 0;
+    while(i < count) {
+        uint64_t word = marked[i / 64] >> (i % 64);
+        if(word == 0) {
+            i = (i / 64 + 1) * 64; // Skip the rest of a clean word
+            continue;
+        }
+        i += __builtin_ctzll(word);
+        if(i >= count)
+            break;
+
+        int run_end = i;
+        while(run_end < count && (marked[run_end / 64] & ((uint64_t)1 << (run_end % 64))))
+            run_end++;
+
+        const char *records = copies + (size_t)written * record_size;
+        if(pwrite_full(fd, records, (size_t)(run_end - i) * record_size, region_offset + (off_t)i * record_size) < 0)
+            return -1;
+        written += run_end - i;
+        i = run_end;
+    }
+    return written;
+}
+
+// Give the records of a mark that could not be written back to the dirty bits, so the next checkpoint writes
+// them again before the journal holding them goes
+void image_mark_restore(const ImageMark *mark) {
+    if(!mark->dirty)
         return;
+    size_t inode_words = (mark->layout.inode_slots + 63) / 64;
+    for(size_t w = 0; w < inode_words; w++) {
+        __atomic_fetch_or(&inode_dirty[w], mark->inodes[w], __ATOMIC_RELAXED);
+        __atomic_fetch_or(&cold_dirty[w], mark->colds[w], __ATOMIC_RELAXED);
     }
+    for(size_t w = 0; w < BITMAP_WORDS(NAME_PAGES(mark->layout.name_granules)); w++)
+        __atomic_fetch_or(&name_dirty[w], mark->names[w], __ATOMIC_RELAXED);
+    if(mark->bitmap != NULL)
+        __atomic_store_n(&bitmap_dirty, true, __ATOMIC_RELAXED);
+    if(mark->superblock)
+        __atomic_store_n(&superblock_dirty, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+}
 
-    // Write each active inode to the file
-    for (int i = 0; i < fs_max_size; i++) {
-        if (fs[i].is_active) {
-            fwrite(&fs[i], sizeof(Inode), 1, file);
+// Take the dirty bits of the tables and the flags of the bitmap and superblock into mark, clearing them, so
+// changes made from now on are left to the next checkpoint. Callers hold operations off
+// The dirty data blocks are not taken, the cache writes whichever it may when the mark is written
+// Returns 0, -1 if no memory was left for the bits or the copies, nothing is taken then
+int image_mark(ImageMark *mark, const uint8_t bitmap[]) {
+    image_layout(&mark->layout);
+    size_t inode_words = (mark->layout.inode_slots + 63) / 64;
+    size_t name_words = BITMAP_WORDS(NAME_PAGES(mark->layout.name_granules));
+    if(2 * inode_words + name_words > mark_word_capacity) {
+        uint64_t *words = realloc(mark_words, (2 * inode_words + name_words) * sizeof(uint64_t));
+        if(words == NULL) {
+            log_error("Error growing checkpoint mark: %m");
+            return -1;
+        }
+        mark_words = words;
+        mark_word_capacity = 2 * inode_words + name_words;
+    }
+    if(BITMAP_BYTES(mark->layout.block_count) > mark_bitmap_capacity) {
+        uint8_t *bitmap = realloc(mark_bitmap, BITMAP_BYTES(mark->layout.block_count));
+        if(bitmap == NULL) {
+            log_error("Error growing checkpoint mark: %m");
+            return -1;
         }
+        mark_bitmap = bitmap;
+        mark_bitmap_capacity = BITMAP_BYTES(mark->layout.block_count);
     }
+    mark->inodes = mark_words;
+    mark->colds = mark_words + inode_words;
+    mark->names = mark_words + 2 * inode_words;
 
-    fclose(file);
+    mark->dirty = __atomic_exchange_n(&image_dirty, false, __ATOMIC_RELAXED);
+    for(size_t w = 0; w < inode_words; w++) {
+        mark->inodes[w] = mark->dirty ? __atomic_exchange_n(&inode_dirty[w], 0, __ATOMIC_RELAXED) : 0;
+        mark->colds[w] = mark->dirty ? __atomic_exchange_n(&cold_dirty[w], 0, __ATOMIC_RELAXED) : 0;
+    }
+    for(size_t w = 0; w < name_words; w++)
+        mark->names[w] = mark->dirty ? __atomic_exchange_n(&name_dirty[w], 0, __ATOMIC_RELAXED) : 0;
+    mark->bitmap = NULL;
+    mark->superblock = false;
+
+    // The records are copied as of the mark, every change to them durable in the journal the checkpoint empties.
+    // Written as they are later, one half changed by a transaction that has not ended could reach the image
+    // with nothing left to replay over it once the retired file goes
+    int inode_slots = mark->layout.inode_slots;
+    int name_pages = NAME_PAGES(mark->layout.name_granules);
+    size_t copied = count_marked(mark->inodes, inode_slots) * sizeof(Inode) +
+        count_marked(mark->colds, inode_slots) * sizeof(InodeCold) + count_marked(mark->names, name_pages) * NAME_PAGE;
+    if(copied > mark_record_capacity) {
+        char *records = realloc(mark_records, copied);
+        if(records == NULL) {
+            log_error("Error growing checkpoint mark: %m");
+            image_mark_restore(mark);
+            return -1;
+        }
+        mark_records = records;
+        mark_record_capacity = copied;
+    }
+    mark->inode_records = mark_records;
+    mark->cold_records = copy_marked(mark->inode_records, mark->inodes, inode_slots, filesystem, sizeof(Inode));
+    mark->name_records = copy_marked(mark->cold_records, mark->colds, inode_slots, inode_cold, sizeof(InodeCold));
+    copy_marked(mark->name_records, mark->names, name_pages, name_arena, NAME_PAGE);
+
+    // Likewise the bitmap, which a later transaction may change
+    if(mark->dirty && __atomic_exchange_n(&bitmap_dirty, false, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&block_allocator_mutex);
+        memcpy(mark_bitmap, bitmap, BITMAP_BYTES(mark->layout.block_count));
+        pthread_mutex_unlock(&block_allocator_mutex);
+        mark->bitmap = mark_bitmap;
+    }
+    mark->superblock = mark->dirty && __atomic_exchange_n(&superblock_dirty, false, __ATOMIC_RELAXED);
+    return 0;
 }
 
+// Write the records of mark and the dirty data blocks to the image, in place
+// Records are written as copied at the mark, see image_mark(). Dirty data blocks are all in the cache and written
+// only once their newest change is durable, see cache_flush()
+// Returns the number of records written, 0 if nothing was dirty, -1 if error occurred, see image_mark_restore()
+int image_write(int fd, const Inode fs[], const ImageMark *mark) {
+    if(!mark->dirty)
+        return 0;
 
-int allocate_block(DataBlock data_blocks[]) {
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (!data_blocks[i].is_active) {
-            data_blocks[i].is_active = true;
-            return i;
+    const Superblock *sb = &mark->layout;
+    int inodes = flush_dirty_runs(fd, mark->inodes, sb->inode_slots, mark->inode_records, sizeof(Inode), sb->inode_table_offset);
+    int colds = flush_dirty_runs(fd, mark->colds, sb->inode_slots, mark->cold_records, sizeof(InodeCold), sb->cold_table_offset);
+    int names = flush_dirty_runs(fd, mark->names, NAME_PAGES(sb->name_granules), mark->name_records, NAME_PAGE, sb->names_offset);
+    int blocks = cache_flush();
+    if(inodes < 0 || colds < 0 || names < 0 || blocks < 0) {
+        log_error("Error writing filesystem image: %m");
+        return -1;
+    }
+    int written = inodes + colds + names + blocks;
+
+    if(mark->bitmap != NULL) {
+        if(pwrite_full(fd, mark->bitmap, BITMAP_BYTES(sb->block_count), sb->bitmap_offset) < 0) {
+            log_error("Error writing block bitmap: %m");
+            return -1;
+        }
+        written++;
+    }
+
+    // The superblock goes last, so a fresh image only becomes valid once its regions are in place
+    if(mark->superblock) {
+        if(pwrite_full(fd, sb, sizeof(Superblock), 0) < 0 || ftruncate(fd, sb->image_size) < 0) {
+            log_error("Error writing superblock: %m");
+            return -1;
+        }
+        written++;
+    }
+    return written;
+}
+
+// Write only the dirty inode records, data blocks and bitmap to the image, in place, with operations held off
+// A failed write leaves everything dirty, so the next checkpoint writes it again before the journal goes
+// Returns the number of records written, 0 if nothing was dirty, -1 if error occurred
+int flush_filesystem(int fd, Inode fs[], uint8_t bitmap[], char data_blocks[]) {
+    ImageMark mark;
+    if(image_mark(&mark, bitmap) < 0)
+        return -1;
+    int written = image_write(fd, fs, &mark);
+    if(written < 0)
+        image_mark_restore(&mark);
+    return written;
+}
+
+
+// Block allocator over the bitmap, scanning 64 blocks per step
+// Bit b of the bitmap is bit b % 8 of byte b / 8, so a little-endian load of 8 bytes gives blocks 64w..64w+63
+// The bitmap, blocks_used and the pool size are guarded by block_allocator_mutex
+uint32_t blocks_used; // Set bits in the bitmap, recounted by allocator_rebuild()
+// Where the previous allocation of this thread ended, searches without a hint start here
+// Threads start spread over the pool, so concurrent writers do not interleave their files
+__thread uint32_t block_hint = UINT32_MAX;
+uint32_t block_hint_threads;
+
+static inline bool block_in_use(const uint8_t bitmap[], uint32_t block) {
+    return bitmap[block / 8] & (1 << (block % 8));
+}
+
+static inline uint64_t bitmap_word(const uint8_t bitmap[], uint32_t word) {
+    uint64_t value;
+    memcpy(&value, bitmap + (size_t)word * 8, sizeof(value));
+    return le64toh(value);
+}
+
+// Returns the first block in [from, to) whose bit is used, or to if there is none
+uint32_t bitmap_scan(const uint8_t bitmap[], uint32_t from, uint32_t to, bool used) {
+    if (from >= to)
+        return to;
+    uint64_t invert = used ? 0 : ~(uint64_t)0;
+    uint32_t word = from / 64;
+    uint64_t bits = (bitmap_word(bitmap, word) ^ invert) & (~(uint64_t)0 << (from % 64));
+    while (bits == 0) {
+        word++;
+        if ((uint64_t)word * 64 >= to)
+            return to;
+        bits = bitmap_word(bitmap, word) ^ invert;
+    }
+    uint64_t found = (uint64_t)word * 64 + __builtin_ctzll(bits);
+    return found < to ? found : to;
+}
+
+// Returns one past the last used block below to, 0 if every one of them is free
+uint32_t bitmap_scan_back(const uint8_t bitmap[], uint32_t to) {
+    for (uint32_t word = (to + 63) / 64; word-- > 0; ) {
+        uint64_t bits = bitmap_word(bitmap, word);
+        if (to - word * 64 < 64)
+            bits &= ((uint64_t)1 << (to - word * 64)) - 1;
+        if (bits != 0)
+            return word * 64 + 64 - __builtin_clzll(bits);
+    }
+    return 0;
+}
+
+uint32_t bitmap_count(const uint8_t bitmap[], uint32_t count) {
+    uint32_t used = 0;
+    for (uint32_t word = 0; word < count / 64; word++)
+        used += __builtin_popcountll(bitmap_word(bitmap, word));
+    if (count % 64)
+        used += __builtin_popcountll(bitmap_word(bitmap, count / 64) & (((uint64_t)1 << (count % 64)) - 1));
+    return used;
+}
+
+// Set or clear the bits of blocks [from, to), whole bytes at a time where possible
+void bitmap_fill(uint8_t bitmap[], uint32_t from, uint32_t to, bool used) {
+    for (; from < to && from % 8 != 0; from++)
+        used ? (bitmap[from / 8] |= 1 << (from % 8)) : (bitmap[from / 8] &= ~(1 << (from % 8)));
+    if (to - from >= 8) {
+        memset(bitmap + from / 8, used ? 0xff : 0, (to - from) / 8);
+        from += (to - from) / 8 * 8;
+    }
+    for (; from < to; from++)
+        used ? (bitmap[from / 8] |= 1 << (from % 8)) : (bitmap[from / 8] &= ~(1 << (from % 8)));
+}
+
+// Claim blocks [start, start + length) for an allocation
+int take_blocks(uint8_t bitmap[], uint32_t start, uint32_t length, uint32_t *got) {
+    bitmap_fill(bitmap, start, start + length, true);
+    mark_bitmap_range_dirty(start, start + length);
+    blocks_used += length;
+    block_hint = start + length;
+    *got = length;
+    return start;
+}
+
+// Allocate a run of between min and want blocks starting at the free blocks at the end of the pool, growing it as needed
+// Returns -1 if not even min blocks fit under the cap
+int allocate_blocks_at_end(uint8_t bitmap[], char data_blocks[], uint32_t want, uint32_t min, uint32_t *got) {
+    uint32_t start = bitmap_scan_back(bitmap, geometry.block_count);
+    uint64_t needed = (uint64_t)start + want;
+    if (needed > geometry.max_blocks)
+        needed = geometry.max_blocks;
+    if (needed > geometry.block_count)
+        grow_block_pool(needed); // On failure the free tail alone may still be long enough
+    uint32_t length = geometry.block_count - start < want ? geometry.block_count - start : want;
+    if (length == 0 || length < min)
+        return -1;
+    return take_blocks(bitmap, start, length, got);
+}
+
+// Allocate a run of between min and want contiguous blocks, preferring the first free run at or after hint
+// BLOCK_NO_HINT continues after the previous allocation. A hint at the end of the pool grows it
+// The pool also grows when no committed run is long enough. Returns the first block and stores the run length in got
+// Returns -1 if no run of min blocks fits under the cap
+int allocate_blocks_locked(uint8_t bitmap[], char data_blocks[], uint32_t hint, uint32_t want, uint32_t min, uint32_t *got) {
+    uint32_t count = geometry.block_count;
+    if (count == geometry.max_blocks && count - blocks_used < min)
+        return -1; // Not enough free blocks left, however they are spread
+
+    if (hint == BLOCK_NO_HINT) {
+        if (block_hint == UINT32_MAX) // Fibonacci hashing of the thread number scatters the starting points
+            block_hint = __atomic_fetch_add(&block_hint_threads, 1, __ATOMIC_RELAXED) * 2654435761u;
+        hint = block_hint % (count > 0 ? count : 1);
+    } else if (hint >= count) {
+        // The caller wants to continue a run ending with the pool, which growing does best
+        int start = allocate_blocks_at_end(bitmap, data_blocks, want, min, got);
+        if (start >= 0)
+            return start;
+    }
+    if (hint >= count)
+        hint = 0;
+
+    // Search from the hint to the end of the pool, then wrap around to the start
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        uint32_t i = pass == 0 ? hint : 0;
+        uint32_t to = pass == 0 ? count : hint;
+        while ((i = bitmap_scan(bitmap, i, to, false)) < to) {
+            uint32_t limit = (uint64_t)i + want < count ? i + want : count;
+            uint32_t end = bitmap_scan(bitmap, i, limit, true);
+            // A short run reaching the end of the pool is left for growing below
+            if (end - i >= min && (end - i == want || end < count))
+                return take_blocks(bitmap, i, end - i, got);
+            i = end;
         }
     }
-    return -1; // No free blocks
+
+    return allocate_blocks_at_end(bitmap, data_blocks, want, min, got);
+}
+
+// Thread-safe entry point of the allocator, see allocate_blocks_locked()
+int allocate_blocks(uint8_t bitmap[], char data_blocks[], uint32_t hint, uint32_t want, uint32_t min, uint32_t *got) {
+    pthread_mutex_lock(&block_allocator_mutex);
+    int start = allocate_blocks_locked(bitmap, data_blocks, hint, want, min, got);
+    pthread_mutex_unlock(&block_allocator_mutex);
+    return start;
+}
+
+// Free count blocks from start, whoever else maps them, see deallocate_blocks()
+void release_blocks(uint8_t bitmap[], uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&block_allocator_mutex);
+    uint32_t end = start + count < geometry.block_count ? start + count : geometry.block_count;
+    if (start < end) {
+        bitmap_fill(bitmap, start, end, false);
+        mark_bitmap_range_dirty(start, end);
+        blocks_used -= end - start;
+    }
+    pthread_mutex_unlock(&block_allocator_mutex);
+}
+
+// Drop a reference to count blocks from start, freeing them unless deduplication shares them with other files
+void deallocate_blocks(uint8_t bitmap[], uint32_t start, uint32_t count) {
+    if(dedup_tracking())
+        dedup_deallocate(bitmap, start, count);
+    else
+        release_blocks(bitmap, start, count);
 }
 
-void deallocate_block(DataBlock data_blocks[], int index) {
-    if (index >= 0 && index < MAX_BLOCKS) {
-        data_blocks[index].is_active = false;
+// Recount used blocks and collect the inactive inode slots after the tables were loaded or replayed
+void allocator_rebuild(const Inode fs[], const uint8_t bitmap[]) {
+    blocks_used = bitmap_count(bitmap, geometry.block_count);
+    free_inode_count = 0;
+    free_inodes_push(fs, 0, geometry.inode_slots);
+}
+
+// Detach the inode at index from the namespace, free its data blocks and mark it inactive
+void remove_inode(Inode fs[], uint8_t bitmap[], char data_blocks[], int index) {
+    path_index_remove(fs, index);
+    dir_unlink_child(fs, index);
+    name_release(fs[index].name, fs[index].name_length);
+    fs[index].name = 0;
+    fs[index].name_length = 0;
+    fs[index].is_active = false;
+    mark_inode_dirty(index);
+    // A slot the kernel still knows by inode number is only reused after its last forget, see lowlevel.c,
+    // and open handles keep the data too, until the last release. inode_unref() reclaims what is kept
+    bool open = __atomic_load_n(&inode_refs[index].opens, __ATOMIC_ACQUIRE) > 0;
+    if(open || __atomic_load_n(&inode_refs[index].lookups, __ATOMIC_ACQUIRE) > 0)
+        inode_refs[index].orphan = true;
+    else if(free_inode_count < free_inode_capacity)
+        free_inodes[free_inode_count++] = index;
+    if(fs[index].is_dir || open)
+        return;
+
+    inline_free(index);
+    extent_free_all(&inode_cold[index], bitmap, data_blocks);
+}
+
+// Free the blocks still held by removed files, those that were open when the filesystem last stopped
+// Their inodes reached the image inactive but with their block map, which the last release did not get to free
+void reclaim_orphan_blocks(Inode fs[], uint8_t bitmap[], char data_blocks[]) {
+    for(uint32_t i = 0; i < geometry.inode_slots; i++) {
+        if(!fs[i].is_active && fs[i].is_inline) {
+            fs[i].is_inline = false; // name_arena_rebuild() finds the chunk free
+            inode_cold[i].inline_data = 0;
+            mark_inode_dirty(i);
+        }
+        if(fs[i].is_active || (inode_cold[i].extent_count == 0 && inode_cold[i].extent_index == 0))
+            continue;
+        log_info("Freeing the blocks of inode %u, removed while open", i);
+        extent_free_all(&inode_cold[i], bitmap, data_blocks);
+        mark_inode_dirty(i);
     }
 }
@@ -0,0 +1,87 @@
+// Inline storage of small files
+//
+// A regular file of at most inline_size bytes keeps its data in a chunk of the name arena instead of in pool
+// blocks, so creating one takes no block and reading or writing it is a single memcpy. The chunk is exactly
+// INLINE_GRANULES(size) granules and zero past the end of the file, so growing within it needs no clearing.
+// A write past inline_size moves the data to blocks, see inode_promote(), and truncating a file to at most
+// inline_size brings it back, see inode_demote(). Both run under the exclusive lock of the inode.
+// Files the arena has no room for simply stay in blocks.
+
+uint32_t inline_size = DEFAULT_INLINE_SIZE;
+
+// Whether the file at index should hold size bytes inline: small enough, and not already using blocks
+bool inline_wanted(int index, off_t size) {
+    const Inode *inode = &filesystem[index];
+    const InodeCold *cold = &inode_cold[index];
+    if(inode->is_dir || size <= 0 || size > inline_size)
+        return false;
+    return inode->is_inline || (cold->extent_count == 0 && cold->extent_index == 0);
+}
+
+// Give the file at index an inline chunk for size bytes, size > 0, keeping the data it held inline
+// The file is inline or has an empty block map, which reads as zeros. The size of the inode is left to the caller
+// Returns -1 if the arena has no room to grow the chunk, the file is unchanged then
+int inline_resize(int index, off_t size) {
+    Inode *inode = &filesystem[index];
+    InodeCold *cold = &inode_cold[index];
+    uint32_t granules = INLINE_GRANULES(size);
+    uint32_t held = INLINE_GRANULES(inode->size);
+    if(inode->is_inline && granules <= held) {
+        // Shrinking keeps the head of the chunk, so it cannot fail
+        size_t cleared = (size_t)granules * NAME_GRANULE < (size_t)inode->size ? (size_t)granules * NAME_GRANULE : (size_t)inode->size;
+        if((size_t)size < cleared) {
+            memset(INLINE_DATA(cold) + size, 0, cleared - size);
+            mark_names_dirty(cold->inline_data + size / NAME_GRANULE, 1);
+        }
+        if(granules < held)
+            name_arena_free(cold->inline_data + granules, held - granules);
+        return 0;
+    }
+
+    uint32_t granule = name_arena_allocate(granules);
+    if(granule == 0)
+        return -1;
+    char *chunk = name_arena + (size_t)granule * NAME_GRANULE;
+    size_t kept = 0;
+    if(inode->is_inline) {
+        kept = size < inode->size ? (size_t)size : (size_t)inode->size;
+        memcpy(chunk, INLINE_DATA(cold), kept);
+        name_arena_free(cold->inline_data, INLINE_GRANULES(inode->size));
+    }
+    memset(chunk + kept, 0, (size_t)granules * NAME_GRANULE - kept);
+    mark_names_dirty(granule, granules);
+    cold->inline_data = granule;
+    inode->is_inline = true;
+    mark_inode_dirty(index);
+    return 0;
+}
+
+// Write size bytes at offset to the file at index, for which inline_wanted() holds at the size it grows to
+// Returns size, or -ENOSPC if the arena is full
+int inline_write(int index, const char *buf, size_t size, off_t offset) {
+    Inode *inode = &filesystem[index];
+    InodeCold *cold = &inode_cold[index];
+    off_t end = offset + size;
+    off_t grown = end > inode->size ? end : inode->size;
+    if(inline_resize(index, grown) < 0)
+        return -ENOSPC;
+
+    memcpy(INLINE_DATA(cold) + offset, buf, size);
+    uint32_t first = offset / NAME_GRANULE;
+    mark_names_dirty(cold->inline_data + first, (end - 1) / NAME_GRANULE - first + 1);
+    inode->size = grown;
+    inode->modif_time = time(NULL);
+    mark_inode_dirty(index);
+    return size;
+}
+
+// Give the chunk of an inline file back to the arena, leaving it with an empty block map
+void inline_free(int index) {
+    Inode *inode = &filesystem[index];
+    if(!inode->is_inline)
+        return;
+    name_arena_free(inode_cold[index].inline_data, INLINE_GRANULES(inode->size));
+    inode_cold[index].inline_data = 0;
+    inode->is_inline = false;
+    mark_inode_dirty(index);
+}
@@ -0,0 +1,733 @@
+// Write-ahead journal with group commit
+//
+// Mutating operations run between journal_begin() and journal_end(). Every inode, data block and
+// bitmap byte they mark dirty is remembered per thread, and journal_end() takes room in a shared
+// in-memory buffer and copies the after-images into it as one checksummed transaction, with the
+// buffer lock held only to take the room. The commit thread writes everything appended since its last pass with
+// a single pwrite and fdatasync, so concurrent fsync callers share one flush.
+// Two journal files take turns: a checkpoint turns new transactions to the other file and writes the
+// image while operations go on, then empties the file holding the transactions before it.
+
+int journal_fd = -1; // The file transactions are committed to
+int journal_retired_fd = -1; // The other one, holding the transactions before the running checkpoint, if any
+off_t journal_size; // Bytes of committed transactions in journal_fd
+bool journal_running;
+bool journal_io_error; // Sticky, reported to every later fsync
+bool journal_retired_pending; // journal_retired_fd may hold transactions, the next checkpoint empties both files
+pthread_t commit_thread;
+
+// Shared by operations in flight, taken exclusively by checkpoints while they pick what to write
+pthread_rwlock_t journal_lock;
+// Serialises writes, truncation and turns of the journal files
+pthread_mutex_t journal_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+// One checkpoint at a time
+pthread_mutex_t journal_checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the append buffer, the sequence numbers and the waiter count
+pthread_mutex_t journal_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_commit_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t journal_durable_cond = PTHREAD_COND_INITIALIZER;
+char *journal_buffer;
+size_t journal_buffer_length;
+size_t journal_buffer_capacity;
+char *journal_spare; // Buffer being written by the committer, swapped with journal_buffer
+size_t journal_spare_capacity;
+uint64_t journal_next_sequence = 1;
+uint64_t journal_appended_sequence; // Last transaction appended to the buffer
+uint64_t journal_durable_sequence; // Last transaction known to be on disk
+int journal_sync_waiters;
+int journal_copying; // Transactions with room in the buffer that are still being copied in, see journal_end()
+pthread_cond_t journal_copied_cond = PTHREAD_COND_INITIALIZER;
+
+// A record in the set of those the running transaction touched, entries of earlier transactions count as free
+typedef struct JournalSeen {
+    uint64_t key; // Type and index of the record
+    uint32_t transaction; // JournalThread.transaction it was added in, 0 if the entry was never used
+} JournalSeen;
+
+// Transactions of a thread
+typedef struct JournalThread {
+    JournalRecord *touched; // Records touched by the running transaction
+    int touched_count;
+    int touched_capacity;
+    JournalSeen *seen; // Open addressing set of the inode, bitmap and name records in touched, so each is recorded once
+    uint32_t seen_capacity;
+    uint32_t seen_count;
+    uint32_t transaction; // Numbers the transactions of the thread, so the set is never cleared
+} JournalThread;
+
+__thread JournalThread *own_journal;
+__thread int journal_depth;
+pthread_key_t journal_key; // Frees the state of an exiting thread
+pthread_once_t journal_key_once = PTHREAD_ONCE_INIT;
+
+void journal_thread_release(void *state) {
+    JournalThread *thread = state;
+    free(thread->touched);
+    free(thread->seen);
+    free(thread);
+}
+
+void journal_key_create(void) {
+    pthread_key_create(&journal_key, journal_thread_release);
+}
+
+// Returns the state of the calling thread, NULL if no memory was left for it
+static JournalThread *journal_thread(void) {
+    if(own_journal == NULL) {
+        pthread_once(&journal_key_once, journal_key_create);
+        own_journal = calloc(1, sizeof(JournalThread));
+        if(own_journal == NULL)
+            return NULL;
+        own_journal->transaction = 1;
+        pthread_setspecific(journal_key, own_journal);
+    }
+    return own_journal;
+}
+
+// Checksum of a byte range eight bytes at a time, used to detect torn transactions
+uint32_t journal_checksum(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+    size_t i = 0;
+    for(; i + 8 <= length; i += 8){
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    if(i < length) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, length - i);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+
+// Checksum of a transaction from that of its records, so a record of one transaction is never taken for another
+static inline uint32_t journal_seal(uint32_t checksum, uint64_t sequence) {
+    return checksum ^ (uint32_t)((sequence * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+// FNV-1a over a byte range, the checksum of JOURNAL_MAGIC_V1 transactions
+uint32_t journal_checksum_v1(uint32_t seed, const void *data, size_t length) {
+    uint32_t hash = 2166136261u ^ seed;
+    const unsigned char *bytes = data;
+    for(size_t i = 0; i < length; i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+size_t journal_payload_size(uint32_t type) {
+    switch(type){
+        case JOURNAL_INODE: return sizeof(Inode) + sizeof(InodeCold);
+        case JOURNAL_BLOCK: return geometry.block_size;
+        case JOURNAL_BITMAP: return JOURNAL_BITMAP_CHUNK;
+        case JOURNAL_NAMES: return NAME_PAGE;
+        case JOURNAL_ZERO: return 0;
+        default: return 0;
+    }
+}
+
+// Open both journal files and prepare the locks, the files are created if they do not exist
+// Returns the file descriptor of the one committed to, -1 if error occurred
+int journal_open(const char *filename, const char *alternate) {
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    // Checkpoints must not starve behind a steady stream of operations
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&journal_lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    journal_fd = open(filename, O_RDWR | O_CREAT, 0644);
+    journal_retired_fd = open(alternate, O_RDWR | O_CREAT, 0644);
+    if(journal_fd < 0 || journal_retired_fd < 0) {
+        log_error("Error opening journal file: %m");
+        return -1;
+    }
+    journal_size = lseek(journal_fd, 0, SEEK_END);
+    journal_retired_pending = lseek(journal_retired_fd, 0, SEEK_END) > 0; // Left by a checkpoint a crash cut short
+    return journal_fd;
+}
+
+void journal_close(void) {
+    close(journal_fd);
+    close(journal_retired_fd);
+    journal_fd = -1;
+    journal_retired_fd = -1;
+}
+
+static inline uint32_t journal_seen_slot(uint64_t key, uint32_t capacity) {
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+// Double the set of a thread, keeping the entries of the running transaction
+// Returns 0 on success, -1 if no memory was left
+static int journal_seen_grow(JournalThread *thread) {
+    uint32_t capacity = thread->seen_capacity ? thread->seen_capacity * 2 : 256;
+    JournalSeen *seen = calloc(capacity, sizeof(JournalSeen));
+    if(seen == NULL)
+        return -1;
+    for(uint32_t i = 0; i < thread->seen_capacity; i++){
+        JournalSeen entry = thread->seen[i];
+        if(entry.transaction != thread->transaction)
+            continue;
+        uint32_t slot = journal_seen_slot(entry.key, capacity);
+        while(seen[slot].transaction == thread->transaction)
+            slot = (slot + 1) & (capacity - 1);
+        seen[slot] = entry;
+    }
+    free(thread->seen);
+    thread->seen = seen;
+    thread->seen_capacity = capacity;
+    return 0;
+}
+
+// Add a record to the set of the running transaction
+// Returns false if it was there already
+static bool journal_seen_add(JournalThread *thread, uint32_t type, uint32_t index) {
+    if(2 * (thread->seen_count + 1) > thread->seen_capacity && journal_seen_grow(thread) < 0)
+        return true; // Recorded twice then, which only costs journal space
+    uint64_t key = (uint64_t)type << 32 | index;
+    uint32_t slot = journal_seen_slot(key, thread->seen_capacity);
+    while(thread->seen[slot].transaction == thread->transaction) {
+        if(thread->seen[slot].key == key)
+            return false;
+        slot = (slot + 1) & (thread->seen_capacity - 1);
+    }
+    thread->seen[slot].key = key;
+    thread->seen[slot].transaction = thread->transaction;
+    thread->seen_count++;
+    return true;
+}
+
+// Remember that the running transaction changed a record, duplicates of inodes and bitmap chunks are dropped
+// Returns whether the record was added, journal_end() then releases blocks from the cache, see cache_hold()
+bool journal_touch(uint32_t type, uint32_t index) {
+    if(journal_depth == 0)
+        return false;
+
+    JournalThread *thread = journal_thread();
+    if(thread != NULL && type != JOURNAL_BLOCK && type != JOURNAL_ZERO && !journal_seen_add(thread, type, index))
+        return false;
+
+    if(thread != NULL && thread->touched_count == thread->touched_capacity) {
+        int capacity = thread->touched_capacity ? thread->touched_capacity * 2 : 64;
+        JournalRecord *touched = realloc(thread->touched, capacity * sizeof(JournalRecord));
+        if(touched != NULL) {
+            thread->touched = touched;
+            thread->touched_capacity = capacity;
+        }
+    }
+    if(thread == NULL || thread->touched_count == thread->touched_capacity) {
+        // The change goes ahead unjournaled, so it is not durable until the next checkpoint: every fsync fails until then
+        log_error("Error growing journal transaction: %m");
+        __atomic_store_n(&journal_io_error, true, __ATOMIC_RELAXED);
+        return false;
+    }
+    thread->touched[thread->touched_count].type = type;
+    thread->touched[thread->touched_count].index = index;
+    thread->touched_count++;
+    return true;
+}
+
+// Start a transaction, the shared journal lock keeps checkpoints out until journal_end()
+void journal_begin(void) {
+    if(journal_depth++ == 0)
+        pthread_rwlock_rdlock(&journal_lock);
+}
+
+// Copy the after-images of the records a thread touched behind header, with the checksum
+static void journal_fill(const JournalThread *thread, JournalHeader *header, const Inode fs[], const uint8_t bitmap[],
+        const char data_blocks[]) {
+    char *position = (char *)(header + 1);
+    for(int i = 0; i < thread->touched_count; i++){
+        JournalRecord record = thread->touched[i];
+        memcpy(position, &record, sizeof(JournalRecord));
+        position += sizeof(JournalRecord);
+        if(record.type == JOURNAL_INODE) {
+            memcpy(position, &fs[record.index], sizeof(Inode));
+            memcpy(position + sizeof(Inode), &inode_cold[record.index], sizeof(InodeCold));
+        } else if(record.type == JOURNAL_BLOCK) {
+            memcpy(position, BLOCK_DATA(data_blocks, record.index), geometry.block_size);
+        } else if(record.type == JOURNAL_NAMES) {
+            memcpy(position, name_arena + (size_t)record.index * NAME_PAGE, NAME_PAGE);
+        } else if(record.type == JOURNAL_BITMAP) {
+            size_t start = (size_t)record.index * JOURNAL_BITMAP_CHUNK;
+            size_t bitmap_bytes = BITMAP_BYTES(geometry.max_blocks);
+            size_t chunk = bitmap_bytes - start < JOURNAL_BITMAP_CHUNK ? bitmap_bytes - start : JOURNAL_BITMAP_CHUNK;
+            memset(position, 0, JOURNAL_BITMAP_CHUNK);
+            // Other threads allocate from the same chunk, take a consistent snapshot
+            pthread_mutex_lock(&block_allocator_mutex);
+            memcpy(position, bitmap + start, chunk);
+            pthread_mutex_unlock(&block_allocator_mutex);
+        }
+        position += journal_payload_size(record.type);
+    }
+    header->checksum = journal_seal(journal_checksum(header + 1, header->length), header->sequence);
+}
+
+// Append the after-images of everything the transaction touched and end it
+// The transaction takes its sequence number and its room in the buffer first and is copied in after
+// journal_buffer_mutex is dropped. Copying after the number is taken keeps replay right: a record another
+// transaction changes meanwhile, such as a block freed here and reused there, is copied at least as new as
+// any transaction numbered before it copies it
+void journal_end(const Inode fs[], const uint8_t bitmap[], const char data_blocks[]) {
+    if(--journal_depth > 0)
+        return;
+
+    JournalThread *thread = own_journal;
+    if(thread == NULL) {
+        pthread_rwlock_unlock(&journal_lock);
+        return;
+    }
+
+    uint64_t sequence = 0;
+    if(thread->touched_count > 0 && journal_fd >= 0) {
+        size_t length = sizeof(JournalHeader);
+        for(int i = 0; i < thread->touched_count; i++){
+            length += sizeof(JournalRecord) + journal_payload_size(thread->touched[i].type);
+        }
+
+        pthread_mutex_lock(&journal_buffer_mutex);
+        if(journal_buffer_length + length > journal_buffer_capacity) {
+            // Growing moves the buffer, which transactions still copying into it must not see
+            while(journal_copying > 0)
+                pthread_cond_wait(&journal_copied_cond, &journal_buffer_mutex);
+        }
+        if(journal_buffer_length + length > journal_buffer_capacity) {
+            size_t capacity = journal_buffer_capacity ? journal_buffer_capacity : 64 * 1024;
+            while(capacity < journal_buffer_length + length)
+                capacity *= 2;
+            char *buffer = realloc(journal_buffer, capacity);
+            if(buffer == NULL) {
+                log_error("Error growing journal buffer: %m");
+                journal_io_error = true;
+                length = 0;
+            } else {
+                journal_buffer = buffer;
+                journal_buffer_capacity = capacity;
+            }
+        }
+        JournalHeader *header = NULL;
+        if(length > 0) {
+            header = (JournalHeader *)(journal_buffer + journal_buffer_length);
+            header->magic = JOURNAL_MAGIC;
+            header->sequence = journal_next_sequence++;
+            header->length = length - sizeof(JournalHeader);
+            header->record_count = thread->touched_count;
+            journal_buffer_length += length;
+            journal_appended_sequence = header->sequence;
+            journal_copying++;
+            sequence = header->sequence;
+        }
+        pthread_mutex_unlock(&journal_buffer_mutex);
+
+        if(header != NULL) {
+            journal_fill(thread, header, fs, bitmap, data_blocks);
+            pthread_mutex_lock(&journal_buffer_mutex);
+            if(--journal_copying == 0)
+                pthread_cond_broadcast(&journal_copied_cond);
+            pthread_mutex_unlock(&journal_buffer_mutex);
+        }
+    }
+
+    // The blocks are copied, the cache may write them back once the transaction is durable
+    for(int i = 0; i < thread->touched_count; i++){
+        if(thread->touched[i].type == JOURNAL_BLOCK || thread->touched[i].type == JOURNAL_ZERO)
+            cache_release(thread->touched[i].index, sequence);
+    }
+    thread->touched_count = 0;
+    thread->seen_count = 0;
+    if(++thread->transaction == 0) {
+        // Numbers wrapped, entries of old transactions could pass for the running one
+        memset(thread->seen, 0, thread->seen_capacity * sizeof(JournalSeen));
+        thread->transaction = 1;
+    }
+    pthread_rwlock_unlock(&journal_lock);
+}
+
+// Appended transactions taken from the buffer for one write
+typedef struct JournalBatch {
+    char *buffer;
+    size_t capacity;
+    size_t length;
+    uint64_t sequence; // Last transaction in the buffer
+} JournalBatch;
+
+// Take every appended transaction once it is copied in, called with journal_io_mutex held
+static JournalBatch journal_take(void) {
+    pthread_mutex_lock(&journal_buffer_mutex);
+    while(journal_copying > 0)
+        pthread_cond_wait(&journal_copied_cond, &journal_buffer_mutex);
+    JournalBatch batch = { journal_buffer, journal_buffer_capacity, journal_buffer_length, journal_appended_sequence };
+    journal_buffer = journal_spare;
+    journal_buffer_capacity = journal_spare_capacity;
+    journal_buffer_length = 0;
+    pthread_mutex_unlock(&journal_buffer_mutex);
+    return batch;
+}
+
+// Write a batch at the end of the journal file fd holding *size bytes with one pwrite and one fdatasync,
+// called with journal_io_mutex held. The buffer becomes the spare again, or if the write failed goes back
+// ahead of the transactions appended since, so the next commit retries them in order and the journal never skips one
+// Returns 0 on success, -EIO if the journal could not be written
+static int journal_write(int fd, off_t *size, JournalBatch batch) {
+    int result = 0;
+    if(batch.length > 0) {
+        uint64_t start = stats_clock();
+        if(pwrite_full(fd, batch.buffer, batch.length, *size) < 0 || fdatasync(fd) < 0) {
+            log_error("Error committing journal: %m");
+            result = -EIO;
+        } else {
+            *size += batch.length;
+        }
+        stats_record(OP_JOURNAL_COMMIT, start, result);
+    }
+
+    pthread_mutex_lock(&journal_buffer_mutex);
+    if(result == 0) {
+        journal_spare = batch.buffer;
+        journal_spare_capacity = batch.capacity;
+        if(batch.sequence > journal_durable_sequence)
+            __atomic_store_n(&journal_durable_sequence, batch.sequence, __ATOMIC_RELEASE); // Read unlocked by the cache
+    } else {
+        journal_io_error = true;
+        while(journal_copying > 0)
+            pthread_cond_wait(&journal_copied_cond, &journal_buffer_mutex);
+        if(batch.length + journal_buffer_length > batch.capacity) {
+            size_t grown = batch.capacity;
+            while(grown < batch.length + journal_buffer_length)
+                grown *= 2;
+            char *bigger = realloc(batch.buffer, grown);
+            if(bigger != NULL) {
+                batch.buffer = bigger;
+                batch.capacity = grown;
+            }
+        }
+        if(batch.length + journal_buffer_length <= batch.capacity) {
+            memcpy(batch.buffer + batch.length, journal_buffer, journal_buffer_length);
+            journal_spare = journal_buffer;
+            journal_spare_capacity = journal_buffer_capacity;
+            journal_buffer = batch.buffer;
+            journal_buffer_capacity = batch.capacity;
+            journal_buffer_length += batch.length;
+        } else {
+            log_error("Error keeping uncommitted journal transactions: %m");
+            journal_spare = batch.buffer;
+            journal_spare_capacity = batch.capacity;
+        }
+    }
+    pthread_cond_broadcast(&journal_durable_cond);
+    pthread_mutex_unlock(&journal_buffer_mutex);
+    return result;
+}
+
+// Write every appended transaction to the journal with one pwrite and one fdatasync
+// Returns 0 on success, -EIO if the journal could not be written
+int journal_commit(void) {
+    pthread_mutex_lock(&journal_io_mutex);
+    int result = journal_write(journal_fd, &journal_size, journal_take());
+    pthread_mutex_unlock(&journal_io_mutex);
+    return result;
+}
+
+// Wait until every transaction appended so far is on disk
+// Concurrent callers are batched by the commit thread into a single fdatasync
+int journal_sync(void) {
+    pthread_mutex_lock(&journal_buffer_mutex);
+    uint64_t target = journal_appended_sequence;
+    journal_sync_waiters++;
+    pthread_cond_signal(&journal_commit_cond);
+    while(journal_durable_sequence < target && !journal_io_error)
+        pthread_cond_wait(&journal_durable_cond, &journal_buffer_mutex);
+    journal_sync_waiters--;
+    int result = journal_io_error ? -EIO : 0;
+    pthread_mutex_unlock(&journal_buffer_mutex);
+    return result;
+}
+
+// Group commit thread: commits immediately when someone waits in journal_sync(),
+// otherwise lets transactions accumulate for up to JOURNAL_COMMIT_INTERVAL_MS
+void* journal_commit_loop() {
+    pthread_mutex_lock(&journal_buffer_mutex);
+    while(journal_running) {
+        if(journal_sync_waiters == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += JOURNAL_COMMIT_INTERVAL_MS / 1000;
+            deadline.tv_nsec += (JOURNAL_COMMIT_INTERVAL_MS % 1000) * 1000000L;
+            if(deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while(journal_running && journal_sync_waiters == 0
+                    && pthread_cond_timedwait(&journal_commit_cond, &journal_buffer_mutex, &deadline) == 0);
+        }
+        pthread_mutex_unlock(&journal_buffer_mutex);
+        journal_commit();
+        pthread_mutex_lock(&journal_buffer_mutex);
+    }
+    pthread_mutex_unlock(&journal_buffer_mutex);
+    return NULL;
+}
+
+int journal_start(void) {
+    journal_running = true;
+    return pthread_create(&commit_thread, NULL, journal_commit_loop, NULL);
+}
+
+void journal_stop(void) {
+    pthread_mutex_lock(&journal_buffer_mutex);
+    journal_running = false;
+    pthread_cond_signal(&journal_commit_cond);
+    pthread_mutex_unlock(&journal_buffer_mutex);
+    pthread_join(commit_thread, NULL);
+}
+
+// Returns the whole content of a journal file in *log, NULL if it is empty, and its size
+// Returns 0 on success, -1 if error occurred
+static int journal_read(int fd, char **log, off_t *size) {
+    *log = NULL;
+    *size = lseek(fd, 0, SEEK_END);
+    if(*size <= 0) {
+        *size = 0;
+        return 0;
+    }
+    *log = malloc(*size);
+    if(*log == NULL || pread_full(fd, *log, *size, 0) < 0) {
+        log_error("Error reading journal: %m");
+        free(*log);
+        *log = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Returns whether the transaction at offset of a journal file is complete and follows sequence last
+static bool journal_valid(const char *log, off_t size, off_t offset, uint64_t last) {
+    if(offset + (off_t)sizeof(JournalHeader) > size)
+        return false;
+    const JournalHeader *header = (const JournalHeader *)(log + offset);
+    if(header->length > size - offset - sizeof(JournalHeader) || header->sequence <= last)
+        return false;
+    if(header->magic == JOURNAL_MAGIC)
+        return header->checksum == journal_seal(journal_checksum(header + 1, header->length), header->sequence);
+    if(header->magic == JOURNAL_MAGIC_V1)
+        return header->checksum == journal_checksum_v1((uint32_t)header->sequence, header + 1, header->length);
+    return false;
+}
+
+// Apply the complete transactions of one journal file following sequence *last
+// Replay stops at the first torn or corrupt transaction, which was never acknowledged
+// Returns the number of transactions applied
+static int journal_replay_log(const char *log, off_t size, uint64_t *last, Inode fs[], uint8_t bitmap[], char data_blocks[]) {
+    int applied = 0;
+    off_t offset = 0;
+    while(journal_valid(log, size, offset, *last)) {
+        const JournalHeader *header = (const JournalHeader *)(log + offset);
+        const char *position = (const char *)(header + 1);
+        const char *end = position + header->length;
+        for(uint32_t i = 0; i < header->record_count && position + sizeof(JournalRecord) <= end; i++){
+            JournalRecord record;
+            memcpy(&record, position, sizeof(JournalRecord));
+            position += sizeof(JournalRecord);
+            size_t payload = journal_payload_size(record.type);
+            if(position + payload > end)
+                break;
+
+            // The tables may have grown after the last checkpoint, so grow them again as records demand
+            if(record.type == JOURNAL_INODE && grow_inode_table(fs, record.index + 1) >= 0) {
+                memcpy(&fs[record.index], position, sizeof(Inode));
+                memcpy(&inode_cold[record.index], position + sizeof(Inode), sizeof(InodeCold));
+                mark_inode_dirty(record.index);
+            } else if(record.type == JOURNAL_BLOCK && grow_block_pool(record.index + 1) >= 0
+                    && cache_pin(record.index, 1, true) == 0) {
+                memcpy(BLOCK_DATA(data_blocks, record.index), position, geometry.block_size);
+                mark_block_dirty(record.index);
+                cache_unpin(record.index, 1);
+            } else if(record.type == JOURNAL_ZERO && grow_block_pool(record.index + 1) >= 0
+                    && cache_pin(record.index, 1, true) == 0) {
+                memset(BLOCK_DATA(data_blocks, record.index), 0, geometry.block_size);
+                mark_block_dirty(record.index);
+                cache_unpin(record.index, 1);
+            } else if(record.type == JOURNAL_NAMES && name_arena_commit((record.index + 1) * (NAME_PAGE / NAME_GRANULE)) >= 0) {
+                memcpy(name_arena + (size_t)record.index * NAME_PAGE, position, NAME_PAGE);
+                if(name_granules_used < (record.index + 1) * (NAME_PAGE / NAME_GRANULE))
+                    name_granules_used = (record.index + 1) * (NAME_PAGE / NAME_GRANULE); // Trimmed by name_arena_rebuild()
+                mark_names_dirty(record.index * (NAME_PAGE / NAME_GRANULE), NAME_PAGE / NAME_GRANULE);
+            } else if(record.type == JOURNAL_BITMAP && (size_t)record.index * JOURNAL_BITMAP_CHUNK < BITMAP_BYTES(geometry.max_blocks)) {
+                size_t start = (size_t)record.index * JOURNAL_BITMAP_CHUNK;
+                size_t bitmap_bytes = BITMAP_BYTES(geometry.max_blocks);
+                size_t chunk = bitmap_bytes - start < JOURNAL_BITMAP_CHUNK ? bitmap_bytes - start : JOURNAL_BITMAP_CHUNK;
+                memcpy(bitmap + start, position, chunk);
+                bitmap_dirty = true;
+            }
+            position += payload;
+        }
+
+        *last = header->sequence;
+        if(header->sequence >= journal_next_sequence)
+            journal_next_sequence = header->sequence + 1;
+        offset += sizeof(JournalHeader) + header->length;
+        applied++;
+    }
+
+    if(offset < size)
+        log_warn("Discarded %lld bytes of incomplete journal", (long long)(size - offset));
+    return applied;
+}
+
+// Apply every complete transaction in both journal files to the in-memory filesystem
+// A checkpoint that did not finish leaves transactions in both, the file holding the older ones is replayed first
+// Returns the number of transactions applied, -1 if error occurred
+int journal_replay(Inode fs[], uint8_t bitmap[], char data_blocks[]) {
+    char *logs[2];
+    off_t sizes[2];
+    if(journal_read(journal_fd, &logs[0], &sizes[0]) < 0)
+        return -1;
+    if(journal_read(journal_retired_fd, &logs[1], &sizes[1]) < 0) {
+        free(logs[0]);
+        return -1;
+    }
+
+    int first = 0;
+    if(journal_valid(logs[1], sizes[1], 0, 0) && (!journal_valid(logs[0], sizes[0], 0, 0)
+            || ((JournalHeader *)logs[1])->sequence < ((JournalHeader *)logs[0])->sequence))
+        first = 1;
+
+    uint64_t last = 0;
+    int applied = journal_replay_log(logs[first], sizes[first], &last, fs, bitmap, data_blocks);
+    applied += journal_replay_log(logs[!first], sizes[!first], &last, fs, bitmap, data_blocks);
+    free(logs[0]);
+    free(logs[1]);
+    return applied;
+}
+
+// Truncate a journal file and sync it
+// Returns 0 on success, -1 if error occurred
+static int journal_empty(int fd) {
+    return ftruncate(fd, 0) == 0 && fdatasync(fd) == 0 ? 0 : -1;
+}
+
+// Checkpoint with operations held off throughout: commit, write the image, sync it and empty the journal
+// Used when the commit thread is not running, and while the retired file may hold transactions, which a checkpoint
+// that failed or was cut short by a crash leaves
+static int journal_checkpoint_whole(int image_fd, Inode fs[], uint8_t bitmap[]) {
+    pthread_rwlock_wrlock(&journal_lock);
+
+    pthread_mutex_lock(&journal_buffer_mutex);
+    bool pending = journal_buffer_length > 0;
+    pthread_mutex_unlock(&journal_buffer_mutex);
+
+    int written = 0;
+    if(__atomic_load_n(&image_dirty, __ATOMIC_RELAXED) || pending || journal_size > 0 || journal_retired_pending) {
+        // Write-ahead rule: nothing reaches the image before it is durable in the journal
+        if(journal_commit() < 0) {
+            pthread_rwlock_unlock(&journal_lock);
+            return -1;
+        }
+        ImageMark mark;
+        written = image_mark(&mark, bitmap);
+        if(written == 0)
+            written = image_write(image_fd, fs, &mark);
+        if(written >= 0 && fdatasync(image_fd) == 0 && (!journal_retired_pending || journal_empty(journal_retired_fd) == 0)) {
+            journal_retired_pending = false;
+            pthread_mutex_lock(&journal_io_mutex);
+            if(ftruncate(journal_fd, 0) == 0)
+                journal_size = 0;
+            pthread_mutex_unlock(&journal_io_mutex);
+        } else {
+            log_error("Error checkpointing filesystem image: %m");
+            if(written >= 0)
+                image_mark_restore(&mark);
+            written = -1;
+        }
+    }
+
+    pthread_rwlock_unlock(&journal_lock);
+    return written;
+}
+
+// Make the image match the journal and empty the journal
+// Operations are held off only while the files are turned and the dirty records are taken into a mark:
+// 1. The transactions before the mark are committed to the retired file, those after it go to the other one.
+// 2. The records of the mark, copied as they were at the turn, and the dirty blocks whose newest change is durable
+//    are written in place and the image is synced.
+// 3. Once every transaction that ran meanwhile has ended and is committed, the retired file is emptied.
+// A crash before that replays the retired file and then the other one over the image.
+// Returns the number of image records written, -1 if error occurred
+int journal_checkpoint(int image_fd, Inode fs[], uint8_t bitmap[], char data_blocks[]) {
+    (void)data_blocks;
+    pthread_mutex_lock(&journal_checkpoint_mutex);
+    pthread_mutex_lock(&journal_buffer_mutex);
+    bool running = journal_running;
+    pthread_mutex_unlock(&journal_buffer_mutex);
+    if(!running || journal_retired_pending) {
+        int written = journal_checkpoint_whole(image_fd, fs, bitmap);
+        pthread_mutex_unlock(&journal_checkpoint_mutex);
+        return written;
+    }
+
+    // Commit first, so little is left to commit below
+    if(journal_commit() < 0) {
+        pthread_mutex_unlock(&journal_checkpoint_mutex);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&journal_lock);
+    pthread_mutex_lock(&journal_io_mutex);
+    pthread_mutex_lock(&journal_buffer_mutex);
+    bool pending = journal_buffer_length > 0;
+    pthread_mutex_unlock(&journal_buffer_mutex);
+    bool clean = !__atomic_load_n(&image_dirty, __ATOMIC_RELAXED) && !pending && journal_size == 0;
+    ImageMark mark;
+    if(clean || image_mark(&mark, bitmap) < 0) {
+        pthread_mutex_unlock(&journal_io_mutex);
+        pthread_rwlock_unlock(&journal_lock);
+        pthread_mutex_unlock(&journal_checkpoint_mutex);
+        return clean ? 0 : -1;
+    }
+    JournalBatch batch = journal_take();
+    int retired = journal_fd;
+    off_t retired_size = journal_size;
+    journal_fd = journal_retired_fd;
+    journal_retired_fd = retired;
+    journal_size = 0;
+    pthread_rwlock_unlock(&journal_lock);
+
+    int written = journal_write(retired, &retired_size, batch);
+    if(written < 0) {
+        // The commit thread waits for journal_io_mutex, so nothing reached the other file yet and the turn is undone
+        journal_retired_fd = journal_fd;
+        journal_fd = retired;
+        journal_size = retired_size;
+    }
+    pthread_mutex_unlock(&journal_io_mutex);
+    if(written < 0) {
+        image_mark_restore(&mark);
+        pthread_mutex_unlock(&journal_checkpoint_mutex);
+        return -1;
+    }
+
+    written = image_write(image_fd, fs, &mark);
+    if(written >= 0 && fdatasync(image_fd) < 0)
+        written = -1;
+    if(written >= 0) {
+        // Wait out the transactions that overlapped the writes, then make them durable
+        pthread_rwlock_wrlock(&journal_lock);
+        pthread_rwlock_unlock(&journal_lock);
+        if(journal_commit() < 0 || journal_empty(retired) < 0)
+            written = -1;
+    }
+    if(written < 0) {
+        log_error("Error checkpointing filesystem image: %m");
+        image_mark_restore(&mark);
+        journal_retired_pending = true;
+    }
+    pthread_mutex_unlock(&journal_checkpoint_mutex);
+    return written;
+}
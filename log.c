@@ -0,0 +1,185 @@
+// Asynchronous logging
+//
+// Each thread formats its records into its own ring and publishes them with a release store of the
+// ring head, so logging never takes a lock or touches stdout on the operation path. The writer
+// thread drains every ring each LOG_FLUSH_INTERVAL_MS and flushes stdout once per batch. A full
+// ring drops records and counts them instead of stalling the operation. Records of one thread stay
+// in order; records of different threads are ordered by their timestamps only.
+// Before log_start() and after log_stop() records are written directly.
+
+int log_level = LOG_DEFAULT_LEVEL;
+
+LogRing *log_rings; // Every ring ever created, new ones are pushed at the head and none is unlinked
+pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread LogRing *log_ring;
+pthread_key_t log_ring_key; // Releases the ring of an exiting thread
+pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+
+bool log_running;
+pthread_t log_thread;
+pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER; // One consumer at a time
+pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *log_level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+// Returns the level called name, or given as a number, -1 if there is no such level
+int log_parse_level(const char *name) {
+    for(int level = LEVEL_ERROR; level <= LEVEL_TRACE; level++){
+        if(strcmp(name, log_level_names[level]) == 0)
+            return level;
+    }
+    if(name[0] >= '0' && name[0] <= '0' + LEVEL_TRACE && name[1] == '\0')
+        return name[0] - '0';
+    return -1;
+}
+
+void log_print(FILE *out, uint64_t time, int level, const char *text) {
+    time_t seconds = time / 1000000000;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    fprintf(out, "%02d:%02d:%02d.%06lu %-5s %s\n", local.tm_hour, local.tm_min, local.tm_sec,
+            (unsigned long)(time % 1000000000 / 1000), log_level_names[level], text);
+}
+
+void log_ring_release(void *ring) {
+    __atomic_store_n(&((LogRing *)ring)->in_use, false, __ATOMIC_RELEASE);
+}
+
+void log_key_create(void) {
+    pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+// Take over the ring of an exited thread, or create one
+// Returns NULL if no memory was left for a new ring
+LogRing *log_ring_acquire(void) {
+    pthread_once(&log_key_once, log_key_create);
+    pthread_mutex_lock(&log_rings_mutex);
+    LogRing *ring = log_rings;
+    while(ring != NULL && __atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE))
+        ring = ring->next;
+    if(ring == NULL) {
+        ring = calloc(1, sizeof(LogRing));
+        if(ring != NULL) {
+            ring->next = log_rings;
+            __atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+        }
+    }
+    if(ring != NULL)
+        ring->in_use = true;
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    if(ring != NULL)
+        pthread_setspecific(log_ring_key, ring);
+    return ring;
+}
+
+// Use through the log_* macros, which skip disabled levels before the arguments are evaluated
+void log_write(int level, const char *format, ...) {
+    int saved_errno = errno; // Kept for %m
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    va_list args;
+
+    if(!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        char text[LOG_MESSAGE_SIZE];
+        errno = saved_errno;
+        va_start(args, format);
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        log_print(stdout, time, level, text);
+        return;
+    }
+
+    if(log_ring == NULL && (log_ring = log_ring_acquire()) == NULL)
+        return;
+    LogRing *ring = log_ring;
+    uint64_t head = ring->head;
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_ENTRIES) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &ring->records[head % LOG_RING_ENTRIES];
+    record->time = time;
+    record->level = level;
+    errno = saved_errno;
+    va_start(args, format);
+    int length = vsnprintf(record->text, LOG_MESSAGE_SIZE, format, args);
+    va_end(args);
+    record->length = length < 0 ? 0 : length < LOG_MESSAGE_SIZE ? length : LOG_MESSAGE_SIZE - 1;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+// Write every published record to out
+// Returns the number of records written
+int log_drain(FILE *out) {
+    pthread_mutex_lock(&log_drain_mutex);
+    int written = 0;
+    for(LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for(; tail != head; tail++, written++){
+            LogRecord *record = &ring->records[tail % LOG_RING_ENTRIES];
+            log_print(out, record->time, record->level, record->text);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if(dropped > 0)
+            fprintf(out, "%llu log records dropped, the ring of a thread was full\n", (unsigned long long)dropped);
+    }
+    if(written > 0)
+        fflush(out);
+    pthread_mutex_unlock(&log_drain_mutex);
+    return written;
+}
+
+void* log_writer_loop() {
+    pthread_mutex_lock(&log_wake_mutex);
+    while(__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&log_wake_cond, &log_wake_mutex, &deadline);
+        pthread_mutex_unlock(&log_wake_mutex);
+        log_drain(stdout);
+        pthread_mutex_lock(&log_wake_mutex);
+    }
+    pthread_mutex_unlock(&log_wake_mutex);
+    return NULL;
+}
+
+// Records still buffered when the process exits on an error path are not lost
+void log_exit_drain(void) {
+    log_drain(stdout);
+}
+
+void log_register_exit(void) {
+    atexit(log_exit_drain);
+}
+
+int log_start(void) {
+    static pthread_once_t registered = PTHREAD_ONCE_INIT;
+    pthread_once(&registered, log_register_exit);
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+    int error = pthread_create(&log_thread, NULL, log_writer_loop, NULL);
+    if(error != 0)
+        __atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+    return error;
+}
+
+void log_stop(void) {
+    pthread_mutex_lock(&log_wake_mutex);
+    __atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_wake_cond);
+    pthread_mutex_unlock(&log_wake_mutex);
+    pthread_join(log_thread, NULL);
+    log_drain(stdout);
+}
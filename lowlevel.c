@@ -0,0 +1,626 @@
+// Inode-number front end on the FUSE low-level API
+//
+// The kernel addresses files by inode number instead of by path, so a request costs an array index rather
+// than a walk of its path, and the kernel caches names, attributes and misses for the entry, attribute and
+// negative timeouts. An inode number is the table slot plus one in its low 32 bits, which makes the root
+// FUSE_ROOT_ID, and the generation of the slot in its high 32 bits. Generations live in memory only and
+// restart at every mount, which is all the kernel needs, though not enough to export the mount over NFS.
+// Each entry replied is a reference the kernel later returns with forget. A file removed while referenced
+// keeps its slot until the last forget, so its number cannot name a newer file in the meantime, and its
+// data until the last release, so open files stay readable. Requests that come with an open handle in fi
+// go through it, see handle_lock().
+
+double entry_timeout = 1.0; // Seconds the kernel may cache a name, -o entry_timeout=T
+double attr_timeout = 1.0; // Seconds the kernel may cache attributes, -o attr_timeout=T
+double negative_timeout = 1.0; // Seconds the kernel may cache a miss, -o negative_timeout=T
+
+// The statistics files and the control file get numbers whose low 32 bits are zero, which no slot has
+#define LL_STATS_INO(k) ((fuse_ino_t)((uint64_t)(k) << 32))
+#define LL_STATS_FILES 3
+static const char *ll_stats_paths[LL_STATS_FILES] = { "/" STATS_FILENAME, "/" STATS_JSON_FILENAME, "/" CONTROL_FILENAME };
+
+fuse_ino_t index_to_ino(int index) {
+	return (fuse_ino_t)((uint64_t)inode_refs[index].generation << 32 | (uint32_t)(index + 1));
+}
+
+// Returns the slot of the file numbered ino, -1 if it has been removed or ino is not one of ours
+// Callers hold the namespace lock, which keeps the answer valid until they release it
+int ino_to_index(fuse_ino_t ino) {
+	uint32_t slot = (uint32_t)ino - 1;
+	if(slot >= geometry.inode_slots || !filesystem[slot].is_active
+			|| inode_refs[slot].generation != (uint32_t)((uint64_t)ino >> 32))
+		return -1;
+	return slot;
+}
+
+// Like lock_path() for an inode number
+int lock_ino(fuse_ino_t ino, bool exclusive) {
+	pthread_rwlock_rdlock(&namespace_lock);
+	int index = ino_to_index(ino);
+	if(index < 0) {
+		pthread_rwlock_unlock(&namespace_lock);
+		return -1;
+	}
+	if(exclusive)
+		pthread_rwlock_wrlock(&inode_locks[index]);
+	else
+		pthread_rwlock_rdlock(&inode_locks[index]);
+	return index;
+}
+
+// Returns the path of the statistics or control file numbered ino, NULL if ino is not one
+static const char *ll_stats_path(fuse_ino_t ino) {
+	uint64_t k = (uint64_t)ino >> 32;
+	if((uint32_t)ino != 0 || k < 1 || k > LL_STATS_FILES)
+		return NULL;
+	return ll_stats_paths[k - 1];
+}
+
+// Fill in the entry of the inode at index and count the reference the kernel gets with it
+// Callers hold the namespace lock and keep the inode from changing
+static void ll_fill_entry(int index, struct fuse_entry_param *entry) {
+	entry->ino = index_to_ino(index);
+	entry->generation = inode_refs[index].generation;
+	inode_stat(index, &entry->attr);
+	entry->attr.st_ino = entry->ino;
+	entry->attr_timeout = attr_timeout;
+	entry->entry_timeout = entry_timeout;
+	__atomic_add_fetch(&inode_refs[index].lookups, 1, __ATOMIC_RELAXED);
+}
+
+// Drop nlookup references to the slot at index, freeing it if it was removed and this was the last one
+static void ll_forget_slot(int index, uint64_t nlookup) {
+	if(__atomic_sub_fetch(&inode_refs[index].lookups, nlookup, __ATOMIC_ACQ_REL) == 0)
+		inode_unref(index);
+}
+
+// Reply with the entry, dropping its reference and handle again if the kernel did not get them
+static void ll_reply_entry(fuse_req_t req, int index, const struct fuse_entry_param *entry, struct fuse_file_info *fi) {
+	int sent = fi != NULL ? fuse_reply_create(req, entry, fi) : fuse_reply_entry(req, entry);
+	if(sent != 0) {
+		if(fi != NULL)
+			handle_release((FileHandle *)(uintptr_t)fi->fh);
+		ll_forget_slot(index, 1);
+	}
+}
+
+// Returns the handle opened on fi, NULL without one
+static FileHandle *ll_handle(fuse_ino_t ino, const struct fuse_file_info *fi) {
+	if(fi == NULL || fi->fh == 0 || ll_stats_path(ino) != NULL)
+		return NULL;
+	return (FileHandle *)(uintptr_t)fi->fh;
+}
+
+// Like lock_ino(), through the handle opened on fi if there is one, which also reaches a file removed since
+static int ll_lock(fuse_ino_t ino, const struct fuse_file_info *fi, bool exclusive) {
+	FileHandle *handle = ll_handle(ino, fi);
+	return handle != NULL ? handle_lock(handle, exclusive) : lock_ino(ino, exclusive);
+}
+
+static void dm510fs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	dm510fs_init(conn);
+}
+
+static void dm510fs_ll_destroy(void *userdata) {
+	dm510fs_destroy(userdata);
+}
+
+static void dm510fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_debug("lookup: (parent=%lu, name=%s)", parent, name);
+	uint64_t start = stats_clock();
+	struct fuse_entry_param entry;
+	memset(&entry, 0, sizeof(entry));
+
+	if(parent == FUSE_ROOT_ID && is_stats_name(name)) {
+		// Timeouts stay 0, the contents change all the time
+		int k = 1;
+		while(strcmp(ll_stats_paths[k - 1] + 1, name) != 0)
+			k++;
+		entry.ino = LL_STATS_INO(k);
+		stats_getattr(ll_stats_paths[k - 1], &entry.attr);
+		entry.attr.st_ino = entry.ino;
+		fuse_reply_entry(req, &entry);
+		stats_record(OP_LOOKUP, start, 0);
+		return;
+	}
+
+	PathName view = path_name(name); // Hashed before the lock is taken
+	int error = 0;
+	int index = -1;
+	pthread_rwlock_rdlock(&namespace_lock);
+	int directory = ino_to_index(parent);
+	if(directory < 0)
+		error = -ESTALE;
+	else if(!filesystem[directory].is_dir)
+		error = -ENOTDIR;
+	else if(view.length + 1 > MAX_NAME_LENGTH)
+		error = -ENAMETOOLONG;
+	else if((index = find_child(filesystem, directory, &view)) < 0)
+		error = -ENOENT;
+	else {
+		pthread_rwlock_rdlock(&inode_locks[index]);
+		ll_fill_entry(index, &entry);
+		pthread_rwlock_unlock(&inode_locks[index]);
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+
+	if(error == -ENOENT && negative_timeout > 0) {
+		entry.entry_timeout = negative_timeout; // An entry with inode number 0 caches the miss
+		fuse_reply_entry(req, &entry);
+	} else if(error != 0) {
+		fuse_reply_err(req, -error);
+	} else {
+		ll_reply_entry(req, index, &entry, NULL);
+	}
+	stats_record(OP_LOOKUP, start, error);
+}
+
+static void dm510fs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	log_trace("forget: (ino=%lu, nlookup=%lu)", ino, nlookup);
+	// The kernel only forgets what it looked up, so the slot is still there even if the file is not
+	if((uint32_t)ino != 0)
+		ll_forget_slot((uint32_t)ino - 1, nlookup);
+	fuse_reply_none(req);
+}
+
+static void dm510fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_debug("getattr: (ino=%lu)", ino);
+	uint64_t start = stats_clock();
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(stbuf));
+	double timeout = attr_timeout;
+	int error = 0;
+
+	if(ll_stats_path(ino) != NULL) {
+		stats_getattr(ll_stats_path(ino), &stbuf);
+		timeout = 0;
+	} else {
+		int index = ll_lock(ino, fi, false);
+		if(index < 0) {
+			error = -ESTALE;
+		} else {
+			inode_stat(index, &stbuf);
+			unlock_path(index);
+		}
+	}
+
+	stbuf.st_ino = ino;
+	if(error != 0)
+		fuse_reply_err(req, -error);
+	else
+		fuse_reply_attr(req, &stbuf, timeout);
+	stats_record(OP_GETATTR, start, error);
+}
+
+/*
+ * Change attributes: truncate, utimens, chmod and chown all end up here
+ */
+static void dm510fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	log_debug("setattr: (ino=%lu, to_set=%#x)", ino, to_set);
+	uint64_t start = stats_clock();
+	const char *stats_path = ll_stats_path(ino);
+	if(stats_path != NULL && is_control_path(stats_path) && !(to_set & ~FUSE_SET_ATTR_SIZE)) {
+		// Shells truncate what they redirect into
+		struct stat stbuf;
+		memset(&stbuf, 0, sizeof(stbuf));
+		stats_getattr(stats_path, &stbuf);
+		stbuf.st_ino = ino;
+		fuse_reply_attr(req, &stbuf, 0);
+		stats_record(OP_SETATTR, start, 0);
+		return;
+	}
+	if(stats_path != NULL) {
+		fuse_reply_err(req, EACCES);
+		stats_record(OP_SETATTR, start, -EACCES);
+		return;
+	}
+
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(stbuf));
+	int error = 0;
+	int index = ll_lock(ino, fi, true);
+	if(index < 0) {
+		error = -ESTALE;
+	} else {
+		Inode *inode = &filesystem[index];
+		if(in_snapshot(index))
+			error = -EROFS;
+		else if((to_set & FUSE_SET_ATTR_SIZE) && inode->is_dir)
+			error = -EISDIR;
+		else if(to_set & FUSE_SET_ATTR_SIZE)
+			error = inode_truncate(index, attr->st_size);
+		if(error == 0) {
+			time_t access_time = to_set & FUSE_SET_ATTR_ATIME ? attr->st_atime : inode->access_time;
+			time_t modif_time = to_set & FUSE_SET_ATTR_MTIME ? attr->st_mtime : inode->modif_time;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+			if(to_set & FUSE_SET_ATTR_ATIME_NOW)
+				access_time = time(NULL);
+			if(to_set & FUSE_SET_ATTR_MTIME_NOW)
+				modif_time = time(NULL);
+#endif
+			if(access_time != inode->access_time || modif_time != inode->modif_time)
+				inode_set_times(index, access_time, modif_time);
+
+			if(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+				journal_begin();
+				if(to_set & FUSE_SET_ATTR_MODE)
+					inode->mode = (inode->mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+				if(to_set & FUSE_SET_ATTR_UID)
+					inode->owner = attr->st_uid;
+				if(to_set & FUSE_SET_ATTR_GID)
+					inode->group = attr->st_gid;
+				mark_inode_dirty(index);
+				journal_end(filesystem, block_bitmap, data_blocks);
+			}
+		}
+		inode_stat(index, &stbuf);
+		unlock_path(index);
+	}
+
+	stbuf.st_ino = ino;
+	if(error != 0)
+		fuse_reply_err(req, -error);
+	else
+		fuse_reply_attr(req, &stbuf, attr_timeout);
+	stats_record(OP_SETATTR, start, error);
+}
+
+// Add an entry to a readdir reply, returns false if it does not fit in the size bytes of buf
+static bool ll_add_entry(fuse_req_t req, char *buf, size_t size, size_t *used, const char *name, fuse_ino_t ino, mode_t mode, off_t next) {
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = ino;
+	stbuf.st_mode = mode & S_IFMT;
+	size_t length = fuse_add_direntry(req, buf + *used, size - *used, name, &stbuf, next);
+	if(length > size - *used)
+		return false;
+	*used += length;
+	return true;
+}
+
+// Offsets are those of dm510fs_readdir()
+static void dm510fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	log_debug("readdir: (ino=%lu, offset=%lld)", ino, (long long)offset);
+	uint64_t start = stats_clock();
+	char *buf = scratch_buffer(size);
+	if(buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		stats_record(OP_READDIR, start, -ENOMEM);
+		return;
+	}
+
+	size_t used = 0;
+	int error = 0;
+	pthread_rwlock_rdlock(&namespace_lock);
+	int index = ino_to_index(ino);
+	if(index < 0) {
+		error = -ESTALE;
+	} else if(!filesystem[index].is_dir) {
+		error = -ENOTDIR;
+	} else {
+		int parent = filesystem[index].parent >= 0 ? filesystem[index].parent : index;
+		bool room = (offset >= 1 || ll_add_entry(req, buf, size, &used, ".", ino, S_IFDIR, 1))
+			&& (offset >= 2 || ll_add_entry(req, buf, size, &used, "..", index_to_ino(parent), S_IFDIR, 2));
+		for(int child = dir_first_after(index, offset); room && child >= 0; child = inode_cold[child].next_sibling)
+			room = ll_add_entry(req, buf, size, &used, INODE_NAME(&filesystem[child]), index_to_ino(child), filesystem[child].mode, dir_cookie(child));
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+
+	if(error != 0)
+		fuse_reply_err(req, -error);
+	else
+		fuse_reply_buf(req, buf, used);
+	stats_record(OP_READDIR, start, error);
+}
+
+static void dm510fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_debug("open: (ino=%lu)", ino);
+	uint64_t start = stats_clock();
+	const char *stats_path = ll_stats_path(ino);
+	int error;
+	if(stats_path != NULL) {
+		error = stats_open(stats_path, fi);
+	} else {
+		pthread_rwlock_rdlock(&namespace_lock);
+		int index = ino_to_index(ino);
+		error = index < 0 ? -ESTALE : filesystem[index].is_dir ? -EISDIR : 0;
+		FileHandle *handle = error == 0 ? handle_open(index) : NULL;
+		pthread_rwlock_unlock(&namespace_lock);
+		if(error == 0 && handle == NULL)
+			error = -ENOMEM;
+		fi->fh = (uintptr_t)handle;
+		fi->keep_cache = 1; // Every write goes through this mount, so cached pages stay valid from one open to the next
+	}
+
+	if(error != 0) {
+		fuse_reply_err(req, -error);
+	} else if(fuse_reply_open(req, fi) != 0) {
+		// Interrupted, release will not follow
+		if(stats_path != NULL)
+			stats_release(fi);
+		else
+			handle_release((FileHandle *)(uintptr_t)fi->fh);
+	}
+	stats_record(OP_OPEN, start, error);
+}
+
+static void dm510fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	log_debug("read: (ino=%lu), (size=%zu), (offset=%lld)", ino, size, (long long)offset);
+	uint64_t start = stats_clock();
+	const char *stats_path = ll_stats_path(ino);
+	int result = -EAGAIN;
+	if(stats_path == NULL) {
+		// The reply points into the cache, so the inode stays locked and the blocks pinned until it is sent
+		ReadVector vector;
+		FileHandle *handle = ll_handle(ino, fi);
+		int index = ll_lock(ino, fi, false);
+		result = index < 0 ? -ESTALE : inode_read_vector(index, size, offset, handle, &vector);
+		if(result >= 0) {
+			fuse_reply_iov(req, vector.segments, vector.count);
+			read_vector_release(&vector);
+		}
+		if(index >= 0)
+			unlock_path(index);
+	}
+
+	char *buf = NULL;
+	if(result == -EAGAIN) {
+		// Statistics, compressed data and badly fragmented ranges are copied into a buffer first
+		buf = scratch_buffer(size);
+		if(buf == NULL) {
+			result = -ENOMEM;
+		} else if(stats_path != NULL) {
+			result = stats_read(stats_path, buf, size, offset, fi);
+		} else {
+			FileHandle *handle = ll_handle(ino, fi);
+			int index = ll_lock(ino, fi, false);
+			result = index < 0 ? -ESTALE : inode_read(index, buf, size, offset, handle);
+			if(index >= 0)
+				unlock_path(index);
+		}
+		if(result >= 0)
+			fuse_reply_buf(req, buf, result);
+	}
+
+	if(result < 0)
+		fuse_reply_err(req, -result);
+	stats_record(OP_READ, start, result);
+}
+
+static void dm510fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	log_debug("write: (ino=%lu), (size=%zu), (offset=%lld)", ino, size, (long long)offset);
+	uint64_t start = stats_clock();
+	int result = -EACCES;
+	const char *stats_path = ll_stats_path(ino);
+	if(stats_path != NULL && is_control_path(stats_path)) {
+		result = control_write(buf, size);
+	} else if(stats_path == NULL) {
+		FileHandle *handle = ll_handle(ino, fi);
+		int index = ll_lock(ino, fi, true);
+		result = index < 0 ? -ESTALE : inode_write(index, buf, size, offset, handle);
+		if(index >= 0)
+			unlock_path(index);
+	}
+
+	if(result < 0)
+		fuse_reply_err(req, -result);
+	else
+		fuse_reply_write(req, result);
+	stats_record(OP_WRITE, start, result);
+}
+
+/*
+ * Write the data in bufv, which stays in the pipe it was spliced into until it is copied to the blocks
+ */
+static void dm510fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
+	size_t size = fuse_buf_size(bufv);
+	log_debug("write_buf: (ino=%lu), (size=%zu), (offset=%lld)", ino, size, (long long)offset);
+	uint64_t start = stats_clock();
+	int result = -EACCES;
+	const char *stats_path = ll_stats_path(ino);
+	if(stats_path != NULL && is_control_path(stats_path)) {
+		char *buf = scratch_buffer(size);
+		struct fuse_bufvec copy = FUSE_BUFVEC_INIT(size);
+		copy.buf[0].mem = buf;
+		result = buf == NULL ? -ENOMEM : fuse_buf_copy(&copy, bufv, 0) != (ssize_t)size ? -EIO : control_write(buf, size);
+	} else if(stats_path == NULL) {
+		FileHandle *handle = ll_handle(ino, fi);
+		int index = ll_lock(ino, fi, true);
+		result = index < 0 ? -ESTALE : inode_write_buf(index, bufv, offset, handle);
+		if(index >= 0)
+			unlock_path(index);
+	}
+
+	if(result < 0)
+		fuse_reply_err(req, -result);
+	else
+		fuse_reply_write(req, result);
+	stats_record(OP_WRITE, start, result);
+}
+
+// Create name in the directory parent and reply with its entry, opened with fi if that is set
+static int ll_create_entry(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t devno, struct fuse_file_info *fi) {
+	struct fuse_entry_param entry;
+	memset(&entry, 0, sizeof(entry));
+	PathName view = path_name(name);
+	pthread_rwlock_wrlock(&namespace_lock);
+	int directory = ino_to_index(parent);
+	int index = directory < 0 ? -ESTALE : create_entry_locked(directory, &view, mode, devno);
+	FileHandle *handle = NULL;
+	if(index >= 0 && fi != NULL && (handle = handle_open(index)) == NULL)
+		index = -ENOMEM; // The file stays, as if the open following a mknod had failed
+	if(index >= 0)
+		ll_fill_entry(index, &entry);
+	pthread_rwlock_unlock(&namespace_lock);
+
+	if(index < 0) {
+		fuse_reply_err(req, -index);
+		return index;
+	}
+	if(fi != NULL) {
+		fi->fh = (uintptr_t)handle;
+		fi->keep_cache = 1;
+	}
+	ll_reply_entry(req, index, &entry, fi);
+	return 0;
+}
+
+static void dm510fs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	log_debug("mknod: (parent=%lu, name=%s) (mode=%o)", parent, name, mode);
+	uint64_t start = stats_clock();
+	stats_record(OP_MKNOD, start, ll_create_entry(req, parent, name, mode, rdev, NULL));
+}
+
+static void dm510fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	log_debug("mkdir: (parent=%lu, name=%s) (mode=%o)", parent, name, mode);
+	uint64_t start = stats_clock();
+	stats_record(OP_MKDIR, start, ll_create_entry(req, parent, name, S_IFDIR | mode, 0, NULL));
+}
+
+/*
+ * Create and open a file in one request instead of a lookup, mknod and open
+ */
+static void dm510fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	log_debug("create: (parent=%lu, name=%s) (mode=%o)", parent, name, mode);
+	uint64_t start = stats_clock();
+	stats_record(OP_MKNOD, start, ll_create_entry(req, parent, name, mode, 0, fi));
+}
+
+static void ll_remove_entry(fuse_req_t req, fuse_ino_t parent, const char *name, bool directory, enum StatsOperation op) {
+	uint64_t start = stats_clock();
+	int error;
+	if(parent == FUSE_ROOT_ID && is_stats_name(name)) {
+		error = directory ? -ENOTDIR : -EACCES;
+	} else {
+		PathName view = path_name(name);
+		pthread_rwlock_wrlock(&namespace_lock);
+		int index = ino_to_index(parent);
+		error = index < 0 ? -ESTALE : remove_entry_locked(index, &view, directory);
+		pthread_rwlock_unlock(&namespace_lock);
+	}
+	fuse_reply_err(req, -error);
+	stats_record(op, start, error);
+}
+
+static void dm510fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_debug("unlink: (parent=%lu, name=%s)", parent, name);
+	ll_remove_entry(req, parent, name, false, OP_UNLINK);
+}
+
+static void dm510fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_debug("rmdir: (parent=%lu, name=%s)", parent, name);
+	ll_remove_entry(req, parent, name, true, OP_RMDIR);
+}
+
+static void dm510fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t new_parent, const char *new_name) {
+	log_debug("rename: (parent=%lu, name=%s) to (parent=%lu, name=%s)", parent, name, new_parent, new_name);
+	uint64_t start = stats_clock();
+	int error;
+	if(parent == FUSE_ROOT_ID && is_stats_name(name)) {
+		error = -EACCES;
+	} else {
+		PathName view = path_name(name), new_view = path_name(new_name);
+		pthread_rwlock_wrlock(&namespace_lock);
+		int from = ino_to_index(parent);
+		int to = ino_to_index(new_parent);
+		error = from < 0 || to < 0 ? -ESTALE : rename_entry_locked(from, &view, to, &new_view);
+		pthread_rwlock_unlock(&namespace_lock);
+	}
+	fuse_reply_err(req, -error);
+	stats_record(OP_RENAME, start, error);
+}
+
+static void dm510fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_debug("flush: (ino=%lu)", ino);
+	uint64_t start = stats_clock();
+	fuse_reply_err(req, 0);
+	stats_record(OP_FLUSH, start, 0);
+}
+
+static void dm510fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_debug("release: (ino=%lu)", ino);
+	uint64_t start = stats_clock();
+	FileHandle *handle = ll_handle(ino, fi);
+	if(ll_stats_path(ino) != NULL)
+		stats_release(fi);
+	else if(handle != NULL)
+		handle_release(handle);
+	fuse_reply_err(req, 0);
+	stats_record(OP_RELEASE, start, 0);
+}
+
+static void dm510fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	log_debug("fsync: (ino=%lu)", ino);
+	uint64_t start = stats_clock();
+	int error = journal_sync();
+	fuse_reply_err(req, -error);
+	stats_record(OP_FSYNC, start, error);
+}
+
+static void dm510fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	log_debug("fallocate: (ino=%lu), (mode=%d), (offset=%lld), (length=%lld)", ino, mode, (long long)offset, (long long)length);
+	uint64_t start = stats_clock();
+	int result = -EACCES;
+	if(ll_stats_path(ino) == NULL) {
+		int index = ll_lock(ino, fi, true);
+		result = index < 0 ? -ESTALE : inode_fallocate(index, mode, offset, length);
+		if(index >= 0)
+			unlock_path(index);
+	}
+	fuse_reply_err(req, -result);
+	stats_record(OP_FALLOCATE, start, result);
+}
+
+struct fuse_lowlevel_ops dm510fs_ll_oper = {
+	.init = dm510fs_ll_init,
+	.destroy = dm510fs_ll_destroy,
+	.lookup = dm510fs_ll_lookup,
+	.forget = dm510fs_ll_forget,
+	.getattr = dm510fs_ll_getattr,
+	.setattr = dm510fs_ll_setattr,
+	.mknod = dm510fs_ll_mknod,
+	.mkdir = dm510fs_ll_mkdir,
+	.unlink = dm510fs_ll_unlink,
+	.rmdir = dm510fs_ll_rmdir,
+	.rename = dm510fs_ll_rename,
+	.open = dm510fs_ll_open,
+	.read = dm510fs_ll_read,
+	.write = dm510fs_ll_write,
+	.write_buf = dm510fs_ll_write_buf,
+	.flush = dm510fs_ll_flush,
+	.release = dm510fs_ll_release,
+	.fsync = dm510fs_ll_fsync,
+	.fallocate = dm510fs_ll_fallocate,
+	.readdir = dm510fs_ll_readdir,
+	.create = dm510fs_ll_create,
+};
+
+// Mount and serve the low-level front end, what fuse_main() does for the path one
+// Returns the exit status for main()
+int lowlevel_main(struct fuse_args *args) {
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+	if(fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
+
+	int error = -1;
+	struct fuse_chan *channel = fuse_mount(mountpoint, args);
+	if(channel != NULL) {
+		struct fuse_session *session = fuse_lowlevel_new(args, &dm510fs_ll_oper, sizeof(dm510fs_ll_oper), NULL);
+		if(session != NULL) {
+			if(fuse_set_signal_handlers(session) == 0) {
+				fuse_session_add_chan(session, channel);
+				// Forks into the background unless -f, so init and its threads run after this
+				if(fuse_daemonize(foreground) == 0)
+					error = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+				fuse_remove_signal_handlers(session);
+				fuse_session_remove_chan(channel);
+			}
+			fuse_session_destroy(session);
+		}
+		fuse_unmount(mountpoint, channel);
+	}
+	free(mountpoint);
+	return error == 0 ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+// Name arena
+//
+// Names live out of the inode table, in an arena of NAME_GRANULE-byte granules that inodes point into, so the
+// hot inode records hold only what lookups and getattr read. A name takes the granules of its characters and
+// terminating NUL, at most MAX_NAME_LENGTH / NAME_GRANULE of them. Freed chunks go on a free list per size and
+// are reused by chunks of the same size, larger ones are split when the arena is full, and the arena grows only
+// when that fails.
+// Granule 0 holds the empty name of the root and of inactive slots.
+// Names change under the exclusive namespace lock and are read under the shared one.
+// The arena also holds the data of small files, see inline.c, which change under the lock of their inode only,
+// so the free lists and the end of the arena are guarded by name_arena_mutex.
+
+char *name_arena; // Reserved for NAME_ARENA_SIZE(geometry.max_inodes) bytes
+uint32_t name_granules_used; // The arena is in use up to here, everything after is free
+size_t name_arena_committed; // Bytes committed, in steps of NAME_CHUNK
+uint64_t *name_dirty; // One bit per NAME_PAGE, sized for the whole reservation
+uint32_t *name_free[NAME_CLASSES]; // Freed chunks of class + 1 granules
+uint32_t name_free_count[NAME_CLASSES];
+uint32_t name_free_capacity[NAME_CLASSES];
+pthread_mutex_t name_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t name_class_granules(size_t length) {
+    return (length + NAME_GRANULE) / NAME_GRANULE; // Room for the NUL
+}
+
+uint32_t name_arena_capacity(void) {
+    return NAME_ARENA_SIZE(geometry.max_inodes) / NAME_GRANULE;
+}
+
+// Mark the pages holding granules [from, from + count) dirty
+void mark_names_dirty(uint32_t from, uint32_t count) {
+    uint32_t first = (uint64_t)from * NAME_GRANULE / NAME_PAGE;
+    uint32_t last = ((uint64_t)(from + count) * NAME_GRANULE - 1) / NAME_PAGE;
+    for(uint32_t page = first; page <= last; page++) {
+        __atomic_fetch_or(&name_dirty[page / 64], (uint64_t)1 << (page % 64), __ATOMIC_RELAXED);
+        journal_touch(JOURNAL_NAMES, page);
+    }
+    __atomic_store_n(&image_dirty, true, __ATOMIC_RELAXED);
+}
+
+// Commit the arena up to granules
+// Returns -1 if that passes the reservation or the memory could not be committed
+int name_arena_commit(uint32_t granules) {
+    if(granules > name_arena_capacity())
+        return -1;
+    size_t bytes = (size_t)granules * NAME_GRANULE;
+    if(bytes <= name_arena_committed)
+        return 0;
+    size_t committed = (bytes + NAME_CHUNK - 1) / NAME_CHUNK * NAME_CHUNK;
+    if(committed > NAME_ARENA_SIZE(geometry.max_inodes))
+        committed = NAME_ARENA_SIZE(geometry.max_inodes);
+    if(commit_region(name_arena, name_arena_committed, committed) < 0) {
+        log_error("Error growing name arena: %m");
+        return -1;
+    }
+    name_arena_committed = committed;
+    return 0;
+}
+
+static void name_free_push(uint32_t granule, uint32_t granules) {
+    int class = granules - 1;
+    if(name_free_count[class] == name_free_capacity[class]) {
+        uint32_t capacity = name_free_capacity[class] ? name_free_capacity[class] * 2 : 64;
+        uint32_t *grown = realloc(name_free[class], capacity * sizeof(uint32_t));
+        if(grown == NULL) {
+            log_error("Error growing name free list: %m"); // The chunk is found again at the next mount
+            return;
+        }
+        name_free[class] = grown;
+        name_free_capacity[class] = capacity;
+    }
+    name_free[class][name_free_count[class]++] = granule;
+}
+
+// Returns the first granule of a free chunk of granules, 0 if the arena is full
+static uint32_t name_allocate(uint32_t granules) {
+    int class = granules - 1;
+    if(name_free_count[class] > 0)
+        return name_free[class][--name_free_count[class]];
+
+    if(name_arena_commit(name_granules_used + granules) == 0) {
+        uint32_t granule = name_granules_used;
+        name_granules_used += granules;
+        superblock_dirty = true;
+        return granule;
+    }
+
+    // Split a larger free chunk and keep the rest
+    for(int larger = class + 1; larger < NAME_CLASSES; larger++) {
+        if(name_free_count[larger] > 0) {
+            uint32_t granule = name_free[larger][--name_free_count[larger]];
+            name_free_push(granule + granules, larger - class);
+            return granule;
+        }
+    }
+    return 0;
+}
+
+// Returns the first granule of a chunk of granules, at most NAME_CLASSES, 0 if the arena is full
+uint32_t name_arena_allocate(uint32_t granules) {
+    pthread_mutex_lock(&name_arena_mutex);
+    uint32_t granule = name_allocate(granules);
+    pthread_mutex_unlock(&name_arena_mutex);
+    return granule;
+}
+
+void name_arena_free(uint32_t granule, uint32_t granules) {
+    pthread_mutex_lock(&name_arena_mutex);
+    name_free_push(granule, granules);
+    pthread_mutex_unlock(&name_arena_mutex);
+}
+
+// Copy the first length characters of name into the arena
+// Returns its first granule, 0 if the arena is full
+uint32_t name_store(const char *name, size_t length) {
+    uint32_t granules = name_class_granules(length);
+    uint32_t granule = name_arena_allocate(granules);
+    if(granule == 0)
+        return 0;
+    char *stored = name_arena + (size_t)granule * NAME_GRANULE;
+    memcpy(stored, name, length);
+    memset(stored + length, 0, (size_t)granules * NAME_GRANULE - length); // No stale bytes reach the image
+    mark_names_dirty(granule, granules);
+    return granule;
+}
+
+// Give back the chunk of a name of length characters stored at granule
+void name_release(uint32_t granule, size_t length) {
+    if(granule != 0)
+        name_arena_free(granule, name_class_granules(length));
+}
+
+// Chunks the inode holds in the arena: its name and, for an inline file, its data
+// Returns the number of chunks, granules 0 for none
+static int name_chunks(const Inode *inode, uint32_t index, uint32_t first[2], uint32_t granules[2]) {
+    if(!inode->is_active)
+        return 0;
+    first[0] = inode->name;
+    granules[0] = inode->name != 0 ? name_class_granules(inode->name_length) : 0;
+    if(!inode->is_inline)
+        return 1;
+    first[1] = inode_cold[index].inline_data;
+    granules[1] = INLINE_GRANULES(inode->size);
+    return 2;
+}
+
+// Recompute the end of the arena and the free lists from the names and inline data of the active inodes
+// Called after the tables were loaded or replayed, before the filesystem is mounted
+// Returns -1 if out of memory
+int name_arena_rebuild(const Inode fs[]) {
+    uint32_t first[2];
+    uint32_t granules[2];
+    uint32_t used = 1; // The empty name
+    for(uint32_t i = 0; i < geometry.inode_slots; i++) {
+        int chunks = name_chunks(&fs[i], i, first, granules);
+        for(int c = 0; c < chunks; c++) {
+            if(granules[c] > 0 && first[c] + granules[c] > used)
+                used = first[c] + granules[c];
+        }
+    }
+    if(used != name_granules_used)
+        superblock_dirty = true;
+    name_granules_used = used;
+
+    uint64_t *taken = calloc(BITMAP_WORDS(used), sizeof(uint64_t));
+    if(taken == NULL) {
+        log_error("Error rebuilding name arena: %m");
+        return -1;
+    }
+    taken[0] = 1;
+    for(uint32_t i = 0; i < geometry.inode_slots; i++) {
+        int chunks = name_chunks(&fs[i], i, first, granules);
+        for(int c = 0; c < chunks; c++) {
+            for(uint32_t g = first[c]; g < first[c] + granules[c]; g++)
+                taken[g / 64] |= (uint64_t)1 << (g % 64);
+        }
+    }
+
+    // Hand out the gaps between names in the largest chunks they fit
+    for(int class = 0; class < NAME_CLASSES; class++)
+        name_free_count[class] = 0;
+    uint32_t g = 0;
+    while(g < used) {
+        if(taken[g / 64] & ((uint64_t)1 << (g % 64))) {
+            g++;
+            continue;
+        }
+        uint32_t end = g;
+        while(end < used && !(taken[end / 64] & ((uint64_t)1 << (end % 64))))
+            end++;
+        while(g < end) {
+            uint32_t granules = end - g < NAME_CLASSES ? end - g : NAME_CLASSES;
+            name_free_push(g, granules);
+            g += granules;
+        }
+    }
+    free(taken);
+    return 0;
+}
+
+// Reserve the arena for the inode cap, of which granules are in use
+// Returns -1 if error occurred
+int name_arena_reserve(uint32_t granules) {
+    name_arena = reserve_region(NAME_ARENA_SIZE(geometry.max_inodes));
+    name_dirty = allocate_region(BITMAP_WORDS(NAME_ARENA_SIZE(geometry.max_inodes) / NAME_PAGE + 1) * sizeof(uint64_t));
+    if(name_arena == NULL || name_dirty == NULL)
+        return -1;
+    name_arena_committed = 0;
+    name_granules_used = granules > 0 ? granules : 1;
+    return name_arena_commit(name_granules_used);
+}
+
+void name_arena_release(void) {
+    munmap(name_arena, NAME_ARENA_SIZE(geometry.max_inodes));
+    munmap(name_dirty, BITMAP_WORDS(NAME_ARENA_SIZE(geometry.max_inodes) / NAME_PAGE + 1) * sizeof(uint64_t));
+    for(int class = 0; class < NAME_CLASSES; class++) {
+        free(name_free[class]);
+        name_free[class] = NULL;
+        name_free_count[class] = 0;
+        name_free_capacity[class] = 0;
+    }
+    name_arena = NULL;
+    name_arena_committed = 0;
+    name_granules_used = 0;
+}
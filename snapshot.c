@@ -0,0 +1,318 @@
+// Snapshots and file clones
+//
+// Commands are written to the control file in the root directory, one per line, e.g.
+// echo "snapshot daily /home" > /.dm510fs-control
+//   snapshot NAME [PATH]   copy the tree at PATH, the whole filesystem by default, to /.snapshots/NAME
+//   drop NAME              remove the snapshot NAME
+//   clone SOURCE TARGET    create the file TARGET holding the data of the file SOURCE
+// Paths are absolute within the filesystem and cannot contain blanks.
+// A copy takes new inodes, names and block maps, and shares every data block with its source through the
+// reference counts of dedup.c, so it costs a counter per block and no data is copied. Whichever side writes
+// to a shared block first gets a copy of its own, see dedup_claim().
+// Snapshots are read-only, every change below SNAPSHOT_DIRNAME fails with EROFS, see in_snapshot().
+// A command holds the exclusive namespace lock throughout, so a snapshot is a consistent image of its tree.
+// Snapshots are built and dropped under a partial name, SNAPSHOT_BATCH_INODES inodes per transaction, which
+// keeps the journal records and cache holds of a transaction bounded. A snapshot only takes or loses its name
+// in a small transaction of its own, and mount removes what a crash left partial, see snapshot_recover(), so
+// after a crash a snapshot is there whole or not at all.
+
+// Inodes copied or removed by the running transaction, commands run one at a time under the namespace lock
+static int snapshot_batch;
+
+// Start the next transaction once the running one holds SNAPSHOT_BATCH_INODES inodes, called between inodes
+static void snapshot_step(void) {
+    if(++snapshot_batch < SNAPSHOT_BATCH_INODES)
+        return;
+    journal_end(filesystem, block_bitmap, data_blocks);
+    journal_begin();
+    snapshot_batch = 0;
+}
+
+// Returns the slot of the directory holding the snapshots, -1 before the first snapshot
+static int snapshot_area(void) {
+    PathName name = path_name(SNAPSHOT_DIRNAME);
+    int area = find_child(filesystem, ROOT_INDEX, &name);
+    return area >= 0 && filesystem[area].is_dir ? area : -1;
+}
+
+// Whether the inode at index is a snapshot or in one, callers hold the namespace lock
+bool in_snapshot(int index) {
+    int area = snapshot_area();
+    return area >= 0 && is_ancestor(filesystem, area, index);
+}
+
+// Make the file at copy, just created, hold the data of the file at source, called inside a transaction
+// Returns 0, -ENOSPC if no room was left for the inline data or the block map, -ENOMEM or -EIO
+static int snapshot_share_data(int source, int copy) {
+    Inode *from = &filesystem[source];
+    InodeCold *cold = &inode_cold[source];
+    InodeCold *target = &inode_cold[copy];
+    if(from->is_inline) {
+        if(inline_resize(copy, from->size) < 0)
+            return -ENOSPC;
+        memcpy(INLINE_DATA(target), INLINE_DATA(cold), from->size);
+        mark_names_dirty(target->inline_data, INLINE_GRANULES(from->size));
+        filesystem[copy].size = from->size;
+        return 0;
+    }
+    if(cold->extent_count == 0) {
+        filesystem[copy].size = from->size;
+        return 0;
+    }
+
+    ExtentWalk walk;
+    extent_walk(&walk, cold, data_blocks);
+    int result = 0;
+    uint32_t shared = 0;
+    for(const Extent *extent; (extent = extent_next(&walk)) != NULL; shared++) {
+        if(dedup_share(extent->start, EXTENT_STORED(*extent)) < 0) {
+            result = -ENOMEM;
+            break;
+        }
+    }
+    if(result == 0)
+        result = walk.error;
+    extent_walk_end(&walk);
+    // The copy gets a map of its own, which it changes without touching the source
+    if(result == 0)
+        result = extent_copy(cold, target, block_bitmap, data_blocks);
+    if(result == 0) {
+        filesystem[copy].size = from->size;
+    } else {
+        extent_walk(&walk, cold, data_blocks);
+        for(const Extent *extent; shared > 0 && (extent = extent_next(&walk)) != NULL; shared--)
+            deallocate_blocks(block_bitmap, extent->start, EXTENT_STORED(*extent)); // Only drops the references again
+        extent_walk_end(&walk);
+    }
+    mark_inode_dirty(copy);
+    return result;
+}
+
+// Remove the inode at index and everything below it, called inside a transaction, which it may end and restart
+static void snapshot_remove_tree(int index) {
+    while(inode_cold[index].first_child >= 0)
+        snapshot_remove_tree(inode_cold[index].first_child);
+    remove_inode(filesystem, block_bitmap, data_blocks, index);
+    inode_count--;
+    snapshot_step();
+}
+
+// Give the inode at index, in the snapshot directory, the name, called inside a transaction
+// Returns 0, -ENOSPC if the name arena is full
+static int snapshot_rename(int index, const PathName *name) {
+    uint32_t stored = name_store(name->text, name->length);
+    if(stored == 0)
+        return -ENOSPC;
+    path_index_remove(filesystem, index);
+    name_release(filesystem[index].name, filesystem[index].name_length);
+    filesystem[index].name = stored;
+    filesystem[index].name_length = name->length;
+    path_index_insert(filesystem, index);
+    mark_inode_dirty(index);
+    return 0;
+}
+
+// Copy the inode at source and, for a directory, everything below it but skip to name in the directory parent,
+// called inside a transaction, which it may end and restart
+// Returns the slot of the copy, or -errno with the copy left partial
+static int snapshot_copy(int source, int parent, const PathName *name, int skip) {
+    Inode *from = &filesystem[source];
+    int copy = add_entry_locked(parent, name, from->mode, from->devno);
+    if(copy < 0)
+        return copy;
+
+    int result = 0;
+    if(from->is_dir) {
+        for(int child = inode_cold[source].first_child; result >= 0 && child >= 0; child = inode_cold[child].next_sibling)
+            if(child != skip) {
+                PathName child_name = path_name_length(INODE_NAME(&filesystem[child]), filesystem[child].name_length);
+                result = snapshot_copy(child, copy, &child_name, skip);
+            }
+    } else {
+        result = snapshot_share_data(source, copy);
+    }
+    if(result < 0)
+        return result;
+
+    Inode *to = &filesystem[copy];
+    to->owner = from->owner;
+    to->group = from->group;
+    to->access_time = from->access_time;
+    to->modif_time = from->modif_time;
+    mark_inode_dirty(copy);
+    snapshot_step();
+    return copy;
+}
+
+static bool snapshot_name_valid(const char *name) {
+    return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0
+        && strncmp(name, SNAPSHOT_PARTIAL_PREFIX, strlen(SNAPSHOT_PARTIAL_PREFIX)) != 0
+        && strlen(SNAPSHOT_PARTIAL_PREFIX) + strlen(name) + 1 <= MAX_NAME_LENGTH;
+}
+
+// Returns the partial name of the snapshot called name
+static PathName snapshot_partial_name(const char *name, char partial[MAX_NAME_LENGTH]) {
+    snprintf(partial, MAX_NAME_LENGTH, "%s%s", SNAPSHOT_PARTIAL_PREFIX, name);
+    return path_name(partial);
+}
+
+// Remove the partial snapshot at index, called inside a transaction, which it ends and restarts
+static void snapshot_discard(int index) {
+    snapshot_remove_tree(index);
+    journal_end(filesystem, block_bitmap, data_blocks);
+    journal_begin();
+    snapshot_batch = 0;
+}
+
+// Snapshot the tree at path as name, callers hold the namespace lock exclusively
+// Returns 0 or -errno
+static int snapshot_create_locked(const char *name, const char *path) {
+    if(!snapshot_name_valid(name)) return -EINVAL;
+    PathName view = path_name(name);
+    int source = find_active_path_index(filesystem, geometry.inode_slots, path);
+    if(source < 0) return -ENOENT;
+    int area = snapshot_area();
+    if(area >= 0 && source == area) return -EINVAL;
+    if(area >= 0 && find_child(filesystem, area, &view) >= 0) return -EEXIST;
+
+    journal_begin();
+    snapshot_batch = 0;
+    if(area < 0) {
+        PathName area_name = path_name(SNAPSHOT_DIRNAME);
+        area = add_entry_locked(ROOT_INDEX, &area_name, S_IFDIR | 0555, 0);
+    }
+    char text[MAX_NAME_LENGTH];
+    PathName partial = snapshot_partial_name(name, text);
+    int leftover = area < 0 ? -1 : find_child(filesystem, area, &partial);
+    if(leftover >= 0)
+        snapshot_discard(leftover); // Of a drop that failed to rename it
+    int copy = area < 0 ? area : snapshot_copy(source, area, &partial, area);
+    int result = copy < 0 ? copy : 0;
+    if(result < 0) {
+        leftover = area < 0 ? -1 : find_child(filesystem, area, &partial);
+        if(leftover >= 0)
+            snapshot_discard(leftover);
+    } else if((result = snapshot_rename(copy, &view)) < 0) {
+        snapshot_discard(copy);
+    }
+    journal_end(filesystem, block_bitmap, data_blocks);
+    if(result == 0)
+        log_info("Snapshot %s of %s taken", name, path);
+    return result;
+}
+
+// Returns 0 or -errno
+static int snapshot_drop_locked(const char *name) {
+    int area = snapshot_area();
+    PathName view = path_name(name);
+    int index = area < 0 ? -1 : find_child(filesystem, area, &view);
+    if(index < 0) return -ENOENT;
+
+    // The snapshot loses its name first, so a crash while it is removed cannot leave part of it behind
+    char text[MAX_NAME_LENGTH];
+    PathName partial = snapshot_partial_name(name, text);
+    journal_begin();
+    snapshot_batch = 0;
+    int leftover = find_child(filesystem, area, &partial);
+    if(leftover >= 0)
+        snapshot_discard(leftover);
+    int result = snapshot_rename(index, &partial);
+    journal_end(filesystem, block_bitmap, data_blocks);
+    if(result < 0)
+        return result;
+
+    journal_begin();
+    snapshot_batch = 0;
+    snapshot_remove_tree(index);
+    journal_end(filesystem, block_bitmap, data_blocks);
+    log_info("Snapshot %s dropped", name);
+    return 0;
+}
+
+// Remove the snapshots a crash left partial, while they were built or dropped, called by mount
+void snapshot_recover(void) {
+    int area = snapshot_area();
+    if(area < 0)
+        return;
+    journal_begin();
+    snapshot_batch = 0;
+    for(int child = inode_cold[area].first_child; child >= 0; ) {
+        int next = inode_cold[child].next_sibling;
+        if(filesystem[child].name_length >= strlen(SNAPSHOT_PARTIAL_PREFIX)
+                && memcmp(INODE_NAME(&filesystem[child]), SNAPSHOT_PARTIAL_PREFIX, strlen(SNAPSHOT_PARTIAL_PREFIX)) == 0) {
+            log_info("Removing the partial snapshot %.*s", (int)filesystem[child].name_length, INODE_NAME(&filesystem[child]));
+            snapshot_remove_tree(child);
+        }
+        child = next;
+    }
+    journal_end(filesystem, block_bitmap, data_blocks);
+}
+
+// Create the file at target_path holding the data of the file at source_path, callers hold the namespace lock exclusively
+// Returns 0 or -errno
+static int clone_file_locked(const char *source_path, const char *target_path) {
+    int source = find_active_path_index(filesystem, geometry.inode_slots, source_path);
+    if(source < 0) return -ENOENT;
+    if(filesystem[source].is_dir) return -EISDIR;
+    if(strlen(target_path) + 1 > MAX_PATH_LENGTH) return -ENAMETOOLONG;
+    PathName name;
+    int parent = find_parent_index(filesystem, geometry.inode_slots, target_path, &name);
+    if(parent < 0) return -ENOENT;
+
+    journal_begin();
+    int copy = create_entry_locked(parent, &name, filesystem[source].mode, filesystem[source].devno);
+    int result = copy < 0 ? copy : snapshot_share_data(source, copy);
+    if(copy >= 0 && result < 0) {
+        remove_inode(filesystem, block_bitmap, data_blocks, copy);
+        inode_count--;
+    }
+    journal_end(filesystem, block_bitmap, data_blocks);
+    return result < 0 ? result : 0;
+}
+
+// Run one command of the control file, see the top of this file
+// Returns 0 or -errno
+static int control_run(char *line) {
+    char *save;
+    char *command = strtok_r(line, " \t\r", &save);
+    if(command == NULL)
+        return 0; // Blank lines are allowed
+    char *first = strtok_r(NULL, " \t\r", &save);
+    char *second = strtok_r(NULL, " \t\r", &save);
+    if(first == NULL || strtok_r(NULL, " \t\r", &save) != NULL || (second != NULL && second[0] != '/'))
+        return -EINVAL;
+
+    int result;
+    pthread_rwlock_wrlock(&namespace_lock);
+    if(strcmp(command, "snapshot") == 0)
+        result = snapshot_create_locked(first, second != NULL ? second : "/");
+    else if(strcmp(command, "drop") == 0 && second == NULL)
+        result = snapshot_drop_locked(first);
+    else if(strcmp(command, "clone") == 0 && first[0] == '/' && second != NULL)
+        result = clone_file_locked(first, second);
+    else
+        result = -EINVAL;
+    pthread_rwlock_unlock(&namespace_lock);
+    if(result < 0)
+        log_warn("Control command %s %s failed: %s", command, first, strerror(-result));
+    return result;
+}
+
+// Run the commands in the size bytes of buf, written to the control file
+// Returns size, or the -errno of the first command that failed, the commands before it stay done
+int control_write(const char *buf, size_t size) {
+    char line[2 * MAX_PATH_LENGTH + 16];
+    for(size_t at = 0; at < size; ) {
+        const char *end = memchr(buf + at, '\n', size - at);
+        size_t length = end != NULL ? (size_t)(end - buf) - at : size - at;
+        if(length >= sizeof(line))
+            return -ENAMETOOLONG;
+        memcpy(line, buf + at, length);
+        line[length] = '\0';
+        int result = control_run(line);
+        if(result < 0)
+            return result;
+        at += length + 1;
+    }
+    return size;
+}
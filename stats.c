@@ -0,0 +1,345 @@
+// Operation statistics
+//
+// Every handler runs through a wrapper that takes two CLOCK_MONOTONIC readings and adds the
+// duration to a histogram owned by the calling thread. Counters have a single writer, so updates
+// are plain relaxed stores without locked instructions; readers sum all threads when rendering.
+// The totals are read through /.dm510fs-stats (text) and /.dm510fs-stats.json, rendered into a
+// snapshot when the file is opened.
+
+ThreadStats *thread_stats; // Every set ever created, new ones are pushed at the head and none is unlinked
+pthread_mutex_t thread_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread ThreadStats *own_stats;
+pthread_key_t stats_key; // Releases the counters of an exiting thread
+pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+uint64_t stats_started_ns;
+
+static const char *stats_operation_names[OP_COUNT] = {
+    "getattr", "lookup", "setattr", "readdir", "open", "read", "write", "mknod", "mkdir", "unlink", "rmdir",
+    "rename", "truncate", "utime", "release", "flush", "fsync", "fallocate", "checkpoint", "journal_commit"
+};
+
+static inline uint64_t stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline uint32_t stats_bucket(uint64_t ns) {
+    if(ns < (2 << STATS_SUB_BITS))
+        return ns;
+    if(ns >= (uint64_t)1 << STATS_MAX_BITS)
+        return STATS_BUCKETS - 1;
+    uint32_t shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+    return ((shift + 1) << STATS_SUB_BITS) + (ns >> shift) - (1 << STATS_SUB_BITS);
+}
+
+// Smallest duration that falls into bucket, and the width of the bucket
+static inline uint64_t stats_bucket_floor(uint32_t bucket, uint64_t *width) {
+    if(bucket < (2 << STATS_SUB_BITS)) {
+        *width = 1;
+        return bucket;
+    }
+    uint32_t shift = (bucket >> STATS_SUB_BITS) - 1;
+    *width = (uint64_t)1 << shift;
+    return (uint64_t)((1 << STATS_SUB_BITS) + (bucket & ((1 << STATS_SUB_BITS) - 1))) << shift;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void stats_set_release(void *set) {
+    __atomic_store_n(&((ThreadStats *)set)->in_use, false, __ATOMIC_RELEASE);
+}
+
+void stats_key_create(void) {
+    pthread_key_create(&stats_key, stats_set_release);
+}
+
+// Take over the counters of an exited thread, or create a new set
+// Returns NULL if no memory was left for a new set
+ThreadStats *stats_acquire(void) {
+    pthread_once(&stats_key_once, stats_key_create);
+    pthread_mutex_lock(&thread_stats_mutex);
+    ThreadStats *set = thread_stats;
+    while(set != NULL && __atomic_load_n(&set->in_use, __ATOMIC_ACQUIRE))
+        set = set->next;
+    if(set == NULL) {
+        set = calloc(1, sizeof(ThreadStats));
+        if(set != NULL) {
+            set->next = thread_stats;
+            __atomic_store_n(&thread_stats, set, __ATOMIC_RELEASE);
+        }
+    }
+    if(set != NULL)
+        set->in_use = true;
+    pthread_mutex_unlock(&thread_stats_mutex);
+
+    if(set != NULL)
+        pthread_setspecific(stats_key, set);
+    return set;
+}
+
+// Account one operation that started at start, result is its return value
+void stats_record(int op, uint64_t start, int result) {
+    uint64_t ns = stats_clock() - start;
+    if(own_stats == NULL && (own_stats = stats_acquire()) == NULL)
+        return;
+
+    ThreadStats *set = own_stats;
+    stats_add(&set->count[op], 1);
+    stats_add(&set->total_ns[op], ns);
+    stats_add(&set->buckets[op][stats_bucket(ns)], 1);
+    if(ns > set->max_ns[op])
+        __atomic_store_n(&set->max_ns[op], ns, __ATOMIC_RELAXED);
+    if(result < 0)
+        stats_add(&set->errors[op], 1);
+    else if(op == OP_READ)
+        stats_add(&set->bytes_read, result);
+    else if(op == OP_WRITE)
+        stats_add(&set->bytes_written, result);
+    else if(op == OP_CHECKPOINT)
+        stats_add(&set->checkpoint_records, result);
+}
+
+// Account a cluster of length bytes the codec was given at start, stored is what it compressed to, 0 if it stayed raw
+void stats_compress(uint64_t start, size_t length, size_t stored) {
+    uint64_t ns = stats_clock() - start;
+    if(own_stats == NULL && (own_stats = stats_acquire()) == NULL)
+        return;
+
+    ThreadStats *set = own_stats;
+    stats_add(&set->compress_clusters, 1);
+    stats_add(&set->compress_ns, ns);
+    if(stored == 0) {
+        stats_add(&set->compress_rejected, 1);
+    } else {
+        stats_add(&set->compress_in, length);
+        stats_add(&set->compress_out, stored);
+    }
+}
+
+// Account length bytes decompressed since start
+void stats_decompress(uint64_t start, size_t length) {
+    uint64_t ns = stats_clock() - start;
+    if(own_stats == NULL && (own_stats = stats_acquire()) == NULL)
+        return;
+
+    stats_add(&own_stats->decompress_bytes, length);
+    stats_add(&own_stats->decompress_ns, ns);
+}
+
+// Sum the counters of every thread into total
+void stats_collect(ThreadStats *total) {
+    memset(total, 0, sizeof(ThreadStats));
+    for(ThreadStats *set = __atomic_load_n(&thread_stats, __ATOMIC_ACQUIRE); set != NULL; set = set->next){
+        for(int op = 0; op < OP_COUNT; op++){
+            total->count[op] += __atomic_load_n(&set->count[op], __ATOMIC_RELAXED);
+            total->errors[op] += __atomic_load_n(&set->errors[op], __ATOMIC_RELAXED);
+            total->total_ns[op] += __atomic_load_n(&set->total_ns[op], __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&set->max_ns[op], __ATOMIC_RELAXED);
+            if(max > total->max_ns[op])
+                total->max_ns[op] = max;
+            for(int b = 0; b < STATS_BUCKETS; b++)
+                total->buckets[op][b] += __atomic_load_n(&set->buckets[op][b], __ATOMIC_RELAXED);
+        }
+        total->bytes_read += __atomic_load_n(&set->bytes_read, __ATOMIC_RELAXED);
+        total->bytes_written += __atomic_load_n(&set->bytes_written, __ATOMIC_RELAXED);
+        total->checkpoint_records += __atomic_load_n(&set->checkpoint_records, __ATOMIC_RELAXED);
+        total->compress_clusters += __atomic_load_n(&set->compress_clusters, __ATOMIC_RELAXED);
+        total->compress_rejected += __atomic_load_n(&set->compress_rejected, __ATOMIC_RELAXED);
+        total->compress_in += __atomic_load_n(&set->compress_in, __ATOMIC_RELAXED);
+        total->compress_out += __atomic_load_n(&set->compress_out, __ATOMIC_RELAXED);
+        total->compress_ns += __atomic_load_n(&set->compress_ns, __ATOMIC_RELAXED);
+        total->decompress_bytes += __atomic_load_n(&set->decompress_bytes, __ATOMIC_RELAXED);
+        total->decompress_ns += __atomic_load_n(&set->decompress_ns, __ATOMIC_RELAXED);
+    }
+}
+
+// Duration below which fraction of the operations finished, taken as the middle of its bucket
+uint64_t stats_percentile(const ThreadStats *total, int op, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * total->count[op]);
+    uint64_t seen = 0;
+    for(int b = 0; b < STATS_BUCKETS; b++){
+        seen += total->buckets[op][b];
+        if(seen > rank) {
+            uint64_t width;
+            uint64_t floor = stats_bucket_floor(b, &width);
+            uint64_t middle = floor + width / 2;
+            return middle < total->max_ns[op] ? middle : total->max_ns[op];
+        }
+    }
+    return total->max_ns[op];
+}
+
+// Names of the virtual statistics files and the control file of snapshot.c, which live in the root directory
+bool is_stats_name(const char *name) {
+    return name[0] == '.' && (strcmp(name, STATS_FILENAME) == 0 || strcmp(name, STATS_JSON_FILENAME) == 0
+        || strcmp(name, CONTROL_FILENAME) == 0);
+}
+
+bool is_control_path(const char *path) {
+    return path[0] == '/' && strcmp(path + 1, CONTROL_FILENAME) == 0;
+}
+
+bool is_stats_path(const char *path) {
+    return path[0] == '/' && is_stats_name(path + 1);
+}
+
+// Render the statistics as text, or as JSON if path is the JSON file
+// Returns a malloc'ed buffer holding length bytes, NULL if error occurred
+char *stats_render(const char *path, size_t *length) {
+    static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+    bool json = strcmp(path + 1, STATS_JSON_FILENAME) == 0;
+
+    ThreadStats *total = malloc(sizeof(ThreadStats));
+    char *text = NULL;
+    FILE *out = total != NULL ? open_memstream(&text, length) : NULL;
+    if(out == NULL) {
+        free(total);
+        return NULL;
+    }
+    stats_collect(total);
+
+    double uptime = (stats_clock() - stats_started_ns) / 1e9;
+    uint32_t blocks = geometry.block_count;
+    uint32_t used_blocks = __atomic_load_n(&blocks_used, __ATOMIC_RELAXED);
+    int inodes = __atomic_load_n(&inode_count, __ATOMIC_RELAXED);
+    CacheStats cache;
+    cache_collect(&cache);
+    // Ratio of the clusters stored compressed, 1 until there are any
+    double ratio = total->compress_out ? (double)total->compress_in / total->compress_out : 1.0;
+    DedupStats dedup;
+    dedup_collect(&dedup);
+    // Blocks the files map for each block they take
+    double dedup_ratio = used_blocks ? (double)(used_blocks + dedup.saved) / used_blocks : 1.0;
+
+    if(json) {
+        fprintf(out, "{\n  \"uptime_seconds\": %.3f,\n", uptime);
+        fprintf(out, "  \"inodes\": {\"used\": %d, \"slots\": %u, \"max\": %u},\n", inodes, geometry.inode_slots, geometry.max_inodes);
+        fprintf(out, "  \"blocks\": {\"used\": %u, \"committed\": %u, \"max\": %u, \"block_size\": %u},\n",
+                used_blocks, blocks, geometry.max_blocks, geometry.block_size);
+        fprintf(out, "  \"cache\": {\"frames\": %u, \"resident\": %u, \"unit_bytes\": %zu, \"hits\": %llu, \"misses\": %llu, "
+                "\"evictions\": %llu, \"writebacks\": %llu},\n", cache.frames, cache.resident, cache.unit_bytes,
+                (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+                (unsigned long long)cache.evictions, (unsigned long long)cache.writebacks);
+        fprintf(out, "  \"compression\": {\"enabled\": %s, \"clusters\": %llu, \"raw\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, "
+                "\"ratio\": %.3f, \"compress_ns\": %llu, \"decompressed_bytes\": %llu, \"decompress_ns\": %llu},\n",
+                compress_enabled ? "true" : "false", (unsigned long long)total->compress_clusters,
+                (unsigned long long)total->compress_rejected, (unsigned long long)total->compress_in,
+                (unsigned long long)total->compress_out, ratio, (unsigned long long)total->compress_ns,
+                (unsigned long long)total->decompress_bytes, (unsigned long long)total->decompress_ns);
+        fprintf(out, "  \"dedup\": {\"enabled\": %s, \"indexed\": %u, \"shared\": %u, \"saved\": %llu, \"ratio\": %.3f, "
+                "\"lookups\": %llu, \"hits\": %llu, \"index_bytes\": %zu},\n", dedup_enabled ? "true" : "false",
+                dedup.indexed, dedup.shared, (unsigned long long)dedup.saved, dedup_ratio,
+                (unsigned long long)dedup.lookups, (unsigned long long)dedup.hits, dedup.index_bytes);
+        fprintf(out, "  \"bytes_read\": %llu,\n  \"bytes_written\": %llu,\n  \"checkpoint_records\": %llu,\n",
+                (unsigned long long)total->bytes_read, (unsigned long long)total->bytes_written,
+                (unsigned long long)total->checkpoint_records);
+        fprintf(out, "  \"operations\": {");
+        for(int op = 0; op < OP_COUNT; op++){
+            uint64_t count = total->count[op];
+            fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"errors\": %llu, \"mean_ns\": %llu", op ? "," : "",
+                    stats_operation_names[op], (unsigned long long)count, (unsigned long long)total->errors[op],
+                    (unsigned long long)(count ? total->total_ns[op] / count : 0));
+            for(int p = 0; p < 4; p++)
+                fprintf(out, ", \"%s_ns\": %llu", percentile_names[p], (unsigned long long)stats_percentile(total, op, percentiles[p]));
+            fprintf(out, ", \"max_ns\": %llu}", (unsigned long long)total->max_ns[op]);
+        }
+        fprintf(out, "\n  }\n}\n");
+    } else {
+        fprintf(out, "uptime %.3f s\n", uptime);
+        fprintf(out, "inodes %d used, %u slots, %u max\n", inodes, geometry.inode_slots, geometry.max_inodes);
+        fprintf(out, "blocks %u used, %u committed, %u max, %u bytes each\n", used_blocks, blocks, geometry.max_blocks, geometry.block_size);
+        fprintf(out, "cache %u of %u units of %zu bytes, %llu hits, %llu misses, %llu evictions, %llu writebacks\n",
+                cache.resident, cache.frames, cache.unit_bytes, (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+                (unsigned long long)cache.evictions, (unsigned long long)cache.writebacks);
+        fprintf(out, "compression %s, %llu clusters, %llu left raw, %llu bytes to %llu (ratio %.2f) in %.1f ms, %llu bytes decompressed in %.1f ms\n",
+                compress_enabled ? "on" : "off", (unsigned long long)total->compress_clusters, (unsigned long long)total->compress_rejected,
+                (unsigned long long)total->compress_in, (unsigned long long)total->compress_out, ratio, total->compress_ns / 1e6,
+                (unsigned long long)total->decompress_bytes, total->decompress_ns / 1e6);
+        fprintf(out, "dedup %s, %u blocks indexed, %u shared, %llu saved (ratio %.2f), %llu of %llu lookups matched, index %zu KiB\n",
+                dedup_enabled ? "on" : "off", dedup.indexed, dedup.shared, (unsigned long long)dedup.saved, dedup_ratio,
+                (unsigned long long)dedup.hits, (unsigned long long)dedup.lookups, dedup.index_bytes / 1024);
+        fprintf(out, "bytes %llu read, %llu written\n", (unsigned long long)total->bytes_read, (unsigned long long)total->bytes_written);
+        fprintf(out, "checkpoints wrote %llu records\n\n", (unsigned long long)total->checkpoint_records);
+        fprintf(out, "%-15s %10s %8s %10s %10s %10s %10s %10s %10s\n",
+                "operation", "count", "errors", "mean us", "p50 us", "p90 us", "p99 us", "p999 us", "max us");
+        for(int op = 0; op < OP_COUNT; op++){
+            uint64_t count = total->count[op];
+            fprintf(out, "%-15s %10llu %8llu %10.1f", stats_operation_names[op], (unsigned long long)count,
+                    (unsigned long long)total->errors[op], count ? total->total_ns[op] / 1e3 / count : 0.0);
+            for(int p = 0; p < 4; p++)
+                fprintf(out, " %10.1f", stats_percentile(total, op, percentiles[p]) / 1e3);
+            fprintf(out, " %10.1f\n", total->max_ns[op] / 1e3);
+        }
+    }
+
+    free(total);
+    if(fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// The stats files are read-only regular files. Their size is unknown until rendered, so it is
+// reported as 0 and reads bypass the page cache (direct_io) to reach the end of the snapshot.
+// The control file is write-only, see control_write()
+void stats_getattr(const char *path, struct stat *stbuf) {
+    stbuf->st_mode = S_IFREG | (is_control_path(path) ? 0200 : 0444);
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = time(NULL);
+}
+
+int stats_open(const char *path, struct fuse_file_info *fi) {
+    if(is_control_path(path)) {
+        if((fi->flags & O_ACCMODE) == O_RDONLY)
+            return -EACCES;
+        fi->fh = 0;
+        fi->direct_io = 1; // Every write reaches control_write()
+        return 0;
+    }
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+
+    StatsSnapshot *snapshot = malloc(sizeof(StatsSnapshot));
+    if(snapshot == NULL)
+        return -ENOMEM;
+    snapshot->text = stats_render(path, &snapshot->length);
+    if(snapshot->text == NULL) {
+        free(snapshot);
+        return -ENOMEM;
+    }
+    fi->fh = (uintptr_t)snapshot;
+    fi->direct_io = 1;
+    return 0;
+}
+
+// Without a file handle a fresh snapshot is rendered for this read alone
+int stats_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if(is_control_path(path))
+        return -EACCES;
+    StatsSnapshot own = { 0, NULL };
+    const StatsSnapshot *snapshot = fi != NULL && fi->fh ? (const StatsSnapshot *)(uintptr_t)fi->fh : &own;
+    if(snapshot == &own && (own.text = stats_render(path, &own.length)) == NULL)
+        return -ENOMEM;
+
+    size_t available = (size_t)offset < snapshot->length ? snapshot->length - offset : 0;
+    size_t copied = size < available ? size : available;
+    memcpy(buf, snapshot->text + offset, copied);
+    free(own.text);
+    return copied;
+}
+
+void stats_release(struct fuse_file_info *fi) {
+    StatsSnapshot *snapshot = (StatsSnapshot *)(uintptr_t)fi->fh;
+    if(snapshot != NULL) {
+        free(snapshot->text);
+        free(snapshot);
+        fi->fh = 0;
+    }
+}
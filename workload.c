@@ -0,0 +1,457 @@
+// Concurrent end-to-end workloads against a mounted filesystem
+//
+// Unlike bench.c this goes through the kernel and FUSE, so it measures what applications see. Every mix
+// runs on several threads started together and prints one JSON line with throughput and latency percentiles.
+// Everything written carries a header naming its file, block and version and a payload derived from them,
+// so every read checks that it got back whole data of the right file and block; a mismatch is counted as
+// corruption. -v walks a tree left by an earlier run, e.g. after a remount, and checks every file the same way.
+//
+// Usage: dm510fs_workload [-t threads] [-d seconds] [-n files] [-s stream MiB] [-m mix,...] [-v] directory
+// Mixes: create (small file create storm), stat (metadata storm), stream (large sequential files),
+// mixed (random 4 KiB reads and writes to shared files). Exits non-zero on any error or corruption.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define CHUNK 4096 // Unit of every check, and the request size of the mixed workload
+#define SMALL_FILE_SIZE 256 // Files of the create storm
+#define STREAM_REQUEST (128 << 10)
+#define MIXED_FILES_PER_THREAD 8
+#define MIXED_FILE_SIZE (1 << 20)
+#define MIXED_READ_PERCENT 70
+#define MAGIC 0xd510f5a5
+
+typedef struct ChunkHeader {
+    uint32_t magic;
+    uint32_t file;
+    uint32_t block;
+    uint32_t version;
+} ChunkHeader;
+
+typedef struct Worker {
+    pthread_t thread;
+    int id;
+    uint64_t *samples; // Latency of each operation in ns
+    size_t sample_count;
+    size_t sample_capacity;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t corrupt;
+    uint64_t random_state;
+} Worker;
+
+// Options
+static int threads = 4;
+static int seconds = 5;
+static int files_per_thread = 1000;
+static uint64_t stream_bytes = 16 << 20;
+static const char *root;
+
+static Worker *workers;
+static pthread_barrier_t start_barrier;
+static uint64_t deadline_ns;
+static int mixed_files;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void record(Worker *worker, uint64_t start) {
+    if(worker->sample_count == worker->sample_capacity) {
+        worker->sample_capacity = worker->sample_capacity ? worker->sample_capacity * 2 : 4096;
+        worker->samples = realloc(worker->samples, worker->sample_capacity * sizeof(uint64_t));
+    }
+    worker->samples[worker->sample_count++] = now_ns() - start;
+}
+
+static void failure(Worker *worker, const char *what, const char *path) {
+    // Only the first few are printed, a crashed mount fails every call after it
+    if(worker->errors++ < 5)
+        fprintf(stderr, "thread %d: %s %s: %s\n", worker->id, what, path, strerror(errno));
+}
+
+// Fill a chunk of length bytes with the contents expected for the given file, block and version
+static void fill_chunk(char *buf, size_t length, uint32_t file, uint32_t block, uint32_t version) {
+    ChunkHeader header = { MAGIC, file, block, version };
+    uint64_t state = ((uint64_t)file << 32 | block) * 0x9e3779b97f4a7c15 + version + 1;
+    for(size_t i = sizeof(header); i < length; i += sizeof(uint64_t)) {
+        uint64_t word = next_random(&state);
+        memcpy(buf + i, &word, length - i < sizeof(word) ? length - i : sizeof(word));
+    }
+    memcpy(buf, &header, sizeof(header));
+}
+
+// Returns true if the chunk holds whole contents of some version of the given file and block
+static bool check_chunk(const char *buf, size_t length, uint32_t file, uint32_t block) {
+    char expected[CHUNK];
+    ChunkHeader header;
+    if(length < sizeof(header))
+        return false;
+    memcpy(&header, buf, sizeof(header));
+    if(header.magic != MAGIC || header.file != file || header.block != block)
+        return false;
+    fill_chunk(expected, length, file, block, header.version);
+    return memcmp(buf, expected, length) == 0;
+}
+
+// Read a whole file and check each of its chunks, returns false if the file could not be read
+static bool verify_file(Worker *worker, const char *path, uint32_t file, off_t expected_size) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        failure(worker, "open", path);
+        return false;
+    }
+    char buf[CHUNK];
+    off_t offset = 0;
+    ssize_t got;
+    while((got = pread(fd, buf, CHUNK, offset)) > 0) {
+        if(!check_chunk(buf, got, file, offset / CHUNK) && worker->corrupt++ < 5)
+            fprintf(stderr, "thread %d: %s: corrupt data at offset %lld\n", worker->id, path, (long long)offset);
+        offset += got;
+    }
+    if(got < 0)
+        failure(worker, "read", path);
+    else if(expected_size >= 0 && offset != expected_size && worker->corrupt++ < 5)
+        fprintf(stderr, "thread %d: %s: size %lld, expected %lld\n", worker->id, path, (long long)offset, (long long)expected_size);
+    close(fd);
+    return got == 0;
+}
+
+static void create_path(char *path, size_t size, int thread, int i) {
+    snprintf(path, size, "%s/create/t%d/f%d", root, thread, thread * files_per_thread + i);
+}
+
+static void *create_worker(void *arg) {
+    Worker *worker = arg;
+    char path[4096];
+    char buf[SMALL_FILE_SIZE];
+    snprintf(path, sizeof(path), "%s/create/t%d", root, worker->id);
+    if(mkdir(path, 0755) < 0)
+        failure(worker, "mkdir", path);
+
+    pthread_barrier_wait(&start_barrier);
+    for(int i = 0; i < files_per_thread; i++) {
+        uint32_t file = worker->id * files_per_thread + i;
+        create_path(path, sizeof(path), worker->id, i);
+        fill_chunk(buf, sizeof(buf), file, 0, 0);
+        uint64_t start = now_ns();
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd < 0) {
+            failure(worker, "create", path);
+            continue;
+        }
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+            failure(worker, "write", path);
+        if(close(fd) < 0)
+            failure(worker, "close", path);
+        record(worker, start);
+        worker->bytes += sizeof(buf);
+    }
+
+    // Every file of the thread must have survived the storm of its neighbours
+    for(int i = 0; i < files_per_thread; i++) {
+        create_path(path, sizeof(path), worker->id, i);
+        verify_file(worker, path, worker->id * files_per_thread + i, SMALL_FILE_SIZE);
+    }
+    return NULL;
+}
+
+static void *stat_worker(void *arg) {
+    Worker *worker = arg;
+    char path[4096];
+    struct stat stbuf;
+    pthread_barrier_wait(&start_barrier);
+    while(now_ns() < deadline_ns) {
+        int thread = next_random(&worker->random_state) % threads;
+        int i = next_random(&worker->random_state) % files_per_thread;
+        create_path(path, sizeof(path), thread, i);
+        uint64_t start = now_ns();
+        int result = stat(path, &stbuf);
+        record(worker, start);
+        if(result < 0)
+            failure(worker, "stat", path);
+        else if(stbuf.st_size != SMALL_FILE_SIZE && worker->corrupt++ < 5)
+            fprintf(stderr, "thread %d: %s: size %lld\n", worker->id, path, (long long)stbuf.st_size);
+    }
+    return NULL;
+}
+
+// Each thread writes a file of its own sequentially and then reads it back
+static void *stream_worker(void *arg, bool reading) {
+    Worker *worker = arg;
+    char path[4096];
+    char *buf = malloc(STREAM_REQUEST);
+    uint32_t file = 1000000 + worker->id;
+    snprintf(path, sizeof(path), "%s/stream/f%u", root, file);
+    int fd = open(path, reading ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        failure(worker, "open", path);
+
+    pthread_barrier_wait(&start_barrier);
+    for(uint64_t offset = 0; fd >= 0 && offset < stream_bytes; offset += STREAM_REQUEST) {
+        size_t length = stream_bytes - offset < STREAM_REQUEST ? stream_bytes - offset : STREAM_REQUEST;
+        if(!reading) {
+            for(size_t c = 0; c < length; c += CHUNK)
+                fill_chunk(buf + c, length - c < CHUNK ? length - c : CHUNK, file, (offset + c) / CHUNK, 0);
+        }
+        uint64_t start = now_ns();
+        ssize_t done = reading ? pread(fd, buf, length, offset) : pwrite(fd, buf, length, offset);
+        record(worker, start);
+        if(done != (ssize_t)length) {
+            failure(worker, reading ? "read" : "write", path);
+            break;
+        }
+        worker->bytes += length;
+        if(reading) {
+            for(size_t c = 0; c < length; c += CHUNK) {
+                if(!check_chunk(buf + c, length - c < CHUNK ? length - c : CHUNK, file, (offset + c) / CHUNK) && worker->corrupt++ < 5)
+                    fprintf(stderr, "thread %d: %s: corrupt data at offset %llu\n", worker->id, path, (unsigned long long)(offset + c));
+            }
+        }
+    }
+    if(fd >= 0 && close(fd) < 0)
+        failure(worker, "close", path);
+    free(buf);
+    return NULL;
+}
+
+static void *stream_write_worker(void *arg) {
+    return stream_worker(arg, false);
+}
+
+static void *stream_read_worker(void *arg) {
+    return stream_worker(arg, true);
+}
+
+// Random aligned reads and writes of whole chunks, all threads sharing the same files
+static void *mixed_worker(void *arg) {
+    Worker *worker = arg;
+    char path[4096];
+    char buf[CHUNK];
+    int fds[mixed_files];
+    for(int f = 0; f < mixed_files; f++) {
+        snprintf(path, sizeof(path), "%s/mixed/f%d", root, 2000000 + f);
+        fds[f] = open(path, O_RDWR);
+        if(fds[f] < 0)
+            failure(worker, "open", path);
+    }
+
+    uint32_t version = worker->id << 24; // Versions written by different threads never collide
+    pthread_barrier_wait(&start_barrier);
+    while(now_ns() < deadline_ns) {
+        int f = next_random(&worker->random_state) % mixed_files;
+        uint32_t block = next_random(&worker->random_state) % (MIXED_FILE_SIZE / CHUNK);
+        if(fds[f] < 0)
+            continue;
+        bool reading = next_random(&worker->random_state) % 100 < MIXED_READ_PERCENT;
+        if(!reading)
+            fill_chunk(buf, CHUNK, 2000000 + f, block, ++version);
+        uint64_t start = now_ns();
+        ssize_t done = reading ? pread(fds[f], buf, CHUNK, (off_t)block * CHUNK) : pwrite(fds[f], buf, CHUNK, (off_t)block * CHUNK);
+        record(worker, start);
+        if(done != CHUNK) {
+            failure(worker, reading ? "read" : "write", "mixed");
+            continue;
+        }
+        worker->bytes += CHUNK;
+        if(reading && !check_chunk(buf, CHUNK, 2000000 + f, block) && worker->corrupt++ < 5)
+            fprintf(stderr, "thread %d: mixed file %d: corrupt block %u\n", worker->id, f, block);
+    }
+    for(int f = 0; f < mixed_files; f++) {
+        if(fds[f] >= 0)
+            close(fds[f]);
+    }
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Run function on every thread and print the merged results, returns the number of errors and corruptions
+static uint64_t run_mix(const char *name, void *(*function)(void *)) {
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for(int t = 0; t < threads; t++) {
+        workers[t] = (Worker){ .id = t, .random_state = 0x9e3779b97f4a7c15 * (t + 1) };
+        pthread_create(&workers[t].thread, NULL, function, &workers[t]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    deadline_ns = start + (uint64_t)seconds * 1000000000;
+
+    size_t count = 0;
+    uint64_t bytes = 0, errors = 0, corrupt = 0;
+    for(int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        count += workers[t].sample_count;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    uint64_t *samples = malloc((count ? count : 1) * sizeof(uint64_t));
+    size_t merged = 0;
+    for(int t = 0; t < threads; t++) {
+        memcpy(samples + merged, workers[t].samples, workers[t].sample_count * sizeof(uint64_t));
+        merged += workers[t].sample_count;
+        bytes += workers[t].bytes;
+        errors += workers[t].errors;
+        corrupt += workers[t].corrupt;
+        free(workers[t].samples);
+    }
+    qsort(samples, count, sizeof(uint64_t), compare_samples);
+    #define PERCENTILE(fraction) (unsigned long long)(count ? samples[(size_t)((fraction) * (count - 1) + 0.5)] : 0)
+    printf("{\"mix\":\"%s\",\"threads\":%d,\"ops\":%zu,\"seconds\":%.3f,\"ops_per_sec\":%.0f,\"mb_per_sec\":%.1f,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,\"errors\":%llu,\"corrupt\":%llu}\n",
+           name, threads, count, elapsed, count / elapsed, bytes / elapsed / (1 << 20),
+           PERCENTILE(0.5) / 1e3, PERCENTILE(0.9) / 1e3, PERCENTILE(0.99) / 1e3, PERCENTILE(0.999) / 1e3, PERCENTILE(1.0) / 1e3,
+           (unsigned long long)errors, (unsigned long long)corrupt);
+    #undef PERCENTILE
+    fflush(stdout);
+    free(samples);
+    return errors + corrupt;
+}
+
+// Files of the mixed workload are written whole before it starts
+static int mixed_setup(void) {
+    char path[4096];
+    char buf[CHUNK];
+    mixed_files = threads * MIXED_FILES_PER_THREAD;
+    for(int f = 0; f < mixed_files; f++) {
+        snprintf(path, sizeof(path), "%s/mixed/f%d", root, 2000000 + f);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            perror(path);
+            return -1;
+        }
+        for(uint32_t block = 0; block < MIXED_FILE_SIZE / CHUNK; block++) {
+            fill_chunk(buf, CHUNK, 2000000 + f, block, 0);
+            if(write(fd, buf, CHUNK) != CHUNK) {
+                perror(path);
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// Check every file below directory, whose names are f<file>
+static void verify_tree(Worker *worker, const char *directory) {
+    DIR *dir = opendir(directory);
+    if(dir == NULL) {
+        if(errno != ENOENT)
+            failure(worker, "opendir", directory);
+        return;
+    }
+    struct dirent *entry;
+    char path[4096];
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        struct stat stbuf;
+        if(stat(path, &stbuf) < 0) {
+            failure(worker, "stat", path);
+        } else if(S_ISDIR(stbuf.st_mode)) {
+            verify_tree(worker, path);
+        } else if(entry->d_name[0] == 'f') {
+            verify_file(worker, path, strtoul(entry->d_name + 1, NULL, 10), stbuf.st_size);
+            worker->sample_count++;
+        }
+    }
+    closedir(dir);
+}
+
+static void make_directory(const char *name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char mixes[256] = "create,stat,stream,mixed";
+    bool verify_only = false;
+    int option;
+    while((option = getopt(argc, argv, "t:d:n:s:m:v")) != -1) {
+        switch(option) {
+            case 't': threads = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'n': files_per_thread = atoi(optarg); break;
+            case 's': stream_bytes = strtoull(optarg, NULL, 10) << 20; break;
+            case 'm': snprintf(mixes, sizeof(mixes), "%s", optarg); break;
+            case 'v': verify_only = true; break;
+            default: goto usage;
+        }
+    }
+    if(optind != argc - 1 || threads <= 0 || seconds <= 0 || files_per_thread <= 0)
+        goto usage;
+    root = argv[optind];
+
+    if(verify_only) {
+        Worker worker = { .id = 0 };
+        verify_tree(&worker, root);
+        printf("{\"verify\":\"%s\",\"files\":%zu,\"errors\":%llu,\"corrupt\":%llu}\n", root, worker.sample_count,
+               (unsigned long long)worker.errors, (unsigned long long)worker.corrupt);
+        return worker.errors || worker.corrupt ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    workers = calloc(threads, sizeof(Worker));
+    uint64_t failures = 0;
+    bool created = false;
+    for(char *mix = strtok(mixes, ","); mix != NULL; mix = strtok(NULL, ",")) {
+        if(strcmp(mix, "create") == 0) {
+            make_directory("create");
+            failures += run_mix("create", create_worker);
+            created = true;
+        } else if(strcmp(mix, "stat") == 0) {
+            if(!created) {
+                fprintf(stderr, "the stat mix looks up the files of the create mix, run that first\n");
+                return EXIT_FAILURE;
+            }
+            failures += run_mix("stat", stat_worker);
+        } else if(strcmp(mix, "stream") == 0) {
+            make_directory("stream");
+            failures += run_mix("stream_write", stream_write_worker);
+            failures += run_mix("stream_read", stream_read_worker);
+        } else if(strcmp(mix, "mixed") == 0) {
+            make_directory("mixed");
+            if(mixed_setup() < 0)
+                return EXIT_FAILURE;
+            failures += run_mix("mixed", mixed_worker);
+        } else {
+            fprintf(stderr, "unknown mix %s\n", mix);
+            goto usage;
+        }
+    }
+    free(workers);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-n files] [-s stream MiB] [-m create,stat,stream,mixed] [-v] directory\n", argv[0]);
+    return EXIT_FAILURE;
+}
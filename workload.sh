@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Mount dm510fs in a temporary directory and run the concurrent workloads of workload.c against it.
+# After the run the filesystem is unmounted, mounted again and every file is verified, so data lost
+# or damaged by saving and restoring the image is caught as well as crashes during the run.
+#
+# Usage: ./workload.sh [dm510fs_workload options], e.g. ./workload.sh -t 16 -d 10 -m create,stat
+# MOUNT_OPTS adds mount options, e.g. MOUNT_OPTS=block_size=65536 ./workload.sh
+
+# Define colors
+GREEN='\e[32m'
+RED='\e[31m'
+RESET_COLOR='\e[0m'
+
+make dm510fs dm510fs_workload > /dev/null || exit 1
+
+original_dir=$(pwd)
+work_dir=$(mktemp -d /tmp/dm510fs-workload.XXXXXX)
+mountpoint="$work_dir/mnt"
+mkdir "$mountpoint"
+options="max_inodes=1000000,max_blocks=4000000${MOUNT_OPTS:+,$MOUNT_OPTS}"
+pid=""
+
+# The image and journal are kept in work_dir, dm510fs stays in the foreground so its exit can be checked
+mount_fs() {
+    (cd "$work_dir" && exec "$original_dir/dm510fs" -f -o "$options" "$mountpoint" >> "$work_dir/dm510fs.log" 2>&1) &
+    pid=$!
+    for i in $(seq 50); do
+        grep -q " $mountpoint " /proc/mounts && return 0
+        kill -0 "$pid" 2> /dev/null || break
+        sleep 0.1
+    done
+    echo -e "${RED}dm510fs failed to mount${RESET_COLOR}"
+    tail "$work_dir/dm510fs.log"
+    return 1
+}
+
+unmount_fs() {
+    if ! kill -0 "$pid" 2> /dev/null; then
+        echo -e "${RED}dm510fs crashed${RESET_COLOR}"
+        tail "$work_dir/dm510fs.log"
+        fusermount -u "$mountpoint" 2> /dev/null
+        return 1
+    fi
+    fusermount -u "$mountpoint"
+    wait "$pid"
+}
+
+status=1
+if mount_fs; then
+    "$original_dir/dm510fs_workload" "$@" "$mountpoint"
+    workload_status=$?
+    if unmount_fs && mount_fs; then
+        "$original_dir/dm510fs_workload" -v "$mountpoint"
+        verify_status=$?
+        if unmount_fs && [ $workload_status -eq 0 ] && [ $verify_status -eq 0 ]; then
+            status=0
+        fi
+    fi
+fi
+
+if [ $status -eq 0 ]; then
+    echo -e "${GREEN}Workload Success${RESET_COLOR}"
+    rm -rf "$work_dir"
+else
+    echo -e "${RED}Workload Fail${RESET_COLOR}, image and log kept in $work_dir"
+fi
+exit $status